@@ -185,9 +185,16 @@ struct MrstParams {
 	/** separation in pixels between minirasters in strip */
 	int separation;
 	
+	/** 
+	 * assemble the strip from a miniraster file per feature? 
+	 * By default, the minirasters are spooled into a single temporary file.
+	 */
+	bool minirasters;
+	
     
     MrstParams() 
     : separation(0),
+      minirasters(false),
       mrst_img_suffix(DEFAULT_MRST_IMG_SUFFIX),
       mrst_shp_suffix(DEFAULT_MRST_SHP_SUFFIX),
       mrst_fid_suffix(DEFAULT_MRST_FID_SUFFIX),
@@ -217,6 +224,30 @@ struct GlobalOptions {
      */
 	double pix_prop;
 	
+	/** Polygon rasterization algorithm.
+	  * "qt"       : quadtree decomposition with GEOS intersections
+	  * "scanline" : exact pixel coverage grid (see traverser/coverage.h)
+	  * ""         : (default) "scanline" if pix_prop > 0 or an observer
+	  *              needs the pixel coverage; "qt" otherwise
+	  */
+	string rasterizer;
+	
+	/** number of threads for feature processing */
+	int num_threads;
+	
+	/** max number of open rasters with --duplicate; 0 for a default
+	  * based on the limit of open files */
+	int max_open_rasters;
+	
+	/** max megabytes of feature footprints kept in memory before
+	  * spilling to a temporary file (see traverser/footprint.h) */
+	int footprint_cache_mb;
+	
+	/** if true, the rasters of the table and summary outputs are read in a
+	  * single traversal, with the band values of all of them in each record
+	  * (see starspan_stack_rasters) */
+	bool stack;
+	
 	/** vector selection parameters */
 	VectorSelectionParams vSelParams;
 	
@@ -248,6 +279,9 @@ struct GlobalOptions {
 	/** value used as nodata */
 	double nodata;  
 	
+	/** use the nodata value of each band instead (--nodata band) */
+	bool nodata_per_band;
+	
 	/** buffer parameters */
 	BufferParams bufferParams;
 	
@@ -14,6 +14,8 @@
 
 using namespace std;
 
+class RawImage;
+
 /** Location of pixel in 0-based (col,row) coordinates.
   */
 struct CRPixel {
@@ -51,6 +53,12 @@ public:
 	
 	GDALDataset* getDataset(void) { return hDataset; }
 	
+	/**
+	  * Gets the memory mapped access to the band values if this is a raw
+	  * ENVI image (see RawImage.h); NULL otherwise.
+	  */
+	RawImage* getRawImage(void) { return rawImage; }
+	
 	// gets raster size in pixels and number of bands
 	void getSize(int *width, int *height, int *bands);
 	
@@ -127,6 +135,7 @@ private:
     Raster(GDALDataset* hDataset);
     
 	GDALDataset* hDataset;
+	RawImage* rawImage;
     const char* pszProjection;
     double adfGeoTransform[6];
 	bool geoTransfOK;
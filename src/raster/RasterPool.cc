@@ -0,0 +1,109 @@
+/*
+	RasterPool - pool of open rasters
+	$Id$
+	See RasterPool.h for public doc.
+*/
+
+#include "RasterPool.h"
+
+#include <sys/resource.h>
+#include <assert.h>
+
+
+// upper bound for the default max number of open rasters
+#define MAX_DEFAULT_OPEN  1024
+
+// number of file descriptors not to be used for rasters
+#define RESERVED_FILES  64
+
+// estimated number of file descriptors per open raster
+#define FILES_PER_RASTER  2
+
+
+int RasterPool::getDefaultMaxOpen(void) {
+	struct rlimit rl;
+	if ( getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY ) {
+		return MAX_DEFAULT_OPEN;
+	}
+	long max = ((long) rl.rlim_cur - RESERVED_FILES) / FILES_PER_RASTER;
+	if ( max > MAX_DEFAULT_OPEN )
+		max = MAX_DEFAULT_OPEN;
+	if ( max < 1 )
+		max = 1;
+	return (int) max;
+}
+
+
+RasterPool::RasterPool(int maxOpen_) : maxOpen(maxOpen_) {
+	if ( maxOpen <= 0 )
+		maxOpen = getDefaultMaxOpen();
+}
+
+
+RasterPool::~RasterPool() {
+	for ( map<string, Entry*>::iterator it = entries.begin(); it != entries.end(); it++ ) {
+		Entry* entry = it->second;
+		delete entry->raster;
+		delete entry;
+	}
+}
+
+
+Raster* RasterPool::acquire(const char* filename) {
+	Entry* entry;
+	map<string, Entry*>::iterator it = entries.find(filename);
+	if ( it != entries.end() ) {
+		entry = it->second;
+		lru.erase(entry->lru);
+	}
+	else {
+		Raster* raster = Raster::open(filename);
+		if ( !raster )
+			return 0;
+		entry = new Entry();
+		entry->filename = filename;
+		entry->raster = raster;
+		entry->pins = 0;
+		entries[entry->filename] = entry;
+		byRaster[raster] = entry;
+	}
+	lru.push_front(entry);
+	entry->lru = lru.begin();
+	entry->pins++;
+
+	evict();
+	return entry->raster;
+}
+
+
+void RasterPool::release(Raster* raster) {
+	map<Raster*, Entry*>::iterator it = byRaster.find(raster);
+	if ( it == byRaster.end() ) {
+		assert( false && "RasterPool::release: raster not in pool" );
+		return;
+	}
+	Entry* entry = it->second;
+	assert( entry->pins > 0 );
+	entry->pins--;
+	evict();
+}
+
+
+//
+// Closes least recently used rasters not acquired while there are more
+// than maxOpen open rasters.
+//
+void RasterPool::evict(void) {
+	list<Entry*>::iterator it = lru.end();
+	while ( (int) entries.size() > maxOpen && it != lru.begin() ) {
+		it--;
+		Entry* entry = *it;
+		if ( entry->pins > 0 )
+			continue;
+		it = lru.erase(it);
+		entries.erase(entry->filename);
+		byRaster.erase(entry->raster);
+		delete entry->raster;
+		delete entry;
+	}
+}
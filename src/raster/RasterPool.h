@@ -0,0 +1,93 @@
+/*
+	RasterPool - pool of open rasters
+	$Id$
+*/
+#ifndef RasterPool_h
+#define RasterPool_h
+
+#include "Raster.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+using namespace std;
+
+
+/**
+  * A pool of open rasters shared by the processing of different features.
+  *
+  * A raster is opened by the first acquire() on its filename and kept open
+  * after release(), so later acquires reuse the same GDAL dataset (no driver
+  * probing, header parsing, or block cache warmup again).
+  * When more than maxOpen rasters are open, the least recently used ones
+  * that are not acquired are closed.
+  *
+  * Usage:
+  * <pre>
+  *    RasterPool pool;
+  *    Raster* raster = pool.acquire(filename);
+  *    ... raster is guaranteed to remain open ...
+  *    pool.release(raster);
+  * </pre>
+  */
+class RasterPool {
+public:
+	/**
+	  * Creates a pool.
+	  * @param maxOpen Max number of open rasters. If <= 0,
+	  *        getDefaultMaxOpen() is used.
+	  */
+	RasterPool(int maxOpen = 0);
+
+	/**
+	  * Closes all rasters in this pool.
+	  */
+	~RasterPool();
+
+	/**
+	  * Gets the raster for the given file, opening it if necessary.
+	  * The raster is not closed until it is released.
+	  * Returns NULL if the raster cannot be opened.
+	  */
+	Raster* acquire(const char* filename);
+
+	/**
+	  * Releases a raster obtained with acquire.
+	  */
+	void release(Raster* raster);
+
+	int getMaxOpen(void) { return maxOpen; }
+
+	int getNumOpen(void) { return entries.size(); }
+
+	/**
+	  * Max number of open rasters according to the limit of open files of
+	  * the process (RLIMIT_NOFILE), leaving room for other files and
+	  * assuming a couple of files per raster.
+	  */
+	static int getDefaultMaxOpen(void);
+
+private:
+	struct Entry {
+		string filename;
+		Raster* raster;
+		int pins;
+		list<Entry*>::iterator lru;
+	};
+
+	int maxOpen;
+
+	/** entries by filename */
+	map<string, Entry*> entries;
+
+	/** the same entries by raster, for release() */
+	map<Raster*, Entry*> byRaster;
+
+	/** most recently used first */
+	list<Entry*> lru;
+
+	void evict(void);
+};
+
+#endif
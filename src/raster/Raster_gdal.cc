@@ -5,6 +5,7 @@
 */
 
 #include "Raster.h"
+#include "RawImage.h"
 
 #include <assert.h>
 
@@ -41,6 +42,7 @@ void Raster::_create(const char* filename, int width, int height, int bands, GDA
 		fprintf(stderr, "Couldn't create dataset: %s\n", CPLGetLastErrorMsg());
         exit(1);
 	}
+	rawImage = 0;
 
 	
 	
@@ -70,10 +72,13 @@ Raster* Raster::open(const char* rastfilename) {
         return 0;
     }
     
-    return new Raster(hDataset);
+    Raster* raster = new Raster(hDataset);
+    raster->rawImage = RawImage::open(rastfilename, hDataset);
+    return raster;
 }
 
 Raster::Raster(GDALDataset* hDataset) : hDataset(hDataset) {
+	rawImage = 0;
 	geoTransfOK = GDALGetGeoTransform(hDataset, adfGeoTransform) == CE_None; 
     if( geoTransfOK ) {
         pszProjection = GDALGetProjectionRef(hDataset);
@@ -89,6 +94,7 @@ Raster::Raster(const char* rastfilename) {
         fprintf(stderr, "GDALOpen failed: %s\n", CPLGetLastErrorMsg());
         exit(1);
     }
+	rawImage = RawImage::open(rastfilename, hDataset);
 
 	geoTransfOK = GDALGetGeoTransform(hDataset, adfGeoTransform) == CE_None; 
     if( geoTransfOK ) {
@@ -168,6 +174,11 @@ void* Raster::getBandValuesForPixel(int col, int row) {
 		return NULL;
 	}
 	
+	if ( rawImage ) {
+		rawImage->getBandValues(col, row, bandValues_buffer);
+		return bandValues_buffer;
+	}
+	
 	char* ptr = (char*) bandValues_buffer;
 	for ( int i = 0; i < bands; i++ ) {
 		GDALRasterBand* band = (GDALRasterBand*) GDALGetRasterBand(hDataset, i+1);
@@ -406,6 +417,8 @@ void Raster::report_corner(FILE* file, const char* corner_name, int ix, int iy)
 Raster::~Raster() {
 	if ( bandValues_buffer )
 		delete[] bandValues_buffer;
+	if ( rawImage )
+		delete rawImage;
 	delete hDataset;
 }
 
@@ -0,0 +1,257 @@
+/*
+	RawImage - memory mapped access to raw ENVI images
+	$Id$
+	See RawImage.h for public doc.
+*/
+
+#include "config.h"
+#include "RawImage.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define USE_MMAP 1
+#endif
+
+
+// converts to lower case and removes surrounding blanks
+static string normalize(const string& str) {
+	size_t b = 0, e = str.length();
+	while ( b < e && isspace((unsigned char) str[b]) )
+		b++;
+	while ( e > b && isspace((unsigned char) str[e - 1]) )
+		e--;
+	string res = str.substr(b, e - b);
+	for ( size_t i = 0; i < res.length(); i++ ) {
+		res[i] = tolower((unsigned char) res[i]);
+	}
+	return res;
+}
+
+//
+// Reads the "key = value" entries of an ENVI header. Values in braces
+// may span several lines.
+// Returns false if the file cannot be read or is not an ENVI header.
+//
+static bool read_header(const string& filename, map<string, string>& entries) {
+	FILE* file = fopen(filename.c_str(), "r");
+	if ( !file ) {
+		return false;
+	}
+	string contents;
+	char buf[4096];
+	size_t n;
+	while ( (n = fread(buf, 1, sizeof(buf), file)) > 0 ) {
+		contents.append(buf, n);
+	}
+	fclose(file);
+
+	if ( normalize(contents.substr(0, 4)) != "envi" ) {
+		return false;
+	}
+
+	size_t pos = contents.find('\n');
+	while ( pos != string::npos && pos < contents.length() ) {
+		size_t eol = contents.find('\n', pos + 1);
+		size_t eq = contents.find('=', pos + 1);
+		if ( eq == string::npos ) {
+			break;
+		}
+		if ( eol != string::npos && eq > eol ) {
+			// line without '=':
+			pos = eol;
+			continue;
+		}
+		string key = normalize(contents.substr(pos + 1, eq - pos - 1));
+		size_t end = eol;
+		size_t brace = contents.find_first_not_of(" \t", eq + 1);
+		if ( brace != string::npos && contents[brace] == '{' ) {
+			end = contents.find('}', brace);
+			if ( end == string::npos ) {
+				break;
+			}
+			end = contents.find('\n', end);
+		}
+		if ( end == string::npos ) {
+			end = contents.length();
+		}
+		entries[key] = normalize(contents.substr(eq + 1, end - eq - 1));
+		pos = end;
+	}
+	return true;
+}
+
+//
+// ENVI data type code to GDALDataType; GDT_Unknown if not handled here
+//
+static GDALDataType envi_data_type(int code) {
+	switch ( code ) {
+		case 1:  return GDT_Byte;
+		case 2:  return GDT_Int16;
+		case 3:  return GDT_Int32;
+		case 4:  return GDT_Float32;
+		case 5:  return GDT_Float64;
+		case 12: return GDT_UInt16;
+		case 13: return GDT_UInt32;
+		default: return GDT_Unknown;
+	}
+}
+
+//
+// Gets the header of the given data file, named as the data file with
+// its extension replaced by (or with the addition of) .hdr.
+//
+static bool find_header(const char* filename, map<string, string>& entries) {
+	string name = filename;
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of("/\\");
+	vector<string> candidates;
+	if ( dot != string::npos && (slash == string::npos || dot > slash) ) {
+		candidates.push_back(name.substr(0, dot) + ".hdr");
+		candidates.push_back(name.substr(0, dot) + ".HDR");
+	}
+	candidates.push_back(name + ".hdr");
+	candidates.push_back(name + ".HDR");
+	for ( unsigned i = 0; i < candidates.size(); i++ ) {
+		if ( read_header(candidates[i], entries) ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+RawImage* RawImage::open(const char* filename, GDALDataset* dataset) {
+#ifdef USE_MMAP
+	GDALDriver* driver = dataset->GetDriver();
+	if ( !driver || 0 != strcmp("ENVI", driver->GetDescription()) ) {
+		return 0;
+	}
+
+	map<string, string> entries;
+	if ( !find_header(filename, entries) ) {
+		return 0;
+	}
+
+	// not handled: compressed data, byte order different from ours
+	if ( atoi(entries["file compression"].c_str()) != 0 ) {
+		return 0;
+	}
+	const int one = 1;
+	const int native_byte_order = *((const char*) &one) ? 0 : 1;
+	if ( entries.find("byte order") != entries.end()
+	&&   atoi(entries["byte order"].c_str()) != native_byte_order ) {
+		return 0;
+	}
+
+	const int width = atoi(entries["samples"].c_str());
+	const int height = atoi(entries["lines"].c_str());
+	const int bands = atoi(entries["bands"].c_str());
+	const GDALDataType type = envi_data_type(atoi(entries["data type"].c_str()));
+	const long offset = atol(entries["header offset"].c_str());
+	const string interleave = entries["interleave"];
+
+	// must be consistent with the dataset:
+	if ( width <= 0 || height <= 0 || bands <= 0 || type == GDT_Unknown || offset < 0
+	||   width != dataset->GetRasterXSize() || height != dataset->GetRasterYSize()
+	||   bands != dataset->GetRasterCount() ) {
+		return 0;
+	}
+	for ( int i = 0; i < bands; i++ ) {
+		if ( dataset->GetRasterBand(i+1)->GetRasterDataType() != type ) {
+			return 0;
+		}
+	}
+
+	RawImage* raw = new RawImage();
+	raw->width = width;
+	raw->height = height;
+	raw->bands = bands;
+	raw->valueSize = GDALGetDataTypeSize(type) >> 3;
+	const size_t vs = raw->valueSize;
+	if ( interleave == "bsq" ) {
+		raw->interleave = "bsq";
+		raw->colStride = vs;
+		raw->rowStride = width * vs;
+		raw->bandStride = (size_t) height * width * vs;
+	}
+	else if ( interleave == "bil" ) {
+		raw->interleave = "bil";
+		raw->colStride = vs;
+		raw->bandStride = width * vs;
+		raw->rowStride = (size_t) bands * width * vs;
+	}
+	else if ( interleave == "bip" ) {
+		raw->interleave = "bip";
+		raw->bandStride = vs;
+		raw->colStride = bands * vs;
+		raw->rowStride = (size_t) width * bands * vs;
+	}
+	else {
+		delete raw;
+		return 0;
+	}
+
+	// map the whole data file, which must contain all the values:
+	int fd = ::open(filename, O_RDONLY);
+	if ( fd < 0 ) {
+		delete raw;
+		return 0;
+	}
+	struct stat st;
+	const size_t dataSize = (size_t) width * height * bands * vs;
+	if ( fstat(fd, &st) != 0 || (size_t) st.st_size < offset + dataSize ) {
+		close(fd);
+		delete raw;
+		return 0;
+	}
+	raw->mappedSize = st.st_size;
+	void* mapped = mmap(0, raw->mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( mapped == MAP_FAILED ) {
+		raw->mappedSize = 0;
+		delete raw;
+		return 0;
+	}
+	raw->mapped = (char*) mapped;
+	raw->data = raw->mapped + offset;
+	return raw;
+#else
+	return 0;
+#endif
+}
+
+
+RawImage::~RawImage() {
+#ifdef USE_MMAP
+	if ( mapped )
+		munmap(mapped, mappedSize);
+#endif
+}
+
+
+void RawImage::getBandValues(int col, int row, void* buffer) {
+	char* ptr = (char*) buffer;
+	const char* value = data + row * rowStride + col * colStride;
+	if ( bandStride == (size_t) valueSize ) {
+		// bip: values of all bands are contiguous
+		memcpy(ptr, value, bands * valueSize);
+		return;
+	}
+	for ( int i = 0; i < bands; i++ ) {
+		memcpy(ptr, value, valueSize);
+		ptr += valueSize;
+		value += bandStride;
+	}
+}
+
@@ -0,0 +1,75 @@
+/*
+	RawImage - memory mapped access to raw ENVI images
+	$Id$
+*/
+#ifndef RawImage_h
+#define RawImage_h
+
+#include "gdal.h"
+#include "gdal_priv.h"
+
+#include <cstddef>
+
+using namespace std;
+
+
+/**
+  * Direct access to the band values of an uncompressed ENVI image (the
+  * format of the images generated by StarSpan), by mapping the data file
+  * in memory. Values are taken from the mapped pages according to the
+  * interleave (bsq, bil or bip) given in the .hdr file, instead of going
+  * through the GDAL block cache.
+  *
+  * Only images in native byte order with a data type handled by GDAL
+  * as the same GDALDataType are served here; for any other image, open()
+  * returns NULL and the GDAL dataset is to be used.
+  */
+class RawImage {
+public:
+	/**
+	  * Maps the data file of an image already opened as the given dataset.
+	  * Returns NULL if the dataset is not a raw ENVI image that can be
+	  * served here, or if it cannot be mapped.
+	  */
+	static RawImage* open(const char* filename, GDALDataset* dataset);
+
+	/** unmaps the data file */
+	~RawImage();
+
+	/** "bsq", "bil" or "bip" */
+	const char* getInterleave(void) { return interleave; }
+
+	/** size in bytes of a band value */
+	int getValueSize(void) { return valueSize; }
+
+	/**
+	  * Returns a pointer to the value of a band (0-based) at (col,row)
+	  * in the mapped data. No range checks are done.
+	  */
+	const char* getValue(int band, int col, int row) {
+		return data + band * bandStride + row * rowStride + col * colStride;
+	}
+
+	/**
+	  * Copies the values of all bands at (col,row), in band order.
+	  */
+	void getBandValues(int col, int row, void* buffer);
+
+private:
+	RawImage(void) : mapped(0), mappedSize(0), data(0) {}
+
+	char* mapped;
+	size_t mappedSize;
+
+	// start of the image data in the mapped file (after the header offset)
+	const char* data;
+
+	int width, height, bands;
+	int valueSize;
+	const char* interleave;
+
+	// bytes between consecutive values in each dimension
+	size_t colStride, rowStride, bandStride;
+};
+
+#endif
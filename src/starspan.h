@@ -14,11 +14,14 @@
 
 #include "common.h"           
 #include "Raster.h"           
+#include "RasterPool.h"
 #include "Vector.h"       
 #include "traverser.h"
 #include "Stats.h"       
 
 #include <cstdio>
+#include <cstring>
+#include <cmath>
 
 /////////////////////////////////////////////////////////////////////////////
 // services:
@@ -68,6 +71,20 @@ double** starspan_getFeatureStatsByField(
 // main operations:
 
 
+/**
+  * Observer generating an output with a traversal per raster, as done by
+  * starspan_csv and starspan_stats: the raster being traversed and whether
+  * the column headers should be written are set before each traversal.
+  */
+class RasterOutputObserver : public Observer {
+public:
+	const char* raster_filename;
+	bool write_header;
+
+	RasterOutputObserver() : raster_filename(0), write_header(true) {}
+};
+
+
 /**
   * Generates a CSV file with the following columns:
   *     FID, link, RID, BandNumber, FieldBandValue, <s1>_ImageBandValue, <s2>_ImageBandValue, ...
@@ -129,6 +146,32 @@ int starspan_stats(
 	int layernum
 );
 
+/** Stats calculation on multiple rasters by sweeping each raster once.
+  * The layer is burned into a zone grid (one zone per feature) and the
+  * raster is then read by strips of blocks, accumulating the stats of each
+  * zone, instead of traversing the raster feature by feature.
+  * Generates a CSV file as starspan_stats. Only polygons and points are
+  * considered, and where features overlap, pixels are assigned to the
+  * first feature.
+  *
+  * @param vect Vector datasource
+  * @param raster_filenames rasters
+  * @param select_stats List of desired statistics
+  * @param select_fields desired fields from vector
+  * @param csv_filename output file name
+  * @param layernum layer number within the vector datasource
+  *
+  * @return 0 iff OK 
+  */
+int starspan_zonal_stats(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*> select_stats,
+	vector<const char*>* select_fields,
+	const char* csv_filename,
+	int layernum
+);
+
 /**
   * Gets an observer that computes statistics for each FID.
   *
@@ -146,24 +189,52 @@ Observer* starspan_getStatsObserver(
 	const char* filename
 );
 
+/**
+  * Gets the observer used by starspan_stats.
+  *
+  * @param tr Data traverser
+  * @param file output file; not closed by the observer
+  * @param select_stats List of desired statistics
+  * @param select_fields desired fields
+  *
+  * @return observer to be added to traverser. 
+  */
+RasterOutputObserver* starspan_getRasterStatsObserver(
+	Traverser& tr,
+	FILE* file,
+	vector<const char*> select_stats,
+	vector<const char*>* select_fields
+);
+
 
 /**
-  * Gets an observer that computes counts per class from an
-  * integral raster band. Only the first band from the raster
+  * Gets an observer that computes counts per class from integral
+  * raster bands. By default, only the first band from the raster
   * dataset will be processed as long as its type is integral.
   * The format of the output file is as follows:
   * <pre>
   *		FID,class,count
   * </pre>
+  * If class_bands are given, the counts for each of these bands are
+  * obtained in the same traversal, and a column band is included:
+  * <pre>
+  *		FID,band,class,count
+  * </pre>
+  * If weighted is true, a column weighted_count is added with the sum
+  * of the proportions of the pixels covered by the feature.
   *
   * @param tr Data traverser
   * @param filename output file name
+  * @param class_bands desired bands (1-based); empty for the first band
+  * @param weighted include weighted counts?
   *
   * @return observer to be added to traverser. 
   */
 Observer* starspan_getCountByClassObserver(
 	Traverser& tr,
-	const char* filename
+	const char* filename,
+	vector<int> class_bands,
+	bool weighted
 );
 
 
@@ -214,6 +285,10 @@ int starspan_csv_raster_field(
   * @param select_fields desired fields from vector
   * @param csv_filename output file name
   * @param layernum layer number within the vector datasource
+  * @param rasterPool If not null, rasters are obtained from this pool
+  *        instead of being opened and closed here.
+  * @param record If not null, only the feature in this record is
+  *        processed, by replaying the record (see Traverser::setFeatureRecord).
   *
   * @return 0 iff OK 
   */
@@ -222,9 +297,91 @@ int starspan_csv(
 	vector<const char*> raster_filenames,
 	vector<const char*>* select_fields,
 	const char* csv_filename,
+	int layernum,
+	RasterPool* rasterPool = 0,
+	FeatureRecord* record = 0
+);
+
+/**
+  * Gets the observer used by starspan_csv.
+  *
+  * @param vect Vector datasource
+  * @param select_fields desired fields from vector
+  * @param file output file; not closed by the observer
+  * @param layernum layer number within the vector datasource
+  *
+  * @return observer to be added to traverser. 
+  */
+RasterOutputObserver* starspan_getCSVObserver(
+	Vector* vect,
+	vector<const char*>* select_fields,
+	FILE* file,
 	int layernum
 );
 
+/**
+  * Generates the outputs of starspan_csv, starspan_stats and
+  * starspan_getCountByClassObserver with a single traversal per raster:
+  * the observers of the requested outputs are added to the same
+  * traverser, so the intersection of each feature and the reading of
+  * its pixels are done once for all of them.
+  * The generated files are the same as with the separate calls, provided
+  * that no particular FID is requested (globalOptions.FID), which is
+  * not considered by starspan_csv.
+  *
+  * @param vect Vector datasource
+  * @param raster_filenames rasters
+  * @param select_fields desired fields from vector
+  * @param csv_filename output file name for the table
+  * @param layernum layer number within the vector datasource
+  * @param select_stats List of desired statistics
+  * @param stats_filename output file name for the summary; NULL for no summary
+  * @param class_filename output file name for the counts by class; NULL
+  *        for no counts. As the counts are obtained from a single
+  *        traversal of all rasters, only one raster can be given in this
+  *        case, unless the rasters are stacked (globalOptions.stack).
+  * @param class_bands desired bands for the counts by class
+  * @param class_weighted include weighted counts?
+  *
+  * @return 0 iff OK 
+  */
+int starspan_csv_with_summaries(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*>* select_fields,
+	const char* csv_filename,
+	int layernum,
+	vector<const char*> select_stats,
+	const char* stats_filename,
+	const char* class_filename,
+	vector<int> class_bands,
+	bool class_weighted
+);
+
+
+
+/** Extraction from multiple rasters in columnar binary form.
+  * Generates one NumPy .npy file per column, named
+  * prefix + column-name + ".npy", with columns:
+  *     FID, RID, [col,row,] [x,y,] {rast-bands}
+  * as in starspan_csv, except that attribute fields from the vector are
+  * not included (FID can be used to join them). FID is int64, RID is a
+  * fixed-width byte string, col/row are int32, x/y are float64, and each
+  * band keeps its GDAL type. All rasters must have the same bands.
+  *
+  * @param vect Vector datasource
+  * @param raster_filenames rasters
+  * @param prefix prefix for output file names
+  * @param layernum layer number within the vector datasource
+  *
+  * @return 0 iff OK 
+  */
+int starspan_columnar(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	const char* prefix,
+	int layernum
+);
 
 
 /**
@@ -260,8 +417,10 @@ Observer* starspan_gen_envisl(
 
 
 /**
-  * Updates a CSV
-  * DOC ME!
+  * Updates a CSV: adds the band values of the given rasters at the
+  * location (x,y or col,row fields) of each record.
+  * Records are processed in chunks; within a chunk, points are read from
+  * each raster in block order, and rows are written in the input order.
   */
 int starspan_update_csv(
 	const char* in_csv_filename,
@@ -435,6 +594,87 @@ inline void starspan_extract_string_value(GDALDataType bandType, char* ptr, char
 }
 
 
+/**
+  * Writes an unsigned integer in decimal (like "%lu") and returns the
+  * number of characters written. No null terminator is added.
+  */
+inline int starspan_format_ulong(unsigned long v, char* value) {
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = (char) ('0' + v % 10);
+		v /= 10;
+	} while ( v > 0 );
+	for ( int i = 0; i < n; i++ ) {
+		value[i] = digits[n - 1 - i];
+	}
+	return n;
+}
+
+/**
+  * Writes a signed integer in decimal (like "%ld") and returns the
+  * number of characters written. No null terminator is added.
+  */
+inline int starspan_format_long(long v, char* value) {
+	if ( v < 0 ) {
+		value[0] = '-';
+		return 1 + starspan_format_ulong(0UL - (unsigned long) v, value + 1);
+	}
+	return starspan_format_ulong((unsigned long) v, value);
+}
+
+/**
+  * Writes a double like "%f" and returns the number of characters written.
+  * Integral values (the common case in imagery) are written without sprintf.
+  */
+inline int starspan_format_fixed6(double v, char* value) {
+	if ( v == floor(v) && fabs(v) < 2e9 && (v != 0 || 1 / v > 0) ) {
+		int n = starspan_format_long((long) v, value);
+		memcpy(value + n, ".000000", 7);
+		return n + 7;
+	}
+	return sprintf(value, "%f", v);
+}
+
+/**
+  * Same as starspan_extract_string_value (including the formats used for
+  * each type), but avoiding sprintf for integer values.
+  * Returns the length of the string; value is null-terminated.
+  */
+inline int starspan_format_value(GDALDataType bandType, char* ptr, char* value) {
+	int n;
+	switch(bandType) {
+		case GDT_Byte:
+			n = starspan_format_long((int) *( (char*) ptr ), value);
+			break;
+		case GDT_UInt16:
+			n = starspan_format_ulong(*( (unsigned short*) ptr ), value);
+			break;
+		case GDT_Int16:
+			n = starspan_format_long(*( (short*) ptr ), value);
+			break;
+		case GDT_UInt32:
+			n = starspan_format_ulong(*( (unsigned int*) ptr ), value);
+			break;
+		case GDT_Int32:
+			// "%u" as in starspan_extract_string_value
+			n = starspan_format_ulong((unsigned int) *( (int*) ptr ), value);
+			break;
+		case GDT_Float32:
+			n = starspan_format_fixed6(*( (float*) ptr ), value);
+			break;
+		case GDT_Float64:
+			n = starspan_format_fixed6(*( (double*) ptr ), value);
+			break;
+		default:
+			fprintf(stderr, "Unexpected GDALDataType: %s\n", GDALGetDataTypeName(bandType));
+			exit(1);
+	}
+	value[n] = 0;
+	return n;
+}
+
+
 /**
   * Extracts a value from a buffer according to a type and returns it as an integer.
   */
@@ -489,6 +729,14 @@ inline void starspan_simplify_filename(string& filename) {
 struct ExtractionItem {
     OGRFeature* feature;
     const char* rasterFilename;
+    
+    // pool to get the raster from; shared by all extraction items
+    RasterPool* rasterPool;
+    
+    // traversal of the feature over the raster (possibly followed by its
+    // mask), to be replayed instead of traversing the feature again.
+    // See Traverser::setFeatureRecord.
+    FeatureRecord* record;
 };
 
 
@@ -569,13 +817,17 @@ struct RasterizeParams {
     const char* projection;
     double* geoTransform;
     
+    /** max size in bytes of the output blocks kept in memory */
+    size_t cacheBytes;
+    
     RasterizeParams() : 
         outRaster_filename(0), 
         rastValue(1), 
         fillNoData(true),
         rastFormat("ENVI"),
         projection(0),
-        geoTransform(new double[6])
+        geoTransform(new double[6]),
+        cacheBytes(64 * 1024 * 1024)
     {
         for ( int i = 0; i < 6; i++ ) {
             geoTransform[i] = 0;
@@ -622,6 +874,45 @@ int starspan_validate_input_elements(
 	vector<const char*> *mask_filenames
 );
 
+/**
+ * Tells if at least two of the given rasters have the same grid, ie., same
+ * size, location and pixel size, so they would get the same pixels for
+ * each feature.
+ */
+bool starspan_rasters_share_grid(vector<const char*> raster_filenames);
+
+/**
+ * Opens a CSV output file to append new rows, making sure they will start
+ * in a new line; the file is created if it does not exist.
+ *
+ * @param filename output file name
+ * @param new_file set to true iff the file was created
+ *
+ * @return the file; NULL if it could not be created.
+ */
+FILE* starspan_open_for_append(const char* filename, bool* new_file);
+
+/**
+ * Opens the given rasters and adds them to the traverser to be read in a
+ * single traversal (--stack), so the band values of each visited pixel are
+ * those of all the rasters, in the given order. The rasters must have the
+ * same grid (see starspan_rasters_share_grid).
+ *
+ * @param tr the traverser
+ * @param raster_filenames rasters
+ * @param rasters the opened rasters, to be deleted by the caller
+ * @param rid set to the value for the RID column: the raster IDs joined
+ *        with '+'
+ *
+ * @return 0 iff OK
+ */
+int starspan_stack_rasters(
+	Traverser& tr,
+	vector<const char*> raster_filenames,
+	vector<Raster*>& rasters,
+	string& rid
+);
+
 
 ///////////////////////////////////////////////////
 // mini raster basic information; A list of these elements
@@ -640,9 +931,23 @@ struct MRBasicInfo {
     
     // row to locate this miniraster in strip:
     int mrs_row;
+    
+    // If >= 0, the data of this miniraster is not in a file of its own
+    // but at this offset in mini_filename, a spool file where the rows are 
+    // stored one after the other, each row with spool_bands bands of 
+    // spool_type values. 
+    long spool_offset;
+    GDALDataType spool_type;
+    int spool_bands;
+    
+    // geotransform of the spooled miniraster; the projection is only 
+    // kept in the first element of the list.
+    double geoTransform[6];
+    string projection;
 	
 	MRBasicInfo(long FID, string& mini_filename, int width, int height, int mrs_row) : 
-		FID(FID), mini_filename(mini_filename), width(width), height(height), mrs_row(mrs_row)
+		FID(FID), mini_filename(mini_filename), width(width), height(height), mrs_row(mrs_row),
+		spool_offset(-1), spool_type(GDT_Unknown), spool_bands(0)
 	{}
     
     /** Returns the next row just below this miniraster */
@@ -23,6 +23,9 @@
 
 #define DEFAULT_TABLE_SUFFIX                "_table.csv"
 
+// column name and ".npy" will be appended to this
+#define DEFAULT_COLUMNAR_SUFFIX             "_"
+
 #define DEFAULT_SUMMARY_SUFFIX              NULL              
         //"_summary.csv"
 
@@ -73,12 +76,14 @@ static void usage(const char* msg) {
 		"      --layer <layername>                         --mask <filenames> ...   \n"
 		"\n"
 		"      --out-prefix <string>                       --out-type <type>\n"
-		"      --table-suffix <string>\n"
+		"      --table-suffix <string>                     --columnar-suffix <string>\n"
 		"      --summary-suffix <string>                   --stats <stat> <stat> ...\n"
-        "      --class-summary-suffix <string> \n"
+        "      --class-summary-suffix <string>             --zonal-sweep\n"
+		"      --class-bands <band> <band> ...             --class-weighted\n"
 		"      --mr-img-suffix <string>                    --mini_raster_parity <parity> \n"
 		"      --mrst-img-suffix <string>                  --mrst-shp-suffix <string>\n"
 		"      --mrst-fid-suffix <string>                  --mrst-glt-suffix <string>\n"
+		"      --mrst-minirasters\n"
 		"\n"
 		"      --duplicate <mode> <mode> ...               --validate_inputs\n"
 		"      --in                                        --separation <num-pixels> \n"
@@ -86,12 +91,16 @@ static void usage(const char* msg) {
 		"      --sql <statement>                           --noColRow \n"
 		"      --where <condition>                         --noXY\n"
 		"      --dialect <string>                          --skip_invalid_polys\n"
-		"      --fid <FID>                                 --nodata <value>\n"
+		"      --fid <FID>                                 --nodata {<value> | band}\n"
 		"      --buffer <distance> [<segments>]            --box <width> [<height>] \n"
 		"      --RID {file | path | none}                  --delimiter <separator>\n"
 		"      --progress [<value>]                        --show-fields \n"
 		"      --report                                    --verbose \n"
 		"      --elapsed_time                              --version\n"
+		"      --rasterizer {qt | scanline}                --threads <num-threads>\n"
+		"      --max-open-rasters <num-rasters>            --rasterize-cache <megabytes>\n"
+		"      --footprint-cache <megabytes>               --stack\n"
+		"      --update-csv <filename>\n"
 		);
 	}
 	
@@ -132,6 +141,11 @@ int main(int argc, char ** argv) {
 	globalOptions.use_pixpolys = false;
 	globalOptions.skip_invalid_polys = false;
 	globalOptions.pix_prop = 0.5;
+	globalOptions.rasterizer = "";
+	globalOptions.num_threads = 1;
+	globalOptions.max_open_rasters = 0;
+	globalOptions.footprint_cache_mb = 256;
+	globalOptions.stack = false;
 	globalOptions.FID = -1;
 	globalOptions.verbose = false;
 	globalOptions.progress = false;
@@ -142,6 +156,7 @@ int main(int argc, char ** argv) {
 	globalOptions.RID = "file";
 	globalOptions.report_summary = true;
 	globalOptions.nodata = 0.0;
+	globalOptions.nodata_per_band = false;
 	globalOptions.bufferParams.given = false;
 	globalOptions.bufferParams.quadrantSegments = "1";
 	globalOptions.boxParams.given = false;
@@ -177,10 +192,15 @@ int main(int argc, char ** argv) {
     const char*  table_suffix = DEFAULT_TABLE_SUFFIX;
 	string  csv_name;
     
+    const char*  columnar_suffix = DEFAULT_COLUMNAR_SUFFIX;
+    
 	const char*  summary_suffix = DEFAULT_SUMMARY_SUFFIX;
 	vector<const char*> select_stats;
+	bool zonal_sweep = false;
     
     const char*  class_summary_suffix = DEFAULT_CLASS_SUMMARY_SUFFIX;
+    vector<int> class_bands;
+    bool class_weighted = false;
     
     // ####.img will be appended to this
     const char*  miniraster_suffix = DEFAULT_MINIRASTER_SUFFIX;
@@ -200,6 +220,8 @@ int main(int argc, char ** argv) {
 
 	const char* dump_geometries_filename = NULL;
 	
+	const char* update_csv_filename = NULL;
+	
     
     
     
@@ -344,6 +366,12 @@ int main(int argc, char ** argv) {
             table_suffix = argv[i];
 		}
 		
+		else if ( 0==strcmp("--columnar-suffix", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--columnar-suffix: ?");
+            columnar_suffix = argv[i];
+		}
+		
 		else if ( 0==strcmp("--summary-suffix", argv[i]) ) {
 			if ( ++i == argc || argv[i][0] == '-' )
 				usage("--summary-suffix: ?");
@@ -359,6 +387,27 @@ int main(int argc, char ** argv) {
 				--i;
 		}
 
+		else if ( 0==strcmp("--class-bands", argv[i]) ) {
+			while ( ++i < argc && argv[i][0] != '-' ) {
+				int band = atoi(argv[i]);
+				if ( band < 1 )
+					usage("--class-bands: expecting band numbers (1-based)");
+				class_bands.push_back(band);
+			}
+			if ( class_bands.size() == 0 )
+				usage("--class-bands: ?");
+			if ( i < argc && argv[i][0] == '-' ) 
+				--i;
+		}
+		
+		else if ( 0==strcmp("--class-weighted", argv[i]) ) {
+			class_weighted = true;
+		}
+		
+		else if ( 0==strcmp("--zonal-sweep", argv[i]) ) {
+			zonal_sweep = true;
+		}
+
 		else if ( 0==strcmp("--class-summary-suffix", argv[i]) ) {
 			if ( ++i == argc || argv[i][0] == '-' )
 				usage("--class-summary-suffix: ?");
@@ -395,6 +444,9 @@ int main(int argc, char ** argv) {
 				usage("--mrst-shp-suffix: ?");
             globalOptions.mrstParams.mrst_glt_suffix = argv[i];
 		}
+		else if ( 0==strcmp("--mrst-minirasters", argv[i]) ) {
+            globalOptions.mrstParams.minirasters = true;
+		}
 		
 		
 		else if ( 0==strcmp("--rasterize-suffix", argv[i]) ) {
@@ -404,6 +456,17 @@ int main(int argc, char ** argv) {
             rasterize_suffix = argv[i];
             // TODO: accept other parameters
 		}
+		
+		else if ( 0==strcmp("--rasterize-cache", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' ) {
+				usage("--rasterize-cache: megabytes?");
+            }
+            int megabytes = atoi(argv[i]);
+            if ( megabytes < 1 ) {
+				usage("--rasterize-cache: expecting a positive number");
+            }
+            rasterizeParams.cacheBytes = (size_t) megabytes * 1024 * 1024;
+		}
         
 		
 		else if ( 0==strcmp("--dump_geometries", argv[i]) ) {
@@ -423,6 +486,11 @@ int main(int argc, char ** argv) {
 		else if ( 0==strcmp("--show-fields", argv[i]) ) {
 			show_fields = true;
 		}
+		else if ( 0==strcmp("--update-csv", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--update-csv: which CSV file?");
+			update_csv_filename = argv[i];
+		}
 		
 		//
 		// OPTIONS
@@ -438,10 +506,54 @@ int main(int argc, char ** argv) {
             globalOptions.pix_prop = pix_prop;
 		}
 		
+		else if ( 0==strcmp("--threads", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--threads: number of threads?");
+			globalOptions.num_threads = atoi(argv[i]);
+			if ( globalOptions.num_threads < 1 ) {
+				usage("--threads: expecting a positive number");
+			}
+		}
+		
+		else if ( 0==strcmp("--max-open-rasters", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--max-open-rasters: number of rasters?");
+			globalOptions.max_open_rasters = atoi(argv[i]);
+			if ( globalOptions.max_open_rasters < 1 ) {
+				usage("--max-open-rasters: expecting a positive number");
+			}
+		}
+		
+		else if ( 0==strcmp("--footprint-cache", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--footprint-cache: megabytes?");
+			globalOptions.footprint_cache_mb = atoi(argv[i]);
+			if ( globalOptions.footprint_cache_mb < 0 ) {
+				usage("--footprint-cache: expecting a non-negative number");
+			}
+		}
+		
+		else if ( 0==strcmp("--stack", argv[i]) ) {
+			globalOptions.stack = true;
+		}
+		
+		else if ( 0==strcmp("--rasterizer", argv[i]) ) {
+			if ( ++i == argc || argv[i][0] == '-' )
+				usage("--rasterizer: missing algorithm");
+			globalOptions.rasterizer = argv[i];
+			if ( globalOptions.rasterizer != "qt"
+			&&   globalOptions.rasterizer != "scanline" ) {
+				usage("--rasterizer: expecting one of: qt, scanline");
+			}
+		}
+		
 		else if ( 0==strcmp("--nodata", argv[i]) ) {
 			if ( ++i == argc || strncmp(argv[i], "--", 2) == 0 )
 				usage("--nodata: value?");
-			globalOptions.nodata = atof(argv[i]);
+			if ( 0==strcmp("band", argv[i]) )
+				globalOptions.nodata_per_band = true;
+			else
+				globalOptions.nodata = atof(argv[i]);
 		}
 		
 		else if ( 0==strcmp("--buffer", argv[i]) ) {
@@ -744,6 +856,21 @@ int main(int argc, char ** argv) {
         goto end;
     }
     
+    // band values at the x,y (or col,row) locations in a given CSV, written
+    // to <out-prefix><table-suffix>:
+    if ( update_csv_filename ) {
+        if ( raster_filenames.size() == 0 ) {
+            usage("--update-csv: provide at least a raster input (use --raster)");
+        }
+        if ( !globalOptions.outprefix ) {
+            usage("--out-prefix: ?");
+        }
+        csv_name = string(globalOptions.outprefix) + table_suffix;
+        res = starspan_update_csv(update_csv_filename, raster_filenames, csv_name.c_str());
+        
+        goto end;
+    }
+    
     
 
     if ( globalOptions.FID >= 0 ) {
@@ -792,7 +919,13 @@ int main(int argc, char ** argv) {
         usage("--out-type: ?");
     }
     
+    // weighted counts need the pixel coverage, not given by the quadtree:
+    if ( class_weighted && globalOptions.rasterizer == "qt" ) {
+        usage("--class-weighted: not supported with --rasterizer qt");
+    }
+    
     if ( outtype != "table" 
+    &&   outtype != "columnar" 
     &&   outtype != "mini_raster_strip" 
     &&   outtype != "mini_rasters"
     &&   outtype != "rasterization"      ) {
@@ -818,6 +951,22 @@ int main(int argc, char ** argv) {
 			usage("--out-type table expects a vector input (use --vector)");
 		}
         csv_name = string(globalOptions.outprefix) + table_suffix;
+        
+        if ( summary_suffix && select_stats.size() == 0 ) {
+            select_stats.push_back(DEFAULT_STAT);
+        }
+        
+        // summaries that can be generated in the same traversals as the
+        // table (starspan_csv does not consider --fid, and the counts
+        // by class are obtained from a single traversal of all rasters,
+        // as done with --stack):
+        bool fused = globalOptions.dupPixelModes.size() == 0
+                  && raster_filenames.size() > 0
+                  && globalOptions.FID < 0;
+        bool fuse_summary = fused && summary_suffix && !zonal_sweep;
+        bool fuse_class_summary = fused && class_summary_suffix
+                  && (raster_filenames.size() == 1 || globalOptions.stack);
+        
         if ( globalOptions.dupPixelModes.size() > 0 ) {
             res = starspan_csv2(
                 vect,
@@ -829,6 +978,22 @@ int main(int argc, char ** argv) {
                 csv_name.c_str()
             );
 		}
+		else if ( fuse_summary || fuse_class_summary ) {
+            string stats_name = fuse_summary ? string(globalOptions.outprefix) + summary_suffix : "";
+            string count_by_class_name = fuse_class_summary ? string(globalOptions.outprefix) + class_summary_suffix : "";
+			res = starspan_csv_with_summaries(
+				vect,  
+				raster_filenames,
+				select_fields, 
+				csv_name.c_str(),
+				vector_layernum,
+				select_stats,
+				fuse_summary ? stats_name.c_str() : NULL,
+				fuse_class_summary ? count_by_class_name.c_str() : NULL,
+				class_bands,
+				class_weighted
+			);
+		}
 		else if ( raster_filenames.size() > 0 ) {
 			res = starspan_csv(
 				vect,  
@@ -846,34 +1011,66 @@ int main(int argc, char ** argv) {
         // summaries:
         //
         
-        if ( summary_suffix ) {
+        if ( summary_suffix && !fuse_summary ) {
             string stats_name = string(globalOptions.outprefix) + summary_suffix;
             
-            if ( select_stats.size() == 0 ) {
-                select_stats.push_back(DEFAULT_STAT);
+            if ( zonal_sweep ) {
+                res = starspan_zonal_stats(
+                    vect,  
+                    raster_filenames,     
+                    select_stats,
+                    select_fields, 
+                    stats_name.c_str(),
+                    vector_layernum
+                );
+            }
+            else {
+                res = starspan_stats(
+                    vect,  
+                    raster_filenames,     
+                    select_stats,
+                    select_fields, 
+                    stats_name.c_str(),
+                    vector_layernum
+                );
             }
-            
-            res = starspan_stats(
-                vect,  
-                raster_filenames,     
-                select_stats,
-                select_fields, 
-                stats_name.c_str(),
-                vector_layernum
-            );
         }
         
-        if ( class_summary_suffix ) {
+        if ( class_summary_suffix && !fuse_class_summary ) {
             add_rasters_to_traverser(raster_filenames, traversr);
             
             string count_by_class_name = string(globalOptions.outprefix) + class_summary_suffix;
-            Observer* obs = starspan_getCountByClassObserver(traversr, count_by_class_name.c_str());
+            Observer* obs = starspan_getCountByClassObserver(traversr, count_by_class_name.c_str(),
+                class_bands, class_weighted
+            );
             if ( obs ) {
                 traversr.addObserver(obs);
             }
         }
     }
     
+    //
+    // Output: Columnar
+    //
+    else if ( outtype == "columnar" ) {
+		if ( !vect ) {
+			usage("--out-type columnar expects a vector input (use --vector)");
+		}
+		if ( raster_filenames.size() == 0 ) {
+			usage("--out-type columnar expects at least a raster input (use --raster)");
+		}
+        if ( globalOptions.dupPixelModes.size() > 0 ) {
+			usage("--out-type columnar: --duplicate not supported");
+        }
+        string columnar_prefix = string(globalOptions.outprefix) + columnar_suffix;
+        res = starspan_columnar(
+            vect,
+            raster_filenames,
+            columnar_prefix.c_str(),
+            vector_layernum
+        );
+    }
+    
     else if ( outtype == "mini_raster_strip" ) {
         string mrst_img_filename = string(globalOptions.outprefix) + globalOptions.mrstParams.mrst_img_suffix;
         string mrst_shp_filename = string(globalOptions.outprefix) + globalOptions.mrstParams.mrst_shp_suffix;
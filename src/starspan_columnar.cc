@@ -0,0 +1,389 @@
+//
+// STARSpan project
+// Carlos A. Rueda
+// starspan_columnar - generate columnar binary output from multiple rasters
+// $Id$
+//
+
+#include "starspan.h"
+#include "traverser.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+
+// number of rows kept in memory for each column before being written out
+#define COLUMNAR_ROW_GROUP  (64 * 1024)
+
+// size of the .npy header (magic, version, length, and dictionary)
+#define NPY_HEADER_SIZE  128
+
+
+/**
+  * A column written as a NumPy .npy file: a small text header followed by
+  * the raw values in native byte order. The number of rows is not known
+  * until the end, so the header is rewritten when the column is closed.
+  */
+class NpyColumn {
+	string filename;
+	string descr;
+	int itemSize;
+	FILE* file;
+	long rows;
+
+	// values not yet written out
+	vector<char> buffer;
+
+	void writeHeader(void) {
+		char dict[NPY_HEADER_SIZE];
+		int len = sprintf(dict, "{'descr': '%s', 'fortran_order': False, 'shape': (%ld,), }",
+			descr.c_str(), rows
+		);
+		// pad with spaces up to the fixed header size, ending with a newline:
+		const int dictSize = NPY_HEADER_SIZE - 10;
+		assert( len < dictSize );
+		memset(dict + len, ' ', dictSize - len);
+		dict[dictSize - 1] = '\n';
+
+		unsigned char preamble[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+			(unsigned char) (dictSize & 0xff), (unsigned char) (dictSize >> 8)
+		};
+		fseek(file, 0, SEEK_SET);
+		fwrite(preamble, 1, sizeof(preamble), file);
+		fwrite(dict, 1, dictSize, file);
+	}
+
+public:
+	/**
+	  * @param filename output file
+	  * @param descr NumPy type descriptor, eg., "<i8"
+	  * @param itemSize size of each value in bytes
+	  */
+	NpyColumn(string filename, string descr, int itemSize)
+	: filename(filename), descr(descr), itemSize(itemSize), file(0), rows(0)
+	{
+		buffer.reserve((size_t) COLUMNAR_ROW_GROUP * itemSize);
+	}
+
+	~NpyColumn() {
+		close();
+	}
+
+	/** creates the output file */
+	bool open(void) {
+		file = fopen(filename.c_str(), "wb");
+		if ( !file ) {
+			fprintf(stderr, "Cannot create %s\n", filename.c_str());
+			return false;
+		}
+		writeHeader();
+		return true;
+	}
+
+	/** appends a value of itemSize bytes */
+	inline void add(const void* value) {
+		const char* p = (const char*) value;
+		buffer.insert(buffer.end(), p, p + itemSize);
+	}
+
+	/** writes out buffered values */
+	void flush(void) {
+		if ( buffer.size() > 0 ) {
+			fwrite(&buffer[0], 1, buffer.size(), file);
+			rows += buffer.size() / itemSize;
+			buffer.clear();
+		}
+	}
+
+	/** writes out pending values, updates the header, and closes the file */
+	void close(void) {
+		if ( file ) {
+			flush();
+			writeHeader();
+			fclose(file);
+			file = 0;
+		}
+	}
+};
+
+
+/** NumPy descriptor for a type of the given kind ('i', 'u', 'f', 'c') and size */
+static string npy_descr(char kind, int size) {
+	const short one = 1;
+	const bool little = *((const char*) &one) == 1;
+	char descr[16];
+	sprintf(descr, "%c%c%d", size == 1 ? '|' : (little ? '<' : '>'), kind, size);
+	return descr;
+}
+
+
+/** NumPy descriptor for a GDAL band type, or "" if not supported */
+static string npy_descr(GDALDataType bandType) {
+	switch ( bandType ) {
+		case GDT_Byte:     return npy_descr('u', 1);
+		case GDT_UInt16:   return npy_descr('u', 2);
+		case GDT_Int16:    return npy_descr('i', 2);
+		case GDT_UInt32:   return npy_descr('u', 4);
+		case GDT_Int32:    return npy_descr('i', 4);
+		case GDT_Float32:  return npy_descr('f', 4);
+		case GDT_Float64:  return npy_descr('f', 8);
+		case GDT_CFloat32: return npy_descr('c', 8);
+		case GDT_CFloat64: return npy_descr('c', 16);
+		default:           return "";
+	}
+}
+
+
+/**
+  * This observer extracts from ONE raster at a time, appending the
+  * rows to the same columns.
+  *
+  * Band values are copied as they come in the traversal buffer, so
+  * each band column keeps the native GDAL type. Values are accumulated
+  * in memory per column and written out in groups of COLUMNAR_ROW_GROUP rows.
+  */
+class ColumnarObserver : public Observer {
+	string prefix;
+	unsigned ridSize;
+
+	NpyColumn* fidColumn;
+	NpyColumn* ridColumn;
+	NpyColumn* colColumn;
+	NpyColumn* rowColumn;
+	NpyColumn* xColumn;
+	NpyColumn* yColumn;
+	vector<NpyColumn*> bandColumns;
+
+	// band layout from first raster:
+	vector<GDALDataType> bandTypes;
+	vector<int> bandTypeSizes;
+
+	GIntBig fid;
+	string ridValue;
+	long rowsInGroup;
+
+	string columnFilename(const char* name) {
+		return prefix + name + ".npy";
+	}
+
+	bool addColumn(NpyColumn*& column, const char* name, string descr, int itemSize) {
+		column = new NpyColumn(columnFilename(name), descr, itemSize);
+		return column->open();
+	}
+
+	/** creates the columns according to the bands in info */
+	void createColumns(GlobalInfo& info) {
+		bool ok = addColumn(fidColumn, "FID", npy_descr('i', 8), 8);
+		if ( ok && globalOptions.RID != "none" ) {
+			char descr[32];
+			sprintf(descr, "|S%u", ridSize);
+			ok = addColumn(ridColumn, "RID", descr, ridSize);
+		}
+		if ( ok && !globalOptions.noColRow ) {
+			ok = addColumn(colColumn, "col", npy_descr('i', 4), 4)
+			  && addColumn(rowColumn, "row", npy_descr('i', 4), 4);
+		}
+		if ( ok && !globalOptions.noXY ) {
+			ok = addColumn(xColumn, "x", npy_descr('f', 8), 8)
+			  && addColumn(yColumn, "y", npy_descr('f', 8), 8);
+		}
+		for ( unsigned i = 0; ok && i < info.bands.size(); i++ ) {
+			GDALDataType bandType = info.bands[i]->GetRasterDataType();
+			string descr = npy_descr(bandType);
+			if ( descr.length() == 0 ) {
+				fprintf(stderr, "Band type %s not supported for columnar output\n",
+					GDALGetDataTypeName(bandType)
+				);
+				exit(1);
+			}
+			int typeSize = GDALGetDataTypeSize(bandType) >> 3;
+			bandTypes.push_back(bandType);
+			bandTypeSizes.push_back(typeSize);
+
+			char name[32];
+			sprintf(name, "Band%u", i+1);
+			NpyColumn* column;
+			ok = addColumn(column, name, descr, typeSize);
+			bandColumns.push_back(column);
+		}
+		if ( !ok ) {
+			exit(1);
+		}
+	}
+
+	void flush(void) {
+		NpyColumn* columns[] = { fidColumn, ridColumn, colColumn, rowColumn, xColumn, yColumn };
+		for ( unsigned i = 0; i < sizeof(columns) / sizeof(columns[0]); i++ ) {
+			if ( columns[i] )
+				columns[i]->flush();
+		}
+		for ( unsigned i = 0; i < bandColumns.size(); i++ ) {
+			bandColumns[i]->flush();
+		}
+		rowsInGroup = 0;
+	}
+
+public:
+	const char* raster_filename;
+
+	/**
+	  * Creates a columnar output creator.
+	  * @param prefix prefix for the column filenames
+	  * @param ridSize max length of RID values
+	  */
+	ColumnarObserver(const char* prefix, unsigned ridSize)
+	: prefix(prefix), ridSize(ridSize > 0 ? ridSize : 1)
+	{
+		fidColumn = ridColumn = colColumn = rowColumn = xColumn = yColumn = 0;
+		rowsInGroup = 0;
+		raster_filename = 0;
+	}
+
+	~ColumnarObserver() {
+		NpyColumn* columns[] = { fidColumn, ridColumn, colColumn, rowColumn, xColumn, yColumn };
+		for ( unsigned i = 0; i < sizeof(columns) / sizeof(columns[0]); i++ ) {
+			delete columns[i];
+		}
+		for ( unsigned i = 0; i < bandColumns.size(); i++ ) {
+			delete bandColumns[i];
+		}
+	}
+
+	/**
+	  * Creates the columns for the first raster; subsequent rasters
+	  * must have the same bands.
+	  */
+	void init(GlobalInfo& info) {
+		if ( !fidColumn ) {
+			createColumns(info);
+		}
+		else {
+			bool same = info.bands.size() == bandTypes.size();
+			for ( unsigned i = 0; same && i < info.bands.size(); i++ ) {
+				same = info.bands[i]->GetRasterDataType() == bandTypes[i];
+			}
+			if ( !same ) {
+				fprintf(stderr, "%s: bands differ from those of the first raster;"
+					" not supported for columnar output\n", raster_filename
+				);
+				exit(1);
+			}
+		}
+
+		if ( globalOptions.RID != "none" ) {
+			ridValue = raster_filename;
+			if ( globalOptions.RID == "file" ) {
+				starspan_simplify_filename(ridValue);
+			}
+			ridValue.resize(ridSize, '\0');
+		}
+	}
+
+	/**
+	  * Used here to update current FID
+	  */
+	void intersectionFound(IntersectionInfo& intersInfo) {
+		fid = intersInfo.feature->GetFID();
+	}
+
+	/**
+	  * Adds a row to the columns.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		fidColumn->add(&fid);
+		if ( ridColumn ) {
+			ridColumn->add(ridValue.data());
+		}
+		if ( colColumn ) {
+			int col = 1 + ev.pixel.col;
+			int row = 1 + ev.pixel.row;
+			colColumn->add(&col);
+			rowColumn->add(&row);
+		}
+		if ( xColumn ) {
+			xColumn->add(&ev.pixel.x);
+			yColumn->add(&ev.pixel.y);
+		}
+
+		// band values, as given in the traversal buffer:
+		char* ptr = (char*) ev.bandValues;
+		for ( unsigned i = 0; i < bandColumns.size(); i++ ) {
+			bandColumns[i]->add(ptr);
+			ptr += bandTypeSizes[i];
+		}
+
+		if ( ++rowsInGroup >= COLUMNAR_ROW_GROUP ) {
+			flush();
+		}
+	}
+
+	/**
+	  * Writes out pending rows.
+	  */
+	void end() {
+		flush();
+	}
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+int starspan_columnar(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	const char* prefix,
+	int layernum
+) {
+	// RID column is fixed width:
+	unsigned ridSize = 0;
+	if ( globalOptions.RID != "none" ) {
+		for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+			string rid = raster_filenames[i];
+			if ( globalOptions.RID == "file" ) {
+				starspan_simplify_filename(rid);
+			}
+			if ( ridSize < rid.length() )
+				ridSize = rid.length();
+		}
+	}
+
+	ColumnarObserver obs(prefix, ridSize);
+
+	Traverser tr;
+	tr.addObserver(&obs);
+
+	tr.setVector(vect);
+	tr.setLayerNum(layernum);
+
+	if ( globalOptions.progress ) {
+		tr.setProgress(globalOptions.progress_perc, cout);
+		cout << "Number of features: ";
+		long psize = vect->getLayer(layernum)->GetFeatureCount();
+		if ( psize >= 0 )
+			cout << psize;
+		else
+			cout << "(not known in advance)";
+		cout<< endl;
+	}
+
+	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+		fprintf(stdout, "starspan_columnar: %3u: Extracting from %s\n", i+1, raster_filenames[i]);
+		obs.raster_filename = raster_filenames[i];
+		tr.removeRasters();
+		Raster* raster = new Raster(raster_filenames[i]);
+		tr.addRaster(raster);
+
+		tr.traverse();
+
+		if ( globalOptions.report_summary ) {
+			tr.reportSummary();
+		}
+
+		delete raster;
+	}
+
+	return 0;
+}
+
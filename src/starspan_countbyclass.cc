@@ -12,16 +12,135 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <math.h>
 #include <cassert>
+#include <algorithm>
 
 using namespace std;
 
 // my prefix for verbose output:
 static const char* vprefix = "  [count-by-class]";
 
+
+/**
+  * Counts of the classes of a band in current feature.
+  * Classes of Byte, UInt16 and Int16 bands are counted in a dense array
+  * over the range of the type; other types in a map.
+  */
+class ClassCounter {
+public:
+	GDALDataType bandType;
+	int bandIndex;     // 1-based
+	int offset;        // of band value in TraversalEvent#bandValues
+	bool weighted;
+
+	ClassCounter(GDALDataType bandType, int bandIndex, int offset, bool weighted) :
+		bandType(bandType), bandIndex(bandIndex), offset(offset), weighted(weighted)
+	{
+		switch ( bandType ) {
+			case GDT_Byte:   base = 0;      size = 256;   break;
+			case GDT_UInt16: base = 0;      size = 65536; break;
+			case GDT_Int16:  base = -32768; size = 65536; break;
+			default:         base = 0;      size = 0;     break;
+		}
+		counts.assign(size, 0);
+		if ( weighted )
+			weights.assign(size, 0.0);
+		lo = 1;
+		hi = 0;
+	}
+
+	inline void add(const char* bandValues, double coverage) {
+		// values in the buffer are not necessarily aligned for their type,
+		// so they are copied into locals:
+		const char* ptr = bandValues + offset;
+		int class_;
+		unsigned short us;
+		short s;
+		switch ( bandType ) {
+			case GDT_Byte:   class_ = *( (unsigned char*) ptr );                 break;
+			case GDT_UInt16: memcpy(&us, ptr, sizeof(us)); class_ = us;          break;
+			case GDT_Int16:  memcpy(&s, ptr, sizeof(s));   class_ = s;           break;
+			case GDT_Int32:  memcpy(&class_, ptr, sizeof(class_));               break;
+			default:
+				// as done by RasterIO with GDT_Int32:
+				GDALCopyWords((void*) ptr, bandType, 0, &class_, GDT_Int32, 0, 1);
+				break;
+		}
+
+		if ( size > 0 ) {
+			const int i = class_ - base;
+			counts[i]++;
+			if ( weighted )
+				weights[i] += coverage;
+			if ( lo > hi ) {
+				lo = hi = i;
+			}
+			else {
+				if ( lo > i )  lo = i;
+				if ( hi < i )  hi = i;
+			}
+		}
+		else {
+			sparseCounts[class_]++;
+			if ( weighted )
+				sparseWeights[class_] += coverage;
+		}
+	}
+
+	/**
+	  * Gets the counts in ascending order of class, and resets them.
+	  */
+	void take(vector<int>& classes, vector<unsigned>& classCounts, vector<double>& classWeights) {
+		classes.clear();
+		classCounts.clear();
+		classWeights.clear();
+		if ( size > 0 ) {
+			for ( int i = lo; i <= hi; i++ ) {
+				if ( counts[i] ) {
+					classes.push_back(base + i);
+					classCounts.push_back(counts[i]);
+					counts[i] = 0;
+					if ( weighted ) {
+						classWeights.push_back(weights[i]);
+						weights[i] = 0.0;
+					}
+				}
+			}
+			lo = 1;
+			hi = 0;
+		}
+		else {
+			for ( map<int,unsigned>::iterator it = sparseCounts.begin(); it != sparseCounts.end(); it++ ) {
+				classes.push_back(it->first);
+				classCounts.push_back(it->second);
+				if ( weighted )
+					classWeights.push_back(sparseWeights[it->first]);
+			}
+			sparseCounts.clear();
+			sparseWeights.clear();
+		}
+	}
+
+private:
+	// dense: count of class c in counts[c - base]; non-zero only in [lo,hi]
+	int base, size;
+	vector<unsigned> counts;
+	vector<double> weights;
+	int lo, hi;
+
+	// sparse:
+	map<int,unsigned> sparseCounts;
+	map<int,double> sparseWeights;
+};
+
+
 /**
   * Creates fields and populates the table.
+  *
+  * Band values are taken as pixels are visited (from the traverser's
+  * window buffers), and counted by ClassCounter for each desired band.
   */
 class CountByClassObserver : public Observer {
 public:
@@ -30,13 +149,24 @@ public:
 	Vector* vect;
 	FILE* outfile;
 	bool OK;
+	
+	// desired bands (1-based); if empty, only the first band is processed
+	// and the band column is not included
+	vector<int> class_bands;
+	
+	// should the sum of pixel coverages be reported?
+	bool weighted;
+	
+	vector<ClassCounter> counters;
 		
 	CsvOutput csvOut;
 
 	/**
 	  * Creates a counter by class.
 	  */
-	CountByClassObserver(Traverser& tr, FILE* f) : tr(tr), outfile(f) {
+	CountByClassObserver(Traverser& tr, FILE* f, vector<int> class_bands, bool weighted) :
+		tr(tr), outfile(f), class_bands(class_bands), weighted(weighted)
+	{
 		vect = tr.getVector();
 		global_info = 0;
 		OK = false;
@@ -63,16 +193,32 @@ public:
 
 
 	/**
-	  * returns true. We ask traverser to get values for
-	  * visited pixels in each feature.
+	  * returns false. We need band values for visited pixels.
 	  */
 	bool isSimple() { 
-		return true; 
+		return false; 
+	}
+
+	/**
+	  * returns true if weighted counts are requested.
+	  */
+	bool needsCoverage() {
+		return weighted;
+	}
+
+	/**
+	  * returns true only for the bands to be counted, so the other bands
+	  * are not read (unless needed by another observer).
+	  */
+	bool usesBand(int band_index) {
+		if ( class_bands.size() == 0 )
+			return band_index == 1;
+		return find(class_bands.begin(), class_bands.end(), band_index) != class_bands.end();
 	}
 
 	/**
 	  * Creates first line with column headers:
-	  *    FID, class, count
+	  *    FID, [band,] class, count [,weighted_count]
 	  */
 	void init(GlobalInfo& info) {
 		global_info = &info;
@@ -92,20 +238,41 @@ public:
 		
 		const unsigned num_bands = global_info->bands.size();
 		
-		if ( num_bands > 1 ) {
-			cerr<< "CountByClass: warning: multiband raster data;" <<endl;
-			cerr<< "              Only the first band will be processed." <<endl;
+		vector<int> bands = class_bands;
+		if ( bands.size() == 0 ) {
+			if ( num_bands > 1 ) {
+				cerr<< "CountByClass: warning: multiband raster data;" <<endl;
+				cerr<< "              Only the first band will be processed." <<endl;
+			}
+			else if ( num_bands == 0 ) {
+				cerr<< "CountByClass: warning: no bands in raster data;" <<endl;
+				return;
+			}
+			bands.push_back(1);
 		}
-		else if ( num_bands == 0 ) {
-			cerr<< "CountByClass: warning: no bands in raster data;" <<endl;
-			return;
+
+		// offsets of band values in TraversalEvent#bandValues:
+		vector<int> offsets;
+		int offset = 0;
+		for ( unsigned i = 0; i < num_bands; i++ ) {
+			offsets.push_back(offset);
+			offset += GDALGetDataTypeSize(global_info->bands[i]->GetRasterDataType()) >> 3;
 		}
 
-		// check first band is of integral type:
-		GDALDataType bandType = global_info->bands[0]->GetRasterDataType();
-		if ( bandType == GDT_Float64 || bandType == GDT_Float32 ) {
-			cerr<< "CountByClass: warning: first band in raster data is not of integral type" <<endl;
-			return;
+		counters.clear();
+		for ( unsigned k = 0; k < bands.size(); k++ ) {
+			const int b = bands[k];
+			if ( b < 1 || b > (int) num_bands ) {
+				cerr<< "CountByClass: warning: band " <<b<< " not in raster data" <<endl;
+				return;
+			}
+			// check band is of integral type:
+			GDALDataType bandType = global_info->bands[b - 1]->GetRasterDataType();
+			if ( bandType == GDT_Float64 || bandType == GDT_Float32 ) {
+				cerr<< "CountByClass: warning: band " <<b<< " in raster data is not of integral type" <<endl;
+				return;
+			}
+			counters.push_back(ClassCounter(bandType, b, offsets[b - 1], weighted));
 		}
 
 		csvOut.setFile(outfile);
@@ -115,7 +282,12 @@ public:
 		//		
 		// write column headers:
 		//
-		csvOut.addString("FID").addString("class").addString("count");
+		csvOut.addString("FID");
+		if ( class_bands.size() > 0 )
+			csvOut.addString("band");
+		csvOut.addString("class").addString("count");
+		if ( weighted )
+			csvOut.addString("weighted_count");
 		csvOut.endLine();
 		//fprintf(outfile, "FID,class,count\n");
 		
@@ -123,6 +295,18 @@ public:
 		OK = true;
 	}
 	
+	/**
+	  * counts the classes of the pixel.
+	  */
+	void addPixel(TraversalEvent& ev) {
+		if ( !OK )
+			return;
+		const char* bandValues = (const char*) ev.bandValues;
+		for ( unsigned k = 0; k < counters.size(); k++ ) {
+			counters[k].add(bandValues, ev.coverage);
+		}
+	}
+	
 	/**
 	  * gets the counts and writes news records accordingly.
 	  */
@@ -132,30 +316,33 @@ public:
 
 		const long FID = intersInfo.feature->GetFID();
 		
-		// get values of pixels corresponding to first band:		
-		vector<int> values;
-		tr.getPixelIntegerValuesInBand(1, values);
-		
-		// get the counts:
-		map<int,int> counters;
-		Stats::computeCounts(values, counters);
-
 		// report the counts:
 		if ( globalOptions.verbose ) {
 			cout<< vprefix<< " FID=" <<FID<< " pixels=" <<tr.getPixelSetSize()<< ":\n";
 		}
-		for ( map<int, int>::iterator it = counters.begin(); it != counters.end(); it++ ) {
-			const int class_ = it->first;
-			const int count = it->second;
-			
-			// add record to outfile:
-			csvOut.startLine();
-			csvOut.addField("%ld", FID).addField("%d", class_).addField("%d", count);
-			csvOut.endLine();
-			//fprintf(outfile, "%ld,%d,%d\n", FID, class_, count);
-
-			if ( globalOptions.verbose ) {
-				cout<< vprefix<< "   class=" <<class_<< " count=" <<count<< endl;
+		vector<int> classes;
+		vector<unsigned> counts;
+		vector<double> weights;
+		for ( unsigned k = 0; k < counters.size(); k++ ) {
+			counters[k].take(classes, counts, weights);
+			for ( unsigned i = 0; i < classes.size(); i++ ) {
+				const int class_ = classes[i];
+				const int count = counts[i];
+				
+				// add record to outfile:
+				csvOut.startLine();
+				csvOut.addField("%ld", FID);
+				if ( class_bands.size() > 0 )
+					csvOut.addField("%d", counters[k].bandIndex);
+				csvOut.addField("%d", class_).addField("%d", count);
+				if ( weighted )
+					csvOut.addField("%f", weights[i]);
+				csvOut.endLine();
+				//fprintf(outfile, "%ld,%d,%d\n", FID, class_, count);
+
+				if ( globalOptions.verbose ) {
+					cout<< vprefix<< "   band=" <<counters[k].bandIndex<< " class=" <<class_<< " count=" <<count<< endl;
+				}
 			}
 		}
 		fflush(outfile);
@@ -169,7 +356,9 @@ public:
   */
 Observer* starspan_getCountByClassObserver(
 	Traverser& tr,
-	const char* filename
+	const char* filename,
+	vector<int> class_bands,
+	bool weighted
 ) {
 	// create output file
 	FILE* outfile = fopen(filename, "w");
@@ -178,7 +367,7 @@ Observer* starspan_getCountByClassObserver(
 		return 0;
 	}
 
-	return new CountByClassObserver(tr, outfile);	
+	return new CountByClassObserver(tr, outfile, class_bands, weighted);	
 }
 		
 
@@ -7,25 +7,116 @@
 
 #include "starspan.h"
 #include "traverser.h"
+#include "recorder.h"
+#include "footprint.h"
 #include "Csv.h"
 
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+
+
+// size of output buffer before it is written out
+#define CSV_BUFFER_SIZE  (1024 * 1024)
 
 
 /**
-  * This observer extracts from ONE raster
+  * This observer extracts from ONE raster.
+  *
+  * The part of the record that only depends on the feature (FID, attribute
+  * fields and RID) is serialized once per feature, and band values are
+  * formatted with starspan_format_value. Records are accumulated in a
+  * buffer that is written out in big chunks.
   */
-class CSVObserver : public Observer {
+class CSVObserver : public RasterOutputObserver {
+	// FID, fields and RID for current feature, already separated and quoted
+	string prefix;
+	bool prefixValid;
+
+	// records not yet written out
+	string buffer;
+
+	string separator;
+	string quote;
+
+	vector<GDALDataType> bandTypes;
+	vector<int> bandTypeSizes;
+
+	/** appends a field to s, quoted if it contains the separator (as CsvOutput does) */
+	void appendField(string& s, const char* value, int len) {
+		if ( strstr(value, separator.c_str()) ) {
+			s += quote;
+			s.append(value, len);
+			s += quote;
+		}
+		else {
+			s.append(value, len);
+		}
+	}
+
+	/** appends a separator and a field to the buffer */
+	inline void appendNextField(const char* value, int len) {
+		buffer += separator;
+		appendField(buffer, value, len);
+	}
+
+	/** serializes FID, fields, and RID for currentFeature */
+	void buildPrefix(void) {
+		char value[64];
+		prefix.clear();
+
+		// FID value:
+		int len = starspan_format_long(currentFeature->GetFID(), value);
+		value[len] = 0;
+		appendField(prefix, value, len);
+
+		// attribute fields from source currentFeature:
+		if ( select_fields ) {
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				const int i = currentFeature->GetFieldIndex(*fname);
+				if ( i < 0 ) {
+					fprintf(stderr, "\n\tField `%s' not found\n", *fname);
+					exit(1);
+				}
+				const char* str = currentFeature->GetFieldAsString(i);
+				prefix += separator;
+				appendField(prefix, str, strlen(str));
+			}
+		}
+		else {
+			// all fields
+			int feature_field_count = currentFeature->GetFieldCount();
+			for ( int i = 0; i < feature_field_count; i++ ) {
+				const char* str = currentFeature->GetFieldAsString(i);
+				prefix += separator;
+				appendField(prefix, str, strlen(str));
+			}
+		}
+
+		// RID field
+		if ( globalOptions.RID != "none" ) {
+			prefix += separator;
+			appendField(prefix, RID_value.c_str(), RID_value.length());
+		}
+
+		prefixValid = true;
+	}
+
+	/** writes out the buffer */
+	void flush(void) {
+		if ( buffer.length() > 0 ) {
+			fwrite(buffer.data(), 1, buffer.length(), file);
+			buffer.clear();
+		}
+	}
+
 public:
 	GlobalInfo* global_info;
 	Vector* vect;
 	OGRLayer* poLayer;
 	OGRFeature* currentFeature;
 	vector<const char*>* select_fields;
-	const char* raster_filename;
 	string RID_value;  //  will be used only if globalOptions.RID != "none".
-	bool write_header;
 	FILE* file;
 	int layernum;
 	CsvOutput csvOut;
@@ -37,6 +128,8 @@ public:
 	: vect(vect), select_fields(select_fields), file(f), layernum(layernum)
 	{
 		global_info = 0;
+		prefixValid = false;
+		quote = "\"";
 		poLayer = vect->getLayer(layernum);
 		if ( !poLayer ) {
 			fprintf(stderr, "Couldn't fetch layer %d\n", layernum);
@@ -51,7 +144,9 @@ public:
 	  */
 	void init(GlobalInfo& info) {
 		global_info = &info;
-		
+
+		separator = globalOptions.delimiter;
+		csvOut.setQuote(quote);
 		csvOut.setFile(file);
 		csvOut.setSeparator(globalOptions.delimiter);
 		csvOut.startLine();
@@ -105,7 +200,17 @@ public:
 			csvOut.endLine();
 		}
 		
+		bandTypes.clear();
+		bandTypeSizes.clear();
+		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
+			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
+			bandTypes.push_back(bandType);
+			bandTypeSizes.push_back(GDALGetDataTypeSize(bandType) >> 3);
+		}
+		buffer.reserve(CSV_BUFFER_SIZE + 64 * 1024);
+
 		currentFeature = NULL;
+		prefixValid = false;
 		if ( globalOptions.RID != "none" ) {
 			RID_value = raster_filename;
 			if ( globalOptions.RID == "file" ) {
@@ -120,83 +225,70 @@ public:
 	  */
 	void intersectionFound(IntersectionInfo& intersInfo) {
 		currentFeature = intersInfo.feature;
+		prefixValid = false;
 	}
 	
 	
 	/**
-	  * Adds a record to the output file.
+	  * Adds a record to the output buffer.
 	  */
-	void addPixel(TraversalEvent& ev) { 
+	void addPixel(TraversalEvent& ev) {
 		int col = 1 + ev.pixel.col;
 		int row = 1 + ev.pixel.row;
-		void* band_values = ev.bandValues;
-		
-		//
-		// Add field values to new record:
-		//
-		
-		csvOut.startLine();
 
-		// Add FID value:
-		csvOut.addField("%ld", currentFeature->GetFID());
-		
-		// add attribute fields from source currentFeature to record:
-		if ( select_fields ) {
-			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
-				const int i = currentFeature->GetFieldIndex(*fname);
-				if ( i < 0 ) {
-					fprintf(stderr, "\n\tField `%s' not found\n", *fname);
-					exit(1);
-				}
-				const char* str = currentFeature->GetFieldAsString(i);
-				csvOut.addString(str);
-			}
-		}
-		else {
-			// all fields
-			int feature_field_count = currentFeature->GetFieldCount();
-			for ( int i = 0; i < feature_field_count; i++ ) {
-				const char* str = currentFeature->GetFieldAsString(i);
-				csvOut.addString(str);
-			}
+		// FID, attribute fields, and RID:
+		if ( !prefixValid ) {
+			buildPrefix();
 		}
+		buffer += prefix;
+
+		char value[1024];
+		int len;
 
-		// add RID field
-		if ( globalOptions.RID != "none" ) {
-			csvOut.addString(RID_value);
-		}
-		
-		
 		// add (col,row) fields
 		if ( !globalOptions.noColRow ) {
-			csvOut.addField("%d", col).addField("%d", row);
+			len = starspan_format_long(col, value);
+			value[len] = 0;
+			appendNextField(value, len);
+			len = starspan_format_long(row, value);
+			value[len] = 0;
+			appendNextField(value, len);
 		}
-		
+
 		// add (x,y) fields
 		if ( !globalOptions.noXY ) {
-			csvOut.addField("%.3f", ev.pixel.x).addField("%.3f", ev.pixel.y);
+			len = sprintf(value, "%.3f", ev.pixel.x);
+			appendNextField(value, len);
+			len = sprintf(value, "%.3f", ev.pixel.y);
+			appendNextField(value, len);
 		}
-		
+
 		// add band values to record:
-		char* ptr = (char*) band_values;
-		char value[1024];
-		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
-			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
-			int typeSize = GDALGetDataTypeSize(bandType) >> 3;
-			
-			starspan_extract_string_value(bandType, ptr, value);
-			csvOut.addString(value);
-			
+		char* ptr = (char*) ev.bandValues;
+		for ( unsigned i = 0; i < bandTypes.size(); i++ ) {
+			len = starspan_format_value(bandTypes[i], ptr, value);
+			appendNextField(value, len);
+
 			// move to next piece of data in buffer:
-			ptr += typeSize;
+			ptr += bandTypeSizes[i];
+		}
+		buffer += '\n';
+
+		if ( buffer.length() >= CSV_BUFFER_SIZE ) {
+			flush();
 		}
-		csvOut.endLine();
 	}
 
 	/**
-	  * does nothing
+	  * Writes out pending records.
 	  */
-	void end() {}
+	void end() {
+		flush();
+	}
+
+	~CSVObserver() {
+		flush();
+	}
 };
 
 
@@ -211,43 +303,14 @@ int starspan_csv(
 	vector<const char*> raster_filenames,
 	vector<const char*>* select_fields,
 	const char* csv_filename,
-	int layernum
+	int layernum,
+	RasterPool* rasterPool,
+	FeatureRecord* record
 ) {
-	FILE* file;
-	bool new_file = false;
-	
-	// if file exists, append new rows. Otherwise create file.
-	file = fopen(csv_filename, "r+");
-	if ( file ) {
-		if ( globalOptions.verbose ) {
-			fprintf(stdout, "starspan_csv: Appending to existing file %s\n", csv_filename);
-        }
-
-		fseek(file, 0, SEEK_END);
-
-		// check that new data will start in a new line:
-		// if last character is not '\n', then write a '\n':
-		// (This check will make the output more robust in case
-		// the previous information is not properly aligned, eg.
-		// when the previous generation was killed for some reason.)
-		long endpos = ftell(file);
-		if ( endpos > 0 ) {
-			fseek(file, endpos -1, SEEK_SET);
-			char c;
-			if ( 1 == fread(&c, sizeof(c), 1, file) ) {
-				if ( c != '\n' )
-					fputc('\n', file);    // add a new line
-			}
-		}
-	}
-	else {
-		// create output file
-		file = fopen(csv_filename, "w");
-		if ( !file) {
-			fprintf(stderr, "Cannot create %s\n", csv_filename);
-			return 1;
-		}
-		new_file = true;
+	bool new_file;
+	FILE* file = starspan_open_for_append(csv_filename, &new_file);
+	if ( !file ) {
+		return 1;
 	}
 
 	CSVObserver obs(vect, select_fields, file, layernum);
@@ -257,6 +320,23 @@ int starspan_csv(
 
 	tr.setVector(vect);
 	tr.setLayerNum(layernum);
+	
+	if ( record ) {
+		tr.setDesiredFID(record->feature->GetFID());
+		tr.setFeatureRecord(record);
+	}
+	
+	// stacked rasters are read in a single traversal
+	const bool stacked = globalOptions.stack && raster_filenames.size() > 1;
+	
+	// one traversal per raster: index features once for all of them
+	tr.setFeatureIndex(raster_filenames.size() > 1 && !stacked);
+	
+	// and reuse the pixels of each feature on rasters with the same grid:
+	FootprintCache footprintCache((size_t) globalOptions.footprint_cache_mb * 1024 * 1024);
+	if ( !record && !stacked && starspan_rasters_share_grid(raster_filenames) ) {
+		tr.setFootprintCache(&footprintCache);
+	}
     
 	if ( globalOptions.progress ) {
 		tr.setProgress(globalOptions.progress_perc, cout);
@@ -269,13 +349,47 @@ int starspan_csv(
 		cout<< endl;
 	}
 	
+	if ( stacked ) {
+		fprintf(stdout, "starspan_csv: Extracting from %u stacked rasters\n", (unsigned) raster_filenames.size());
+		vector<Raster*> rasters;
+		string rid;
+		if ( starspan_stack_rasters(tr, raster_filenames, rasters, rid) ) {
+			fclose(file);
+			return 1;
+		}
+		obs.raster_filename = rid.c_str();
+		obs.write_header = new_file;
+		
+		tr.traverse();
+
+		if ( globalOptions.report_summary ) {
+			tr.reportSummary();
+		}
+		
+		for ( unsigned i = 0; i < rasters.size(); i++ ) {
+			delete rasters[i];
+		}
+		fclose(file);
+		return 0;
+	}
+	
 	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
 		fprintf(stdout, "starspan_csv: %3u: Extracting from %s\n", i+1, raster_filenames[i]);
 		obs.raster_filename = raster_filenames[i];
 		obs.write_header = new_file && i == 0;
 		tr.removeRasters();
 
-		Raster* raster = new Raster(raster_filenames[i]);
+		Raster* raster;
+		if ( rasterPool ) {
+			raster = rasterPool->acquire(raster_filenames[i]);
+			if ( !raster ) {
+				fclose(file);
+				return 1;
+			}
+		}
+		else {
+			raster = new Raster(raster_filenames[i]);
+		}
 		tr.addRaster(raster);
 		
 		tr.traverse();
@@ -284,7 +398,10 @@ int starspan_csv(
 			tr.reportSummary();
 		}
 
-		delete raster;
+		if ( rasterPool )
+			rasterPool->release(raster);
+		else
+			delete raster;
 	}
 	
 	fclose(file);
@@ -292,3 +409,163 @@ int starspan_csv(
 	return 0;
 }
 
+
+/**
+  * starspan_getCSVObserver: implementation
+  */
+RasterOutputObserver* starspan_getCSVObserver(
+	Vector* vect,
+	vector<const char*>* select_fields,
+	FILE* file,
+	int layernum
+) {
+	return new CSVObserver(vect, select_fields, file, layernum);
+}
+
+
+//
+// As starspan_csv, with the observers of the summaries added to the same
+// traverser.
+//
+int starspan_csv_with_summaries(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*>* select_fields,
+	const char* csv_filename,
+	int layernum,
+	vector<const char*> select_stats,
+	const char* stats_filename,
+	const char* class_filename,
+	vector<int> class_bands,
+	bool class_weighted
+) {
+	// stacked rasters are read in a single traversal
+	const bool stacked = globalOptions.stack && raster_filenames.size() > 1;
+	
+	if ( class_filename && raster_filenames.size() != 1 && !stacked ) {
+		fprintf(stderr, "starspan_csv_with_summaries: counts by class require a single raster or --stack\n");
+		return 1;
+	}
+
+	Traverser tr;
+	tr.setVector(vect);
+	tr.setLayerNum(layernum);
+	
+	// the outputs generated with a traversal per raster:
+	vector<RasterOutputObserver*> observers;
+	vector<FILE*> files;
+	vector<bool> new_files;
+	
+	bool new_file;
+	FILE* file = starspan_open_for_append(csv_filename, &new_file);
+	if ( !file ) {
+		return 1;
+	}
+	observers.push_back(starspan_getCSVObserver(vect, select_fields, file, layernum));
+	files.push_back(file);
+	new_files.push_back(new_file);
+	
+	if ( stats_filename ) {
+		file = starspan_open_for_append(stats_filename, &new_file);
+		if ( !file ) {
+			fclose(files[0]);
+			delete observers[0];
+			return 1;
+		}
+		observers.push_back(starspan_getRasterStatsObserver(tr, file, select_stats, select_fields));
+		files.push_back(file);
+		new_files.push_back(new_file);
+	}
+	
+	for ( unsigned k = 0; k < observers.size(); k++ ) {
+		tr.addObserver(observers[k]);
+	}
+	
+	// counts by class: a single traversal, which is the one done here
+	if ( class_filename ) {
+		Observer* obs = starspan_getCountByClassObserver(tr, class_filename,
+			class_bands, class_weighted
+		);
+		if ( obs ) {
+			tr.addObserver(obs);
+		}
+	}
+	
+	// one traversal per raster: index features once for all of them
+	tr.setFeatureIndex(raster_filenames.size() > 1 && !stacked);
+	
+	// and reuse the pixels of each feature on rasters with the same grid:
+	FootprintCache footprintCache((size_t) globalOptions.footprint_cache_mb * 1024 * 1024);
+	if ( !stacked && starspan_rasters_share_grid(raster_filenames) ) {
+		tr.setFootprintCache(&footprintCache);
+	}
+    
+	if ( globalOptions.progress ) {
+		tr.setProgress(globalOptions.progress_perc, cout);
+		cout << "Number of features: ";
+		long psize = vect->getLayer(layernum)->GetFeatureCount();
+		if ( psize >= 0 )
+			cout << psize;
+		else
+			cout << "(not known in advance)";
+		cout<< endl;
+	}
+	
+	if ( stacked ) {
+		fprintf(stdout, "starspan_csv: Extracting from %u stacked rasters\n", (unsigned) raster_filenames.size());
+		vector<Raster*> rasters;
+		string rid;
+		int res = starspan_stack_rasters(tr, raster_filenames, rasters, rid);
+		if ( !res ) {
+			for ( unsigned k = 0; k < observers.size(); k++ ) {
+				observers[k]->raster_filename = rid.c_str();
+				observers[k]->write_header = new_files[k];
+			}
+			
+			tr.traverse();
+
+			if ( globalOptions.report_summary ) {
+				tr.reportSummary();
+			}
+		}
+		
+		tr.releaseObservers();
+		for ( unsigned i = 0; i < rasters.size(); i++ ) {
+			delete rasters[i];
+		}
+		for ( unsigned k = 0; k < files.size(); k++ ) {
+			fclose(files[k]);
+		}
+		return res;
+	}
+	
+	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+		fprintf(stdout, "starspan_csv: %3u: Extracting from %s\n", i+1, raster_filenames[i]);
+		for ( unsigned k = 0; k < observers.size(); k++ ) {
+			observers[k]->raster_filename = raster_filenames[i];
+			observers[k]->write_header = new_files[k] && i == 0;
+		}
+		tr.removeRasters();
+
+		Raster* raster = new Raster(raster_filenames[i]);
+		tr.addRaster(raster);
+		
+		tr.traverse();
+
+		if ( globalOptions.report_summary ) {
+			tr.reportSummary();
+		}
+
+		delete raster;
+	}
+	
+	// releases all observers, including the one for the counts by class,
+	// which closes its file:
+	tr.releaseObservers();
+	
+	for ( unsigned k = 0; k < files.size(); k++ ) {
+		fclose(files[k]);
+	}
+	
+	return 0;
+}
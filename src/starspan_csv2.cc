@@ -43,7 +43,9 @@ static void extractFunction(ExtractionItem* item) {
 		raster_filenames,
 		select_fields,
 		csv_filename,
-		layernum
+		layernum,
+		item->rasterPool,
+		item->record
 	);
 	Traverser::_resetReading = prevResetReading;
 	
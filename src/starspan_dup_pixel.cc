@@ -8,7 +8,9 @@
 
 #include "starspan.h"
 #include "traverser.h"
+#include "recorder.h"
 #include "Csv.h"
+#include "EnvelopeIndex.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -45,6 +47,9 @@ static int layernum;
 static void (*extrFunction)(ExtractionItem* item);
 static ExtractionItem extrItem;
 
+// open rasters and masks, shared by all features:
+static RasterPool* rasterPool;
+
 
 /**
  * Gets the center of the geometry. 
@@ -69,33 +74,67 @@ struct RasterInfo {
 	// mask filename
 	const char* ri_mask_filename;
 	
-	// mask
-	Raster* ri_mask;
-	
-    
 	// bounding box
 	OGRPolygon* ri_bb;
 	
+	// envelope of ri_bb
+	OGREnvelope ri_env;
+	
 	// center of ri_bb;
 	OGRPoint* ri_center;
 	
+	// number of bands in raster
+	int ri_num_bands;
+	
+	// can the mask be traversed together with the raster?
+	// (ie., same size, location and pixel size)
+	bool ri_mask_stacked;
+	
+	// traversal of the current feature over the raster (and the mask if
+	// ri_mask_stacked): set during evaluation as a candidate
+	FeatureRecord* ri_record;
+	
 	// distance: set during evaluation as a candidate
 	double distance;
 	
 	RasterInfo(int idx, const char* raster_filename, const char* mask_filename)
 	: ri_idx(idx), ri_filename(raster_filename),
-      ri_mask_filename(mask_filename), ri_mask(0), ri_bb(0), ri_center(0) {
-        
-        if ( ri_mask_filename ) {
-            ri_mask = new Raster(ri_mask_filename);
-        }
+      ri_mask_filename(mask_filename), ri_bb(0), ri_center(0),
+      ri_mask_stacked(false), ri_record(0) {
         
-        // open the raster momentarily to get its bounding box and center:
-		Raster ri_raster(ri_filename);
+        // get the raster from the pool to get its bounding box and center:
+		Raster* ri_raster = rasterPool->acquire(ri_filename);
+		if ( !ri_raster ) {
+			exit(1);
+		}
         
 		// create a geometry for raster envelope:
+		int width, height;
 		double x0, y0, x1, y1;		
-		ri_raster.getCoordinates(&x0, &y0, &x1, &y1);
+		double pix_x_size, pix_y_size;
+		ri_raster->getSize(&width, &height, &ri_num_bands);
+		ri_raster->getCoordinates(&x0, &y0, &x1, &y1);
+		ri_raster->getPixelSize(&pix_x_size, &pix_y_size);
+		rasterPool->release(ri_raster);
+		
+		if ( ri_mask_filename ) {
+			Raster* ri_mask = rasterPool->acquire(ri_mask_filename);
+			if ( !ri_mask ) {
+				exit(1);
+			}
+			int m_width, m_height;
+			double m_x0, m_y0, m_x1, m_y1;		
+			double m_pix_x_size, m_pix_y_size;
+			ri_mask->getSize(&m_width, &m_height, NULL);
+			ri_mask->getCoordinates(&m_x0, &m_y0, &m_x1, &m_y1);
+			ri_mask->getPixelSize(&m_pix_x_size, &m_pix_y_size);
+			rasterPool->release(ri_mask);
+			
+			ri_mask_stacked = m_width == width && m_height == height
+			               && m_x0 == x0 && m_y0 == y0 && m_x1 == x1 && m_y1 == y1
+			               && m_pix_x_size == pix_x_size && m_pix_y_size == pix_y_size;
+		}
+		
 		OGRLinearRing* raster_ring = new OGRLinearRing();
 		raster_ring->addPoint(x0, y0);
 		raster_ring->addPoint(x1, y0);
@@ -104,6 +143,7 @@ struct RasterInfo {
 		raster_ring->addPoint(x0, y0);
 		ri_bb = new OGRPolygon();
 		ri_bb->addRingDirectly(raster_ring);
+		ri_bb->getEnvelope(&ri_env);
 		
 		ri_center = getGeometryCenter(ri_bb);
 	}
@@ -111,14 +151,82 @@ struct RasterInfo {
 	~RasterInfo() {
 		delete ri_bb;
 		delete ri_center;
-        
-        if ( ri_mask ) {
-            delete ri_mask;
-        }
+		delete ri_record;
 	}
 };
 
 
+/**
+ * Traverses the feature over the raster, and over the mask too if withMask
+ * is true, notifying the given observer.
+ * If a record is given, it is replayed instead of processing the feature.
+ */
+static void traverse_candidate(OGRFeature* feature, RasterInfo* rasterInfo,
+		bool withMask, Observer* obs, FeatureRecord* record) {
+	
+	Traverser tr;
+	tr.addObserver(obs);
+
+	tr.setVector(vect);
+	tr.setLayerNum(layernum);
+	tr.setDesiredFID(feature->GetFID());
+	tr.setFeatureRecord(record);
+	
+    Raster* ri_raster = rasterPool->acquire(rasterInfo->ri_filename);
+    if ( !ri_raster ) {
+        exit(1);
+    }
+    tr.addRaster(ri_raster);
+    
+    Raster* ri_mask = 0;
+    if ( withMask ) {
+        ri_mask = rasterPool->acquire(rasterInfo->ri_mask_filename);
+        if ( !ri_mask ) {
+            exit(1);
+        }
+        tr.addRaster(ri_mask);
+    }
+    
+	bool prevResetReading = Traverser::_resetReading;
+	Traverser::_resetReading = false;
+    
+    tr.traverse();
+    
+    Traverser::_resetReading = prevResetReading;
+    
+    if ( ri_mask ) {
+        rasterPool->release(ri_mask);
+    }
+    rasterPool->release(ri_raster);
+}
+
+
+/**
+ * Traverses the feature once over the candidate raster (and its mask, if
+ * withMask is true) recording pixel locations and band values, so the
+ * ignore_nodata and mask checks, and the extraction, can replay the record
+ * instead of traversing the feature again.
+ */
+static void record_candidate(OGRFeature* feature, RasterInfo* rasterInfo, bool withMask) {
+	delete rasterInfo->ri_record;
+	rasterInfo->ri_record = new FeatureRecord(0, feature);
+	
+	RecorderObserver obs(false);
+	obs.rec = rasterInfo->ri_record;
+	traverse_candidate(feature, rasterInfo, withMask, &obs, 0);
+}
+
+/**
+ * Releases the records obtained with record_candidate.
+ */
+static void release_records(vector<RasterInfo*>& rastInfos) {
+	for ( unsigned i = 0; i < rastInfos.size(); i++ ) {
+		delete rastInfos[i]->ri_record;
+		rastInfos[i]->ri_record = 0;
+	}
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 ///////// ignore_nodata handling
 
@@ -140,7 +248,7 @@ static bool ok_for_nodata(DupPixelMode* ignore_nodata, OGRFeature* feature, Rast
    }
    
 	// strategy:
-    // - Traverse feature with a NoDataObserver
+    // - Replay the feature record to a NoDataObserver
     
     /**
       * Checks bands for nodata values according to the band_param and band_number
@@ -247,22 +355,7 @@ static bool ok_for_nodata(DupPixelMode* ignore_nodata, OGRFeature* feature, Rast
     
     NoDataObserver obs;
     
-	Traverser tr;
-	tr.addObserver(&obs);
-    
-	tr.setVector(vect);
-	tr.setLayerNum(layernum);
-	tr.setDesiredFID(feature->GetFID());
-               
-    Raster ri_raster(rasterInfo->ri_filename);
-    tr.addRaster(&ri_raster);
-    
-	bool prevResetReading = Traverser::_resetReading;
-	Traverser::_resetReading = false;
-    
-    tr.traverse();
-    
-    Traverser::_resetReading = prevResetReading;
+    traverse_candidate(feature, rasterInfo, false, &obs, rasterInfo->ri_record);
     
     return obs.OK && !obs.nodataFound;
 }
@@ -275,16 +368,20 @@ static bool ok_for_nodata(DupPixelMode* ignore_nodata, OGRFeature* feature, Rast
 /**
   * Checks bands for zero values. If a zero is found, it records its
   * location [col0, row0].
+  * Bands before firstBand (those of the raster when the mask is stacked
+  * with it) are not checked.
   */
 struct MaskObserver : public Observer {
 	GlobalInfo* global_info;
 	bool OK;
     bool zeroFound;
     
+    unsigned firstBand;
+    
     int col0;
     int row0;
 		
-	MaskObserver() : global_info(0), zeroFound(false) {
+	MaskObserver() : global_info(0), zeroFound(false), firstBand(0) {
 	}
 	
 	void init(GlobalInfo& info) {
@@ -292,7 +389,7 @@ struct MaskObserver : public Observer {
 
 		OK = false;   // but let's see ...
 		
-		if ( global_info->bands.size() == 0 ) {
+		if ( global_info->bands.size() <= firstBand ) {
 			cerr<< "MaskObserver: warning: no bands in raster mask" <<endl;
 			return;
 		}
@@ -314,6 +411,11 @@ struct MaskObserver : public Observer {
 			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
 			int typeSize = GDALGetDataTypeSize(bandType) >> 3;
 			
+			if ( i < firstBand ) {
+				ptr += typeSize;
+				continue;
+			}
+			
 			int value = starspan_extract_int_value(bandType, ptr);
             if ( value == 0 ) {
                 zeroFound = true;
@@ -337,13 +439,20 @@ struct MaskObserver : public Observer {
  * according to the mask. 
  */
 static bool within_mask(OGRFeature* feature, RasterInfo* rasterInfo) {
-    assert( rasterInfo->ri_mask ) ;
+    assert( rasterInfo->ri_mask_filename ) ;
 
 	// strategy:
-    // - Traverse feature with a MaskObserver to detect if a zero value appears
+    // - Traverse feature with a MaskObserver to detect if a zero value appears.
+    //   If the mask is stacked with the raster, the feature record is replayed.
     
     MaskObserver obs;
     
+    if ( rasterInfo->ri_mask_stacked ) {
+        obs.firstBand = rasterInfo->ri_num_bands;
+        traverse_candidate(feature, rasterInfo, true, &obs, rasterInfo->ri_record);
+        return obs.OK && !obs.zeroFound;
+    }
+    
 	Traverser tr;
 	tr.addObserver(&obs);
 
@@ -351,7 +460,11 @@ static bool within_mask(OGRFeature* feature, RasterInfo* rasterInfo) {
 	tr.setLayerNum(layernum);
 	tr.setDesiredFID(feature->GetFID());
     
-    tr.addRaster(rasterInfo->ri_mask);
+    Raster* ri_mask = rasterPool->acquire(rasterInfo->ri_mask_filename);
+    if ( !ri_mask ) {
+        exit(1);
+    }
+    tr.addRaster(ri_mask);
     
 	bool prevResetReading = Traverser::_resetReading;
 	Traverser::_resetReading = false;
@@ -360,6 +473,8 @@ static bool within_mask(OGRFeature* feature, RasterInfo* rasterInfo) {
     
     Traverser::_resetReading = prevResetReading;
     
+    rasterPool->release(ri_mask);
+    
     return obs.OK && !obs.zeroFound;
 }
 
@@ -374,6 +489,8 @@ static void do_extraction(OGRFeature* feature, RasterInfo* rasterInfo) {
 
     extrItem.feature = feature;
     extrItem.rasterFilename = rasterInfo->ri_filename;
+    extrItem.rasterPool = rasterPool;
+    extrItem.record = rasterInfo->ri_record;
     extrFunction(&extrItem);
 }
 		
@@ -407,7 +524,8 @@ static bool comparator(RasterInfo* ri1, RasterInfo* ri2) {
 static void process_modes_feature(
 		vector<DupPixelMode>& dupPixelModes,
 		OGRFeature* feature, 
-		vector<RasterInfo*>& rastInfos) {
+		vector<RasterInfo*>& rastInfos,
+		EnvelopeIndex& rasterIndex) {
 	
 
     // will point to the first "ignore_nodata" mode, if any:
@@ -448,13 +566,25 @@ static void process_modes_feature(
 	
 	/////////////////////////////////////////////////////////////////
 	// initialize candidates with the rasters containing the feature:
+	// only rasters whose envelope intersects the feature envelope are
+	// obtained from the index (in original order), and the exact Contains
+	// test is only done if the raster envelope contains the feature envelope.
+	OGREnvelope feature_env;
+	feature_geometry->getEnvelope(&feature_env);
+	vector<int> overlapping;
+	rasterIndex.query(feature_env.MinX, feature_env.MinY, feature_env.MaxX, feature_env.MaxY, overlapping);
+	
 	vector<RasterInfo*> candidates;
 	if ( globalOptions.verbose ) {
-        cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": Checking " <<rastInfos.size()<< " rasters for containment" <<endl;
+        cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": Checking " <<overlapping.size()<< " rasters for containment" <<endl;
 	}
-	for ( unsigned i = 0, numRasters = rastInfos.size(); i < numRasters; i++ ) {
-		RasterInfo* rasterInfo = rastInfos[i];
-		bool containsFeature = false;
+	for ( unsigned i = 0, numRasters = overlapping.size(); i < numRasters; i++ ) {
+		RasterInfo* rasterInfo = rastInfos[overlapping[i]];
+		const OGREnvelope& ri_env = rasterInfo->ri_env;
+		if ( feature_env.MinX < ri_env.MinX || feature_env.MaxX > ri_env.MaxX
+		||   feature_env.MinY < ri_env.MinY || feature_env.MaxY > ri_env.MaxY ) {
+			continue;
+		}
 		if ( rasterInfo->ri_bb->Contains(feature_geometry) ) {
 			candidates.push_back(rasterInfo);
             if ( globalOptions.verbose ) {
@@ -471,6 +601,20 @@ static void process_modes_feature(
 		return;
 	}
     
+	/////////////////////////////////////////////////////////////////
+	// traverse the feature once over each candidate whose band values are
+	// needed by the checks below: all of them with ignore_nodata, or those
+	// with a mask stacked with the raster. Other candidates are not
+	// traversed; only the selected one will be (for the extraction).
+	vector<RasterInfo*> recorded;
+	for ( unsigned i = 0; i < candidates.size(); i++ ) {
+		RasterInfo* rasterInfo = candidates[i];
+		const bool stackedMask = rasterInfo->ri_mask_filename && rasterInfo->ri_mask_stacked;
+		if ( ignore_nodata || stackedMask ) {
+			record_candidate(feature, rasterInfo, stackedMask);
+			recorded.push_back(rasterInfo);
+		}
+	}
     
 	///////////////////////////////////////////////////////////////////
 	// ignore_nodata?
@@ -501,6 +645,7 @@ static void process_modes_feature(
             if ( globalOptions.verbose ) {
                 cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": No raster containing the feature" << endl;
             }
+            release_records(recorded);
             delete feature_center;
             return;
         }
@@ -515,7 +660,7 @@ static void process_modes_feature(
     vector<RasterInfo*> newCandidates;
     for ( unsigned i = 0, numRasters = candidates.size(); i < numRasters; i++ ) {
         RasterInfo* rasterInfo = candidates[i];
-        if ( !rasterInfo->ri_mask || within_mask(feature, rasterInfo) ) {
+        if ( !rasterInfo->ri_mask_filename || within_mask(feature, rasterInfo) ) {
             newCandidates.push_back(rasterInfo);
             if ( globalOptions.verbose ) {
                 cout<< "\t" << "  " <<rasterInfo->ri_filename<< endl;
@@ -533,6 +678,7 @@ static void process_modes_feature(
 		if ( globalOptions.verbose ) {
 			cout<< "--duplicate_pixel: FID " <<feature->GetFID()<< ": No raster containing the feature" << endl;
 		}
+		release_records(recorded);
 		delete feature_center;
 		return;
 	}
@@ -653,8 +799,14 @@ static void process_modes_feature(
 	
 	delete feature_center;
 	
-	// we have our selected raster:
+	// we have our selected raster; traverse it if not done for the checks:
+	if ( !selectedRasterInfo->ri_record ) {
+		record_candidate(feature, selectedRasterInfo, false);
+		recorded.push_back(selectedRasterInfo);
+	}
 	do_extraction(feature, selectedRasterInfo);
+	
+	release_records(recorded);
 }
 
 
@@ -693,9 +845,14 @@ int starspan_dup_pixel(
 	}
 	layer->ResetReading();
 	
+	rasterPool = new RasterPool(globalOptions.max_open_rasters);
+	if ( globalOptions.verbose ) {
+		cout<< "--duplicate_pixel: max number of open rasters: " <<rasterPool->getMaxOpen()<< endl;
+	}
 	
 	// Open rasters, corresponding bounding boxes, and union of all boxes:
 	vector<RasterInfo*> rastInfos;
+	EnvelopeIndex rasterIndex;
 	OGRGeometry* allRasterArea = new OGRPolygon();
 	
 	int res = 0;
@@ -710,6 +867,9 @@ int starspan_dup_pixel(
 		delete allRasterArea;
 		allRasterArea = newAllRasterArea;
 		
+		const OGREnvelope& ri_env = rasterInfo->ri_env;
+		rasterIndex.insert(ri_env.MinX, ri_env.MinY, ri_env.MaxX, ri_env.MaxY, i);
+		
 		rastInfos.push_back(rasterInfo);
 	}
 	
@@ -730,7 +890,7 @@ int starspan_dup_pixel(
 			res = 2;
 			goto end;
 		}
-		process_modes_feature(dupPixelModes, feature, rastInfos);
+		process_modes_feature(dupPixelModes, feature, rastInfos, rasterIndex);
 		delete feature;
 	}
 	
@@ -751,7 +911,7 @@ int starspan_dup_pixel(
 		layer->SetSpatialFilter(allRasterArea);
 		
 		while( (feature = layer->GetNextFeature()) != NULL ) {
-			process_modes_feature(dupPixelModes, feature, rastInfos);
+			process_modes_feature(dupPixelModes, feature, rastInfos, rasterIndex);
 			delete feature;
 		}
 	}
@@ -766,6 +926,8 @@ end:
 	for ( unsigned i = 0; i < rastInfos.size(); i++ ) {
 		delete rastInfos[i];
 	}
+	delete rasterPool;
+	rasterPool = 0;
 	
 	return res;
 }
@@ -22,6 +22,13 @@
 using namespace std;
 
 
+// max size of the buffer used to nullify pixels outside the feature
+#define NULLIFY_BUFFER_BYTES  (64 * 1024 * 1024)
+
+// max size of the buffer used to spool a miniraster
+#define SPOOL_BUFFER_BYTES  (64 * 1024 * 1024)
+
+
 /**
   * Creates a miniraster for each traversed feature.
   */
@@ -36,8 +43,15 @@ public:
 	bool first;
 	int mini_col0, mini_row0, mini_col1, mini_row1;
 	
+	// pixels visited in current feature (only kept if only_in_feature)
+	vector<CRPixel> visited;
+	
 	// If not null, basic info is added for each created miniraster
 	vector<MRBasicInfo>* mrbi_list;
+	
+	// spool file for the minirasters going to a strip
+	string spool_filename;
+	FILE* spool;
     
 	/**
 	  * Creates the observer for this operation. 
@@ -48,6 +62,8 @@ public:
 		global_info = 0;
 		hOutDS = 0;
 		mrbi_list = 0;
+		spool_filename = prefix + "spool.bin";
+		spool = 0;
 	}
 	
 	
@@ -61,9 +77,20 @@ public:
     
     
 	/**
-	  * Nothing done in this class.
+	  * Closes the spool file, if any.
 	  */
 	virtual void end() {
+		closeSpool();
+	}
+	
+	/**
+	  * Closes the spool file, if open, so its contents can be read.
+	  */
+	void closeSpool() {
+		if ( spool ) {
+			fclose(spool);
+			spool = 0;
+		}
 	}
 	
 	/**
@@ -86,6 +113,7 @@ public:
 	  */
 	void intersectionFound(IntersectionInfo& intersInfo) {
 		first = true;
+		visited.clear();
 	}
 
 	/**
@@ -94,6 +122,9 @@ public:
 	void addPixel(TraversalEvent& ev) {
 		int col = ev.pixel.col;
 		int row = ev.pixel.row;
+		if ( globalOptions.only_in_feature ) {
+			visited.push_back(CRPixel(col, row));
+		}
 		if ( first ) {
 			first = false;
 			mini_col0 = mini_col1 = col;
@@ -111,6 +142,156 @@ public:
 		}
 	}
 
+	/**
+	  * Sets the pixels of the miniraster not visited in the feature to
+	  * nodata. Instead of writing each pixel, the window is read, masked
+	  * and written back in groups of rows, with one RasterIO for all bands.
+	  * @return number of visited pixels
+	  */
+	int nullifyNonVisited(GDALDataset* ds, int width, int height, double nodata) {
+		// visited pixels relative to the miniraster:
+		vector<char> mask((size_t) width * height, 0);
+		int num_points = 0;
+		for ( unsigned k = 0; k < visited.size(); k++ ) {
+			char& m = mask[(size_t) (visited[k].row - mini_row0) * width + visited[k].col - mini_col0];
+			if ( !m ) {
+				m = 1;
+				num_points++;
+			}
+		}
+		
+		const int nBandCount = ds->GetRasterCount();
+		int group_rows = (int) (NULLIFY_BUFFER_BYTES / ((double) width * nBandCount * sizeof(double)));
+		if ( group_rows < 1 )
+			group_rows = 1;
+		if ( group_rows > height )
+			group_rows = height;
+		vector<double> buffer((size_t) width * group_rows * nBandCount);
+		
+		for ( int row0 = 0; row0 < height; row0 += group_rows ) {
+			const int rows = height - row0 < group_rows ? height - row0 : group_rows;
+			const size_t plane = (size_t) width * rows;
+			const char* m = &mask[(size_t) row0 * width];
+			
+			// anything to nullify in these rows?
+			size_t i = 0;
+			while ( i < plane && m[i] )
+				i++;
+			if ( i == plane )
+				continue;
+			
+			// band sequential: value of band b at i in buffer[b * plane + i]
+			ds->RasterIO(GF_Read,
+				0, row0, width, rows,
+				&buffer[0], width, rows, GDT_Float64,
+				nBandCount, NULL,
+				0, 0, 0
+			);
+			for ( ; i < plane; i++ ) {
+				if ( !m[i] ) {
+					for ( int b = 0; b < nBandCount; b++ ) {
+						buffer[b * plane + i] = nodata;
+					}
+				}
+			}
+			ds->RasterIO(GF_Write,
+				0, row0, width, rows,
+				&buffer[0], width, rows, GDT_Float64,
+				nBandCount, NULL,
+				0, 0, 0
+			);
+		}
+		return num_points;
+	}
+
+	/**
+	  * Appends the miniraster data to the spool file instead of creating
+	  * a miniraster file that would only be copied into the strip and
+	  * deleted. Rows are read from the raster and written to the spool in
+	  * groups, all bands at once; pixels not visited are nullified if
+	  * only_in_feature. The parity increments add a column and/or row of
+	  * zeros, as in the minirasters created by starspan_subset_raster.
+	  * @return offset of the data in the spool file; -1 if error.
+	  */
+	long spoolMiniRaster(GDALDataset* ds, int width, int height,
+		int xsize_incr, int ysize_incr,
+		GDALDataType type, int nBandCount
+	) {
+		if ( !spool ) {
+			// the spool is restarted with each new list of minirasters:
+			spool = fopen(spool_filename.c_str(), mrbi_list->size() == 0 ? "wb" : "ab");
+			if ( !spool ) {
+				cerr<< "Cannot create " <<spool_filename<< endl;
+				return -1;
+			}
+		}
+		fseek(spool, 0, SEEK_END);
+		const long offset = ftell(spool);
+		
+		const int type_size = GDALGetDataTypeSize(type) / 8;
+		const int out_width = width + xsize_incr;
+		const size_t row_size = (size_t) out_width * nBandCount * type_size;
+		int group_rows = (int) (SPOOL_BUFFER_BYTES / row_size);
+		if ( group_rows < 1 )
+			group_rows = 1;
+		if ( group_rows > height )
+			group_rows = height;
+		vector<char> buffer(row_size * group_rows);
+		
+		// visited pixels relative to the miniraster, if needed:
+		vector<char> mask;
+		vector<char> nodata;
+		if ( globalOptions.only_in_feature ) {
+			mask.resize((size_t) width * height, 0);
+			for ( unsigned k = 0; k < visited.size(); k++ ) {
+				mask[(size_t) (visited[k].row - mini_row0) * width + visited[k].col - mini_col0] = 1;
+			}
+			nodata.resize(type_size);
+			GDALCopyWords(&globalOptions.nodata, GDT_Float64, 0, &nodata[0], type, 0, 1);
+		}
+		
+		for ( int row0 = 0; row0 < height; row0 += group_rows ) {
+			const int rows = height - row0 < group_rows ? height - row0 : group_rows;
+			
+			// band interleaved by line: each row has all bands, one after the
+			// other; the parity column, if any, is never read, so stays zero:
+			CPLErr err = ds->RasterIO(GF_Read,
+				mini_col0, mini_row0 + row0, width, rows,
+				&buffer[0], width, rows, type,
+				nBandCount, NULL,
+				type_size, row_size, (size_t) out_width * type_size
+			);
+			if ( err != CE_None ) {
+				cerr<< "Error reading rows " <<(mini_row0 + row0)<< "-" <<(mini_row0 + row0 + rows - 1)<< " for miniraster\n";
+				exit(1);
+			}
+			if ( mask.size() > 0 ) {
+				for ( int i = 0; i < rows; i++ ) {
+					const char* m = &mask[(size_t) (row0 + i) * width];
+					for ( int j = 0; j < width; j++ ) {
+						if ( m[j] )
+							continue;
+						for ( int b = 0; b < nBandCount; b++ ) {
+							memcpy(&buffer[i * row_size + ((size_t) b * out_width + j) * type_size], &nodata[0], type_size);
+						}
+					}
+				}
+			}
+			if ( fwrite(&buffer[0], row_size, rows, spool) != (size_t) rows ) {
+				cerr<< "Error writing " <<spool_filename<< endl;
+				return -1;
+			}
+		}
+		if ( ysize_incr ) {
+			vector<char> zeros(row_size, 0);
+			if ( fwrite(&zeros[0], row_size, 1, spool) != 1 ) {
+				cerr<< "Error writing " <<spool_filename<< endl;
+				return -1;
+			}
+		}
+		return offset;
+	}
+
 	/** aux to create image filename */
 	static string create_filename(string prefix, long FID) {
 		ostringstream ostr;
@@ -190,6 +371,50 @@ public:
         
         Raster* rastr = intersInfo.trv->getRaster(0);
         
+		// size of the miniraster in the strip, including parity increments:
+		const int strip_width = mini_width + xsize_incr;
+		const int strip_height = mini_height + ysize_incr;
+		
+		if ( mrbi_list && !globalOptions.mrstParams.minirasters ) {
+			// spool the data for the strip:
+			GDALDataset* ds = rastr->getDataset();
+			GDALDataType type = ds->GetRasterBand(1)->GetRasterDataType();
+			int nBandCount = ds->GetRasterCount();
+			long offset = spoolMiniRaster(ds, mini_width, mini_height, 
+				xsize_incr, ysize_incr, type, nBandCount
+			);
+			if ( offset < 0 )
+				return;
+			
+            int next_row = 0;   // will remain zero if mrbi_list is empty
+            if ( mrbi_list->size() > 0 ) {
+                next_row = mrbi_list->back().getNextRow() + globalOptions.mrstParams.separation;
+            }
+			MRBasicInfo mrbi(FID, spool_filename, strip_width, strip_height, next_row);
+			mrbi.spool_offset = offset;
+			mrbi.spool_type = type;
+			mrbi.spool_bands = nBandCount;
+			
+			// as done for the minirasters by starspan_subset_raster:
+			double* gt = mrbi.geoTransform;
+			if ( ds->GetGeoTransform(gt) == CE_None ) {
+				gt[0] += mini_col0 * gt[1] + mini_row0 * gt[2];
+				gt[3] += mini_col0 * gt[4] + mini_row0 * gt[5];
+			}
+			else {
+				gt[0] = 0; gt[1] = 1; gt[2] = 0; 
+				gt[3] = 0; gt[4] = 0; gt[5] = 1;
+			}
+			if ( mrbi_list->size() == 0 ) {
+				const char* projection = ds->GetProjectionRef();
+				if ( projection ) 
+					mrbi.projection = projection;
+			}
+			
+			mrbi_list->push_back(mrbi);
+			return;
+		}
+		
 		GDALDatasetH hOutDS = starspan_subset_raster(
 			rastr->getDataset(),
 			mini_col0, mini_row0, mini_width, mini_height,
@@ -205,32 +430,7 @@ public:
 			if ( globalOptions.verbose )
 				cout<< "nullifying pixels...\n";
 
-			const int nBandCount = GDALGetRasterCount(hOutDS);
-			
-			int num_points = 0;			
-			for ( int row = mini_row0; row <= mini_row1; row++ ) {
-				for ( int col = mini_col0; col <= mini_col1 ; col++ ) {
-					if ( intersInfo.trv->pixelVisited(col, row) ) {
-						num_points++;
-					}
-					else {   // nullify:
-						for(int i = 0; i < nBandCount; i++ ) {
-							GDALRasterBand* band = ((GDALDataset *) hOutDS)->GetRasterBand(i+1);
-							band->RasterIO(
-								GF_Write,
-								col - mini_col0, 
-								row - mini_row0,
-								1, 1,              // nXSize, nYSize
-								&nodata,           // pData
-								1, 1,              // nBufXSize, nBufYSize
-								GDT_Float64,       // eBufType
-								0, 0               // nPixelSpace, nLineSpace
-							);
-							
-						}
-					}
-				}
-			}
+			int num_points = nullifyNonVisited((GDALDataset *) hOutDS, mini_width, mini_height, nodata);
 			if ( globalOptions.verbose )
 				cout<< " " <<num_points<< " points retained\n";
 		}
@@ -243,7 +443,7 @@ public:
                 next_row = mrbi.getNextRow() + globalOptions.mrstParams.separation;
             }
             
-			mrbi_list->push_back(MRBasicInfo(FID, mini_filename, mini_width, mini_height, next_row));
+			mrbi_list->push_back(MRBasicInfo(FID, mini_filename, strip_width, strip_height, next_row));
 		}
 		
 		GDALClose(hOutDS);
@@ -484,6 +684,7 @@ public:
       * Then releases outVector if there is one and we own it.
 	  */
 	virtual void end() {
+		closeSpool();
 		if ( createStrip && mrbi_list ) {
             int strip_bands;
             rastr->getSize(NULL, NULL, &strip_bands);
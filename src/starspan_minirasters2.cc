@@ -47,10 +47,14 @@ static void extractFunction(ExtractionItem* item) {
 	tr.setVector(vect);
 	tr.setLayerNum(layernum);
 
-    Raster* raster = new Raster(item->rasterFilename);  
+    Raster* raster = item->rasterPool->acquire(item->rasterFilename);  
+    if ( !raster ) {
+        exit(1);
+    }
     tr.addRaster(raster);
 
     tr.setDesiredFID(globalOptions.FID);
+    tr.setFeatureRecord(item->record);
     
     // - Create and register MiniRasterObserver
     Observer* obs = starspan_getMiniRasterObserver(mini_prefix, mini_srs);
@@ -63,7 +67,7 @@ static void extractFunction(ExtractionItem* item) {
     
 	Traverser::_resetReading = prevResetReading;
     
-    delete raster;
+    item->rasterPool->release(raster);
 	
 	if ( globalOptions.verbose ) {
 		cout<< "--starspan_miniraster2: completed." << endl;
@@ -44,16 +44,22 @@ static void mrs_extractFunction(ExtractionItem* item) {
 	tr.setVector(vect);
 	tr.setLayerNum(layernum);
 
-    Raster raster(item->rasterFilename);  
-    tr.addRaster(&raster);
+    Raster* raster = item->rasterPool->acquire(item->rasterFilename);  
+    if ( !raster ) {
+        exit(1);
+    }
+    tr.addRaster(raster);
 
     tr.setDesiredFID(globalOptions.FID);
+    tr.setFeatureRecord(item->record);
     
     // - Register the common observer
 	tr.addObserver(obs);
 
     // - traverse
     tr.traverse();
+    
+    item->rasterPool->release(raster);
 }
 
 //
@@ -10,12 +10,114 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <list>
+#include <map>
 
 
 /**
-  * This observer extracts from ONE raster
+  * This observer extracts from ONE raster.
+  *
+  * Pixels are not written to the output dataset one at a time, but to
+  * in-memory copies of the output blocks (according to the block layout
+  * of the output band, eg., scanlines for ENVI). A block is read from the
+  * dataset when first touched, and written back as a whole when evicted
+  * from the cache (least recently used first) or at the end. At most
+  * rasterizeParams->cacheBytes are kept in memory.
   */
 class RasterizeObserver : public Observer {
+    /** an output block in memory */
+    struct Block {
+        int col0, row0, cols, rows;
+        char* data;
+        list<long>::iterator lru;
+    };
+    
+    // cached blocks by key (block row * numBlockCols + block col):
+    map<long, Block*> blocks;
+    
+    // keys of cached blocks, most recently used first:
+    list<long> lru;
+    
+    int blockXSize, blockYSize;
+    long numBlockCols;
+    int typeSize;
+    unsigned maxBlocks;
+    
+    // block of last written pixel:
+    long lastKey;
+    Block* lastBlock;
+    
+    /**
+      * Gets the block with the given key, reading it from the output
+      * dataset if not already in memory.
+      */
+    Block* getBlock(long key) {
+        map<long, Block*>::iterator it = blocks.find(key);
+        if ( it != blocks.end() ) {
+            Block* block = it->second;
+            lru.erase(block->lru);
+            lru.push_front(key);
+            block->lru = lru.begin();
+            return block;
+        }
+        
+        if ( blocks.size() >= maxBlocks ) {
+            long oldest = lru.back();
+            lru.pop_back();
+            Block* block = blocks[oldest];
+            blocks.erase(oldest);
+            writeBlock(block);
+            delete[] block->data;
+            delete block;
+        }
+        
+        Block* block = new Block();
+        block->col0 = (int) (key % numBlockCols) * blockXSize;
+        block->row0 = (int) (key / numBlockCols) * blockYSize;
+        block->cols = min(blockXSize, global_info->width - block->col0);
+        block->rows = min(blockYSize, global_info->height - block->row0);
+        block->data = new char[(size_t) block->cols * block->rows * typeSize];
+        CPLErr err = ds->GetRasterBand(1)->RasterIO(GF_Read,
+            block->col0, block->row0, block->cols, block->rows,
+            block->data, block->cols, block->rows,
+            data_type, 0, 0
+        );
+        if ( err != CE_None ) {
+            cerr<< "Error reading block at col " <<block->col0<< ", row " <<block->row0<< endl;
+            exit(1);
+        }
+        lru.push_front(key);
+        block->lru = lru.begin();
+        blocks[key] = block;
+        return block;
+    }
+    
+    void writeBlock(Block* block) {
+        CPLErr err = ds->GetRasterBand(1)->RasterIO(GF_Write,
+            block->col0, block->row0, block->cols, block->rows,
+            block->data, block->cols, block->rows,
+            data_type, 0, 0
+        );
+        if ( err != CE_None ) {
+            cerr<< "Error writing block at col " <<block->col0<< ", row " <<block->row0<< endl;
+            exit(1);
+        }
+    }
+    
+    /** writes and releases all cached blocks */
+    void flushBlocks(void) {
+        for ( map<long, Block*>::iterator it = blocks.begin(); it != blocks.end(); it++ ) {
+            Block* block = it->second;
+            writeBlock(block);
+            delete[] block->data;
+            delete block;
+        }
+        blocks.clear();
+        lru.clear();
+        lastBlock = 0;
+    }
+
 public:
     RasterizeParams* rasterizeParams;
     
@@ -34,7 +136,7 @@ public:
 	  * Creates a rasterizer
 	  */
 	RasterizeObserver(RasterizeParams* rasterizeParams)
-    : rasterizeParams(rasterizeParams)
+    : rasterizeParams(rasterizeParams), ds(0), lastBlock(0)
 	{
 	}
 	
@@ -107,6 +209,20 @@ public:
             ds->GetRasterBand(1)->Fill(globalOptions.nodata);
         }
         
+        // block cache:
+        ds->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+        numBlockCols = (width + blockXSize - 1) / blockXSize;
+        typeSize = GDALGetDataTypeSize(data_type) >> 3;
+        size_t blockBytes = (size_t) blockXSize * blockYSize * typeSize;
+        maxBlocks = rasterizeParams->cacheBytes / blockBytes;
+        if ( maxBlocks < 1 ) {
+            maxBlocks = 1;
+        }
+        if ( globalOptions.verbose ) {
+            cout<< "Output blocks: " <<blockXSize<< " x " <<blockYSize
+                << "; max blocks in memory: " <<maxBlocks<< endl;
+        }
+        lastBlock = 0;
 	}
 	
     
@@ -120,21 +236,22 @@ public:
 		int col = ev.pixel.col;
 		int row = ev.pixel.row;
 		
-        ds->RasterIO(GF_Write,
-            col,               //nXOff,
-            row,               //nYOff,
-            1,                 //nXSize,
-            1,                 //nYSize,
-            buffer,            //pData,
-            1,                 //nBufXSize,
-            1,                 //nBufYSize,
-            data_type,         //eBufType,
-            1,                 //nBandCount,
-            NULL,              //panBandMap,
-            0,                 //nPixelSpace,
-            0,                 //nLineSpace,
-            0                  //nBandSpace
-        );  	
+        if ( !ds ) {
+            return;
+        }
+        // (as with a direct RasterIO, locations outside the raster are ignored)
+        if ( col < 0 || col >= global_info->width || row < 0 || row >= global_info->height ) {
+            return;
+        }
+        
+        long key = (long) (row / blockYSize) * numBlockCols + col / blockXSize;
+        if ( !lastBlock || key != lastKey ) {
+            lastBlock = getBlock(key);
+            lastKey = key;
+        }
+        Block* block = lastBlock;
+        size_t offset = ((size_t) (row - block->row0) * block->cols + (col - block->col0)) * typeSize;
+        memcpy(block->data + offset, buffer, typeSize);
 	}
 
 	/**
@@ -144,6 +261,9 @@ public:
 		if ( globalOptions.verbose ) {
 			cout<< "Closing generated raster\n";
 		}
+        if ( ds ) {
+            flushBlocks();
+        }
         delete ds;
         cout<< "Done.\n";
     }
@@ -7,6 +7,7 @@
 
 #include "starspan.h"           
 #include "traverser.h"       
+#include "footprint.h"
 #include "Stats.h"       
 #include "Csv.h"
 
@@ -14,14 +15,58 @@
 #include <cstdlib>
 #include <math.h>
 #include <cassert>
+#include <climits>
 
 using namespace std;
 
 
+// number of pixels whose band values are passed at once to the Stats objects
+#define STATS_BLOCK_PIXELS  4096
+
+
+/** band value converted to int as done by RasterIO with GDT_Int32 */
+static inline int band_value_as_int(GDALDataType bandType, const char* ptr) {
+	switch ( bandType ) {
+		case GDT_Byte:    return *( (unsigned char*) ptr );
+		case GDT_UInt16:  return *( (unsigned short*) ptr );
+		case GDT_Int16:   return *( (short*) ptr );
+		case GDT_Int32:   return *( (int*) ptr );
+		default: {
+			int value;
+			GDALCopyWords((void*) ptr, bandType, 0, &value, GDT_Int32, 0, 1);
+			return value;
+		}
+	}
+}
+
+/** band value converted to double as done by RasterIO with GDT_Float64 */
+static inline double band_value_as_double(GDALDataType bandType, const char* ptr) {
+	switch ( bandType ) {
+		case GDT_Byte:    return *( (unsigned char*) ptr );
+		case GDT_UInt16:  return *( (unsigned short*) ptr );
+		case GDT_Int16:   return *( (short*) ptr );
+		case GDT_UInt32:  return *( (unsigned int*) ptr );
+		case GDT_Int32:   return *( (int*) ptr );
+		case GDT_Float32: return *( (float*) ptr );
+		case GDT_Float64: return *( (double*) ptr );
+		default: {
+			double value;
+			GDALCopyWords((void*) ptr, bandType, 0, &value, GDT_Float64, 0, 1);
+			return value;
+		}
+	}
+}
+
+
 /**
   * Creates fields and populates the table.
+  *
+  * Band values are passed to a Stats object per band as pixels are
+  * visited, so the values of a feature are not kept: they are copied to
+  * a block per band in their native type, which is given to Stats::add
+  * every STATS_BLOCK_PIXELS pixels.
   */
-class StatsObserver : public Observer {
+class StatsObserver : public RasterOutputObserver {
 public:
 	Traverser& tr;
 	GlobalInfo* global_info;
@@ -29,17 +74,32 @@ public:
 	FILE* file;
 	vector<const char*> select_stats;
 	vector<const char*>* select_fields;
-	const char* raster_filename;
 	string RID;  //  will be used only if globalOptions.RID != "none".
 	
-	// if all bands are of integral type, then tr.getPixelIntegerValuesInBand
-	// is used; else tr.getPixelDoubleValuesInBand is used.
+	// if all bands are of integral type, then band values are taken
+	// as int; else as double.
 	bool get_integer;
 	
+	// desired stats (as keys given by Stats::select, in the order of
+	// select_stats), and stats for each band in current feature:
 	Stats stats;
+	vector<int> statKeys;
+	vector<Stats> bandStats;
+	vector<GDALDataType> bandTypes;
+	vector<int> bandTypeSizes;
+	
+	// have bandStats been prepared for current feature?
+	bool feature_started;
+	
+	// band values of pixels not yet given to bandStats:
+	vector< vector<char> > blocks;
+	unsigned block_count;
+	
 	double* result_stats[TOT_RESULTS];
 	
-	bool write_header;
+	// result_percentiles[k][j]: stats.percentiles[k]-th percentile for band j
+	vector< vector<double> > result_percentiles;
+	
 	bool closeFile;
 	bool releaseStats;
 
@@ -63,8 +123,8 @@ public:
 		global_info = 0;
 		for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
 			result_stats[i] = 0;
-			stats.include[i] = false;
 		}
+		stats.excludeAll();
 		
 		// by default, write the header in init()
 		write_header = true;
@@ -78,28 +138,16 @@ public:
 
 		last_FID = -1;
 		last_feature = 0;
+		feature_started = false;
+		block_count = 0;
 		
 		for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
-			if ( 0 == strcmp(*stat, "avg") )
-				stats.include[AVG] = true;
-			else if ( 0 == strcmp(*stat, "mode") )
-				stats.include[MODE] = true;
-			else if ( 0 == strcmp(*stat, "stdev") )
-				stats.include[STDEV] = true;
-			else if ( 0 == strcmp(*stat, "min") )
-				stats.include[MIN] = true;
-			else if ( 0 == strcmp(*stat, "max") )
-				stats.include[MAX] = true;
-			else if ( 0 == strcmp(*stat, "sum") )
-				stats.include[SUM] = true;
-			else if ( 0 == strcmp(*stat, "median") )
-				stats.include[MEDIAN] = true;
-			else if ( 0 == strcmp(*stat, "nulls") )
-				stats.include[NULLS] = true;
-			else {
+			int key = stats.select(*stat);
+			if ( key < 0 ) {
 				cerr<< "Unrecognized stats " << *stat<< endl;
 				exit(1);
 			}
+			statKeys.push_back(key);
 		}
 	}
 	
@@ -135,11 +183,10 @@ public:
 
 
 	/**
-	  * returns true. We ask traverser to get values for
-	  * visited pixels in each feature.
+	  * returns false. We need band values for visited pixels.
 	  */
 	bool isSimple() { 
-		return true; 
+		return false; 
 	}
 
 	/**
@@ -216,16 +263,26 @@ public:
 		for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
 			result_stats[i] = new double[global_info->bands.size()];
 		}
+		result_percentiles.assign(stats.percentiles.size(), vector<double>(global_info->bands.size()));
 		
 		// assume integer bands:
 		get_integer = true;
+		bandTypes.clear();
+		bandTypeSizes.clear();
 		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
 			GDALDataType bandType = global_info->bands[i]->GetRasterDataType();
 			if ( bandType == GDT_Float64 || bandType == GDT_Float32 ) {
 				get_integer = false;
-				break;
 			}
+			bandTypes.push_back(bandType);
+			bandTypeSizes.push_back(GDALGetDataTypeSize(bandType) >> 3);
 		}		
+		bandStats.assign(global_info->bands.size(), stats);
+		blocks.resize(global_info->bands.size());
+		for ( unsigned i = 0; i < global_info->bands.size(); i++ ) {
+			blocks[i].resize(STATS_BLOCK_PIXELS * bandTypeSizes[i]);
+		}
+		feature_started = false;
 		
 		// prepare RID
 		if ( globalOptions.RID != "none" ) {
@@ -238,38 +295,98 @@ public:
 	
 
 	/**
-	  * compute all results from current list of pixels.
-	  * Desired results are reported by finalizePreviousFeatureIfAny.
+	  * prepares bandStats for the pixels of a new feature.
+	  * With globalOptions.nodata_per_band, the nodata value of each band
+	  * is used (and no value is excluded for a band without one).
 	  */
-	void computeResults(void) {
-		if ( get_integer ) {
-			vector<int> values;
-			for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-				values.clear();
-				tr.getPixelIntegerValuesInBand(j+1, values);
+	void startFeature(void) {
+		for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
+			int has_nodata = 1;
+			double nodata;
+			if ( globalOptions.nodata_per_band ) {
+				has_nodata = 0;
+				nodata = global_info->bands[j]->GetNoDataValue(&has_nodata);
+				if ( !has_nodata )
+					nodata = 0;
+				else if ( get_integer && (nodata != floor(nodata) || nodata < INT_MIN || nodata > INT_MAX) )
+					has_nodata = 0;  // no band value can be equal to it
+			}
+			else {
 				if (!globalOptions.nodata) {
 					double nodata = global_info->bands[j]->GetNoDataValue();
 					globalOptions.nodata = nodata;
 				} 
-				stats.compute(values, int(globalOptions.nodata));
-				for ( int i = 0; i < TOT_RESULTS; i++ ) {
-					result_stats[i][j] = stats.result[i]; 
+				nodata = globalOptions.nodata;
+			}
+			if ( get_integer ) {
+				// initial histogram range:
+				int lo = 0, hi = -1;
+				switch ( bandTypes[j] ) {
+					case GDT_Byte:   lo = 0;      hi = 255;   break;
+					case GDT_UInt16: lo = 0;      hi = 65535; break;
+					case GDT_Int16:  lo = -32768; hi = 32767; break;
+					default: break;
 				}
+				bandStats[j].begin(int(nodata), lo, hi);
+			}
+			else {
+				bandStats[j].begin(nodata);
+			}
+			if ( !has_nodata ) {
+				bandStats[j].disableNodata();
 			}
 		}
-		else {
-			vector<double> values;
-			for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-				values.clear();
-				tr.getPixelDoubleValuesInBand(j+1, values);
-				if (!globalOptions.nodata) {
-					double nodata = global_info->bands[j]->GetNoDataValue();
-					globalOptions.nodata = nodata;
-				} 
-				stats.compute(values, globalOptions.nodata);
-				for ( int i = 0; i < TOT_RESULTS; i++ ) {
-					result_stats[i][j] = stats.result[i]; 
-				}
+		block_count = 0;
+		feature_started = true;
+	}
+
+	/**
+	  * gives the pending band values to bandStats.
+	  */
+	void flushBlocks(void) {
+		for ( unsigned j = 0; j < bandStats.size(); j++ ) {
+			const char* data = &blocks[j][0];
+			Stats& st = bandStats[j];
+			switch ( bandTypes[j] ) {
+				case GDT_Byte:    st.add((const unsigned char*) data, block_count);  break;
+				case GDT_UInt16:  st.add((const unsigned short*) data, block_count); break;
+				case GDT_Int16:   st.add((const short*) data, block_count);          break;
+				case GDT_Int32:   st.add((const int*) data, block_count);            break;
+				case GDT_Float32: st.add((const float*) data, block_count);          break;
+				case GDT_Float64: st.add((const double*) data, block_count);         break;
+				case GDT_UInt32:
+					if ( !get_integer ) {
+						st.add((const unsigned int*) data, block_count);
+						break;
+					}
+					// else: conversion to int is needed:
+				default:
+					for ( unsigned i = 0; i < block_count; i++ ) {
+						const char* ptr = data + i * bandTypeSizes[j];
+						if ( get_integer )
+							st.add(band_value_as_int(bandTypes[j], ptr));
+						else
+							st.add(band_value_as_double(bandTypes[j], ptr));
+					}
+					break;
+			}
+		}
+		block_count = 0;
+	}
+
+	/**
+	  * compute all results for current feature.
+	  * Desired results are reported by finalizePreviousFeatureIfAny.
+	  */
+	void computeResults(void) {
+		flushBlocks();
+		for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
+			bandStats[j].end();
+			for ( int i = 0; i < TOT_RESULTS; i++ ) {
+				result_stats[i][j] = bandStats[j].result[i]; 
+			}
+			for ( unsigned k = 0; k < result_percentiles.size(); k++ ) {
+				result_percentiles[k][j] = bandStats[j].percentileResult[k];
 			}
 		}
 	}
@@ -336,58 +453,14 @@ public:
 			
 			// report desired results:
 			// (desired list is traversed to keep order according to column headers)
-			for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
-				if ( 0 == strcmp(*stat, "avg") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[AVG][j]);
-						//fprintf(file, ",%f", result_stats[AVG][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "mode") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MODE][j]);
-						//fprintf(file, ",%f", result_stats[MODE][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "stdev") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[STDEV][j]);
-						//fprintf(file, ",%f", result_stats[STDEV][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "min") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MIN][j]);
-						//fprintf(file, ",%f", result_stats[MIN][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "max") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MAX][j]);
-						//fprintf(file, ",%f", result_stats[MAX][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "sum") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[SUM][j]);
-						//fprintf(file, ",%f", result_stats[SUM][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "median") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%f", result_stats[MEDIAN][j]);
-						//fprintf(file, ",%f", result_stats[MEDIAN][j]);
-					}
-				}
-				else if ( 0 == strcmp(*stat, "nulls") ) {
-					for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
-						csvOut.addField("%d", int(result_stats[NULLS][j]) );
-						//fprintf(file, ",%d", int(result_stats[NULLS][j]) );
-					}
-				}
-				else {
-					cerr<< "Unrecognized stats "<< *stat << endl;
-					exit(1);
+			for ( unsigned k = 0; k < statKeys.size(); k++ ) {
+				const int key = statKeys[k];
+				for ( unsigned j = 0; j < global_info->bands.size(); j++ ) {
+					const double value = key < TOT_RESULTS ? result_stats[key][j] : result_percentiles[key - TOT_RESULTS][j];
+					if ( Stats::isCount(key) )
+						csvOut.addField("%d", int(value));
+					else
+						csvOut.addField("%f", value);
 				}
 			}
 			csvOut.endLine();
@@ -407,14 +480,25 @@ public:
 		last_FID = intersInfo.feature->GetFID();
 		
 		last_feature = intersInfo.feature->Clone();
+		feature_started = false;
 	}
 	
 	
 	/**
-	  * Nothing needs to be done here. Traverser keeps track of
-	  * pixels in current feature.
+	  * Adds the band values to the blocks of current feature.
 	  */
 	void addPixel(TraversalEvent& ev) {
+		if ( !feature_started ) {
+			startFeature();
+		}
+		const char* ptr = (const char*) ev.bandValues;
+		for ( unsigned j = 0; j < blocks.size(); j++ ) {
+			memcpy(&blocks[j][block_count * bandTypeSizes[j]], ptr, bandTypeSizes[j]);
+			ptr += bandTypeSizes[j];
+		}
+		if ( ++block_count == STATS_BLOCK_PIXELS ) {
+			flushBlocks();
+		}
 	}
 
 };
@@ -439,6 +523,21 @@ Observer* starspan_getStatsObserver(
 
 	return new StatsObserver(tr, file, select_stats, select_fields);	
 }
+
+
+/**
+  * starspan_getRasterStatsObserver: implementation
+  */
+RasterOutputObserver* starspan_getRasterStatsObserver(
+	Traverser& tr,
+	FILE* file,
+	vector<const char*> select_stats,
+	vector<const char*>* select_fields
+) {
+	StatsObserver* obs = new StatsObserver(tr, file, select_stats, select_fields);
+	obs->closeFile = false;
+	return obs;
+}
 		
 
 /**
@@ -524,40 +623,10 @@ int starspan_stats(
 	const char* csv_filename,
 	int layernum
 ) {
-	FILE* file;
-	bool new_file = false;
-	
-	// if file exists, append new rows. Otherwise create file.
-	file = fopen(csv_filename, "r+");
-	if ( file ) {
-		if ( globalOptions.verbose )
-			fprintf(stdout, "Appending to existing file %s\n", csv_filename);
-
-		fseek(file, 0, SEEK_END);
-
-		// check that new data will start in a new line:
-		// if last character is not '\n', then write a '\n':
-		// (This check will make the output more robust in case
-		// the previous information is not properly aligned, eg.
-		// when the previous generation was killed for some reason.)
-		long endpos = ftell(file);
-		if ( endpos > 0 ) {
-			fseek(file, endpos -1, SEEK_SET);
-			char c;
-			if ( 1 == fread(&c, sizeof(c), 1, file) ) {
-				if ( c != '\n' )
-					fputc('\n', file);    // add a new line
-			}
-		}
-	}
-	else {
-		// create output file
-		file = fopen(csv_filename, "w");
-		if ( !file) {
-			fprintf(stderr, "Cannot create %s\n", csv_filename);
-			return 1;
-		}
-		new_file = true;
+	bool new_file;
+	FILE* file = starspan_open_for_append(csv_filename, &new_file);
+	if ( !file ) {
+		return 1;
 	}
 
 	Traverser tr;
@@ -566,6 +635,19 @@ int starspan_stats(
 
 	if ( globalOptions.FID >= 0 )
 		tr.setDesiredFID(globalOptions.FID);
+	
+	// stacked rasters are read in a single traversal
+	const bool stacked = globalOptions.stack && raster_filenames.size() > 1;
+	
+	// one traversal per raster: index features once for all of them
+	tr.setFeatureIndex(raster_filenames.size() > 1 && !stacked);
+	
+	// and reuse the pixels of each feature on rasters with the same grid:
+	FootprintCache footprintCache((size_t) globalOptions.footprint_cache_mb * 1024 * 1024);
+	if ( !stacked && starspan_rasters_share_grid(raster_filenames) ) {
+		tr.setFootprintCache(&footprintCache);
+	}
+	
 	if ( globalOptions.progress ) {
 		tr.setProgress(globalOptions.progress_perc, cout);
 		cout << "Number of features: ";
@@ -581,6 +663,29 @@ int starspan_stats(
 	obs.closeFile = false;
 	tr.addObserver(&obs);
 
+	if ( stacked ) {
+		fprintf(stdout, "Extracting from %u stacked rasters\n", (unsigned) raster_filenames.size());
+		vector<Raster*> rasters;
+		string rid;
+		if ( starspan_stack_rasters(tr, raster_filenames, rasters, rid) ) {
+			fclose(file);
+			return 1;
+		}
+		obs.raster_filename = rid.c_str();
+		obs.write_header = new_file;
+		
+		tr.traverse();
+
+		if ( globalOptions.report_summary ) {
+			tr.reportSummary();
+		}
+		
+		fclose(file);
+		for ( unsigned i = 0; i < rasters.size(); i++ ) {
+			delete rasters[i];
+		}
+		return 0;
+	}
 
 	Raster* rasters[raster_filenames.size()];
 	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
@@ -11,6 +11,121 @@
 
 #include <cstdlib>
 #include <cassert>
+#include <algorithm>
+
+
+// max number of band values kept in memory for a chunk of records
+#define CHUNK_VALUES  (16 * 1024 * 1024)
+
+// min and max number of records in a chunk
+#define MIN_CHUNK_RECORDS  1024
+#define MAX_CHUNK_RECORDS  (1024 * 1024)
+
+
+// to sort point indices by block key, then by original order
+struct BlockKeyLess {
+	const vector<long>& keys;
+	BlockKeyLess(const vector<long>& keys) : keys(keys) {}
+	bool operator()(unsigned a, unsigned b) const {
+		return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+	}
+};
+
+
+//
+// Gets the band values of a raster at given pixel locations.
+// Locations are visited in (block row, block col) order so each block is
+// read once (one RasterIO per band) for all the points falling in it,
+// instead of a 1x1 read per point per band.
+// values[i*bands + b]: value of band b at location i, if valid[i].
+//
+static void extract_points(
+	Raster* rast,
+	const vector<int>& cols, const vector<int>& rows,
+	vector<double>& values, vector<char>& valid
+) {
+	int width, height, bands;
+	rast->getSize(&width, &height, &bands);
+	GDALDataset* dataset = rast->getDataset();
+
+	const unsigned n = cols.size();
+	values.resize((size_t) n * bands);
+	valid.assign(n, 0);
+	if ( bands == 0 ) {
+		return;
+	}
+
+	int blockXSize, blockYSize;
+	dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	const long numBlockCols = (width + blockXSize - 1) / blockXSize;
+
+	// block key of each valid location:
+	vector<long> keys(n);
+	vector<unsigned> order;
+	order.reserve(n);
+	for ( unsigned i = 0; i < n; i++ ) {
+		if ( cols[i] < 0 || cols[i] >= width || rows[i] < 0 || rows[i] >= height ) {
+			continue;
+		}
+		keys[i] = (long) (rows[i] / blockYSize) * numBlockCols + cols[i] / blockXSize;
+		order.push_back(i);
+	}
+	sort(order.begin(), order.end(), BlockKeyLess(keys));
+
+	vector<GDALDataType> bandTypes(bands);
+	vector<int> bandTypeSizes(bands);
+	size_t pixelSize = 0;
+	for ( int b = 0; b < bands; b++ ) {
+		bandTypes[b] = dataset->GetRasterBand(b+1)->GetRasterDataType();
+		bandTypeSizes[b] = GDALGetDataTypeSize(bandTypes[b]) >> 3;
+		pixelSize += bandTypeSizes[b];
+	}
+	vector<char> buffer((size_t) blockXSize * blockYSize * pixelSize);
+
+	for ( unsigned k = 0; k < order.size(); ) {
+		const long key = keys[order[k]];
+		unsigned end = k + 1;
+		while ( end < order.size() && keys[order[end]] == key ) {
+			end++;
+		}
+
+		// read the block, band-sequential, each band in its own type:
+		const int col0 = (int) (key % numBlockCols) * blockXSize;
+		const int row0 = (int) (key / numBlockCols) * blockYSize;
+		const int w = min(blockXSize, width - col0);
+		const int h = min(blockYSize, height - row0);
+		vector<size_t> bandOffsets(bands);
+		size_t offset = 0;
+		for ( int b = 0; b < bands; b++ ) {
+			bandOffsets[b] = offset;
+			int status = dataset->GetRasterBand(b+1)->RasterIO(
+				GF_Read,
+				col0, row0,
+				w, h,                 // nXSize, nYSize
+				&buffer[offset],      // pData
+				w, h,                 // nBufXSize, nBufYSize
+				bandTypes[b],         // eBufType
+				0, 0                  // nPixelSpace, nLineSpace
+			);
+			if ( status != CE_None ) {
+				fprintf(stderr, "Error reading band value, status= %d\n", status);
+				exit(1);
+			}
+			offset += (size_t) w * h * bandTypeSizes[b];
+		}
+
+		// get values for all points in this block:
+		for ( ; k < end; k++ ) {
+			const unsigned i = order[k];
+			const size_t pixel = (size_t) (rows[i] - row0) * w + (cols[i] - col0);
+			for ( int b = 0; b < bands; b++ ) {
+				const char* ptr = &buffer[bandOffsets[b] + pixel * bandTypeSizes[b]];
+				values[(size_t) i * bands + b] = starspan_extract_double_value(bandTypes[b], (void*) ptr);
+			}
+			valid[i] = 1;
+		}
+	}
+}
 
 
 /**
@@ -60,12 +175,12 @@ int starspan_update_csv(
 	}
 	
 	if ( x_field_index < 0 || y_field_index < 0 ) {
-		cout<< "Warning: No fields 'x' and/or 'y' are present in " <<in_csv_filename<<endl;
-		cout<< "         Will try with col,row fields ...\n";
+		cerr<< "Warning: No fields 'x' and/or 'y' are present in " <<in_csv_filename<<endl;
+		cerr<< "         Will try with col,row fields ...\n";
 		use_xy = false;
 		if ( col_field_index < 0 || row_field_index < 0 ) {
 			in_file.close();
-			cout<< "No fields 'col' and/or 'row' are present in " <<in_csv_filename<<endl;
+			cerr<< "No fields 'col' and/or 'row' are present in " <<in_csv_filename<<endl;
 			return 1;
 		}
 	}
@@ -118,80 +233,125 @@ int starspan_update_csv(
 	//
 	// main body of processing
 	//
+	// Records are processed in chunks. For each chunk, the points are
+	// extracted from each raster in block order (see extract_points), and
+	// then the rows are written in the original order.
+	//
+	unsigned total_bands = 0;
+	for ( unsigned r = 0; r < rasts.size(); r++ ) {
+		int bands;
+		rasts[r]->getSize(NULL, NULL, &bands);
+		total_bands += bands;
+	}
+	unsigned chunk_records = CHUNK_VALUES / (total_bands > 0 ? total_bands : 1);
+	if ( chunk_records < MIN_CHUNK_RECORDS )
+		chunk_records = MIN_CHUNK_RECORDS;
+	if ( chunk_records > MAX_CHUNK_RECORDS )
+		chunk_records = MAX_CHUNK_RECORDS;
 	
-	// for each point point in input csv...
 	cout<< "processing records...\n";
-	for ( int record = 0; csv.getline(line); record++ ) {
-		cout<< "record " <<record<< "  ";
+	
+	vector<string> prefixes;      // existing field values of each record
+	vector<double> xs, ys;
+	vector<int> given_cols, given_rows;
+	vector<int> cols, rows;
+	vector< vector<double> > values(rasts.size());
+	vector< vector<char> > valid(rasts.size());
+	
+	int record = 0;
+	bool more_records = true;
+	while ( more_records ) {
 		//
-		// copy existing field values
+		// read a chunk of records:
 		//
-		for ( unsigned i = 0; i < num_existing_fields; i++ ) {
-			string field = csv.getfield(i);
-			if ( i > 0 ) {
-				out_file << delimiter;
+		prefixes.clear();
+		xs.clear();
+		ys.clear();
+		given_cols.clear();
+		given_rows.clear();
+		while ( prefixes.size() < chunk_records ) {
+			if ( !csv.getline(line) ) {
+				more_records = false;
+				break;
+			}
+			
+			// copy existing field values
+			string prefix;
+			for ( unsigned i = 0; i < num_existing_fields; i++ ) {
+				if ( i > 0 ) {
+					prefix += delimiter;
+				}
+				prefix += csv.getfield(i);
+			}
+			prefixes.push_back(prefix);
+			
+			if ( use_xy ) {
+				double x = atof(csv.getfield(x_field_index).c_str());
+				double y = atof(csv.getfield(y_field_index).c_str());
+				xs.push_back(x);
+				ys.push_back(y);
+				if ( globalOptions.verbose ) {
+					cout<< "record " <<record<< "  x , y = " <<x<< " , " <<y<< endl;
+				}
+			}
+			else {
+				int col = atoi(csv.getfield(col_field_index).c_str());
+				int row = atoi(csv.getfield(row_field_index).c_str());
+				if ( globalOptions.verbose ) {
+					cout<< "record " <<record<< "  col , row = " <<col<< " , " <<row<< endl;
+				}
+				// make col and row 0-based:
+				given_cols.push_back(col - 1);
+				given_rows.push_back(row - 1);
 			}
-			out_file << field;
+			record++;
 		}
 		
+		const unsigned n = prefixes.size();
+		if ( n == 0 ) {
+			break;
+		}
 		
 		//
-		// now extract desired pixel from given rasters
+		// extract desired pixels from given rasters
 		//
-		
-		double x = 0, y = 0;
-		int col = 0, row = 0;
-		
-		if ( use_xy ) {
-			x = atof(csv.getfield(x_field_index).c_str());
-			y = atof(csv.getfield(y_field_index).c_str());
-			cout<< "x , y = " <<x<< " , " <<y<< endl;
-		}
-		else {
-			col = atoi(csv.getfield(col_field_index).c_str());
-			row = atoi(csv.getfield(row_field_index).c_str());
-			cout<< "col , row = " <<col<< " , " <<row<< endl;
-			// make col and row 0-based:
-			--col;
-			--row;
-		}
-		
-		
-		// for each raster...
-		next_field_index = num_existing_fields;
 		for ( unsigned r = 0; r < rasts.size(); r++ ) {
 			Raster* rast = rasts[r];
-			int bands;
-			rast->getSize(NULL, NULL, &bands);
-			GDALDataset* dataset = rast->getDataset();
-
 			if ( use_xy ) {
 				// convert from (x,y) to (col,row) in this rast
-				rast->toColRow(x, y, &col, &row);
-				//cout<< "x,y = " <<x<< " , " <<y<< endl;
+				cols.resize(n);
+				rows.resize(n);
+				for ( unsigned i = 0; i < n; i++ ) {
+					rast->toColRow(xs[i], ys[i], &cols[i], &rows[i]);
+				}
+				extract_points(rast, cols, rows, values[r], valid[r]);
 			}
-			// else: (col,row) already given above.
-			
-			
-			//
-			// extract pixel at (col,row) from rast
-			char* ptr = (char*) rast->getBandValuesForPixel(col, row);
-			if ( ptr ) {
-				// add these bands to csv
+			else {
+				// (col,row) already given above.
+				extract_points(rast, given_cols, given_rows, values[r], valid[r]);
+			}
+		}
+		
+		//
+		// write the rows in original order
+		//
+		for ( unsigned i = 0; i < n; i++ ) {
+			out_file << prefixes[i];
+			for ( unsigned r = 0; r < rasts.size(); r++ ) {
+				if ( !valid[r][i] ) {
+					continue;
+				}
+				int bands;
+				rasts[r]->getSize(NULL, NULL, &bands);
+				const double* vals = &values[r][(size_t) i * bands];
 				for ( int b = 0; b < bands; b++ ) {
-					GDALRasterBand* band = dataset->GetRasterBand(b+1);
-					GDALDataType bandType = band->GetRasterDataType();
-
-					double val = starspan_extract_double_value(bandType, ptr);
-					out_file << delimiter << val;
-
-					int bandTypeSize = GDALGetDataTypeSize(bandType) >> 3;
-					ptr += bandTypeSize;
+					out_file << delimiter << vals[b];
 				}
 			}
+			// end record (no flush)
+			out_file << '\n';
 		}
-		// end record
-		out_file << endl;
+		cout<< "  " <<record<< " records processed" <<endl;
 	}
 
 	// close files:
@@ -11,6 +11,7 @@
 
 #include <stdlib.h>
 #include <iomanip>
+#include <algorithm>
 
 // aux routine for reporting 
 void starspan_report(Traverser& tr) {
@@ -479,10 +480,140 @@ int starspan_validate_input_elements(
 }
 
 
+bool starspan_rasters_share_grid(vector<const char*> raster_filenames) {
+	vector<string> grids;
+	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+		Raster raster(raster_filenames[i]);
+		int width, height;
+		double x0, y0, x1, y1, pix_x_size, pix_y_size;
+		raster.getSize(&width, &height, NULL);
+		raster.getCoordinates(&x0, &y0, &x1, &y1);
+		raster.getPixelSize(&pix_x_size, &pix_y_size);
+		
+		ostringstream ostr;
+		ostr << setprecision(17) << width << " " << height << " " << x0 << " " << y0 
+		     << " " << pix_x_size << " " << pix_y_size;
+		string grid = ostr.str();
+		if ( find(grids.begin(), grids.end(), grid) != grids.end() ) {
+			return true;
+		}
+		grids.push_back(grid);
+	}
+	return false;
+}
+
+
+FILE* starspan_open_for_append(const char* filename, bool* new_file) {
+	*new_file = false;
+	
+	// if file exists, append new rows. Otherwise create file.
+	FILE* file = fopen(filename, "r+");
+	if ( file ) {
+		if ( globalOptions.verbose ) {
+			fprintf(stdout, "Appending to existing file %s\n", filename);
+		}
+
+		fseek(file, 0, SEEK_END);
+
+		// check that new data will start in a new line:
+		// if last character is not '\n', then write a '\n':
+		// (This check will make the output more robust in case
+		// the previous information is not properly aligned, eg.
+		// when the previous generation was killed for some reason.)
+		long endpos = ftell(file);
+		if ( endpos > 0 ) {
+			fseek(file, endpos -1, SEEK_SET);
+			char c;
+			if ( 1 == fread(&c, sizeof(c), 1, file) ) {
+				if ( c != '\n' )
+					fputc('\n', file);    // add a new line
+			}
+		}
+	}
+	else {
+		// create output file
+		file = fopen(filename, "w");
+		if ( !file) {
+			fprintf(stderr, "Cannot create %s\n", filename);
+			return 0;
+		}
+		*new_file = true;
+	}
+	return file;
+}
+
+
+int starspan_stack_rasters(
+	Traverser& tr,
+	vector<const char*> raster_filenames,
+	vector<Raster*>& rasters,
+	string& rid
+) {
+	int width0 = 0, height0 = 0;
+	double x0_0 = 0, y0_0 = 0, x1_0 = 0, y1_0 = 0, pix_x_size0 = 0, pix_y_size0 = 0;
+	
+	int num_bands = 0;
+	rid = "";
+	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+		Raster* raster = new Raster(raster_filenames[i]);
+		int width, height, bands;
+		double x0, y0, x1, y1, pix_x_size, pix_y_size;
+		raster->getSize(&width, &height, &bands);
+		raster->getCoordinates(&x0, &y0, &x1, &y1);
+		raster->getPixelSize(&pix_x_size, &pix_y_size);
+		
+		if ( i == 0 ) {
+			width0 = width;
+			height0 = height;
+			x0_0 = x0;
+			y0_0 = y0;
+			x1_0 = x1;
+			y1_0 = y1;
+			pix_x_size0 = pix_x_size;
+			pix_y_size0 = pix_y_size;
+		}
+		else if ( width != width0 || height != height0 
+		||   x0 != x0_0 || y0 != y0_0 || x1 != x1_0 || y1 != y1_0 
+		||   pix_x_size != pix_x_size0 || pix_y_size != pix_y_size0 ) {
+			cerr<< "--stack: rasters with different grids:\n"
+			    << "   " <<raster_filenames[0]<< "\n"
+			    << "   " <<raster_filenames[i]<< "\n";
+			delete raster;
+			for ( unsigned k = 0; k < rasters.size(); k++ ) {
+				delete rasters[k];
+			}
+			rasters.clear();
+			return 1;
+		}
+		
+		if ( globalOptions.verbose ) {
+			fprintf(stdout, "  Band%d..Band%d: %s\n", num_bands + 1, num_bands + bands, raster_filenames[i]);
+		}
+		num_bands += bands;
+		
+		rasters.push_back(raster);
+		tr.addRaster(raster);
+		
+		string id = raster_filenames[i];
+		if ( globalOptions.RID == "file" ) {
+			starspan_simplify_filename(id);
+		}
+		if ( i > 0 ) {
+			rid += "+";
+		}
+		rid += id;
+	}
+	return 0;
+}
+
+
 
 ///////////////////////////////////////////////////
 // mini raster strip creation
 
+// max size of the buffer used to transfer the rows of a miniraster
+#define STRIP_BUFFER_BYTES  (64 * 1024 * 1024)
+
 static string create_filename_hdr(string prefix, long FID) {
     ostringstream ostr;
     ostr << prefix << setfill('0') << setw(4) << FID << ".hdr";
@@ -537,18 +668,6 @@ void starspan_create_strip(
             <<strip_width<< " x " <<strip_height<< " x " <<strip_bands<< endl;
     }
 
-    /////////////////////////////////////////////////////////////////////
-    // allocate transfer buffer with enough space for the longest row	
-    const long doubles = (long)strip_width * strip_bands;
-    if ( globalOptions.verbose ) {
-        cout<< "Allocating " <<doubles<< " doubles for buffer\n";
-    }
-    double* buffer = new double[doubles];
-    if ( !buffer ) {
-        cerr<< " Cannot allocate " <<doubles<< " doubles for buffer\n";
-        return;
-    }
-    
     //////////////////////////////////////////////
     // the band types for the strips: 
     const GDALDataType fid_band_type = GDT_Int32; 
@@ -569,7 +688,6 @@ void starspan_create_strip(
         papszOptions 
     );
     if ( !strip_ds ) {
-        delete buffer;
         cerr<< "Couldn't create " <<strip_filename<< endl;
         return;
     }
@@ -588,7 +706,6 @@ void starspan_create_strip(
     if ( !fid_ds ) {
         delete strip_ds;
         hDriver->Delete(strip_filename.c_str());
-        delete buffer;
         cerr<< "Couldn't create " <<fid_filename<< endl;
         return;
     }
@@ -608,7 +725,6 @@ void starspan_create_strip(
         hDriver->Delete(fid_filename.c_str());
         delete strip_ds;
         hDriver->Delete(strip_filename.c_str());
-        delete buffer;
         cerr<< "Couldn't create " <<loc_filename<< endl;
         return;
     }
@@ -619,9 +735,19 @@ void starspan_create_strip(
     
     
     /////////////////////////////////////////////////////////////////////
-    // transfer data, fid, and loc from minirasters to output strips
+    // transfer data, fid, and loc from minirasters to output strips.
+    // Each miniraster is transferred in groups of rows, with a single
+    // RasterIO call per group for each output image.
     /////////////////////////////////////////////////////////////////////
     
+    vector<char> buffer;   // data, band interleaved by line
+    vector<int> fids;      // replicated FID
+    vector<float> locs;    // x and y planes
+    
+    // spool file being read, if any:
+    string spool_filename;
+    FILE* spool = 0;
+    
     int processed_minirasters = 0;
     
     /////////////////////////////////////////////////////////////////////
@@ -636,14 +762,50 @@ void starspan_create_strip(
         // get miniraster filename:
         string mini_filename = mrbi->mini_filename; //create_filename(prefix, mrbi->FID);
         
-        ///////////////////////
-        // open miniraster
-        GDALDataset* mini_ds = (GDALDataset*) GDALOpen(mini_filename.c_str(), GA_ReadOnly);
-        if ( !mini_ds ) {
-            cerr<< " Unexpected: couldn't read " <<mini_filename<< endl;
-            hDriver->Delete(mini_filename.c_str());
-            unlink(create_filename_hdr(prefix, mrbi->FID).c_str()); // hack
-            continue;
+        GDALDataset* mini_ds = 0;
+        int width, height, bands;
+        GDALDataType buf_type;
+        double adfGeoTransform[6];
+        const char* projection;
+        
+        if ( mrbi->spool_offset >= 0 ) {
+            ///////////////////////
+            // data in spool file
+            if ( mini_filename != spool_filename ) {
+                if ( spool ) {
+                    fclose(spool);
+                    unlink(spool_filename.c_str());
+                }
+                spool_filename = mini_filename;
+                spool = fopen(spool_filename.c_str(), "rb");
+            }
+            if ( !spool || fseek(spool, mrbi->spool_offset, SEEK_SET) != 0 ) {
+                cerr<< " Unexpected: couldn't read " <<mini_filename<< endl;
+                continue;
+            }
+            width = mrbi->width;
+            height = mrbi->height;
+            bands = mrbi->spool_bands;
+            buf_type = mrbi->spool_type;
+            memcpy(adfGeoTransform, mrbi->geoTransform, sizeof(adfGeoTransform));
+            projection = mrbi->projection.c_str();
+        }
+        else {
+            ///////////////////////
+            // open miniraster
+            mini_ds = (GDALDataset*) GDALOpen(mini_filename.c_str(), GA_ReadOnly);
+            if ( !mini_ds ) {
+                cerr<< " Unexpected: couldn't read " <<mini_filename<< endl;
+                hDriver->Delete(mini_filename.c_str());
+                unlink(create_filename_hdr(prefix, mrbi->FID).c_str()); // hack
+                continue;
+            }
+            width = mini_ds->GetRasterXSize();
+            height = mini_ds->GetRasterYSize();
+            bands = strip_bands;
+            buf_type = strip_band_type;
+            mini_ds->GetGeoTransform(adfGeoTransform);
+            projection = mini_ds->GetProjectionRef();
         }
         
         // row to position miniraster in strip:
@@ -652,126 +814,81 @@ void starspan_create_strip(
         // column to position miniraster in strip:
         int next_col = 0;
         
-
-        ///////////////////////////////////////////////////////////////
-        // transfer data to image strip (row by row):			
-        for ( int i = 0; i < mini_ds->GetRasterYSize(); i++ ) {
-            
-            // read data from raster into buffer
-            // (note: reading is always (0,0)-relative in source miniraster)
-            mini_ds->RasterIO(GF_Read,
-                0,   	                     //nXOff,
-                0 + i,  	                 //nYOff,
-                mini_ds->GetRasterXSize(),   //nXSize,
-                1,                           //nYSize,
-                buffer,                      //pData,
-                mini_ds->GetRasterXSize(),   //nBufXSize,
-                1,                           //nBufYSize,
-                strip_band_type,             //eBufType,
-                strip_bands,                 //nBandCount,
-                NULL,                        //panBandMap,
-                0,                           //nPixelSpace,
-                0,                           //nLineSpace,
-                0                            //nBandSpace
-            );  	
-            
-            // write buffer in strip image
-            // (note: wiritn is (next_col,next_row)-based in destination strip)
-            strip_ds->RasterIO(GF_Write,
-                next_col,                    //nXOff,
-                next_row + i,                //nYOff,
-                mini_ds->GetRasterXSize(),   //nXSize,
-                1,                           //nYSize,
-                buffer,                      //pData,
-                mini_ds->GetRasterXSize(),   //nBufXSize,
-                1,                           //nBufYSize,
-                strip_band_type,             //eBufType,
-                strip_bands,                 //nBandCount,
-                NULL,                        //panBandMap,
-                0,                           //nPixelSpace,
-                0,                           //nLineSpace,
-                0                            //nBandSpace
-            );  	
-        }
+        // bands transferred to the strip:
+        const int nBandCount = bands < strip_bands ? bands : strip_bands;
         
-        ///////////////////////////////////////////////////////////////
-        // write FID chunck by replication
-        long fid_datum = mrbi->FID;
+        const int type_size = GDALGetDataTypeSize(buf_type) / 8;
+        const int row_size = width * bands * type_size;
+        int group_rows = STRIP_BUFFER_BYTES / row_size;
+        if ( group_rows < 1 )
+            group_rows = 1;
+        if ( group_rows > height )
+            group_rows = height;
         
-        if ( false ) {  
-            // ----- should work but seems to be a RasterIO bug  -----
-            // NOTE: The arguments in the following call need to be reviewed
-            // since I haven't paid much attention to keep it up to date.
-            fid_ds->RasterIO(GF_Write,
-                next_col,                  //nXOff,
-                next_row,                  //nYOff,
-                mini_ds->GetRasterXSize(), //nXSize,
-                mini_ds->GetRasterYSize(), //nYSize,
-                &fid_datum,                //pData,
-                1,                         //nBufXSize,
-                1,                         //nBufYSize,
-                fid_band_type,             //eBufType,
-                1,                         //nBandCount,
-                NULL,                      //panBandMap,
-                0,                         //nPixelSpace,
-                0,                         //nLineSpace,
-                0                          //nBandSpace
-            );
-        }
-        else { 
-           // ------- workaround  -------------
-            // replicate FID in buffer
-            int* fids = (int*) buffer;
-            for ( int j = 0; j < mini_ds->GetRasterXSize(); j++ ) {
-                fids[j] = (int) mrbi->FID;
-            }
-            for ( int i = 0; i < mini_ds->GetRasterYSize(); i++ ) {
-                fid_ds->RasterIO(GF_Write,
-                    next_col,                   //nXOff,
-                    next_row + i,               //nYOff,
-                    mini_ds->GetRasterXSize(),  //nXSize,
-                    1,                          //nYSize,
-                    fids,                       //pData,
-                    mini_ds->GetRasterXSize(),  //nBufXSize,
-                    1,                          //nBufYSize,
-                    fid_band_type,              //eBufType,
-                    1,                          //nBandCount,
-                    NULL,                       //panBandMap,
-                    0,                          //nPixelSpace,
-                    0,                          //nLineSpace,
-                    0                           //nBandSpace
-                );
-            }
-        }
+        if ( buffer.size() < (size_t) row_size * group_rows )
+            buffer.resize((size_t) row_size * group_rows);
+        fids.assign((size_t) width * group_rows, (int) mrbi->FID);
+        if ( locs.size() < (size_t) 2 * width * group_rows )
+            locs.resize((size_t) 2 * width * group_rows);
         
-        ///////////////////////////////////////////////////////////////
-        // write loc data
-        double adfGeoTransform[6];
-        mini_ds->GetGeoTransform(adfGeoTransform);
+        // loc values are accumulated from the miniraster origin:
         float pix_x_size = (float) adfGeoTransform[1];
         float pix_y_size = (float) adfGeoTransform[5];
         float x0 = (float) adfGeoTransform[0];
-        float y0 = (float) adfGeoTransform[3];
-        float xy[2] = { x0, y0 };
-        for ( int i = 0; i < mini_ds->GetRasterYSize(); i++, xy[1] += pix_y_size ) {
-            xy[0] = x0;
-            for ( int j = 0; j < mini_ds->GetRasterXSize(); j++, xy[0] += pix_x_size ) {
-                loc_ds->RasterIO(GF_Write,
-                    next_col + j,               //nXOff,
-                    next_row + i,               //nYOff,
-                    1,                          //nXSize,
-                    1,                          //nYSize,
-                    xy,                         //pData,
-                    1,                          //nBufXSize,
-                    1,                          //nBufYSize,
-                    loc_band_type,              //eBufType,
-                    2,                          //nBandCount,
-                    NULL,                       //panBandMap,
-                    0,                          //nPixelSpace,
-                    0,                          //nLineSpace,
-                    0                           //nBandSpace
+        float y = (float) adfGeoTransform[3];
+        
+        for ( int row0 = 0; row0 < height; row0 += group_rows ) {
+            const int rows = height - row0 < group_rows ? height - row0 : group_rows;
+            
+            ///////////////////////////////////////////////////////////////
+            // transfer data to image strip:
+            // (note: reading is always (0,0)-relative in source miniraster
+            // and writing is (next_col,next_row)-based in destination strip)
+            if ( mini_ds ) {
+                mini_ds->RasterIO(GF_Read,
+                    0, row0, width, rows,
+                    &buffer[0], width, rows, buf_type,
+                    nBandCount, NULL,
+                    type_size, row_size, width * type_size
                 );
             }
+            else if ( fread(&buffer[0], row_size, rows, spool) != (size_t) rows ) {
+                cerr<< " Unexpected: couldn't read " <<mini_filename<< endl;
+                break;
+            }
+            strip_ds->RasterIO(GF_Write,
+                next_col, next_row + row0, width, rows,
+                &buffer[0], width, rows, buf_type,
+                nBandCount, NULL,
+                type_size, row_size, width * type_size
+            );
+            
+            ///////////////////////////////////////////////////////////////
+            // write FID chunk by replication
+            fid_ds->RasterIO(GF_Write,
+                next_col, next_row + row0, width, rows,
+                &fids[0], width, rows, fid_band_type,
+                1, NULL,
+                0, 0, 0
+            );
+            
+            ///////////////////////////////////////////////////////////////
+            // write loc data
+            float* xs = &locs[0];
+            float* ys = xs + (size_t) width * rows;
+            for ( int i = 0; i < rows; i++, y += pix_y_size ) {
+                float x = x0;
+                for ( int j = 0; j < width; j++, x += pix_x_size ) {
+                    *xs++ = x;
+                    *ys++ = y;
+                }
+            }
+            loc_ds->RasterIO(GF_Write,
+                next_col, next_row + row0, width, rows,
+                &locs[0], width, rows, loc_band_type,
+                2, NULL,
+                0, 0, 0
+            );
         }
         
         ///////////////////////////////////////////////////////////////
@@ -783,7 +900,6 @@ void starspan_create_strip(
             // then, set projection for generated strips using the info from
             // this (arbitrarely chosen) first miniraster:
             //
-            const char* projection = mini_ds->GetProjectionRef();
             if ( projection && strlen(projection) > 0 ) {
                 strip_ds->SetProjection(projection);
                 fid_ds->  SetProjection(projection);                   
@@ -815,18 +931,23 @@ void starspan_create_strip(
         }
         
         // close and delete miniraster
-        delete mini_ds;
-        hDriver->Delete(mini_filename.c_str());
-        unlink(create_filename_hdr(prefix, mrbi->FID).c_str()); // hack
+        if ( mini_ds ) {
+            delete mini_ds;
+            hDriver->Delete(mini_filename.c_str());
+            unlink(create_filename_hdr(prefix, mrbi->FID).c_str()); // hack
+        }
+    }
+    
+    // close and delete spool file
+    if ( spool ) {
+        fclose(spool);
+        unlink(spool_filename.c_str());
     }
     
     // close outputs
     delete strip_ds;
     delete fid_ds;
     delete loc_ds;
-    
-    // release buffer
-    delete buffer;
 }
 
 
@@ -0,0 +1,892 @@
+//
+// STARSpan project
+// Carlos A. Rueda
+// starspan_zonal - raster-first zonal statistics
+// $Id$
+//
+// Instead of traversing the raster feature by feature, the whole layer is
+// burned into a zone grid (the zone of a pixel is the ordinal of the
+// feature it belongs to), and then the raster is read once, by strips of
+// blocks, accumulating the stats of each pixel into its zone.
+//
+// Polygons are burned with the coverage grid (traverser/coverage.h) and the
+// same pixel selection as the scanline rasterizer: a pixel is included if
+// its covered proportion is at least --pixprop (or if it is intersected at
+// all when --pixprop is 0). Points are burned into the pixel containing
+// them; lines are not supported.
+//
+// A pixel belongs to at most one zone: if features overlap, a pixel is
+// assigned to the first feature in layer order and the overlap is reported.
+//
+// The zone grid takes 4 bytes per pixel. If the raster is too big, it is
+// processed in strips of rows, with the layer burned again for each strip
+// (only features whose envelope intersects the strip are actually burned).
+//
+// MODE, MEDIAN and percentiles of Byte and 16-bit integer bands are obtained
+// from a histogram per zone, allocated by pages (see ZoneHistograms), so
+// a zone takes at most the range of the band type. Other bands use a
+// Stats per zone.
+//
+
+#include "starspan.h"
+#include "coverage.h"
+#include "Csv.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+
+// max number of pixels in the zone grid of a strip of rows
+#define ZONAL_MAX_ZONE_PIXELS  (64 * 1024 * 1024)
+
+// max number of pixels in the coverage grid when burning a polygon;
+// bigger polygons are burned in groups of rows
+#define ZONAL_MAX_BURN_PIXELS  (4 * 1024 * 1024)
+
+// tolerance for coverage comparisons (as in the scanline rasterizer)
+#define ZONAL_EPSILON  1e-9
+
+// number of counts in a page of a zone histogram
+#define ZONAL_HIST_PAGE  256
+
+
+/**
+  * Moments of the values of a band in a zone, updated per value.
+  */
+struct ZoneMoments {
+	unsigned long count;
+	unsigned long nulls;
+	double sum, min, max;
+	double mean, m2;    // Welford
+
+	ZoneMoments() : count(0), nulls(0), sum(0), min(0), max(0), mean(0), m2(0) {}
+
+	inline void add(double value) {
+		count++;
+		sum += value;
+		if ( count == 1 ) {
+			min = max = value;
+		}
+		else {
+			if ( min > value )
+				min = value;
+			if ( max < value )
+				max = value;
+		}
+		double delta = value - mean;
+		mean += delta / count;
+		m2 += delta * (value - mean);
+	}
+};
+
+
+/**
+  * Histograms of the values of a Byte or 16-bit integer band, one per zone.
+  * The range of the band type is divided in pages of ZONAL_HIST_PAGE
+  * counts; the directory of pages of a zone is allocated with its first
+  * value, and a page when a value in it is first seen in the zone. So a
+  * zone takes 1KB for a Byte band, and for a 16-bit band 1KB plus 1KB for
+  * each page of 256 consecutive values seen in the zone (256KB at most).
+  */
+class ZoneHistograms {
+public:
+	/** is the band type supported? */
+	static bool supports(GDALDataType type) {
+		return type == GDT_Byte || type == GDT_UInt16 || type == GDT_Int16;
+	}
+
+	void init(GDALDataType type, int numZones) {
+		base = type == GDT_Int16 ? -32768 : 0;
+		const int span = type == GDT_Byte ? 256 : 65536;
+		numPages = span / ZONAL_HIST_PAGE;
+		dirOffsets.assign(numZones, -1);
+		dirs.clear();
+		pages.clear();
+	}
+
+	/** adds a value (in the range of the band type) to zone z (1-based) */
+	inline void add(int z, int value) {
+		const int index = value - base;
+		int dir = dirOffsets[z - 1];
+		if ( dir < 0 ) {
+			dir = dirOffsets[z - 1] = dirs.size();
+			dirs.resize(dirs.size() + numPages, -1);
+		}
+		int& page = dirs[dir + index / ZONAL_HIST_PAGE];
+		if ( page < 0 ) {
+			page = pages.size();
+			pages.resize(pages.size() + ZONAL_HIST_PAGE, 0);
+		}
+		pages[page + index % ZONAL_HIST_PAGE]++;
+	}
+
+	/**
+	  * MODE, MEDIAN or percentile q (in [0,1]) of zone z with count values,
+	  * as obtained by Stats for integer values.
+	  */
+	double getMode(int z);
+	double getMedian(int z, unsigned long count);
+	double getQuantile(int z, unsigned long count, double q);
+
+private:
+	int base;
+	int numPages;
+	vector<int> dirOffsets;   // directory of zone z at dirs[dirOffsets[z - 1]], or -1
+	vector<int> dirs;         // offset of each page in pages, or -1
+	vector<unsigned> pages;
+
+	int valueAt(int z, unsigned long index);
+};
+
+
+//
+// Integer value at the given position in the sorted sequence of values
+// of zone z.
+//
+int ZoneHistograms::valueAt(int z, unsigned long index) {
+	const int dir = dirOffsets[z - 1];
+	unsigned long cumulated = 0;
+	int last = base;
+	for ( int p = 0; p < numPages; p++ ) {
+		const int page = dirs[dir + p];
+		if ( page < 0 )
+			continue;
+		for ( int i = 0; i < ZONAL_HIST_PAGE; i++ ) {
+			const unsigned count = pages[page + i];
+			if ( count == 0 )
+				continue;
+			last = base + p * ZONAL_HIST_PAGE + i;
+			cumulated += count;
+			if ( index < cumulated )
+				return last;
+		}
+	}
+	return last;
+}
+
+//
+// first value with the highest count
+//
+double ZoneHistograms::getMode(int z) {
+	const int dir = dirOffsets[z - 1];
+	int best_value = 0;
+	unsigned best_count = 0;
+	for ( int p = 0; p < numPages; p++ ) {
+		const int page = dirs[dir + p];
+		if ( page < 0 )
+			continue;
+		for ( int i = 0; i < ZONAL_HIST_PAGE; i++ ) {
+			if ( best_count < pages[page + i] ) {
+				best_value = base + p * ZONAL_HIST_PAGE + i;
+				best_count = pages[page + i];
+			}
+		}
+	}
+	return best_value;
+}
+
+//
+// middle value, or average of the two middle values
+//
+double ZoneHistograms::getMedian(int z, unsigned long count) {
+	const unsigned long pos1 = (count - 1) / 2;
+	const unsigned long pos2 = count / 2;
+	if ( pos1 == pos2 )
+		return valueAt(z, pos1);
+	return ((double) valueAt(z, pos1) + valueAt(z, pos2)) / 2.0;
+}
+
+//
+// linear interpolation between the closest ranks
+//
+double ZoneHistograms::getQuantile(int z, unsigned long count, double q) {
+	const double pos = q * (count - 1);
+	const unsigned long i = (unsigned long) pos;
+	const double value = valueAt(z, i);
+	if ( i + 1 >= count || pos == i )
+		return value;
+	return value + (pos - i) * (valueAt(z, i + 1) - value);
+}
+
+
+/**
+  * Zonal stats for one raster.
+  */
+class ZonalSweep {
+public:
+	ZonalSweep(Raster* raster, OGRLayer* layer, Stats& stats) :
+		raster(raster), layer(layer), stats(stats)
+	{
+		raster->getSize(&width, &height, &numBands);
+		raster->getCoordinates(&x0, &y0, &x1, &y1);
+		raster->getPixelSize(&pix_x_size, &pix_y_size);
+
+		// stats requiring the distribution of values in each zone:
+		orderStats.excludeAll();
+		if ( stats.include[MODE] )
+			orderStats.select("mode");
+		if ( stats.include[MEDIAN] )
+			orderStats.select("median");
+		orderStats.percentiles = stats.percentiles;
+		needOrder = stats.include[MODE] || stats.include[MEDIAN] || stats.percentiles.size() > 0;
+
+		numZones = 0;
+		overlapping_pixels = 0;
+		skipped_features = 0;
+	}
+
+	~ZonalSweep() {
+		for ( unsigned i = 0; i < zoneStats.size(); i++ ) {
+			delete zoneStats[i];
+		}
+	}
+
+	/**
+	  * Computes the stats of all zones.
+	  */
+	void sweep(void);
+
+	/** Number of zones (ie., features selected from the layer) */
+	int getNumZones(void) { return numZones; }
+
+	/** Number of pixels in zone z (1-based) */
+	unsigned long getNumPixels(int z) { return zonePixels[z - 1]; }
+
+	/**
+	  * Gets the result for a key given by Stats::select for band b of zone z.
+	  */
+	double getResult(int z, int b, int key);
+
+	/** reports some info about the sweep */
+	void reportSummary(void) {
+		cout<< "Zonal sweep summary:" << endl
+		    << "  zones: " <<numZones<< endl
+		    << "  overlapping pixels: " <<overlapping_pixels<< endl
+		    << "  skipped features (not polygons nor points): " <<skipped_features<< endl;
+	}
+
+private:
+	Raster* raster;
+	OGRLayer* layer;
+	Stats& stats;
+
+	int width, height, numBands;
+	double x0, y0, x1, y1;
+	double pix_x_size, pix_y_size;
+
+	bool get_integer;
+	vector<bool> hasNodata;
+	vector<double> nodata;
+
+	int numZones;
+	vector<unsigned long> zonePixels;
+	vector<ZoneMoments> moments;     // moments[(z-1) * numBands + b]
+
+	// MODE, MEDIAN and percentiles, if requested:
+	Stats orderStats;
+	bool needOrder;
+	vector<bool> useHistograms;      // per band: are histograms[b] used?
+	vector<ZoneHistograms> histograms;
+	vector<Stats*> zoneStats;        // zoneStats[(z-1) * numBands + b], created as needed
+
+	// zone grid for rows [strip_row, strip_row + strip_rows):
+	vector<int> zones;
+	int strip_row, strip_rows;
+
+	CoverageGrid coverageGrid;
+	long overlapping_pixels;
+	long skipped_features;
+
+	void prepareBands(void);
+	void burnStrip(void);
+	void burnGeometry(OGRGeometry* geometry, int zone);
+	void burnPolygon(OGRPolygon* poly, int zone);
+	void addRingToCoverage(OGRLinearRing* ring, bool hole, double x, double y);
+	void burnPixel(int col, int row, int zone);
+	void readStrip(void);
+
+	/** (x,y) to (col,row) conversion */
+	inline void toColRow(double x, double y, int *col, int *row) {
+		*col = (int) floor( (x - x0) / pix_x_size );
+		*row = (int) floor( (y - y0) / pix_y_size );
+	}
+};
+
+
+//
+// nodata value for each band, as in the stats observer
+//
+void ZonalSweep::prepareBands(void) {
+	GDALDataset* dataset = raster->getDataset();
+	get_integer = true;
+	for ( int b = 0; b < numBands; b++ ) {
+		GDALDataType bandType = dataset->GetRasterBand(b + 1)->GetRasterDataType();
+		if ( bandType == GDT_Float64 || bandType == GDT_Float32 ) {
+			get_integer = false;
+		}
+	}
+
+	hasNodata.assign(numBands, true);
+	nodata.assign(numBands, 0.0);
+	for ( int b = 0; b < numBands; b++ ) {
+		GDALRasterBand* band = dataset->GetRasterBand(b + 1);
+		double nd;
+		if ( globalOptions.nodata_per_band ) {
+			int success = 0;
+			nd = band->GetNoDataValue(&success);
+			if ( !success )
+				hasNodata[b] = false;
+			else if ( get_integer && (nd != floor(nd) || nd < INT_MIN || nd > INT_MAX) )
+				hasNodata[b] = false;
+		}
+		else {
+			if (!globalOptions.nodata) {
+				globalOptions.nodata = band->GetNoDataValue();
+			}
+			nd = globalOptions.nodata;
+		}
+		// values are compared as read (integer values are exact in double):
+		nodata[b] = get_integer ? (double) int(nd) : nd;
+	}
+
+	// histograms for integer bands of small types (for real rasters, all
+	// values go through Stats, as in the stats observer):
+	useHistograms.assign(numBands, false);
+	histograms.assign(numBands, ZoneHistograms());
+	for ( int b = 0; b < numBands; b++ ) {
+		GDALDataType bandType = dataset->GetRasterBand(b + 1)->GetRasterDataType();
+		useHistograms[b] = needOrder && get_integer && ZoneHistograms::supports(bandType);
+	}
+}
+
+
+void ZonalSweep::sweep(void) {
+	prepareBands();
+
+	// one strip of rows at a time, in multiples of the block height:
+	int blockXSize, blockYSize;
+	raster->getDataset()->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	if ( blockYSize < 1 )
+		blockYSize = 1;
+	int max_rows = (int) (ZONAL_MAX_ZONE_PIXELS / width);
+	max_rows -= max_rows % blockYSize;
+	if ( max_rows < blockYSize )
+		max_rows = blockYSize;
+
+	for ( strip_row = 0; strip_row < height; strip_row += strip_rows ) {
+		strip_rows = height - strip_row < max_rows ? height - strip_row : max_rows;
+		if ( globalOptions.verbose ) {
+			cout<< "  zonal sweep: rows " <<strip_row<< " to " <<(strip_row + strip_rows - 1)<< endl;
+		}
+		burnStrip();
+		readStrip();
+	}
+
+	for ( unsigned k = 0; k < zoneStats.size(); k++ ) {
+		if ( zoneStats[k] )
+			zoneStats[k]->end();
+	}
+}
+
+
+//
+// burns all features into the zone grid of the current strip.
+// The zone of a feature is its ordinal in the layer, so it is the same
+// in every strip.
+//
+void ZonalSweep::burnStrip(void) {
+	zones.assign((size_t) width * strip_rows, 0);
+
+	layer->ResetReading();
+	layer->SetSpatialFilterRect(
+		x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+		x0 < x1 ? x1 : x0, y0 < y1 ? y1 : y0
+	);
+
+	const double strip_y0 = y0 + strip_row * pix_y_size;
+	const double strip_y1 = y0 + (strip_row + strip_rows) * pix_y_size;
+
+	int zone = 0;
+	OGRFeature* feature;
+	while( (feature = layer->GetNextFeature()) != NULL ) {
+		if ( globalOptions.FID >= 0 && feature->GetFID() != globalOptions.FID ) {
+			delete feature;
+			continue;
+		}
+		zone++;
+		OGRGeometry* geometry = feature->GetGeometryRef();
+		if ( geometry ) {
+			OGREnvelope env;
+			geometry->getEnvelope(&env);
+			if ( env.MaxY >= (strip_y0 < strip_y1 ? strip_y0 : strip_y1)
+			&&   env.MinY <= (strip_y0 < strip_y1 ? strip_y1 : strip_y0) ) {
+				burnGeometry(geometry, zone);
+			}
+		}
+		delete feature;
+	}
+
+	if ( strip_row == 0 ) {
+		numZones = zone;
+		zonePixels.assign(numZones, 0);
+		moments.assign((size_t) numZones * numBands, ZoneMoments());
+		if ( needOrder ) {
+			zoneStats.assign((size_t) numZones * numBands, (Stats*) 0);
+			for ( int b = 0; b < numBands; b++ ) {
+				if ( useHistograms[b] ) {
+					GDALDataType bandType = raster->getDataset()->GetRasterBand(b + 1)->GetRasterDataType();
+					histograms[b].init(bandType, numZones);
+				}
+			}
+		}
+	}
+}
+
+
+void ZonalSweep::burnGeometry(OGRGeometry* geometry, int zone) {
+	switch ( geometry->getGeometryType() ) {
+		case wkbPolygon:
+		case wkbPolygon25D:
+			burnPolygon((OGRPolygon*) geometry, zone);
+			break;
+
+		case wkbPoint:
+		case wkbPoint25D: {
+			OGRPoint* point = (OGRPoint*) geometry;
+			int col, row;
+			toColRow(point->getX(), point->getY(), &col, &row);
+			burnPixel(col, row, zone);
+			break;
+		}
+
+		case wkbMultiPolygon:
+		case wkbMultiPolygon25D:
+		case wkbMultiPoint:
+		case wkbMultiPoint25D:
+		case wkbGeometryCollection:
+		case wkbGeometryCollection25D: {
+			OGRGeometryCollection* coll = (OGRGeometryCollection*) geometry;
+			for ( int i = 0; i < coll->getNumGeometries(); i++ ) {
+				burnGeometry(coll->getGeometryRef(i), zone);
+			}
+			break;
+		}
+
+		default:
+			// only counted once per strip
+			if ( strip_row == 0 ) {
+				skipped_features++;
+			}
+			if ( globalOptions.verbose ) {
+				cout<< "  zonal sweep: " <<geometry->getGeometryName()<< " not supported" << endl;
+			}
+			break;
+	}
+}
+
+
+void ZonalSweep::burnPixel(int col, int row, int zone) {
+	if ( col < 0 || col >= width || row < strip_row || row >= strip_row + strip_rows )
+		return;
+	int& z = zones[(size_t) (row - strip_row) * width + col];
+	if ( z == 0 )
+		z = zone;
+	else if ( z != zone )
+		overlapping_pixels++;
+}
+
+
+//
+// Burns the polygon in groups of rows. The coverage grid has an extra
+// column on each side so edges outside the raster (accumulated in those
+// columns) do not alter the coverage of the pixels inside.
+//
+void ZonalSweep::burnPolygon(OGRPolygon* poly, int zone) {
+	OGREnvelope env;
+	poly->getEnvelope(&env);
+
+	int minCol, minRow, maxCol, maxRow;
+	toColRow(env.MinX, env.MinY, &minCol, &minRow);
+	toColRow(env.MaxX, env.MaxY, &maxCol, &maxRow);
+	if ( minCol > maxCol ) std::swap(minCol, maxCol);
+	if ( minRow > maxRow ) std::swap(minRow, maxRow);
+
+	if ( minCol < 0 )                          minCol = 0;
+	if ( maxCol >= width )                     maxCol = width - 1;
+	if ( minRow < strip_row )                  minRow = strip_row;
+	if ( maxRow >= strip_row + strip_rows )    maxRow = strip_row + strip_rows - 1;
+	if ( minCol > maxCol || minRow > maxRow )
+		return;
+
+	const int cols = maxCol - minCol + 1;
+	int group_rows = ZONAL_MAX_BURN_PIXELS / (cols + 2);
+	if ( group_rows < 1 )
+		group_rows = 1;
+
+	const double pix_prop = globalOptions.pix_prop;
+	const float min_coverage = (float) (pix_prop > 0.0 ? pix_prop - ZONAL_EPSILON : ZONAL_EPSILON);
+
+	for ( int row0 = minRow; row0 <= maxRow; row0 += group_rows ) {
+		const int rows = maxRow - row0 + 1 < group_rows ? maxRow - row0 + 1 : group_rows;
+
+		// origin of the coverage grid:
+		const double x = x0 + (minCol - 1) * pix_x_size;
+		const double y = y0 + row0 * pix_y_size;
+
+		coverageGrid.reset(cols + 2, rows);
+		addRingToCoverage(poly->getExteriorRing(), false, x, y);
+		for ( int k = 0; k < poly->getNumInteriorRings(); k++ ) {
+			addRingToCoverage(poly->getInteriorRing(k), true, x, y);
+		}
+		coverageGrid.compute();
+
+		for ( int i = 0; i < rows; i++ ) {
+			for ( int j = 0; j < cols; j++ ) {
+				if ( coverageGrid.coverage(j + 1, i) >= min_coverage ) {
+					burnPixel(minCol + j, row0 + i, zone);
+				}
+			}
+		}
+	}
+}
+
+
+//
+// Adds a ring to the coverage grid, whose origin is at (x,y).
+//
+void ZonalSweep::addRingToCoverage(OGRLinearRing* ring, bool hole, double x, double y) {
+	if ( !ring )
+		return;
+	const int n = ring->getNumPoints();
+	vector<double> us(n), vs(n);
+	for ( int i = 0; i < n; i++ ) {
+		us[i] = (ring->getX(i) - x) / pix_x_size;
+		vs[i] = (ring->getY(i) - y) / pix_y_size;
+	}
+	if ( n > 0 ) {
+		coverageGrid.addRing(&us[0], &vs[0], n, hole);
+	}
+}
+
+
+//
+// Reads the rows of the current strip, one block height at a time, and
+// accumulates the values of each pixel in a zone.
+//
+void ZonalSweep::readStrip(void) {
+	GDALDataset* dataset = raster->getDataset();
+	int blockXSize, blockYSize;
+	dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	if ( blockYSize < 1 )
+		blockYSize = 1;
+
+	vector< vector<double> > values(numBands, vector<double>((size_t) width * blockYSize));
+
+	for ( int row0 = 0; row0 < strip_rows; row0 += blockYSize ) {
+		const int rows = strip_rows - row0 < blockYSize ? strip_rows - row0 : blockYSize;
+
+		// any zone in these rows?
+		const int* zrow = &zones[(size_t) row0 * width];
+		const size_t n = (size_t) width * rows;
+		size_t i = 0;
+		while ( i < n && zrow[i] == 0 )
+			i++;
+		if ( i == n )
+			continue;
+
+		for ( int b = 0; b < numBands; b++ ) {
+			CPLErr err = dataset->GetRasterBand(b + 1)->RasterIO(GF_Read,
+				0, strip_row + row0, width, rows,
+				&values[b][0], width, rows, GDT_Float64,
+				0, 0
+			);
+			if ( err != CE_None ) {
+				cerr<< "Error reading band " <<(b + 1)<< ", rows " <<(strip_row + row0)<< "-" <<(strip_row + row0 + rows - 1)<< endl;
+				exit(1);
+			}
+		}
+
+		for ( i = 0; i < n; i++ ) {
+			const int z = zrow[i];
+			if ( z == 0 )
+				continue;
+			zonePixels[z - 1]++;
+			for ( int b = 0; b < numBands; b++ ) {
+				const double value = values[b][i];
+				const size_t k = (size_t) (z - 1) * numBands + b;
+				if ( hasNodata[b] && value == nodata[b] ) {
+					moments[k].nulls++;
+					continue;
+				}
+				moments[k].add(value);
+				if ( useHistograms[b] ) {
+					histograms[b].add(z, int(value));
+				}
+				else if ( needOrder ) {
+					Stats* st = zoneStats[k];
+					if ( !st ) {
+						st = zoneStats[k] = new Stats(orderStats);
+						if ( get_integer )
+							st->begin(int(nodata[b]));
+						else
+							st->begin(nodata[b]);
+					}
+					if ( get_integer )
+						st->add(int(value));
+					else
+						st->add(value);
+				}
+			}
+		}
+	}
+}
+
+
+//
+// As in Stats::end: all results are 0 if there are no values.
+//
+double ZonalSweep::getResult(int z, int b, int key) {
+	const size_t k = (size_t) (z - 1) * numBands + b;
+	const ZoneMoments& m = moments[k];
+	if ( m.count == 0 )
+		return 0.0;
+
+	if ( key >= TOT_RESULTS || key == MODE || key == MEDIAN ) {
+		if ( useHistograms[b] ) {
+			if ( key == MODE )
+				return histograms[b].getMode(z);
+			if ( key == MEDIAN )
+				return histograms[b].getMedian(z, m.count);
+			return histograms[b].getQuantile(z, m.count, stats.percentiles[key - TOT_RESULTS] / 100);
+		}
+		Stats* st = zoneStats[k];
+		return st ? st->getResult(key) : 0.0;
+	}
+
+	switch ( key ) {
+		case AVG:   return m.sum / m.count;
+		case SUM:   return m.sum;
+		case MIN:   return m.min;
+		case MAX:   return m.max;
+		case NULLS: return (double) m.nulls;
+		case VAR:   return m.count > 1 ? m.m2 / (m.count - 1) : 0.0;
+		case STDEV: return m.count > 1 ? sqrt(m.m2 / (m.count - 1)) : 0.0;
+	}
+	return 0.0;
+}
+
+
+
+//
+// gets the layer as the traverser does (with --sql and --where)
+//
+static OGRLayer* get_layer(Vector* vect, int layernum, bool* releaseLayer) {
+	OGRLayer* layer = 0;
+	*releaseLayer = false;
+	if ( globalOptions.vSelParams.sql.length() > 0 ) {
+		OGRDataSource *poDS = vect->getDataSource();
+		const char *dialect = 0;
+		if ( globalOptions.vSelParams.dialect.length() > 0 ) {
+			dialect = globalOptions.vSelParams.dialect.c_str();
+		}
+		layer = poDS->ExecuteSQL(globalOptions.vSelParams.sql.c_str(), 0, dialect);
+		if ( !layer ) {
+			cerr<< "No result or an error occured while issueing query: "
+			    << globalOptions.vSelParams.sql << endl;
+			return 0;
+		}
+		*releaseLayer = true;
+	}
+	else {
+		layer = vect->getLayer(layernum);
+		if ( !layer ) {
+			cerr<< "Couldn't get layer " <<layernum<< " from " << vect->getName()<< endl;
+			return 0;
+		}
+	}
+	if ( globalOptions.vSelParams.where.length() > 0 ) {
+		layer->SetAttributeFilter(globalOptions.vSelParams.where.c_str());
+	}
+	return layer;
+}
+
+
+//
+// Same columns as in starspan_stats.
+//
+static void write_header(CsvOutput& csvOut, OGRLayer* layer,
+	vector<const char*>& select_stats, vector<const char*>* select_fields, int numBands
+) {
+	csvOut.startLine();
+	csvOut.addString("FID");
+	if ( select_fields ) {
+		for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+			csvOut.addString(*fname);
+		}
+	}
+	else {
+		OGRFeatureDefn* poDefn = layer->GetLayerDefn();
+		for ( int i = 0; i < poDefn->GetFieldCount(); i++ ) {
+			csvOut.addString(poDefn->GetFieldDefn(i)->GetNameRef());
+		}
+	}
+	if ( globalOptions.RID != "none" ) {
+		csvOut.addString(RID_colName);
+	}
+	csvOut.addString("numPixels");
+	for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
+		for ( int b = 0; b < numBands; b++ ) {
+			csvOut.addField("%s_Band%d", *stat, b+1);
+		}
+	}
+	csvOut.endLine();
+}
+
+
+//
+// Writes a record for each zone with pixels, in layer order.
+//
+static void write_records(CsvOutput& csvOut, OGRLayer* layer, ZonalSweep& zs,
+	vector<int>& statKeys, vector<const char*>* select_fields, string& RID, int numBands
+) {
+	// same features, in the same order, as in the sweep:
+	layer->ResetReading();
+	int zone = 0;
+	OGRFeature* feature;
+	while( (feature = layer->GetNextFeature()) != NULL ) {
+		if ( globalOptions.FID >= 0 && feature->GetFID() != globalOptions.FID ) {
+			delete feature;
+			continue;
+		}
+		zone++;
+		if ( zone > zs.getNumZones() || zs.getNumPixels(zone) == 0 ) {
+			delete feature;
+			continue;
+		}
+
+		csvOut.startLine();
+		csvOut.addField("%ld", feature->GetFID());
+		if ( select_fields ) {
+			for ( vector<const char*>::const_iterator fname = select_fields->begin(); fname != select_fields->end(); fname++ ) {
+				const int i = feature->GetFieldIndex(*fname);
+				if ( i < 0 ) {
+					cerr<< endl << "\tField `" <<*fname<< "' not found" << endl;
+					exit(1);
+				}
+				csvOut.addString(feature->GetFieldAsString(i));
+			}
+		}
+		else {
+			for ( int i = 0; i < feature->GetFieldCount(); i++ ) {
+				csvOut.addString(feature->GetFieldAsString(i));
+			}
+		}
+		if ( globalOptions.RID != "none" ) {
+			csvOut.addString(RID);
+		}
+		csvOut.addField("%d", (int) zs.getNumPixels(zone));
+
+		for ( unsigned k = 0; k < statKeys.size(); k++ ) {
+			const int key = statKeys[k];
+			for ( int b = 0; b < numBands; b++ ) {
+				const double value = zs.getResult(zone, b, key);
+				if ( Stats::isCount(key) )
+					csvOut.addField("%d", int(value));
+				else
+					csvOut.addField("%f", value);
+			}
+		}
+		csvOut.endLine();
+		delete feature;
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Each raster is processed independently
+//
+int starspan_zonal_stats(
+	Vector* vect,
+	vector<const char*> raster_filenames,
+	vector<const char*> select_stats,
+	vector<const char*>* select_fields,
+	const char* csv_filename,
+	int layernum
+) {
+	if ( globalOptions.bufferParams.given || globalOptions.boxParams.given ) {
+		cerr<< "--zonal-sweep: --buffer and --box are not supported" << endl;
+		return 1;
+	}
+
+	Stats stats;
+	stats.excludeAll();
+	vector<int> statKeys;
+	for ( vector<const char*>::const_iterator stat = select_stats.begin(); stat != select_stats.end(); stat++ ) {
+		int key = stats.select(*stat);
+		if ( key < 0 ) {
+			cerr<< "Unrecognized stats " << *stat<< endl;
+			return 1;
+		}
+		statKeys.push_back(key);
+	}
+
+	bool releaseLayer;
+	OGRLayer* layer = get_layer(vect, layernum, &releaseLayer);
+	if ( !layer )
+		return 1;
+
+	bool new_file;
+	FILE* file = starspan_open_for_append(csv_filename, &new_file);
+	if ( !file ) {
+		if ( releaseLayer ) {
+			vect->getDataSource()->ReleaseResultSet(layer);
+		}
+		return 1;
+	}
+
+	CsvOutput csvOut;
+	csvOut.setFile(file);
+	csvOut.setSeparator(globalOptions.delimiter);
+
+	for ( unsigned i = 0; i < raster_filenames.size(); i++ ) {
+		fprintf(stdout, "%3u: Zonal sweep on %s\n", i+1, raster_filenames[i]);
+		Raster* raster = new Raster(raster_filenames[i]);
+		int width, height, numBands;
+		raster->getSize(&width, &height, &numBands);
+
+		if ( new_file && i == 0 ) {
+			write_header(csvOut, layer, select_stats, select_fields, numBands);
+		}
+
+		ZonalSweep zs(raster, layer, stats);
+		zs.sweep();
+
+		string RID;
+		if ( globalOptions.RID != "none" ) {
+			RID = raster_filenames[i];
+			if ( globalOptions.RID == "file" ) {
+				starspan_simplify_filename(RID);
+			}
+		}
+		write_records(csvOut, layer, zs, statKeys, select_fields, RID, numBands);
+
+		if ( globalOptions.report_summary ) {
+			zs.reportSummary();
+		}
+		delete raster;
+	}
+
+	fclose(file);
+
+	if ( releaseLayer ) {
+		vect->getDataSource()->ReleaseResultSet(layer);
+	}
+	return 0;
+}
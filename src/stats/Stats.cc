@@ -10,7 +10,74 @@
 #include <map>
 #include <cstdio>
 #include <cstdlib>  // atof
+#include <cstring>
 #include <cmath>  // sqrt
+#include <climits>
+#include <limits>
+#include <cassert>
+
+
+//
+// Registry of the stats that can be selected by name.
+// Percentiles (pNN) are handled separately in select().
+//
+static const struct {
+	const char* name;
+	int key;
+} statNames[] = {
+	{ "avg",    AVG    },
+	{ "mode",   MODE   },
+	{ "stdev",  STDEV  },
+	{ "min",    MIN    },
+	{ "max",    MAX    },
+	{ "sum",    SUM    },
+	{ "median", MEDIAN },
+	{ "nulls",  NULLS  },
+	{ 0, 0 }
+};
+
+
+void Stats::excludeAll(void) {
+	for ( int i = 0; i < TOT_RESULTS; i++ ) {
+		include[i] = false;
+	}
+	percentiles.clear();
+}
+
+
+int Stats::select(const char* name) {
+	for ( int i = 0; statNames[i].name; i++ ) {
+		if ( 0 == strcmp(name, statNames[i].name) ) {
+			include[statNames[i].key] = true;
+			if ( statNames[i].key == STDEV )
+				include[VAR] = true;
+			return statNames[i].key;
+		}
+	}
+	if ( name[0] == 'p' && name[1] ) {
+		char* end;
+		double p = strtod(name + 1, &end);
+		if ( *end == 0 && p >= 0 && p <= 100 ) {
+			percentiles.push_back(p);
+			return TOT_RESULTS + percentiles.size() - 1;
+		}
+	}
+	return -1;
+}
+
+
+//
+// q-th quantile of the sorted values, with linear interpolation between
+// the closest ranks.
+//
+template <typename T>
+static double sorted_quantile(const vector<T>& values, double q) {
+	const double pos = q * (values.size() - 1);
+	const unsigned long i = (unsigned long) pos;
+	if ( i + 1 >= values.size() )
+		return values[values.size() - 1];
+	return values[i] + (pos - i) * ((double) values[i + 1] - values[i]);
+}
 
 
 void Stats::compute(vector<int>& values, int nodata) {
@@ -27,6 +94,7 @@ void Stats::compute(vector<int>& values, int nodata) {
 	for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
 		result[i] = 0.0;
 	}
+	percentileResult.assign(percentiles.size(), 0.0);
 	
 	const unsigned num_values = values.size();
 	if ( num_values == 0 )
@@ -117,6 +185,14 @@ void Stats::compute(vector<int>& values, int nodata) {
 	        result[MEDIAN] = median;
 	}
 
+	if ( percentiles.size() > 0 ) {
+		if ( !include[MEDIAN] )
+			sort(values.begin(), values.end());
+		for ( unsigned k = 0; k < percentiles.size(); k++ ) {
+			percentileResult[k] = sorted_quantile(values, percentiles[k] / 100);
+		}
+	}
+
 }
 
 void Stats::computeCounts(vector<int>& values, map<int,int>& count) {
@@ -146,6 +222,7 @@ void Stats::compute(vector<double>& values, double nodata) {
 	for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
 		result[i] = 0.0;
 	}
+	percentileResult.assign(percentiles.size(), 0.0);
 	
 	const unsigned num_values = values.size();
 	if ( num_values == 0 )
@@ -245,6 +322,446 @@ void Stats::compute(vector<double>& values, double nodata) {
 		}
 	        result[MEDIAN] = median;
 	}
+
+	if ( percentiles.size() > 0 ) {
+		if ( !include[MEDIAN] )
+			sort(values.begin(), values.end());
+		for ( unsigned k = 0; k < percentiles.size(); k++ ) {
+			percentileResult[k] = sorted_quantile(values, percentiles[k] / 100);
+		}
+	}
+}
+
+
+
+
+//
+// Streaming computation
+//
+
+void Stats::reset(void) {
+	// clear counts from previous integer values:
+	if ( histUsed && num_values > 0 ) {
+		if ( sparse ) {
+			sparseCounts.clear();
+		}
+		else {
+			for ( long v = (long) min; v <= (long) max; v++ ) {
+				hist[v - histBase] = 0;
+			}
+		}
+	}
+	histUsed = false;
+	sparse = false;
+	hasNodata = true;
+
+	// accumulators needed by the included stats:
+	needVariance = include[VAR] || include[STDEV];
+	needOrder = include[MEDIAN] || percentiles.size() > 0;
+	needHistogram = include[MODE] || needOrder;
+
+	exactValues.clear();
+	digest.clear();
+	modeCounts.clear();
+	modeByCount.clear();
+	modeSaturated = false;
+
+	total = num_values = 0;
+	sum = min = max = 0.0;
+	mean = m2 = 0.0;
+}
+
+
+void Stats::begin(int nodata, int lo, int hi) {
+	reset();
+	integer = true;
+	inodata = nodata;
+	if ( lo <= hi ) {
+		long span = (long) hi - lo + 1;
+		if ( span <= STATS_MAX_DENSE_SPAN
+		&&  ( lo < histBase || (long) hi - histBase >= (long) hist.size() ) ) {
+			hist.assign(span, 0);
+			histBase = lo;
+		}
+	}
 }
 
 
+void Stats::begin(double nodata) {
+	reset();
+	integer = false;
+	dnodata = nodata;
+}
+
+
+//
+// Called with value already accumulated (so it is within [min, max]) but
+// out of the current dense histogram. Either reallocates the histogram
+// (at least doubling its size) or moves the counts to sparseCounts if the
+// range is too big.
+//
+void Stats::growHistogram(int value) {
+	const long lo = (long) min;
+	const long hi = (long) max;
+	const long span = hi - lo + 1;
+	if ( span > STATS_MAX_DENSE_SPAN ) {
+		for ( unsigned i = 0; i < hist.size(); i++ ) {
+			if ( hist[i] ) {
+				sparseCounts[histBase + (int) i] = hist[i];
+				hist[i] = 0;
+			}
+		}
+		sparse = true;
+		return;
+	}
+
+	long newSize = 2 * (long) hist.size();
+	if ( newSize < span )
+		newSize = span;
+	if ( newSize > STATS_MAX_DENSE_SPAN )
+		newSize = STATS_MAX_DENSE_SPAN;
+
+	// leave the extra room on the side the values are growing to:
+	long newBase = value < histBase ? hi - newSize + 1 : lo;
+	if ( newBase < INT_MIN )
+		newBase = INT_MIN;
+	if ( newBase + newSize - 1 > INT_MAX )
+		newBase = INT_MAX - newSize + 1;
+
+	vector<unsigned> newHist(newSize, 0);
+	for ( unsigned i = 0; i < hist.size(); i++ ) {
+		if ( hist[i] ) {
+			newHist[histBase + (long) i - newBase] = hist[i];
+		}
+	}
+	hist.swap(newHist);
+	histBase = (int) newBase;
+}
+
+
+void Stats::keep(double value) {
+	if ( needOrder ) {
+		if ( exactValues.size() < STATS_MAX_EXACT_VALUES && digest.getCount() == 0 ) {
+			exactValues.push_back(value);
+		}
+		else {
+			for ( unsigned i = 0; i < exactValues.size(); i++ ) {
+				digest.add(exactValues[i]);
+			}
+			exactValues.clear();
+			digest.add(value);
+		}
+	}
+
+	if ( include[MODE] ) {
+		char str[1024];
+		sprintf(str, "%.3f", value);
+		countMode(str);
+	}
+}
+
+
+//
+// Counts the value in modeCounts, or, if it already has
+// STATS_MAX_MODE_VALUES values, replaces the value with the least count
+// (the new one takes that count plus one, which bounds its error).
+//
+void Stats::countMode(const string& value) {
+	map<string,unsigned>::iterator it = modeCounts.find(value);
+	if ( it != modeCounts.end() ) {
+		if ( modeSaturated ) {
+			modeByCount.erase(make_pair(it->second, value));
+			modeByCount.insert(make_pair(it->second + 1, value));
+		}
+		it->second++;
+		return;
+	}
+
+	if ( modeCounts.size() < STATS_MAX_MODE_VALUES ) {
+		modeCounts[value] = 1;
+		return;
+	}
+
+	if ( !modeSaturated ) {
+		for ( it = modeCounts.begin(); it != modeCounts.end(); it++ ) {
+			modeByCount.insert(make_pair(it->second, it->first));
+		}
+		modeSaturated = true;
+	}
+	set<pair<unsigned,string> >::iterator least = modeByCount.begin();
+	const unsigned count = least->first + 1;
+	modeCounts.erase(least->second);
+	modeByCount.erase(least);
+	modeCounts[value] = count;
+	modeByCount.insert(make_pair(count, value));
+}
+
+
+void Stats::merge(unsigned long n, double nsum, double nmean, double nm2, double nmin, double nmax) {
+	if ( n == 0 )
+		return;
+	if ( num_values == 0 ) {
+		min = nmin;
+		max = nmax;
+	}
+	else {
+		if ( min > nmin )
+			min = nmin;
+		if ( max < nmax )
+			max = nmax;
+	}
+	// (Chan et al. combination of mean and sum of squared deviations)
+	const double count = (double) num_values + n;
+	const double delta = nmean - mean;
+	mean += delta * n / count;
+	m2 += nm2 + delta * delta * ((double) num_values * n / count);
+	num_values += n;
+	sum += nsum;
+}
+
+
+//
+// nodata as a value of type T, if values of type T can be equal to it.
+//
+template <typename T>
+static bool nodata_as(double nodata, T* nd) {
+	if ( nodata != nodata )
+		return false;   // NaN
+	if ( numeric_limits<T>::is_integer ) {
+		if ( nodata < (double) numeric_limits<T>::min() || nodata > (double) numeric_limits<T>::max() )
+			return false;
+	}
+	else if ( fabs(nodata) > numeric_limits<T>::max() && fabs(nodata) != numeric_limits<double>::infinity() ) {
+		return false;
+	}
+	*nd = (T) nodata;
+	return (double) *nd == nodata;
+}
+
+
+// values of a type whose sums are exact with Reduction<long long> are
+// reduced in groups of up to this size, so count * sumsq does not overflow
+#define SMALL_INTS_GROUP  (1 << 15)
+
+//
+// 8 and 16-bit values: the sum of squared deviations of each group is
+// computed exactly from the integer sums.
+//
+template <typename T>
+void Stats::addSmallInts(const T* values, unsigned n) {
+	T nd = 0;
+	const bool excludeNodata = hasNodata && nodata_as(integer ? (double) inodata : dnodata, &nd);
+	total += n;
+	for ( unsigned start = 0; start < n; start += SMALL_INTS_GROUP ) {
+		const unsigned len = n - start < SMALL_INTS_GROUP ? n - start : SMALL_INTS_GROUP;
+		Reduction<long long> r;
+		StatsKernels::reduce(values + start, len, excludeNodata, nd, r);
+		if ( r.count > 0 ) {
+			// count * m2:
+			const long long cm2 = (long long) r.count * r.sumsq - r.sum * r.sum;
+			merge(r.count, (double) r.sum, (double) r.sum / r.count, (double) cm2 / r.count, r.min, r.max);
+		}
+	}
+	addToHistogram(values, n, excludeNodata, nd);
+}
+
+//
+// Other types (32-bit integers and real values): added one at a time, so
+// sums and variance are accumulated in the same order as with add(value)
+// and the reported digits do not depend on the way values are given.
+//
+template <typename T>
+void Stats::addValues(const T* values, unsigned n) {
+	if ( integer ) {
+		for ( unsigned i = 0; i < n; i++ )
+			add((int) values[i]);
+	}
+	else {
+		for ( unsigned i = 0; i < n; i++ )
+			add((double) values[i]);
+	}
+}
+
+//
+// Values for MODE, MEDIAN and percentiles, if included.
+//
+template <typename T>
+void Stats::addToHistogram(const T* values, unsigned n, bool excludeNodata, T nodata) {
+	if ( !needHistogram )
+		return;
+	for ( unsigned i = 0; i < n; i++ ) {
+		const T v = values[i];
+		if ( excludeNodata && v == nodata )
+			continue;
+		if ( integer )
+			addToHistogram((int) v);
+		else
+			keep((double) v);
+	}
+}
+
+void Stats::add(const unsigned char* values, unsigned n) {
+	addSmallInts(values, n);
+}
+
+void Stats::add(const unsigned short* values, unsigned n) {
+	addSmallInts(values, n);
+}
+
+void Stats::add(const short* values, unsigned n) {
+	addSmallInts(values, n);
+}
+
+void Stats::add(const int* values, unsigned n) {
+	addValues(values, n);
+}
+
+void Stats::add(const unsigned int* values, unsigned n) {
+	assert( !integer );
+	addValues(values, n);
+}
+
+void Stats::add(const float* values, unsigned n) {
+	assert( !integer );
+	addValues(values, n);
+}
+
+void Stats::add(const double* values, unsigned n) {
+	assert( !integer );
+	addValues(values, n);
+}
+
+
+//
+// Integer value at the given position in the sorted sequence of values.
+//
+int Stats::histogramValueAt(unsigned long index) {
+	unsigned long cumulated = 0;
+	if ( sparse ) {
+		for ( map<int,unsigned>::iterator it = sparseCounts.begin(); it != sparseCounts.end(); it++ ) {
+			cumulated += it->second;
+			if ( index < cumulated )
+				return it->first;
+		}
+	}
+	else {
+		for ( long v = (long) min; v <= (long) max; v++ ) {
+			cumulated += hist[v - histBase];
+			if ( index < cumulated )
+				return (int) v;
+		}
+	}
+	return (int) max;
+}
+
+
+//
+// q-th quantile of the added values, with linear interpolation between
+// the closest ranks (exact except when the t-digest is in use).
+// exactValues must be sorted.
+//
+double Stats::quantile(double q) {
+	if ( integer ) {
+		const double pos = q * (num_values - 1);
+		const unsigned long i = (unsigned long) pos;
+		const double value = histogramValueAt(i);
+		if ( i + 1 >= num_values || pos == i )
+			return value;
+		return value + (pos - i) * (histogramValueAt(i + 1) - value);
+	}
+	else if ( digest.getCount() == 0 ) {
+		return sorted_quantile(exactValues, q);
+	}
+	else {
+		return digest.quantile(q);
+	}
+}
+
+
+void Stats::end(void) {
+	// initialize result:
+	for ( unsigned i = 0; i < TOT_RESULTS; i++ ) {
+		result[i] = 0.0;
+	}
+	percentileResult.assign(percentiles.size(), 0.0);
+
+	if ( num_values == 0 )
+		return;
+
+	result[NULLS] = total - num_values;
+	result[SUM] = sum;
+	result[MIN] = min;
+	result[MAX] = max;
+	result[AVG] = sum / num_values;
+
+	// standard deviation defined as sqrt of the sample variance.
+	if ( (include[VAR] || include[STDEV]) && num_values > 1 ) {
+		result[VAR] = m2 / (num_values - 1);
+		result[STDEV] = sqrt(result[VAR]);
+	}
+
+	if ( include[MODE] ) {
+		if ( integer ) {
+			// first value with the highest count:
+			int best_value = (int) min;
+			unsigned best_count = 0;
+			if ( sparse ) {
+				for ( map<int,unsigned>::iterator it = sparseCounts.begin(); it != sparseCounts.end(); it++ ) {
+					if ( best_count < it->second ) {
+						best_value = it->first;
+						best_count = it->second;
+					}
+				}
+			}
+			else {
+				for ( long v = (long) min; v <= (long) max; v++ ) {
+					if ( best_count < hist[v - histBase] ) {
+						best_value = (int) v;
+						best_count = hist[v - histBase];
+					}
+				}
+			}
+			result[MODE] = best_value;
+		}
+		else {
+			string best_str;
+			unsigned best_count = 0;
+			for ( map<string, unsigned>::iterator it = modeCounts.begin(); it != modeCounts.end(); it++ ) {
+				if ( it == modeCounts.begin()  ||  best_count < it->second ) {
+					best_str = it->first;
+					best_count = it->second;
+				}
+			}
+			result[MODE] = atof(best_str.c_str());
+		}
+	}
+
+	if ( needOrder && !integer && digest.getCount() == 0 )
+		sort(exactValues.begin(), exactValues.end());
+
+	if ( include[MEDIAN] ) {
+		// middle value, or average of the two middle values:
+		const unsigned long pos1 = (num_values - 1) / 2;
+		const unsigned long pos2 = num_values / 2;
+		if ( integer ) {
+			if ( pos1 == pos2 )
+				result[MEDIAN] = histogramValueAt(pos1);
+			else
+				result[MEDIAN] = ((double) histogramValueAt(pos1) + histogramValueAt(pos2)) / 2.0;
+		}
+		else if ( digest.getCount() == 0 ) {
+			if ( pos1 == pos2 )
+				result[MEDIAN] = exactValues[pos1];
+			else
+				result[MEDIAN] = (exactValues[pos1] + exactValues[pos2]) / 2.0;
+		}
+		else {
+			result[MEDIAN] = digest.quantile(0.5);
+		}
+	}
+
+	for ( unsigned k = 0; k < percentiles.size(); k++ ) {
+		percentileResult[k] = quantile(percentiles[k] / 100);
+	}
+}
+
@@ -7,8 +7,13 @@
 #ifndef Stats_h
 #define Stats_h
 
+#include "TDigest.h"
+#include "StatsKernels.h"
+
 #include <vector>
 #include <map>
+#include <set>
+#include <string>
 #include <algorithm>
 
 using namespace std;
@@ -33,8 +38,37 @@ enum {
 };
 
 
+/** max span of integer values counted in a dense histogram */
+#define STATS_MAX_DENSE_SPAN  (1 << 20)
+
+/** real values kept for an exact median before switching to a t-digest */
+#define STATS_MAX_EXACT_VALUES  4096
+
+/** distinct real values counted for MODE before keeping only the most frequent */
+#define STATS_MAX_MODE_VALUES  4096
+
+
 /**
-  * Basic statistics calculator
+  * Basic statistics calculator.
+  *
+  * Values can be given all at once (compute) or one at a time (begin, add,
+  * end). In the latter case, values are not kept: sum, min, max and
+  * the variance (Welford) are updated as values come in; for integer values,
+  * MODE and MEDIAN are obtained from a histogram (dense over the range of
+  * values seen unless it spans more than STATS_MAX_DENSE_SPAN values); for
+  * real values, MEDIAN is exact up to STATS_MAX_EXACT_VALUES values and
+  * estimated with a t-digest beyond that, and MODE is obtained from a count
+  * of the values rounded to 3 decimals (as in compute). This count is exact
+  * up to STATS_MAX_MODE_VALUES distinct rounded values; beyond that, only
+  * that many counters are kept (Space-Saving: a new value replaces the one
+  * with the least count), so MODE is still exact if its count is more than
+  * 1/STATS_MAX_MODE_VALUES of the values, and approximate otherwise.
+  * Arrays of values can also be added at once, in which case sum, min, max
+  * and the variance are obtained with StatsKernels.
+  *
+  * Besides the stats in result[], any percentiles can be requested (see
+  * percentiles). Stats can be selected by name (see select), and only the
+  * accumulators needed by the selected stats are updated.
   */
 class Stats {
 public:
@@ -46,11 +80,28 @@ public:
 	  */
 	double result[TOT_RESULTS];
 
+	/**
+	  * Desired percentiles (each in [0, 100]). After calling compute() or
+	  * end(), percentileResult[k] will contain the percentiles[k]-th
+	  * percentile, with linear interpolation between the closest ranks
+	  * (so, the 50th percentile is the median).
+	  */
+	vector<double> percentiles;
+	vector<double> percentileResult;
+
 	/** creates a stats object. All stats will be calculated by default */
 	Stats() {
 		for ( int i = 0; i < TOT_RESULTS; i++ ) {
 			include[i] = true;
 		}
+		hasNodata = true;
+		needVariance = needOrder = needHistogram = true;
+		integer = false;
+		num_values = 0;
+		histBase = 0;
+		histUsed = false;
+		sparse = false;
+		modeSaturated = false;
 	}
 	
 	/**
@@ -69,6 +120,168 @@ public:
 	  */
 	static void computeCounts(vector<int>& values, map<int,int>& count); 
 	
+	/** sets include[s] = false for all s, and clears percentiles */
+	void excludeAll(void);
+
+	/**
+	  * Selects a statistic by name: avg, mode, stdev, min, max, sum,
+	  * median, nulls, or pNN for the NN-th percentile (eg., p5, p97.5).
+	  * @return a key for getResult, or -1 if the name is not recognized.
+	  */
+	int select(const char* name);
+
+	/** result for a key returned by select() */
+	double getResult(int key) {
+		return key < TOT_RESULTS ? result[key] : percentileResult[key - TOT_RESULTS];
+	}
+
+	/** is the result for a key returned by select() a count? */
+	static bool isCount(int key) {
+		return key == NULLS;
+	}
+	
+	/**
+	  * Prepares for adding integer values with add(int).
+	  * @param nodata Values equal to this are only counted as NULLS.
+	  * @param lo,hi Expected range of values (eg., according to data type);
+	  *        the dense histogram is initially allocated for this range
+	  *        if not bigger than STATS_MAX_DENSE_SPAN.
+	  */
+	void begin(int nodata, int lo = 0, int hi = -1);
+
+	/**
+	  * Prepares for adding real values with add(double).
+	  * @param nodata Values equal to this are only counted as NULLS.
+	  */
+	void begin(double nodata);
+
+	/** Called after begin() if no value is to be taken as nodata. */
+	void disableNodata(void) {
+		hasNodata = false;
+	}
+
+	/** adds an integer value */
+	inline void add(int value) {
+		total++;
+		if ( value == inodata && hasNodata )
+			return;
+		accumulate(value);
+		if ( needHistogram )
+			addToHistogram(value);
+	}
+
+	/** adds a real value */
+	inline void add(double value) {
+		total++;
+		if ( value == dnodata && hasNodata )
+			return;
+		accumulate(value);
+		keep(value);
+	}
+
+	/**
+	  * Adds n values at once, with the same results as calling add() for
+	  * each of them. 8 and 16-bit values are reduced with StatsKernels.
+	  * The first four can be used for integer and real values; the others,
+	  * only for real values (note that int conversion of unsigned int
+	  * values would be needed otherwise).
+	  */
+	void add(const unsigned char* values, unsigned n);
+	void add(const unsigned short* values, unsigned n);
+	void add(const short* values, unsigned n);
+	void add(const int* values, unsigned n);
+	void add(const unsigned int* values, unsigned n);
+	void add(const float* values, unsigned n);
+	void add(const double* values, unsigned n);
+
+	/**
+	  * computes those stats s where include[s] == true from the values
+	  * added since begin(). Results are as with compute().
+	  */
+	void end(void);
+
+private:
+	// state of streaming computation:
+	bool hasNodata;
+	bool needVariance, needOrder, needHistogram;
+	bool integer;
+	int inodata;
+	double dnodata;
+	unsigned long total;
+	unsigned long num_values;
+	double sum, min, max;
+	double mean, m2;    // Welford
+
+	// integer values: count of value v in hist[v - histBase] (non-zero
+	// only in [min, max]), or in sparseCounts if sparse.
+	vector<unsigned> hist;
+	int histBase;
+	bool histUsed;
+	bool sparse;
+	map<int,unsigned> sparseCounts;
+
+	// real values:
+	vector<double> exactValues;
+	TDigest digest;
+	map<string,unsigned> modeCounts;
+
+	// (count, value) of modeCounts, once it has STATS_MAX_MODE_VALUES values
+	set<pair<unsigned,string> > modeByCount;
+	bool modeSaturated;
+
+	inline void accumulate(double value) {
+		num_values++;
+		sum += value;
+		if ( num_values == 1 ) {
+			min = max = value;
+		}
+		else {
+			if ( min > value )
+				min = value;
+			if ( max < value )
+				max = value;
+		}
+		if ( needVariance ) {
+			double delta = value - mean;
+			mean += delta / num_values;
+			m2 += delta * (value - mean);
+		}
+	}
+
+	/** value already accumulated */
+	inline void addToHistogram(int value) {
+		histUsed = true;
+		if ( !sparse ) {
+			unsigned long offset = (unsigned long) ((long) value - histBase);
+			if ( offset < hist.size() ) {
+				hist[offset]++;
+				return;
+			}
+			growHistogram(value);
+		}
+		if ( sparse )
+			sparseCounts[value]++;
+		else
+			hist[value - histBase]++;
+	}
+
+	/** keeps a real value for MEDIAN, percentiles and MODE, if included */
+	void keep(double value);
+
+	/** counts a rounded real value for MODE */
+	void countMode(const string& value);
+
+	/** merges the moments of a group of n values into the state */
+	void merge(unsigned long n, double nsum, double nmean, double nm2, double nmin, double nmax);
+
+	template <typename T> void addSmallInts(const T* values, unsigned n);
+	template <typename T> void addValues(const T* values, unsigned n);
+	template <typename T> void addToHistogram(const T* values, unsigned n, bool excludeNodata, T nodata);
+
+	void reset(void);
+	void growHistogram(int value);
+	double quantile(double q);
+	int histogramValueAt(unsigned long index);
 };
 
 
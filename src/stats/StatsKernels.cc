@@ -0,0 +1,524 @@
+//
+//	StatsKernels - reductions over arrays of band values
+//	$Id$
+//	See StatsKernels.h for public doc.
+//
+
+#include "StatsKernels.h"
+
+#include <limits>
+
+using namespace std;
+
+
+// SSE2/AVX2 implementations are compiled with function target attributes,
+// so no special compiler flags are needed:
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define STATS_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+
+// instruction set in use; -1 if not determined yet
+static int currentIsa = -1;
+
+
+StatsKernels::Isa StatsKernels::getBestIsa(void) {
+#ifdef STATS_KERNELS_X86
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") )
+		return AVX2;
+	if ( __builtin_cpu_supports("sse2") )
+		return SSE2;
+#endif
+	return SCALAR;
+}
+
+StatsKernels::Isa StatsKernels::getIsa(void) {
+	if ( currentIsa < 0 )
+		currentIsa = getBestIsa();
+	return (Isa) currentIsa;
+}
+
+bool StatsKernels::setIsa(Isa isa) {
+	if ( isa > getBestIsa() )
+		return false;
+	currentIsa = isa;
+	return true;
+}
+
+const char* StatsKernels::getIsaName(Isa isa) {
+	switch ( isa ) {
+		case AVX2: return "avx2";
+		case SSE2: return "sse2";
+		default:   return "scalar";
+	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// scalar implementation
+
+// initial values for min and max, so NaNs are ignored as in the SIMD versions:
+template <typename T> static inline T highest(void) {
+	return numeric_limits<T>::has_infinity ? numeric_limits<T>::infinity() : numeric_limits<T>::max();
+}
+template <typename T> static inline T lowest(void) {
+	return numeric_limits<T>::has_infinity ? -numeric_limits<T>::infinity() : numeric_limits<T>::min();
+}
+
+template <typename T>
+static void reduce_scalar(const T* values, unsigned n, bool hasNodata, T nodata, Reduction<long long>& r) {
+	unsigned long count = 0, nulls = 0;
+	long long sum = 0, sumsq = 0;
+	T min = highest<T>(), max = lowest<T>();
+	for ( unsigned i = 0; i < n; i++ ) {
+		const T v = values[i];
+		if ( hasNodata && v == nodata ) {
+			nulls++;
+			continue;
+		}
+		count++;
+		if ( v < min )
+			min = v;
+		if ( v > max )
+			max = v;
+		sum += v;
+		sumsq += (long long) v * v;
+	}
+	r.count = count;
+	r.nulls = nulls;
+	r.sum = sum;
+	r.sumsq = sumsq;
+	r.min = min;
+	r.max = max;
+}
+
+template <typename T>
+static void reduce_scalar(const T* values, unsigned n, bool hasNodata, T nodata, double shift, Reduction<double>& r) {
+	unsigned long count = 0, nulls = 0;
+	double sum = 0, sumsq = 0;
+	T min = highest<T>(), max = lowest<T>();
+	for ( unsigned i = 0; i < n; i++ ) {
+		const T v = values[i];
+		if ( hasNodata && v == nodata ) {
+			nulls++;
+			continue;
+		}
+		count++;
+		if ( v < min )
+			min = v;
+		if ( v > max )
+			max = v;
+		const double d = (double) v - shift;
+		sum += d;
+		sumsq += d * d;
+	}
+	r.count = count;
+	r.nulls = nulls;
+	r.sum = sum;
+	r.sumsq = sumsq;
+	r.min = min;
+	r.max = max;
+}
+
+// adds b to a
+template <typename A>
+static void merge(Reduction<A>& a, const Reduction<A>& b) {
+	if ( b.count > 0 ) {
+		if ( a.count == 0 || a.min > b.min )
+			a.min = b.min;
+		if ( a.count == 0 || a.max < b.max )
+			a.max = b.max;
+		a.count += b.count;
+		a.sum += b.sum;
+		a.sumsq += b.sumsq;
+	}
+	a.nulls += b.nulls;
+}
+
+
+#ifdef STATS_KERNELS_X86
+/////////////////////////////////////////////////////////////////////////////
+// 8 and 16-bit values: processed in 16-bit signed lanes.
+// unsigned short values are biased by -BIAS to fit in the lanes.
+
+template <typename T> struct Lanes16;
+
+template <> struct Lanes16<unsigned char> {
+	static const int BIAS = 0;
+	static inline short toLane(unsigned char v) { return v; }
+
+	__attribute__((target("sse2")))
+	static inline __m128i load8(const unsigned char* p) {
+		return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) p), _mm_setzero_si128());
+	}
+	__attribute__((target("avx2")))
+	static inline __m256i load16(const unsigned char* p) {
+		return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) p));
+	}
+};
+
+template <> struct Lanes16<short> {
+	static const int BIAS = 0;
+	static inline short toLane(short v) { return v; }
+
+	__attribute__((target("sse2")))
+	static inline __m128i load8(const short* p) {
+		return _mm_loadu_si128((const __m128i*) p);
+	}
+	__attribute__((target("avx2")))
+	static inline __m256i load16(const short* p) {
+		return _mm256_loadu_si256((const __m256i*) p);
+	}
+};
+
+template <> struct Lanes16<unsigned short> {
+	static const int BIAS = 32768;
+	static inline short toLane(unsigned short v) { return (short) (v ^ 0x8000); }
+
+	__attribute__((target("sse2")))
+	static inline __m128i load8(const unsigned short* p) {
+		return _mm_xor_si128(_mm_loadu_si128((const __m128i*) p), _mm_set1_epi16((short) 0x8000));
+	}
+	__attribute__((target("avx2")))
+	static inline __m256i load16(const unsigned short* p) {
+		return _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) p), _mm256_set1_epi16((short) 0x8000));
+	}
+};
+
+// max number of iterations before 32-bit lane sums (each iteration adds
+// at most 2 * 32768 per lane) are added up:
+#define MAX_RUN16  (1 << 14)
+
+//
+// Sets r from the results over the first done values, in lane units,
+// and adds the remaining values with the scalar implementation.
+//
+template <typename T>
+static void finish16(const T* values, unsigned n, unsigned done, bool hasNodata, T nodata,
+	unsigned long nulls, long long laneSum, long long laneSumsq, int laneMin, int laneMax,
+	Reduction<long long>& r
+) {
+	const long long B = Lanes16<T>::BIAS;
+	const unsigned long count = done - nulls;
+	r.count = count;
+	r.nulls = nulls;
+	r.sum = laneSum + B * count;
+	r.sumsq = laneSumsq + 2 * B * laneSum + B * B * count;
+	r.min = laneMin + B;
+	r.max = laneMax + B;
+	if ( done < n ) {
+		Reduction<long long> tail;
+		reduce_scalar(values + done, n - done, hasNodata, nodata, tail);
+		merge(r, tail);
+	}
+}
+
+template <typename T>
+__attribute__((target("sse2")))
+static void reduce16_sse2(const T* values, unsigned n, bool hasNodata, T nodata, Reduction<long long>& r) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i nd = _mm_set1_epi16(Lanes16<T>::toLane(nodata));
+	const __m128i ndMask = hasNodata ? _mm_set1_epi16(-1) : zero;
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i laneMax = _mm_set1_epi16(32767);
+	const __m128i laneMin = _mm_set1_epi16(-32768);
+
+	__m128i vmin = laneMax;
+	__m128i vmax = laneMin;
+	__m128i vsumsq = zero;
+	long long sum = 0;
+	unsigned long nulls = 0;
+	unsigned i = 0;
+	while ( i + 8 <= n ) {
+		__m128i vsum = zero;
+		for ( unsigned k = 0; k < MAX_RUN16 && i + 8 <= n; k++, i += 8 ) {
+			__m128i x = Lanes16<T>::load8(values + i);
+			__m128i isnd = _mm_and_si128(_mm_cmpeq_epi16(x, nd), ndMask);
+			nulls += __builtin_popcount(_mm_movemask_epi8(isnd)) >> 1;
+
+			// nodata lanes: 0 for the sums, laneMax/laneMin for min/max
+			x = _mm_andnot_si128(isnd, x);
+			vmin = _mm_min_epi16(vmin, _mm_or_si128(x, _mm_and_si128(isnd, laneMax)));
+			vmax = _mm_max_epi16(vmax, _mm_or_si128(x, _mm_and_si128(isnd, laneMin)));
+
+			vsum = _mm_add_epi32(vsum, _mm_madd_epi16(x, ones));
+			// (pairs of squares are up to 2^31: taken as unsigned)
+			__m128i sq = _mm_madd_epi16(x, x);
+			vsumsq = _mm_add_epi64(vsumsq, _mm_unpacklo_epi32(sq, zero));
+			vsumsq = _mm_add_epi64(vsumsq, _mm_unpackhi_epi32(sq, zero));
+		}
+		int s[4];
+		_mm_storeu_si128((__m128i*) s, vsum);
+		sum += (long long) s[0] + s[1] + s[2] + s[3];
+	}
+
+	short mins[8], maxs[8];
+	long long sumsqs[2];
+	_mm_storeu_si128((__m128i*) mins, vmin);
+	_mm_storeu_si128((__m128i*) maxs, vmax);
+	_mm_storeu_si128((__m128i*) sumsqs, vsumsq);
+	int min = mins[0], max = maxs[0];
+	for ( int k = 1; k < 8; k++ ) {
+		if ( min > mins[k] )
+			min = mins[k];
+		if ( max < maxs[k] )
+			max = maxs[k];
+	}
+	finish16(values, n, i, hasNodata, nodata, nulls, sum, sumsqs[0] + sumsqs[1], min, max, r);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void reduce16_avx2(const T* values, unsigned n, bool hasNodata, T nodata, Reduction<long long>& r) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i nd = _mm256_set1_epi16(Lanes16<T>::toLane(nodata));
+	const __m256i ndMask = hasNodata ? _mm256_set1_epi16(-1) : zero;
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i laneMax = _mm256_set1_epi16(32767);
+	const __m256i laneMin = _mm256_set1_epi16(-32768);
+
+	__m256i vmin = laneMax;
+	__m256i vmax = laneMin;
+	__m256i vsumsq = zero;
+	long long sum = 0;
+	unsigned long nulls = 0;
+	unsigned i = 0;
+	while ( i + 16 <= n ) {
+		__m256i vsum = zero;
+		for ( unsigned k = 0; k < MAX_RUN16 && i + 16 <= n; k++, i += 16 ) {
+			__m256i x = Lanes16<T>::load16(values + i);
+			__m256i isnd = _mm256_and_si256(_mm256_cmpeq_epi16(x, nd), ndMask);
+			nulls += __builtin_popcount(_mm256_movemask_epi8(isnd)) >> 1;
+
+			// nodata lanes: 0 for the sums, laneMax/laneMin for min/max
+			x = _mm256_andnot_si256(isnd, x);
+			vmin = _mm256_min_epi16(vmin, _mm256_or_si256(x, _mm256_and_si256(isnd, laneMax)));
+			vmax = _mm256_max_epi16(vmax, _mm256_or_si256(x, _mm256_and_si256(isnd, laneMin)));
+
+			vsum = _mm256_add_epi32(vsum, _mm256_madd_epi16(x, ones));
+			// (pairs of squares are up to 2^31: taken as unsigned)
+			__m256i sq = _mm256_madd_epi16(x, x);
+			vsumsq = _mm256_add_epi64(vsumsq, _mm256_unpacklo_epi32(sq, zero));
+			vsumsq = _mm256_add_epi64(vsumsq, _mm256_unpackhi_epi32(sq, zero));
+		}
+		int s[8];
+		_mm256_storeu_si256((__m256i*) s, vsum);
+		for ( int k = 0; k < 8; k++ )
+			sum += s[k];
+	}
+
+	short mins[16], maxs[16];
+	long long sumsqs[4];
+	_mm256_storeu_si256((__m256i*) mins, vmin);
+	_mm256_storeu_si256((__m256i*) maxs, vmax);
+	_mm256_storeu_si256((__m256i*) sumsqs, vsumsq);
+	int min = mins[0], max = maxs[0];
+	for ( int k = 1; k < 16; k++ ) {
+		if ( min > mins[k] )
+			min = mins[k];
+		if ( max < maxs[k] )
+			max = maxs[k];
+	}
+	finish16(values, n, i, hasNodata, nodata, nulls, sum,
+		sumsqs[0] + sumsqs[1] + sumsqs[2] + sumsqs[3], min, max, r
+	);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// float values: min/max in float lanes, sums in double lanes.
+// Note that the first operand of min/max is the new value, so NaNs are
+// ignored (the second operand is returned if either is NaN).
+
+//
+// Sets r from the results over the first done values, and adds the
+// remaining values with the scalar implementation.
+//
+static void finish_float(const float* values, unsigned n, unsigned done, bool hasNodata, float nodata,
+	double shift, unsigned long nulls, double sum, double sumsq, float min, float max,
+	Reduction<double>& r
+) {
+	r.count = done - nulls;
+	r.nulls = nulls;
+	r.sum = sum;
+	r.sumsq = sumsq;
+	r.min = min;
+	r.max = max;
+	if ( done < n ) {
+		Reduction<double> tail;
+		reduce_scalar(values + done, n - done, hasNodata, nodata, shift, tail);
+		merge(r, tail);
+	}
+}
+
+__attribute__((target("sse2")))
+static void reduce_float_sse2(const float* values, unsigned n, bool hasNodata, float nodata, double shift, Reduction<double>& r) {
+	const __m128 nd = _mm_set1_ps(nodata);
+	const __m128 ndMask = hasNodata ? _mm_castsi128_ps(_mm_set1_epi32(-1)) : _mm_setzero_ps();
+	const __m128 inf = _mm_set1_ps(numeric_limits<float>::infinity());
+	const __m128 ninf = _mm_set1_ps(-numeric_limits<float>::infinity());
+	const __m128d vshift = _mm_set1_pd(shift);
+
+	__m128 vmin = inf;
+	__m128 vmax = ninf;
+	__m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+	__m128d sq0 = _mm_setzero_pd(), sq1 = _mm_setzero_pd();
+	unsigned long nulls = 0;
+	unsigned i = 0;
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128 x = _mm_loadu_ps(values + i);
+		__m128 isnd = _mm_and_ps(_mm_cmpeq_ps(x, nd), ndMask);
+		nulls += __builtin_popcount(_mm_movemask_ps(isnd));
+
+		vmin = _mm_min_ps(_mm_or_ps(_mm_and_ps(isnd, inf), _mm_andnot_ps(isnd, x)), vmin);
+		vmax = _mm_max_ps(_mm_or_ps(_mm_and_ps(isnd, ninf), _mm_andnot_ps(isnd, x)), vmax);
+
+		// nodata lanes: 0 for the sums
+		__m128i m = _mm_castps_si128(isnd);
+		__m128d lo = _mm_sub_pd(_mm_cvtps_pd(x), vshift);
+		__m128d hi = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), vshift);
+		lo = _mm_andnot_pd(_mm_castsi128_pd(_mm_unpacklo_epi32(m, m)), lo);
+		hi = _mm_andnot_pd(_mm_castsi128_pd(_mm_unpackhi_epi32(m, m)), hi);
+		sum0 = _mm_add_pd(sum0, lo);
+		sum1 = _mm_add_pd(sum1, hi);
+		sq0 = _mm_add_pd(sq0, _mm_mul_pd(lo, lo));
+		sq1 = _mm_add_pd(sq1, _mm_mul_pd(hi, hi));
+	}
+
+	float mins[4], maxs[4];
+	double sums[2], sqs[2];
+	_mm_storeu_ps(mins, vmin);
+	_mm_storeu_ps(maxs, vmax);
+	_mm_storeu_pd(sums, _mm_add_pd(sum0, sum1));
+	_mm_storeu_pd(sqs, _mm_add_pd(sq0, sq1));
+	float min = mins[0], max = maxs[0];
+	for ( int k = 1; k < 4; k++ ) {
+		if ( min > mins[k] )
+			min = mins[k];
+		if ( max < maxs[k] )
+			max = maxs[k];
+	}
+	finish_float(values, n, i, hasNodata, nodata, shift, nulls,
+		sums[0] + sums[1], sqs[0] + sqs[1], min, max, r
+	);
+}
+
+__attribute__((target("avx2")))
+static void reduce_float_avx2(const float* values, unsigned n, bool hasNodata, float nodata, double shift, Reduction<double>& r) {
+	const __m256 nd = _mm256_set1_ps(nodata);
+	const __m256 ndMask = hasNodata ? _mm256_castsi256_ps(_mm256_set1_epi32(-1)) : _mm256_setzero_ps();
+	const __m256 inf = _mm256_set1_ps(numeric_limits<float>::infinity());
+	const __m256 ninf = _mm256_set1_ps(-numeric_limits<float>::infinity());
+	const __m256d vshift = _mm256_set1_pd(shift);
+
+	__m256 vmin = inf;
+	__m256 vmax = ninf;
+	__m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+	__m256d sq0 = _mm256_setzero_pd(), sq1 = _mm256_setzero_pd();
+	unsigned long nulls = 0;
+	unsigned i = 0;
+	for ( ; i + 8 <= n; i += 8 ) {
+		__m256 x = _mm256_loadu_ps(values + i);
+		__m256 isnd = _mm256_and_ps(_mm256_cmp_ps(x, nd, _CMP_EQ_OQ), ndMask);
+		nulls += __builtin_popcount(_mm256_movemask_ps(isnd));
+
+		vmin = _mm256_min_ps(_mm256_blendv_ps(x, inf, isnd), vmin);
+		vmax = _mm256_max_ps(_mm256_blendv_ps(x, ninf, isnd), vmax);
+
+		// nodata lanes: 0 for the sums
+		__m256i m = _mm256_castps_si256(isnd);
+		__m256d lo = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), vshift);
+		__m256d hi = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), vshift);
+		lo = _mm256_andnot_pd(_mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(m))), lo);
+		hi = _mm256_andnot_pd(_mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(m, 1))), hi);
+		sum0 = _mm256_add_pd(sum0, lo);
+		sum1 = _mm256_add_pd(sum1, hi);
+		sq0 = _mm256_add_pd(sq0, _mm256_mul_pd(lo, lo));
+		sq1 = _mm256_add_pd(sq1, _mm256_mul_pd(hi, hi));
+	}
+
+	float mins[8], maxs[8];
+	double sums[4], sqs[4];
+	_mm256_storeu_ps(mins, vmin);
+	_mm256_storeu_ps(maxs, vmax);
+	_mm256_storeu_pd(sums, _mm256_add_pd(sum0, sum1));
+	_mm256_storeu_pd(sqs, _mm256_add_pd(sq0, sq1));
+	float min = mins[0], max = maxs[0];
+	for ( int k = 1; k < 8; k++ ) {
+		if ( min > mins[k] )
+			min = mins[k];
+		if ( max < maxs[k] )
+			max = maxs[k];
+	}
+	finish_float(values, n, i, hasNodata, nodata, shift, nulls,
+		(sums[0] + sums[1]) + (sums[2] + sums[3]), (sqs[0] + sqs[1]) + (sqs[2] + sqs[3]),
+		min, max, r
+	);
+}
+
+#endif  // STATS_KERNELS_X86
+
+
+/////////////////////////////////////////////////////////////////////////////
+// dispatch
+
+template <typename T>
+static inline void reduce16(const T* values, unsigned n, bool hasNodata, T nodata, Reduction<long long>& r) {
+#ifdef STATS_KERNELS_X86
+	switch ( StatsKernels::getIsa() ) {
+		case StatsKernels::AVX2:
+			reduce16_avx2(values, n, hasNodata, nodata, r);
+			return;
+		case StatsKernels::SSE2:
+			reduce16_sse2(values, n, hasNodata, nodata, r);
+			return;
+		default:
+			break;
+	}
+#endif
+	reduce_scalar(values, n, hasNodata, nodata, r);
+}
+
+void StatsKernels::reduce(const unsigned char* values, unsigned n, bool hasNodata, unsigned char nodata, Reduction<long long>& r) {
+	reduce16(values, n, hasNodata, nodata, r);
+}
+
+void StatsKernels::reduce(const unsigned short* values, unsigned n, bool hasNodata, unsigned short nodata, Reduction<long long>& r) {
+	reduce16(values, n, hasNodata, nodata, r);
+}
+
+void StatsKernels::reduce(const short* values, unsigned n, bool hasNodata, short nodata, Reduction<long long>& r) {
+	reduce16(values, n, hasNodata, nodata, r);
+}
+
+void StatsKernels::reduce(const int* values, unsigned n, bool hasNodata, int nodata, double shift, Reduction<double>& r) {
+	reduce_scalar(values, n, hasNodata, nodata, shift, r);
+}
+
+void StatsKernels::reduce(const unsigned int* values, unsigned n, bool hasNodata, unsigned int nodata, double shift, Reduction<double>& r) {
+	reduce_scalar(values, n, hasNodata, nodata, shift, r);
+}
+
+void StatsKernels::reduce(const float* values, unsigned n, bool hasNodata, float nodata, double shift, Reduction<double>& r) {
+#ifdef STATS_KERNELS_X86
+	switch ( getIsa() ) {
+		case AVX2:
+			reduce_float_avx2(values, n, hasNodata, nodata, shift, r);
+			return;
+		case SSE2:
+			reduce_float_sse2(values, n, hasNodata, nodata, shift, r);
+			return;
+		default:
+			break;
+	}
+#endif
+	reduce_scalar(values, n, hasNodata, nodata, shift, r);
+}
+
+void StatsKernels::reduce(const double* values, unsigned n, bool hasNodata, double nodata, double shift, Reduction<double>& r) {
+	reduce_scalar(values, n, hasNodata, nodata, shift, r);
+}
+
@@ -0,0 +1,84 @@
+//
+// StatsKernels - reductions over arrays of band values
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef StatsKernels_h
+#define StatsKernels_h
+
+
+/**
+  * Result of reducing an array of values.
+  * A is the type used for the sums (long long for 8 and 16-bit values,
+  * whose sums are exact; double otherwise).
+  */
+template <typename A>
+struct Reduction {
+	/** number of values not equal to nodata */
+	unsigned long count;
+
+	/** number of values equal to nodata */
+	unsigned long nulls;
+
+	/** sum of (value - shift) and of (value - shift)^2 over the count values */
+	A sum, sumsq;
+
+	/** min and max over the count values (undefined if count == 0) */
+	double min, max;
+};
+
+
+/**
+  * Reduction kernels for the stats of a band: count, nulls, sum,
+  * sum of squares, min and max in one pass over an array of values in
+  * their native type.
+  *
+  * Besides a scalar implementation, there are SSE2 and AVX2 implementations
+  * for unsigned char, short, unsigned short and float (on x86 with GCC),
+  * with the best one supported by the CPU selected at runtime.
+  * The instruction set is chosen once per call, not in the inner loop.
+  * Results are the same with all instruction sets, except for the rounding
+  * of the float sums, which are accumulated in a different order (for
+  * this reason, Stats only uses the kernels for 8 and 16-bit values).
+  */
+class StatsKernels {
+public:
+	enum Isa { SCALAR, SSE2, AVX2 };
+
+	/** best instruction set supported by this build and CPU */
+	static Isa getBestIsa(void);
+
+	/** instruction set in use (getBestIsa() by default) */
+	static Isa getIsa(void);
+
+	/**
+	  * Sets the instruction set to use.
+	  * @return false (and nothing is changed) if not supported.
+	  */
+	static bool setIsa(Isa isa);
+
+	/** name of an instruction set */
+	static const char* getIsaName(Isa isa);
+
+	/**
+	  * Reduces the n values, excluding those equal to nodata if hasNodata.
+	  * For 8 and 16-bit values, sums are exact and no shift is applied.
+	  */
+	static void reduce(const unsigned char* values, unsigned n, bool hasNodata, unsigned char nodata, Reduction<long long>& r);
+	static void reduce(const unsigned short* values, unsigned n, bool hasNodata, unsigned short nodata, Reduction<long long>& r);
+	static void reduce(const short* values, unsigned n, bool hasNodata, short nodata, Reduction<long long>& r);
+
+	/**
+	  * Reduces the n values, excluding those equal to nodata if hasNodata.
+	  * Sums are of (value - shift); a shift close to the mean of the values
+	  * avoids cancellation when the variance is computed from them.
+	  */
+	static void reduce(const int* values, unsigned n, bool hasNodata, int nodata, double shift, Reduction<double>& r);
+	static void reduce(const unsigned int* values, unsigned n, bool hasNodata, unsigned int nodata, double shift, Reduction<double>& r);
+	static void reduce(const float* values, unsigned n, bool hasNodata, float nodata, double shift, Reduction<double>& r);
+	static void reduce(const double* values, unsigned n, bool hasNodata, double nodata, double shift, Reduction<double>& r);
+};
+
+
+#endif
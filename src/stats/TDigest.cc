@@ -0,0 +1,134 @@
+//
+//	TDigest - approximate quantiles with bounded memory
+//	$Id$
+//	See TDigest.h for public doc.
+//
+
+#include "TDigest.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+static const double PI = 3.14159265358979323846;
+
+
+TDigest::TDigest(double compression_) : compression(compression_) {
+	if ( compression < 20 )
+		compression = 20;
+	bufferCapacity = (unsigned) (5 * compression);
+	buffer.reserve(bufferCapacity);
+	centroids.reserve((unsigned) (2 * compression));
+	clear();
+}
+
+
+void TDigest::clear(void) {
+	centroids.clear();
+	buffer.clear();
+	totalWeight = 0;
+	min = max = 0;
+}
+
+
+//
+// With the scale function k(q) = compression/(2 PI) asin(2q - 1), a
+// centroid spans at most 1 in k.
+//
+double TDigest::qLimit(double q) {
+	const double kScale = compression / (2 * PI);
+	double k = kScale * asin(2 * q - 1) + 1;
+	if ( k >= kScale * PI / 2 )
+		return 1.0;
+	return (sin(k / kScale) + 1) / 2;
+}
+
+
+//
+// Merges the buffered values into the centroids, which are rebuilt
+// according to qLimit.
+//
+void TDigest::merge(void) {
+	if ( buffer.size() == 0 )
+		return;
+
+	sort(buffer.begin(), buffer.end());
+	if ( totalWeight == 0 ) {
+		min = buffer[0];
+		max = buffer[buffer.size() - 1];
+	}
+	else {
+		if ( min > buffer[0] )
+			min = buffer[0];
+		if ( max < buffer[buffer.size() - 1] )
+			max = buffer[buffer.size() - 1];
+	}
+
+	// all centroids and new values, sorted by mean:
+	vector<Centroid> all;
+	all.reserve(centroids.size() + buffer.size());
+	for ( unsigned i = 0; i < buffer.size(); i++ ) {
+		Centroid c = { buffer[i], 1 };
+		all.push_back(c);
+	}
+	unsigned middle = all.size();
+	all.insert(all.end(), centroids.begin(), centroids.end());
+	inplace_merge(all.begin(), all.begin() + middle, all.end(), centroidLess);
+
+	const double n = totalWeight + buffer.size();
+
+	centroids.clear();
+	Centroid cur = all[0];
+	double weightSoFar = 0;
+	double limit = qLimit(0);
+	for ( unsigned i = 1; i < all.size(); i++ ) {
+		const Centroid& c = all[i];
+		double q = (weightSoFar + cur.weight + c.weight) / n;
+		if ( q <= limit ) {
+			cur.weight += c.weight;
+			cur.mean += (c.mean - cur.mean) * c.weight / cur.weight;
+		}
+		else {
+			centroids.push_back(cur);
+			weightSoFar += cur.weight;
+			limit = qLimit(weightSoFar / n);
+			cur = c;
+		}
+	}
+	centroids.push_back(cur);
+
+	totalWeight = n;
+	buffer.clear();
+}
+
+
+//
+// Linear interpolation between the centroid means, each located at the
+// middle of its weight, with min at 0 and max at totalWeight.
+//
+double TDigest::quantile(double q) {
+	merge();
+	if ( centroids.size() == 0 )
+		return 0;
+
+	const double index = q * totalWeight;
+	double prevPos = 0;
+	double prevValue = min;
+	double cumulated = 0;
+	for ( unsigned i = 0; i < centroids.size(); i++ ) {
+		const Centroid& c = centroids[i];
+		double pos = cumulated + c.weight / 2;
+		if ( index <= pos ) {
+			if ( pos == prevPos )
+				return c.mean;
+			return prevValue + (c.mean - prevValue) * (index - prevPos) / (pos - prevPos);
+		}
+		prevPos = pos;
+		prevValue = c.mean;
+		cumulated += c.weight;
+	}
+	if ( totalWeight == prevPos )
+		return max;
+	return prevValue + (max - prevValue) * (index - prevPos) / (totalWeight - prevPos);
+}
+
@@ -0,0 +1,77 @@
+//
+// TDigest - approximate quantiles with bounded memory
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef TDigest_h
+#define TDigest_h
+
+#include <vector>
+
+using namespace std;
+
+
+/**
+  * Merging t-digest (Dunning & Ertl): values are summarized in a sorted
+  * list of centroids whose weights are small near the extremes and larger
+  * around the median, so quantile estimates are accurate with a number of
+  * centroids bounded by the compression parameter, regardless of the
+  * number of values added.
+  */
+class TDigest {
+public:
+	/**
+	  * @param compression Max number of centroids is about this value.
+	  */
+	TDigest(double compression = 200);
+
+	/** removes all values */
+	void clear(void);
+
+	/** adds a value */
+	inline void add(double value) {
+		buffer.push_back(value);
+		if ( buffer.size() >= bufferCapacity )
+			merge();
+	}
+
+	/** number of values added */
+	double getCount(void) {
+		return totalWeight + buffer.size();
+	}
+
+	/**
+	  * Estimated value at quantile q (0 <= q <= 1).
+	  * Returns 0 if no values have been added.
+	  */
+	double quantile(double q);
+
+private:
+	struct Centroid {
+		double mean;
+		double weight;
+	};
+
+	double compression;
+	unsigned bufferCapacity;
+
+	vector<Centroid> centroids;
+	double totalWeight;
+	double min, max;
+
+	// values not yet merged:
+	vector<double> buffer;
+
+	void merge(void);
+
+	/** largest quantile that a centroid starting at quantile q can reach */
+	double qLimit(double q);
+
+	static bool centroidLess(const Centroid& a, const Centroid& b) {
+		return a.mean < b.mean;
+	}
+};
+
+
+#endif
@@ -0,0 +1,183 @@
+//
+// STARSpan project
+// CoverageGrid - Exact pixel coverage of polygons
+// Carlos A. Rueda
+// $Id$
+// See coverage.h for public documentation
+//
+
+#include "coverage.h"
+
+#include <algorithm>
+
+// coverage values closer than this to 0 or 1 are snapped
+#define COVERAGE_EPSILON  1e-9
+
+
+CoverageGrid::CoverageGrid() {
+	cols = rows = 0;
+}
+
+void CoverageGrid::reset(int cols_, int rows_) {
+	cols = cols_;
+	rows = rows_;
+	for ( unsigned r = 0; r < cells.size(); r++ ) {
+		cells[r].clear();
+	}
+	cells.resize(rows);
+}
+
+void CoverageGrid::addRing(const double* us, const double* vs, int n, bool hole) {
+	if ( n < 2 )
+		return;
+
+	// orientation: get the signed area as it results from the accumulation
+	// (see addPiece), so exterior rings contribute positive coverage:
+	double ringArea = 0;
+	for ( int i = 1; i < n; i++ ) {
+		ringArea -= (vs[i] - vs[i-1]) * (us[i] + us[i-1]) / 2;
+	}
+	double sign = ringArea >= 0 ? 1.0 : -1.0;
+	if ( hole )
+		sign = -sign;
+
+	for ( int i = 1; i < n; i++ ) {
+		addEdge(us[i-1], vs[i-1], us[i], vs[i], sign);
+	}
+}
+
+//
+// splits the edge by rows
+//
+void CoverageGrid::addEdge(double u1, double v1, double u2, double v2, double dir) {
+	if ( v1 == v2 )
+		return;   // horizontal: no contribution
+
+	if ( v1 > v2 ) {
+		std::swap(u1, u2);
+		std::swap(v1, v2);
+		dir = -dir;
+	}
+
+	int r0 = (int) floor(v1);
+	int r1 = (int) ceil(v2) - 1;
+	if ( r0 < 0 )      r0 = 0;
+	if ( r1 >= rows )  r1 = rows - 1;
+
+	const double dudv = (u2 - u1) / (v2 - v1);
+	for ( int r = r0; r <= r1; r++ ) {
+		double va = v1 > r ? v1 : r;
+		double vb = v2 < r + 1 ? v2 : r + 1;
+		if ( va >= vb )
+			continue;
+		double ua = va == v1 ? u1 : u1 + (va - v1) * dudv;
+		double ub = vb == v2 ? u2 : u1 + (vb - v1) * dudv;
+		addRowSegment(r, ua, va, ub, vb, dir);
+	}
+}
+
+//
+// splits a segment contained in a row by columns
+//
+void CoverageGrid::addRowSegment(int row, double ua, double va, double ub, double vb, double dir) {
+	int ca = colOf(ua);
+	int cb = colOf(ub);
+	if ( ca == cb ) {
+		addPiece(row, ua, va, ub, vb, dir);
+		return;
+	}
+	const double dvdu = (vb - va) / (ub - ua);
+	double pu = ua, pv = va;
+	if ( ca < cb ) {
+		for ( int k = ca + 1; k <= cb; k++ ) {
+			double v = va + (k - ua) * dvdu;
+			addPiece(row, pu, pv, k, v, dir);
+			pu = k;
+			pv = v;
+		}
+	}
+	else {
+		for ( int k = ca; k > cb; k-- ) {
+			double v = va + (k - ua) * dvdu;
+			addPiece(row, pu, pv, k, v, dir);
+			pu = k;
+			pv = v;
+		}
+	}
+	addPiece(row, pu, pv, ub, vb, dir);
+}
+
+//
+// adds the contribution of a piece of edge contained in a single cell
+//
+void CoverageGrid::addPiece(int row, double ua, double va, double ub, double vb, double dir) {
+	double dy = (vb - va) * dir;
+	if ( dy == 0.0 )
+		return;
+	double um = (ua + ub) / 2;
+	Cell cell;
+	cell.col = colOf(um);
+	cell.cover = dy;
+	cell.area = dy * ((cell.col + 1) - um);
+	cells[row].push_back(cell);
+}
+
+//
+// Sweeps each row: pixels crossed by edges get their accumulated area plus
+// the cover from cells to their left; pixels in between just get that cover.
+//
+void CoverageGrid::compute(void) {
+	const size_t stride = cols + 1;
+	cov.assign((size_t) cols * rows, 0.0f);
+	sat.assign(stride * (rows + 1), 0.0);
+	
+	// coverage in current row (the summed area table is computed in
+	// double precision; cov only keeps float values)
+	vector<double> covRow(cols);
+
+	for ( int r = 0; r < rows; r++ ) {
+		vector<Cell>& rowCells = cells[r];
+		std::sort(rowCells.begin(), rowCells.end());
+
+		double cover = 0;
+		int c = 0;     // next column to be assigned
+		unsigned k = 0;
+		while ( k < rowCells.size() ) {
+			const int col = rowCells[k].col;
+
+			// span with no edges:
+			double value = cover;
+			if ( value < COVERAGE_EPSILON )            value = 0.0;
+			else if ( value > 1.0 - COVERAGE_EPSILON ) value = 1.0;
+			for ( ; c < col; c++ )
+				covRow[c] = value;
+
+			// cell crossed by edges:
+			double area = 0, cellCover = 0;
+			for ( ; k < rowCells.size() && rowCells[k].col == col; k++ ) {
+				area += rowCells[k].area;
+				cellCover += rowCells[k].cover;
+			}
+			value = cover + area;
+			if ( value < COVERAGE_EPSILON )            value = 0.0;
+			else if ( value > 1.0 - COVERAGE_EPSILON ) value = 1.0;
+			covRow[c++] = value;
+			cover += cellCover;
+		}
+		// remaining pixels are outside:
+		for ( ; c < cols; c++ )
+			covRow[c] = 0.0;
+
+		// summed area table:
+		const double* prev = &sat[(size_t) r * stride];
+		double* curr = &sat[(size_t) (r + 1) * stride];
+		float* covOut = &cov[(size_t) r * cols];
+		double rowsum = 0;
+		for ( c = 0; c < cols; c++ ) {
+			covOut[c] = (float) covRow[c];
+			rowsum += covRow[c];
+			curr[c + 1] = prev[c + 1] + rowsum;
+		}
+	}
+}
+
@@ -0,0 +1,123 @@
+//
+// STARSpan project
+// CoverageGrid - Exact pixel coverage of polygons
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef coverage_h
+#define coverage_h
+
+#include <vector>
+#include <cmath>
+
+using namespace std;
+
+
+/**
+  * Computes the exact proportion of each pixel in a grid that is covered
+  * by a polygon.
+  *
+  * Coordinates are given in pixel units relative to the grid origin, ie.,
+  * pixel [col,row] spans [col,col+1) x [row,row+1).
+  *
+  * Each ring is walked once (see addRing): every edge is split at pixel
+  * boundaries and its contribution is accumulated in the cells it crosses.
+  * Cells not crossed by any edge are then filled in a sweep along each row
+  * (see compute) with no further geometric work, so interior pixels get 1.0
+  * and exterior pixels 0.0.
+  *
+  * Usage:
+  * <pre>
+  *    CoverageGrid grid;
+  *    grid.reset(cols, rows);
+  *    grid.addRing(us, vs, n, false);   // exterior ring
+  *    grid.addRing(us, vs, n, true);    // holes, if any
+  *    grid.compute();
+  *    ... grid.coverage(col, row) ... grid.area(col, row, cols, rows) ...
+  * </pre>
+  */
+class CoverageGrid {
+public:
+	CoverageGrid();
+
+	/**
+	  * Prepares this grid for a new polygon.
+	  */
+	void reset(int cols, int rows);
+
+	/**
+	  * Adds a closed ring (first point equal to last point).
+	  * Orientation of the ring is not important.
+	  * @param hole true if this is an interior ring.
+	  */
+	void addRing(const double* us, const double* vs, int n, bool hole);
+
+	/**
+	  * Computes the coverage of all pixels from the accumulated rings.
+	  */
+	void compute(void);
+
+	int getCols(void) { return cols; }
+	int getRows(void) { return rows; }
+
+	/**
+	  * Proportion in [0,1] of pixel [col,row] covered by the polygon.
+	  */
+	inline double coverage(int col, int row) {
+		return cov[(size_t) row * cols + col];
+	}
+
+	/**
+	  * Area, in pixel units, of the polygon within the given rectangle of pixels.
+	  */
+	inline double area(int col, int row, int ncols, int nrows) {
+		const size_t stride = cols + 1;
+		const double* top    = &sat[(size_t) row * stride];
+		const double* bottom = &sat[(size_t) (row + nrows) * stride];
+		return bottom[col + ncols] - bottom[col] - top[col + ncols] + top[col];
+	}
+
+	/**
+	  * Number of bytes required for a grid of the given size.
+	  */
+	static double requiredBytes(int cols, int rows) {
+		return (double) cols * rows * (sizeof(float) + sizeof(double));
+	}
+
+private:
+	/** contribution of edges to a cell in a row */
+	struct Cell {
+		int col;
+		double cover;   // signed height of edge pieces in this cell
+		double area;    // signed area between those pieces and the right side of the cell
+
+		bool operator<(const Cell& c) const {
+			return col < c.col;
+		}
+	};
+
+	int cols, rows;
+
+	/** cells crossed by edges, per row */
+	vector< vector<Cell> > cells;
+
+	/** resulting coverage */
+	vector<float> cov;
+
+	/** summed area table of cov, (rows+1) x (cols+1) */
+	vector<double> sat;
+
+	void addEdge(double u1, double v1, double u2, double v2, double dir);
+	void addRowSegment(int row, double ua, double va, double ub, double vb, double dir);
+	void addPiece(int row, double ua, double va, double ub, double vb, double dir);
+
+	inline int colOf(double u) {
+		int c = (int) floor(u);
+		if ( c < 0 )     c = 0;
+		if ( c >= cols ) c = cols - 1;
+		return c;
+	}
+};
+
+#endif
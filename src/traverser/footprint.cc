@@ -0,0 +1,247 @@
+//
+// STARSpan project
+// FootprintCache
+// Carlos A. Rueda
+// $Id$
+// See footprint.h for public documentation
+//
+
+#include "config.h"
+#include "footprint.h"
+
+#include <cstring>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+	#include <sys/mman.h>
+	#define USE_MMAP 1
+#endif
+
+
+void Footprint::clear() {
+	found = false;
+	hasEnvelope = false;
+	col0 = row0 = col1 = row1 = 0;
+	geometryToIntersect.clear();
+	intersection_geometry.clear();
+	runs.clear();
+	memset(&summary, 0, sizeof(summary));
+}
+
+
+void Footprint::addPixel(int col, int row, double x, double y, double coverage, double gx, double gy) {
+	if ( runs.size() > 0 ) {
+		PixelRun& run = runs.back();
+		if ( row == run.row && col == run.col + run.len && coverage == run.coverage
+		&&   x == gx && y == gy ) {
+			run.len++;
+			return;
+		}
+	}
+	PixelRun run;
+	run.col = col;
+	run.row = row;
+	run.len = 1;
+	run.x = x;
+	run.y = y;
+	run.coverage = coverage;
+	runs.push_back(run);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// serialization
+
+// fixed part of a serialized footprint
+struct FootprintHeader {
+	char found;
+	char hasEnvelope;
+	int col0, row0, col1, row1;
+	Traverser::Summary summary;
+	unsigned geometryToIntersectSize;
+	unsigned intersectionGeometrySize;
+	unsigned numRuns;
+};
+
+static void append(vector<char>& out, const void* data, size_t size) {
+	if ( size > 0 ) {
+		const char* ptr = (const char*) data;
+		out.insert(out.end(), ptr, ptr + size);
+	}
+}
+
+static void serialize(const Footprint& fp, vector<char>& out) {
+	FootprintHeader h;
+	memset(&h, 0, sizeof(h));
+	h.found = fp.found;
+	h.hasEnvelope = fp.hasEnvelope;
+	h.col0 = fp.col0;
+	h.row0 = fp.row0;
+	h.col1 = fp.col1;
+	h.row1 = fp.row1;
+	h.summary = fp.summary;
+	h.geometryToIntersectSize = fp.geometryToIntersect.size();
+	h.intersectionGeometrySize = fp.intersection_geometry.size();
+	h.numRuns = fp.runs.size();
+	append(out, &h, sizeof(h));
+	if ( h.geometryToIntersectSize )
+		append(out, &fp.geometryToIntersect[0], h.geometryToIntersectSize);
+	if ( h.intersectionGeometrySize )
+		append(out, &fp.intersection_geometry[0], h.intersectionGeometrySize);
+	if ( h.numRuns )
+		append(out, &fp.runs[0], h.numRuns * sizeof(PixelRun));
+}
+
+static void deserialize(const char* data, Footprint& fp) {
+	FootprintHeader h;
+	memcpy(&h, data, sizeof(h));
+	data += sizeof(h);
+	fp.found = h.found;
+	fp.hasEnvelope = h.hasEnvelope;
+	fp.col0 = h.col0;
+	fp.row0 = h.row0;
+	fp.col1 = h.col1;
+	fp.row1 = h.row1;
+	fp.summary = h.summary;
+	fp.geometryToIntersect.assign(data, data + h.geometryToIntersectSize);
+	data += h.geometryToIntersectSize;
+	fp.intersection_geometry.assign(data, data + h.intersectionGeometrySize);
+	data += h.intersectionGeometrySize;
+	fp.runs.resize(h.numRuns);
+	if ( h.numRuns )
+		memcpy(&fp.runs[0], data, h.numRuns * sizeof(PixelRun));
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// FootprintCache
+
+FootprintCache::FootprintCache(size_t memoryLimit) : memoryLimit(memoryLimit) {
+	spill = 0;
+	spillSize = 0;
+	spillFailed = false;
+	mapped = 0;
+	mappedSize = 0;
+}
+
+
+FootprintCache::~FootprintCache() {
+#ifdef USE_MMAP
+	if ( mapped )
+		munmap(mapped, mappedSize);
+#endif
+	if ( spill )
+		fclose(spill);    // tmpfile: removed on close
+}
+
+
+int FootprintCache::getGridId(const string& signature) {
+	map<string, int>::const_iterator it = grids.find(signature);
+	if ( it != grids.end() )
+		return it->second;
+	int id = grids.size();
+	grids[signature] = id;
+	return id;
+}
+
+
+bool FootprintCache::get(int gridId, long FID, Footprint& fp) {
+	map<pair<int, long>, Entry>::const_iterator it = entries.find(make_pair(gridId, FID));
+	if ( it == entries.end() )
+		return false;
+	const Entry& e = it->second;
+	if ( !e.spilled ) {
+		deserialize(&memory[e.offset], fp);
+		return true;
+	}
+	vector<char> buffer;
+	const char* data = spilledData(e.offset, e.size, buffer);
+	if ( !data )
+		return false;
+	deserialize(data, fp);
+	return true;
+}
+
+
+bool FootprintCache::useFID(long FID) {
+	if ( duplicated.count(FID) )
+		return false;
+	if ( visited.insert(FID).second )
+		return true;
+	duplicated.insert(FID);
+	for ( int gridId = 0; gridId < (int) grids.size(); gridId++ )
+		entries.erase(make_pair(gridId, FID));
+	return false;
+}
+
+
+void FootprintCache::put(int gridId, long FID, const Footprint& fp) {
+	if ( duplicated.count(FID) )
+		return;
+	vector<char> data;
+	serialize(fp, data);
+
+	Entry e;
+	e.size = data.size();
+	if ( memory.size() + data.size() <= memoryLimit ) {
+		e.spilled = false;
+		e.offset = memory.size();
+		memory.insert(memory.end(), data.begin(), data.end());
+	}
+	else {
+		if ( spillFailed ) {
+			return;
+		}
+		if ( !spill ) {
+			spill = tmpfile();
+			if ( !spill ) {
+				cerr<< "FootprintCache: cannot create spill file; footprint not cached\n";
+				return;
+			}
+		}
+		e.spilled = true;
+		e.offset = spillSize;
+		if ( fwrite(&data[0], 1, data.size(), spill) != data.size() ) {
+			// a partial write is left past spillSize, not referenced by any entry:
+			cerr<< "FootprintCache: error writing spill file; no more footprints will be spilled\n";
+			spillFailed = true;
+			return;
+		}
+		spillSize += data.size();
+	}
+	entries[make_pair(gridId, FID)] = e;
+}
+
+
+//
+// gets a spilled footprint: from the memory map, remapping the file if the
+// footprint was written after the current map was created.
+// Without mmap, the footprint is read into the given buffer.
+//
+const char* FootprintCache::spilledData(size_t offset, size_t size, vector<char>& buffer) {
+	fflush(spill);
+#ifdef USE_MMAP
+	if ( offset + size > mappedSize ) {
+		if ( mapped )
+			munmap(mapped, mappedSize);
+		mappedSize = spillSize;
+		mapped = (char*) mmap(0, mappedSize, PROT_READ, MAP_SHARED, fileno(spill), 0);
+		if ( mapped == (char*) MAP_FAILED ) {
+			cerr<< "FootprintCache: cannot map spill file\n";
+			mapped = 0;
+			mappedSize = 0;
+			return 0;
+		}
+	}
+	return mapped + offset;
+#else
+	buffer.resize(size);
+	if ( fseek(spill, offset, SEEK_SET) != 0
+	||   fread(&buffer[0], 1, size, spill) != size ) {
+		cerr<< "FootprintCache: error reading spill file\n";
+		fseek(spill, 0, SEEK_END);
+		return 0;
+	}
+	fseek(spill, 0, SEEK_END);
+	return &buffer[0];
+#endif
+}
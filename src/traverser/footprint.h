@@ -0,0 +1,144 @@
+//
+// STARSpan project
+// FootprintCache - Pixel footprints of features on a raster grid
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef footprint_h
+#define footprint_h
+
+#include "traverser.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+using namespace std;
+
+
+/**
+  * Run of visited pixels in a row, notified one after the other, with the
+  * same coverage. The (x,y) location is given for the first pixel; for the
+  * others it is the grid location of the pixel (see Traverser::toGridXY).
+  */
+struct PixelRun {
+	int col, row;
+	int len;
+	double x, y;
+	double coverage;
+};
+
+
+/**
+  * Footprint of a feature on a raster grid: what the traverser notified
+  * about the feature except the band values, so it can be replayed on
+  * another raster with the same grid.
+  */
+struct Footprint {
+	/** was intersectionFound notified? */
+	bool found;
+
+	/** pixel envelope of the intersection, if hasEnvelope */
+	bool hasEnvelope;
+	int col0, row0, col1, row1;
+
+	/** WKB of geometryToIntersect; empty if it was the feature geometry */
+	vector<unsigned char> geometryToIntersect;
+
+	/** WKB of intersection_geometry; empty if it was geometryToIntersect */
+	vector<unsigned char> intersection_geometry;
+
+	/** visited pixels in order of notification */
+	vector<PixelRun> runs;
+
+	/** summary counts for this feature */
+	Traverser::Summary summary;
+
+	/** clears this footprint */
+	void clear(void);
+
+	/** adds a visited pixel, extending the last run if possible */
+	void addPixel(int col, int row, double x, double y, double coverage, double gx, double gy);
+};
+
+
+/**
+  * Footprints of features keyed by (FID, grid signature), where the
+  * signature includes the raster geometry and the parameters that
+  * determine the visited pixels (pixel proportion, buffer, box, ...).
+  *
+  * Footprints are serialized in memory up to a given number of bytes;
+  * further footprints are spilled to a temporary file, read back through
+  * a memory map (if mmap is available).
+  */
+class FootprintCache {
+public:
+	/**
+	  * @param memoryLimit max bytes kept in memory before spilling.
+	  */
+	FootprintCache(size_t memoryLimit);
+
+	~FootprintCache();
+
+	/** Gets the id for a grid signature, registering it if new */
+	int getGridId(const string& signature);
+
+	/** Starts a traversal; see useFID */
+	void beginTraversal(void) { visited.clear(); }
+
+	/**
+	  * Tells if footprints can be keyed by the given FID. A FID seen twice
+	  * in the same traversal is not unique: its footprints are removed
+	  * and it is not cached from then on.
+	  */
+	bool useFID(long FID);
+
+	/** Gets a footprint. Returns false if not in this cache. */
+	bool get(int gridId, long FID, Footprint& fp);
+
+	/** Adds a footprint */
+	void put(int gridId, long FID, const Footprint& fp);
+
+	/** Tells if a footprint is in this cache */
+	bool contains(int gridId, long FID) {
+		return entries.count(make_pair(gridId, FID)) > 0;
+	}
+
+	/** number of footprints */
+	int size(void) { return entries.size(); }
+
+	/** number of bytes spilled to file */
+	size_t getSpilledBytes(void) { return spillSize; }
+
+private:
+	struct Entry {
+		bool spilled;
+		size_t offset;
+		size_t size;
+	};
+
+	map<string, int> grids;
+	map<pair<int, long>, Entry> entries;
+
+	// FIDs in the current traversal, and those found not to be unique:
+	set<long> visited;
+	set<long> duplicated;
+
+	// in-memory footprints:
+	vector<char> memory;
+	size_t memoryLimit;
+
+	// spill file:
+	FILE* spill;
+	size_t spillSize;
+	bool spillFailed;
+	char* mapped;
+	size_t mappedSize;
+
+	const char* spilledData(size_t offset, size_t size, vector<char>& buffer);
+};
+
+#endif
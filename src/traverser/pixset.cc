@@ -5,38 +5,76 @@
 // $Id$
 //
 
-#include "traverser.h"           
+#include "pixset.h"
 
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
 
+#define WORD_BITS  (8 * sizeof(unsigned))
+
 /////////////////////////////////////////////////////////////////////
 //
 //    PixSet
 //
 
 PixSet::PixSet() {
+	_dense = false;
+	_col0 = _row0 = 0;
+	_cols = _rows = 0;
+	_denseCount = 0;
 }
 
 PixSet::~PixSet() {
 }
 
+void PixSet::setEnvelope(int col0, int row0, int cols, int rows) {
+	clear();
+	if ( cols <= 0 || rows <= 0 
+	||   (double) cols * rows > MAX_BITMAP_BITS ) {
+		return;
+	}
+	unsigned numBits = (unsigned) cols * rows;
+	_bits.assign((numBits + WORD_BITS - 1) / WORD_BITS, 0);
+	_col0 = col0;
+	_row0 = row0;
+	_cols = cols;
+	_rows = rows;
+	_dense = true;
+}
+
 void PixSet::insert(int col, int row) {
-	EPixel colrow(col, row);
-	_set.insert(colrow);
+	if ( inEnvelope(col, row) ) {
+		unsigned idx = bitIndex(col, row);
+		unsigned mask = 1U << (idx % WORD_BITS);
+		unsigned& word = _bits[idx / WORD_BITS];
+		if ( !(word & mask) ) {
+			word |= mask;
+			_denseCount++;
+		}
+	}
+	else {
+		EPixel colrow(col, row);
+		_set.insert(colrow);
+	}
 }
 
 bool PixSet::contains(int col, int row) {
+	if ( inEnvelope(col, row) ) {
+		unsigned idx = bitIndex(col, row);
+		return (_bits[idx / WORD_BITS] >> (idx % WORD_BITS)) & 1U;
+	}
 	return _set.find(EPixel(col, row)) != _set.end() ;
 }
 
 int PixSet::size() {
-	return _set.size();
+	return _denseCount + _set.size();
 }
 
 void PixSet::clear() {
 	_set.clear();
+	_dense = false;
+	_denseCount = 0;
 }
 
 PixSet::Iterator* PixSet::iterator() {
@@ -48,24 +86,55 @@ PixSet::Iterator* PixSet::iterator() {
 //
 //    PixSet::Iterator
 //
+// Merges the locations in the bitmap and in the sparse set so the
+// resulting sequence is in (col,row) order.
+//
 
 PixSet::Iterator::Iterator(PixSet* ps) : ps(ps) { 
 	colrow = ps->_set.begin();
+	bit = 0;
+	numBits = ps->_dense ? (unsigned) ps->_cols * ps->_rows : 0;
+	advanceDense();
 }
 
 PixSet::Iterator::~Iterator() { 
 }
 
+void PixSet::Iterator::advanceDense() {
+	denseNext = false;
+	while ( bit < numBits ) {
+		unsigned word = ps->_bits[bit / WORD_BITS] >> (bit % WORD_BITS);
+		if ( word == 0 ) {
+			// skip to next word
+			bit = (bit / WORD_BITS + 1) * WORD_BITS;
+			continue;
+		}
+		if ( word & 1U ) {
+			denseCol = ps->_col0 + bit / ps->_rows;
+			denseRow = ps->_row0 + bit % ps->_rows;
+			denseNext = true;
+			bit++;
+			return;
+		}
+		bit++;
+	}
+}
 
 bool PixSet::Iterator::hasNext() {
-	return colrow != ps->_set.end();
+	return denseNext || colrow != ps->_set.end();
 }
 
 void PixSet::Iterator::next(int *col, int *row) {
-	*col = colrow->col;
-	*row = colrow->row;
-	colrow++;
+	if ( denseNext 
+	&& ( colrow == ps->_set.end() || EPixel(denseCol, denseRow) < *colrow ) ) {
+		*col = denseCol;
+		*row = denseRow;
+		advanceDense();
+	}
+	else {
+		*col = colrow->col;
+		*row = colrow->row;
+		colrow++;
+	}
 }
 
-
-
@@ -0,0 +1,115 @@
+//
+// STARSpan project
+// PixSet - Set of pixel locations
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef pixset_h
+#define pixset_h
+
+#include <set>
+#include <vector>
+
+using namespace std;
+
+
+/**
+  * Pixel location.
+  * Used as element for set of visited pixels
+  */
+class EPixel {
+	public:
+	int col, row;
+	EPixel(int col, int row) : col(col), row(row) {}
+	EPixel(const EPixel& p) : col(p.col), row(p.row) {}
+	bool operator<(EPixel const &right) const {
+		if ( col < right.col )
+			return true;
+		else if ( col == right.col )
+			return row < right.row;
+		else
+			return false;
+	}
+};
+
+
+/**
+  * Set of visited pixels in feature currently being processed.
+  *
+  * If an envelope is given (see setEnvelope), locations within it are kept
+  * in a dense bitmap; any other location is kept in a sparse set.
+  * Without an envelope, or if the envelope would require a bitmap bigger
+  * than MAX_BITMAP_BITS, only the sparse set is used.
+  *
+  * In all cases, iteration is in (col,row) order.
+  */
+class PixSet {
+	// sparse representation:
+	set<EPixel> _set;
+
+	// dense representation (column-major bitmap over the envelope):
+	vector<unsigned> _bits;
+	bool _dense;
+	int _col0, _row0;
+	int _cols, _rows;
+	int _denseCount;
+
+	inline bool inEnvelope(int col, int row) {
+		return _dense
+		    && col >= _col0 && col < _col0 + _cols
+		    && row >= _row0 && row < _row0 + _rows;
+	}
+
+	inline unsigned bitIndex(int col, int row) {
+		return (unsigned) (col - _col0) * _rows + (row - _row0);
+	}
+
+public:
+	/** max number of bits for the dense representation (8MB) */
+	static const unsigned MAX_BITMAP_BITS = 64 * 1024 * 1024;
+
+	class Iterator {
+		friend class PixSet;
+
+		PixSet* ps;
+		set<EPixel>::iterator colrow;
+
+		// next bit to examine in the bitmap
+		unsigned bit;
+		unsigned numBits;
+
+		// next location in the bitmap, if any
+		bool denseNext;
+		int denseCol, denseRow;
+
+		Iterator(PixSet* ps);
+		void advanceDense();
+	public:
+		~Iterator();
+		bool hasNext();
+		void next(int *col, int *row);
+	};
+
+	PixSet();
+	~PixSet();
+
+	/**
+	  * Clears this set and makes the given envelope the dense region.
+	  * The bitmap is only used if cols*rows <= MAX_BITMAP_BITS.
+	  */
+	void setEnvelope(int col0, int row0, int cols, int rows);
+
+	void insert(int col, int row);
+	int size();
+	bool contains(int col, int row);
+
+	/**
+	  * Clears this set. Also discards any envelope given.
+	  */
+	void clear();
+
+	Iterator* iterator();
+};
+
+#endif
@@ -0,0 +1,175 @@
+//
+// STARSpan project
+// Traverse::processValidPolygon_SL
+// Carlos A. Rueda
+// $Id$
+// Scanline algorithm for polygon rasterization
+//
+// The coverage grid (coverage.h) gives, for every pixel in the polygon
+// envelope, the exact proportion of the pixel covered by the polygon.
+// No GEOS overlay operations are involved.
+//
+// Pixel selection and dispatch order are the same as in the quadtree
+// algorithm (polyqt.cc): the same recursive decomposition of the envelope
+// is performed, but areas of intersection are obtained from the coverage
+// grid instead of intersecting pixel polygons.
+//
+// Polygons whose envelope exceeds SL_MAX_PIXELS are processed in groups of
+// rows, each with its own (bounded) coverage grid, as done when burning
+// polygons in starspan_zonal.cc. Pixel selection is the same; pixels are
+// dispatched group after group, in quadtree order within each group.
+//
+
+#include "traverser.h"
+
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+
+// max number of pixels in the coverage grid; bigger envelopes are
+// processed in groups of rows
+#define SL_MAX_PIXELS  (4 * 1024 * 1024)
+
+// tolerance for area comparisons (in pixel units)
+#define SL_EPSILON  1e-9
+
+
+// processValidPolygon_SL: Scanline algorithm
+void Traverser::processValidPolygon_SL(Polygon* geos_poly) {
+	const Envelope* intersection_env = geos_poly->getEnvelopeInternal();
+
+	// get envelope corners in pixel coordinates:
+	int minCol, minRow, maxCol, maxRow;
+	toColRow(intersection_env->getMinX(), intersection_env->getMinY(), &minCol, &minRow);
+	toColRow(intersection_env->getMaxX(), intersection_env->getMaxY(), &maxCol, &maxRow);
+
+	// since minCol is not necessarily <= maxCol (ditto for *Row):
+	if ( minCol > maxCol ) std::swap(minCol, maxCol);
+	if ( minRow > maxRow ) std::swap(minRow, maxRow);
+
+	const int cols = maxCol - minCol + 1;
+	const int rows = maxRow - minRow + 1;
+	int group_rows = rows;
+	if ( (double) cols * rows > SL_MAX_PIXELS ) {
+		group_rows = SL_MAX_PIXELS / cols;
+		if ( group_rows < 1 )
+			group_rows = 1;
+	}
+
+	for ( int row0 = 0; row0 < rows; row0 += group_rows ) {
+		const int nrows = rows - row0 < group_rows ? rows - row0 : group_rows;
+
+		// origin of the coverage grid:
+		double x, y;
+		toGridXY(minCol, minRow + row0, &x, &y);
+
+		// (edges outside these rows do not contribute to the grid)
+		coverageGrid.reset(cols, nrows);
+		addRingToCoverage(geos_poly->getExteriorRing(), false, x, y);
+		for ( unsigned k = 0; k < geos_poly->getNumInteriorRing(); k++ ) {
+			addRingToCoverage(geos_poly->getInteriorRingN(k), true, x, y);
+		}
+		coverageGrid.compute();
+
+		_Rect env(this, x, y, cols, nrows);
+		rasterize_poly_SL(env, 0, 0);
+	}
+}
+
+
+//
+// Adds a ring to the coverage grid, whose origin is at (x,y).
+//
+void Traverser::addRingToCoverage(const LineString* ring, bool hole, double x, double y) {
+	const CoordinateSequence* cs = ring->getCoordinatesRO();
+	const int n = cs->getSize();
+	vector<double> us(n), vs(n);
+	for ( int i = 0; i < n; i++ ) {
+		const Coordinate& c = cs->getAt(i);
+		us[i] = (c.x - x) / pix_x_size;
+		vs[i] = (c.y - y) / pix_y_size;
+	}
+	if ( n > 0 ) {
+		coverageGrid.addRing(&us[0], &vs[0], n, hole);
+	}
+}
+
+
+//
+// Same decomposition as in rasterize_poly_QT, but with areas in pixel units
+// taken from the summed area table.
+// (col,row): location of e relative to the envelope.
+//
+void Traverser::rasterize_poly_SL(_Rect& e, int col, int row) {
+	if ( e.empty() )
+		return;
+
+	// area of intersection:
+	double area_i = coverageGrid.area(col, row, e.cols, e.rows);
+
+	// no intersection?
+	if ( area_i < SL_EPSILON )
+		return;
+
+	double area_e = (double) e.cols * e.rows;
+	double pix_prop = globalOptions.pix_prop;
+
+	//
+	// If the area of intersection is at least the area of the whole
+	// envelope minus a fraction dependent on the pixel proportion,
+	// then all pixels in envelope are to be included in the intersection:
+	//
+	if ( area_i >= area_e - (1.0 - pix_prop) - SL_EPSILON ) {
+		dispatchRect_SL(e, col, row);
+		return;
+	}
+
+	if ( pix_prop > 0.0 ) {
+		if ( area_i < pix_prop - SL_EPSILON ) {
+			// we can safely discard the whole envelope.
+			return;
+		}
+	}
+	else {
+		// any intersection is enough when this is just a pixel:
+		if ( e.cols == e.rows && e.rows == 1 ) {
+			dispatchRect_SL(e, col, row);
+			return;
+		}
+	}
+
+	//
+	// recur to each of the children in the quadtree decomposition:
+	//
+	const int cols2 = (e.cols >> 1);
+	const int rows2 = (e.rows >> 1);
+
+	_Rect e_ul = e.upperLeft();
+	rasterize_poly_SL(e_ul, col, row);
+
+	_Rect e_ur = e.upperRight();
+	rasterize_poly_SL(e_ur, col + cols2, row);
+
+	_Rect e_ll = e.lowerLeft();
+	rasterize_poly_SL(e_ll, col, row + rows2);
+
+	_Rect e_lr = e.lowerRight();
+	rasterize_poly_SL(e_lr, col + cols2, row + rows2);
+}
+
+// like dispatchRect_QT, but also passing the coverage of each pixel
+// (ecol,erow): location of r relative to the envelope.
+void Traverser::dispatchRect_SL(_Rect& r, int ecol, int erow) {
+	int col, row;
+	toColRow(r.x, r.y, &col, &row);
+	for ( int i = 0; i < r.rows; i++ ) {
+		double y = r.y + i * pix_y_size; 
+		for ( int j = 0; j < r.cols; j++ ) {
+			double x = r.x + j * pix_x_size;
+			double coverage = coverageGrid.coverage(ecol + j, erow + i);
+			dispatchPixel(col + j, row + i, x, y, coverage);
+		}
+	}
+}
@@ -0,0 +1,171 @@
+//
+// STARSpan project
+// FeatureRecord - Recorded notifications about a feature
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef recorder_h
+#define recorder_h
+
+#include "traverser.h"
+
+#include <cstring>
+
+
+/** A visited pixel as notified to a RecorderObserver */
+struct PixelRecord {
+	int col, row;
+	double x, y;
+	double coverage;
+};
+
+
+/**
+  * Notifications about a feature, as recorded by a RecorderObserver.
+  * Can be replayed to the observers of a traverser, see
+  * Traverser::setFeatureRecord.
+  * Note that the feature itself is not owned by the record.
+  */
+struct FeatureRecord {
+	/** order in which the feature was read (if applicable) */
+	long seq;
+
+	OGRFeature* feature;
+
+	/** was intersectionFound notified? */
+	bool found;
+
+	/** copy of geometryToIntersect, or NULL if it was the feature geometry */
+	OGRGeometry* geometryToIntersect;
+
+	/** copy of intersection_geometry */
+	OGRGeometry* intersection_geometry;
+
+	/** visited pixels in order of notification */
+	vector<PixelRecord> pixels;
+
+	/** band values for each visited pixel, if recorded */
+	vector<char> bandValues;
+
+	/** size of band values per pixel in bandValues */
+	size_t bandValuesSize;
+
+	/** summary counts for this feature */
+	Traverser::Summary summary;
+
+	/** was the feature completely processed? */
+	bool complete;
+
+	/**
+	  * the notifications exceeded the recorder's byte limit, so pixels and
+	  * band values were discarded; the feature must be processed again
+	  */
+	bool overflow;
+
+	/** footprint of the feature may be cached (FID given and unique) */
+	bool cacheable;
+
+	/** footprint of the feature is cached; feature is not to be processed by a worker */
+	bool cached;
+
+	FeatureRecord(long seq, OGRFeature* feature) : seq(seq), feature(feature) {
+		found = false;
+		geometryToIntersect = 0;
+		intersection_geometry = 0;
+		bandValuesSize = 0;
+		memset(&summary, 0, sizeof(summary));
+		complete = false;
+		overflow = false;
+		cacheable = false;
+		cached = false;
+	}
+
+	~FeatureRecord() {
+		delete intersection_geometry;
+		delete geometryToIntersect;
+	}
+
+	/** band values for the i-th visited pixel */
+	const char* getBandValues(unsigned i) const {
+		return &bandValues[i * bandValuesSize];
+	}
+};
+
+
+/**
+  * Records the notifications about features in a FeatureRecord.
+  * rec must be set before each feature is processed.
+  */
+class RecorderObserver : public Observer {
+	bool simple;
+	size_t bandBufferSize;
+	size_t maxBytes;
+
+public:
+	/** where notifications are recorded */
+	FeatureRecord* rec;
+
+	/** bands whose values are to be recorded (all if empty), see Observer::usesBand */
+	vector<bool> bandsUsed;
+
+	/**
+	  * @param simple true if band values are not to be recorded.
+	  * @param bandBufferSize size of band values per pixel. If 0, it is
+	  *        obtained from the bands in init().
+	  * @param maxBytes if not 0, max bytes of pixels and band values per
+	  *        record; beyond that, they are discarded and rec->overflow
+	  *        is set.
+	  */
+	RecorderObserver(bool simple, size_t bandBufferSize = 0, size_t maxBytes = 0)
+	: simple(simple), bandBufferSize(bandBufferSize), maxBytes(maxBytes), rec(0) {}
+
+	bool isSimple(void) { return simple; }
+
+	bool usesBand(int band_index) {
+		return bandsUsed.empty() || bandsUsed[band_index - 1];
+	}
+
+	void init(GlobalInfo& info) {
+		if ( bandBufferSize == 0 ) {
+			for ( unsigned i = 0; i < info.bands.size(); i++ ) {
+				GDALDataType bandType = info.bands[i]->GetRasterDataType();
+				bandBufferSize += GDALGetDataTypeSize(bandType) >> 3;
+			}
+		}
+	}
+
+	void intersectionFound(IntersectionInfo& intersInfo) {
+		rec->found = true;
+		if ( intersInfo.geometryToIntersect != intersInfo.feature->GetGeometryRef() ) {
+			rec->geometryToIntersect = intersInfo.geometryToIntersect->clone();
+		}
+		rec->intersection_geometry = intersInfo.intersection_geometry->clone();
+	}
+
+	void addPixel(TraversalEvent& ev) {
+		if ( rec->overflow ) {
+			return;
+		}
+		PixelRecord p;
+		p.col = ev.pixel.col;
+		p.row = ev.pixel.row;
+		p.x = ev.pixel.x;
+		p.y = ev.pixel.y;
+		p.coverage = ev.coverage;
+		rec->pixels.push_back(p);
+		if ( !simple ) {
+			const char* values = (const char*) ev.bandValues;
+			rec->bandValues.insert(rec->bandValues.end(), values, values + bandBufferSize);
+			rec->bandValuesSize = bandBufferSize;
+		}
+		if ( maxBytes > 0
+		&&   rec->pixels.size() * sizeof(PixelRecord) + rec->bandValues.size() > maxBytes ) {
+			rec->overflow = true;
+			vector<PixelRecord>().swap(rec->pixels);
+			vector<char>().swap(rec->bandValues);
+		}
+	}
+};
+
+#endif
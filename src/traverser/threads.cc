@@ -0,0 +1,331 @@
+//
+// STARSpan project
+// Traverse::traverseParallel
+// Carlos A. Rueda
+// $Id$
+// Multi-threaded processing of features.
+//
+// Features are read from the layer by the calling thread and processed by
+// a number of worker traversers, each one with its own raster datasets.
+// A worker does not notify the actual observers but records the
+// notifications for each feature (intersection geometries, pixel locations
+// and band values). The calling thread then replays these records to the
+// observers strictly in the order the features were read, so observers
+// get exactly the same sequence of notifications as in a serial traversal.
+//
+// GEOS operations (buffer, overlay with the raster ring, conversion to
+// GEOS, quadtree rasterization) are serialized with GeosLock, as the GEOS
+// geometries share global_factory. Scanline rasterization and band reads
+// run in parallel.
+//
+// A record takes at most MAX_RECORD_BYTES of pixels and band values;
+// if a feature exceeds it, the record is discarded and the feature is
+// processed again by the calling thread when it is its turn.
+//
+// If a footprint cache is set, the calling thread looks up each feature
+// (with a given and unique FID) before queueing it; cached features are
+// not given to the workers but
+// replayed from the cache, and the footprints of the others are obtained
+// from their records when delivered.
+//
+
+#include "config.h"
+#include "traverser.h"
+#include "recorder.h"
+#include "footprint.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <queue>
+
+#ifdef HAVE_LIBPTHREAD
+	#include <pthread.h>
+#endif
+
+
+// max number of features being processed or waiting to be delivered,
+// per worker
+#define MAX_PENDING_PER_THREAD  4
+
+// max bytes of pixels and band values recorded for a feature, so records
+// in flight take at most about MAX_PENDING_PER_THREAD * MAX_RECORD_BYTES
+// per worker
+#define MAX_RECORD_BYTES  (16 * 1024 * 1024)
+
+
+bool GeosLock::enabled = false;
+
+#ifdef HAVE_LIBPTHREAD
+
+static pthread_mutex_t geosMutex;
+static bool geosMutexInitialized = false;
+
+void GeosLock::setEnabled(bool enable) {
+	if ( enable && !geosMutexInitialized ) {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&geosMutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+		geosMutexInitialized = true;
+	}
+	enabled = enable;
+}
+
+void GeosLock::lock(void) {
+	if ( enabled && !locked ) {
+		pthread_mutex_lock(&geosMutex);
+		locked = true;
+	}
+}
+
+void GeosLock::unlock(void) {
+	if ( locked ) {
+		pthread_mutex_unlock(&geosMutex);
+		locked = false;
+	}
+}
+
+#else
+
+void GeosLock::setEnabled(bool enable) {
+	enabled = enable;
+}
+
+void GeosLock::lock(void) {}
+
+void GeosLock::unlock(void) {}
+
+#endif
+
+
+#ifdef HAVE_LIBPTHREAD
+
+/** State shared by the calling thread and the workers */
+struct WorkQueue {
+	pthread_mutex_t mutex;
+
+	/** signaled when a feature is added to pending, or on finish */
+	pthread_cond_t workCond;
+
+	/** signaled when a feature is added to done */
+	pthread_cond_t doneCond;
+
+	/** features to be processed */
+	queue<FeatureRecord*> pending;
+
+	/** processed features, by seq */
+	map<long, FeatureRecord*> done;
+
+	/** no more features will be added */
+	bool finished;
+};
+
+
+struct Worker {
+	Traverser* trv;
+	RecorderObserver* recorder;
+	vector<Raster*> rasters;
+	WorkQueue* wq;
+	pthread_t thread;
+};
+
+
+void* Traverser::workerMain(void* arg) {
+	Worker* worker = (Worker*) arg;
+	WorkQueue* wq = worker->wq;
+	Traverser* trv = worker->trv;
+
+	for (;;) {
+		pthread_mutex_lock(&wq->mutex);
+		while ( wq->pending.empty() && !wq->finished ) {
+			pthread_cond_wait(&wq->workCond, &wq->mutex);
+		}
+		if ( wq->pending.empty() ) {
+			pthread_mutex_unlock(&wq->mutex);
+			break;
+		}
+		FeatureRecord* rec = wq->pending.front();
+		wq->pending.pop();
+		pthread_mutex_unlock(&wq->mutex);
+
+		worker->recorder->rec = rec;
+		memset(&trv->summary, 0, sizeof(trv->summary));
+		trv->footprintComplete = false;
+		trv->process_feature(rec->feature);
+		rec->summary = trv->summary;
+		rec->complete = trv->footprintComplete;
+
+		pthread_mutex_lock(&wq->mutex);
+		wq->done[rec->seq] = rec;
+		pthread_cond_signal(&wq->doneCond);
+		pthread_mutex_unlock(&wq->mutex);
+	}
+	return 0;
+}
+
+
+//
+// Processes all features in the layer with numThreads workers.
+//
+void Traverser::traverseParallel(OGRLayer* layer, Progress* progress) {
+	WorkQueue wq;
+	pthread_mutex_init(&wq.mutex, 0);
+	pthread_cond_init(&wq.workCond, 0);
+	pthread_cond_init(&wq.doneCond, 0);
+	wq.finished = false;
+
+	//
+	// create the workers, each one with its own rasters:
+	//
+	vector<Worker*> workers;
+	for ( int k = 0; k < numThreads; k++ ) {
+		Worker* worker = new Worker();
+		worker->wq = &wq;
+		worker->trv = new Traverser();
+		worker->trv->setNumThreads(1);
+		worker->trv->setVector(vect);
+		worker->trv->logstream = logstream;
+		for ( unsigned i = 0; i < rasts.size(); i++ ) {
+			const char* filename = rasts[i]->getDataset()->GetDescription();
+			Raster* raster = Raster::open(filename);
+			if ( !raster ) {
+				cerr<< "traverser: cannot open raster for worker thread: " <<filename<< endl;
+				exit(1);
+			}
+			worker->rasters.push_back(raster);
+			worker->trv->addRaster(raster);
+		}
+		worker->recorder = new RecorderObserver(!notSimpleObserver, minimumBandBufferSize, MAX_RECORD_BYTES);
+		worker->recorder->bandsUsed = bandsUsed;
+		worker->trv->addObserver(worker->recorder);
+		worker->trv->coverageObserver = coverageObserver;
+		worker->trv->beginTraversal();
+		workers.push_back(worker);
+	}
+	GeosLock::setEnabled(true);
+	for ( unsigned k = 0; k < workers.size(); k++ ) {
+		pthread_create(&workers[k]->thread, 0, workerMain, workers[k]);
+	}
+
+	//
+	// read features and deliver the processed ones in order:
+	//
+	const long maxPending = MAX_PENDING_PER_THREAD * numThreads;
+	long nextSeq = 0;     // next feature to be read
+	long nextDeliver = 0; // next feature to be delivered
+	bool moreFeatures = true;
+
+	while ( moreFeatures || nextDeliver < nextSeq ) {
+		if ( moreFeatures && nextSeq - nextDeliver < maxPending ) {
+			OGRFeature* feature = nextFeature(layer);
+			if ( feature ) {
+				FeatureRecord* rec = new FeatureRecord(nextSeq++, feature);
+				rec->cacheable = footprintCache && cacheableFeature(feature);
+				rec->cached = rec->cacheable
+				           && footprintCache->contains(footprintGrid, feature->GetFID());
+				pthread_mutex_lock(&wq.mutex);
+				if ( rec->cached ) {
+					wq.done[rec->seq] = rec;
+				}
+				else {
+					wq.pending.push(rec);
+					pthread_cond_signal(&wq.workCond);
+				}
+				pthread_mutex_unlock(&wq.mutex);
+			}
+			else {
+				moreFeatures = false;
+			}
+
+			// keep reading while the next one to deliver is not ready:
+			pthread_mutex_lock(&wq.mutex);
+			bool ready = wq.done.count(nextDeliver) > 0;
+			pthread_mutex_unlock(&wq.mutex);
+			if ( !ready && moreFeatures ) {
+				continue;
+			}
+		}
+
+		if ( nextDeliver == nextSeq ) {
+			continue;
+		}
+
+		// wait for next feature to deliver:
+		pthread_mutex_lock(&wq.mutex);
+		map<long, FeatureRecord*>::iterator it;
+		while ( (it = wq.done.find(nextDeliver)) == wq.done.end() ) {
+			pthread_cond_wait(&wq.doneCond, &wq.mutex);
+		}
+		FeatureRecord* rec = it->second;
+		wq.done.erase(it);
+		pthread_mutex_unlock(&wq.mutex);
+
+		if ( rec->cached || rec->overflow ) {
+			if ( rec->cacheable ) {
+				process_feature_cached(rec->feature);
+			}
+			else {
+				process_feature_uncached(rec->feature);
+			}
+		}
+		else {
+			replayFeature(rec);
+			if ( rec->cacheable ) {
+				cacheFeatureRecord(rec);
+			}
+		}
+		delete rec->feature;
+		delete rec;
+		nextDeliver++;
+		if ( progress )
+			progress->update();
+	}
+
+	//
+	// finish workers:
+	//
+	pthread_mutex_lock(&wq.mutex);
+	wq.finished = true;
+	pthread_cond_broadcast(&wq.workCond);
+	pthread_mutex_unlock(&wq.mutex);
+
+	for ( unsigned k = 0; k < workers.size(); k++ ) {
+		pthread_join(workers[k]->thread, 0);
+	}
+	GeosLock::setEnabled(false);
+
+	for ( unsigned k = 0; k < workers.size(); k++ ) {
+		Worker* worker = workers[k];
+		worker->trv->endTraversal();
+		delete worker->trv;
+		delete worker->recorder;
+		for ( unsigned i = 0; i < worker->rasters.size(); i++ ) {
+			delete worker->rasters[i];
+		}
+		delete worker;
+	}
+
+	pthread_cond_destroy(&wq.doneCond);
+	pthread_cond_destroy(&wq.workCond);
+	pthread_mutex_destroy(&wq.mutex);
+}
+
+#else
+
+//
+// No thread support: features are processed serially.
+//
+void Traverser::traverseParallel(OGRLayer* layer, Progress* progress) {
+	cerr<< "traverser: Warning: no thread support; processing features serially\n";
+	OGRFeature* feature;
+	while( (feature = nextFeature(layer)) != NULL ) {
+		process_feature(feature);
+		delete feature;
+		if ( progress )
+			progress->update();
+	}
+}
+
+#endif
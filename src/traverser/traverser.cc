@@ -7,10 +7,15 @@
 //
 
 #include "traverser.h"           
+#include "recorder.h"
+#include "footprint.h"
+#include "RawImage.h"
 
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <sstream>
+#include <iomanip>
 
 // for polygon processing:
 #include "geos/opPolygonize.h"
@@ -25,6 +30,7 @@ bool Traverser::_resetReading = true;
 Traverser::Traverser() {
 	vect = 0;
 	desired_FID = -1;
+	featureRecord = 0;
 	desired_fieldName = "";
 	desired_fieldValue = "";
 	
@@ -35,8 +41,24 @@ Traverser::Traverser() {
 	
 	// assume observers will be all simple:
 	notSimpleObserver = false;
+	coverageObserver = false;
 	
 	lineRasterizer = 0;
+	numThreads = globalOptions.num_threads;
+	
+	useFeatureIndex = false;
+	featureIndex = 0;
+	nextCandidate = 0;
+	
+	footprintCache = 0;
+	footprintGrid = 0;
+	footprint = 0;
+	footprintComplete = false;
+	
+	window.buffer = 0;
+	window.bufferSize = 0;
+	window.loaded = false;
+	
 	progress_out = 0;
 	logstream = 0;
     
@@ -52,6 +74,8 @@ void Traverser::addObserver(Observer* aObserver) {
 	//if at least one observer is not simple...
 	if ( !aObserver->isSimple() )
 		notSimpleObserver = true;
+	if ( aObserver->needsCoverage() )
+		coverageObserver = true;
 }
 
 
@@ -61,6 +85,7 @@ void Traverser::releaseObservers(void) {
 	
 	observers.clear();
 	notSimpleObserver = false;
+	coverageObserver = false;
 }
 
 
@@ -79,10 +104,22 @@ void Traverser::setVector(Vector* vector) {
 	if ( vect )
 		cerr<< "traverser: Warning: resetting vector\n";
 	vect = vector;
+	setFeatureIndex(useFeatureIndex);   // index to be rebuilt
 }
 
 void Traverser::setLayerNum(int vector_layernum) {
 	layernum = vector_layernum;
+	setFeatureIndex(useFeatureIndex);   // index to be rebuilt
+}
+
+void Traverser::setFeatureIndex(bool b) {
+	useFeatureIndex = b;
+	if ( featureIndex ) {
+		delete featureIndex;
+		featureIndex = 0;
+	}
+	featureIndexFIDs.clear();
+	featureCandidates.clear();
 }
 
 
@@ -94,9 +131,12 @@ void Traverser::addRaster(Raster* raster) {
 	GDALDataset* dataset = raster->getDataset();
 	
 	// add band info from given raster
+	RawImage* rawImage = raster->getRawImage();
 	for ( int i = 0; i < dataset->GetRasterCount(); i++ ) {
 		GDALRasterBand* band = dataset->GetRasterBand(i+1);
 		globalInfo.bands.push_back(band);
+		bandRawImages.push_back(rawImage);
+		bandRawIndices.push_back(i);
 		
 		// update minimumBandBufferSize:
 		GDALDataType bandType = band->GetRasterDataType();
@@ -155,6 +195,9 @@ void Traverser::addRaster(Raster* raster) {
 void Traverser::removeRasters() {
 	rasts.clear();
 	globalInfo.bands.clear();
+	bandRawImages.clear();
+	bandRawIndices.clear();
+	minimumBandBufferSize = 0;
 	// make sure we have a an empty rasterPoly:
 	globalInfo.rasterPoly.empty();
 	memset(&summary, 0, sizeof(summary));
@@ -168,40 +211,191 @@ Traverser::~Traverser() {
 		delete[] bandValues_buffer;
 	if ( lineRasterizer )
 		delete lineRasterizer;
+	if ( featureIndex )
+		delete featureIndex;
+	releaseBandWindow();
 }
 
 void* Traverser::getBandValuesForPixel(int col, int row, void* buffer) {
 	char* ptr = (char*) buffer;
+	for ( unsigned i = 0; i < globalInfo.bands.size(); i++ ) {
+		ptr += readBandValue(i, col, row, ptr);
+	}
+	return buffer;
+}
+
+
+//
+// Reads the value of the i-th band at (col,row) into ptr.
+// Returns the size of the value.
+//
+size_t Traverser::readBandValue(unsigned i, int col, int row, char* ptr) {
+	GDALRasterBand* band = globalInfo.bands[i];
+	GDALDataType bandType = band->GetRasterDataType();
+	int bandTypeSize = GDALGetDataTypeSize(bandType) >> 3;
+	
+	if ( bandRawImages[i] ) {
+		memcpy(ptr, bandRawImages[i]->getValue(bandRawIndices[i], col, row), bandTypeSize);
+		return bandTypeSize;
+	}
+
+	int status = band->RasterIO(
+		GF_Read,
+		col, row,
+		1, 1,             // nXSize, nYSize
+		ptr,              // pData
+		1, 1,             // nBufXSize, nBufYSize
+		bandType,         // eBufType
+		0, 0              // nPixelSpace, nLineSpace
+	);
+	
+	if ( status != CE_None ) {
+		cerr<< "Error reading band value, status= " <<status<< "\n";
+		exit(1);
+	}
+	
+	return bandTypeSize;
+}
+
+
+void Traverser::getBandValuesForPixel(int col, int row) {
+	assert(bandValues_buffer);
+	
+	if ( !window.loaded
+	||   col < window.col0 || col >= window.col0 + window.cols
+	||   row < window.row0 || row >= window.row0 + window.rows ) {
+		// not covered by the window: read directly from the used bands
+		char* ptr = (char*) bandValues_buffer;
+		for ( unsigned i = 0; i < globalInfo.bands.size(); i++ ) {
+			if ( bandsUsed[i] )
+				ptr += readBandValue(i, col, row, ptr);
+			else
+				ptr += GDALGetDataTypeSize(globalInfo.bands[i]->GetRasterDataType()) >> 3;
+		}
+		return;
+	}
+	
+	size_t pixOffset = (size_t) (row - window.row0) * window.cols + (col - window.col0);
+	char* ptr = (char*) bandValues_buffer;
+	for ( unsigned i = 0; i < globalInfo.bands.size(); i++ ) {
+		int bandTypeSize = window.bandTypeSizes[i];
+		if ( bandsUsed[i] ) {
+			if ( bandRawImages[i] )
+				memcpy(ptr, bandRawImages[i]->getValue(bandRawIndices[i], col, row), bandTypeSize);
+			else
+				memcpy(ptr, window.buffer + window.bandOffsets[i] + pixOffset * bandTypeSize, bandTypeSize);
+		}
+		ptr += bandTypeSize;
+	}
+}
+
+
+//
+// Gets the pixel envelope of the given geometry, clamped to the raster
+// extension. Returns false if the envelope is empty.
+//
+bool Traverser::getPixelEnvelope(OGRGeometry* geometry, int *col0, int *row0, int *col1, int *row1) {
+	OGREnvelope env;
+	geometry->getEnvelope(&env);
+	
+	int colA, rowA, colB, rowB;
+	toColRow(env.MinX, env.MinY, &colA, &rowA);
+	toColRow(env.MaxX, env.MaxY, &colB, &rowB);
+	
+	*col0 = colA < colB ? colA : colB;
+	*col1 = colA < colB ? colB : colA;
+	*row0 = rowA < rowB ? rowA : rowB;
+	*row1 = rowA < rowB ? rowB : rowA;
+	
+	if ( *col0 < 0 )        *col0 = 0;
+	if ( *row0 < 0 )        *row0 = 0;
+	if ( *col1 >= width )   *col1 = width - 1;
+	if ( *row1 >= height )  *row1 = height - 1;
+	
+	return *col0 <= *col1 && *row0 <= *row1;
+}
+
+
+//
+// Reads the window of band values covering the given pixel envelope.
+// If the window would be too big, nothing is loaded and band values 
+// will be read pixel by pixel.
+// Bands of memory mapped images and bands not used by the observers are
+// not loaded; if there are no other bands, no window is needed.
+//
+void Traverser::loadBandWindow(int col0, int row0, int col1, int row1) {
+	window.loaded = false;
+	
+	// bytes per pixel of the bands to be loaded:
+	size_t pixelSize = 0;
+	for ( unsigned i = 0; i < globalInfo.bands.size(); i++ ) {
+		if ( bandsUsed[i] && !bandRawImages[i] )
+			pixelSize += GDALGetDataTypeSize(globalInfo.bands[i]->GetRasterDataType()) >> 3;
+	}
+	if ( pixelSize == 0 ) {
+		return;
+	}
+	
+	const int cols = col1 - col0 + 1;
+	const int rows = row1 - row0 + 1;
+	const size_t numPixels = (size_t) cols * rows;
+	
+	if ( numPixels > MAX_WINDOW_BYTES / pixelSize ) {
+		return;
+	}
+	
+	const size_t size = numPixels * pixelSize;
+	if ( window.bufferSize < size ) {
+		delete[] window.buffer;
+		window.buffer = new char[size];
+		window.bufferSize = size;
+	}
+	
+	window.bandOffsets.clear();
+	window.bandTypeSizes.clear();
+	size_t offset = 0;
 	for ( unsigned i = 0; i < globalInfo.bands.size(); i++ ) {
 		GDALRasterBand* band = globalInfo.bands[i];
 		GDALDataType bandType = band->GetRasterDataType();
-	
+		int bandTypeSize = GDALGetDataTypeSize(bandType) >> 3;
+		
+		window.bandOffsets.push_back(offset);
+		window.bandTypeSizes.push_back(bandTypeSize);
+		if ( bandRawImages[i] || !bandsUsed[i] ) {
+			continue;
+		}
+		
 		int status = band->RasterIO(
 			GF_Read,
-			col, row,
-			1, 1,             // nXSize, nYSize
-			ptr,              // pData
-			1, 1,             // nBufXSize, nBufYSize
-			bandType,         // eBufType
-			0, 0              // nPixelSpace, nLineSpace
+			col0, row0,
+			cols, rows,            // nXSize, nYSize
+			window.buffer + offset, // pData
+			cols, rows,            // nBufXSize, nBufYSize
+			bandType,              // eBufType
+			0, 0                   // nPixelSpace, nLineSpace
 		);
 		
 		if ( status != CE_None ) {
-			cerr<< "Error reading band value, status= " <<status<< "\n";
+			cerr<< "Error reading band window, status= " <<status<< "\n";
 			exit(1);
 		}
 		
-		int bandTypeSize = GDALGetDataTypeSize(bandType) >> 3;
-		ptr += bandTypeSize;
+		offset += numPixels * bandTypeSize;
 	}
 	
-	return buffer;
+	window.col0 = col0;
+	window.row0 = row0;
+	window.cols = cols;
+	window.rows = rows;
+	window.loaded = true;
 }
 
 
-void Traverser::getBandValuesForPixel(int col, int row) {
-	assert(bandValues_buffer);
-	getBandValuesForPixel(col, row, bandValues_buffer);
+void Traverser::releaseBandWindow(void) {
+	delete[] window.buffer;
+	window.buffer = 0;
+	window.bufferSize = 0;
+	window.loaded = false;
 }
 
 
@@ -325,6 +519,10 @@ void Traverser::pixelFound(double x, double y) {
 	
 	// keep track of processed pixels
 	pixset.insert(col, row);
+	
+	if ( footprint ) {
+		addFootprintPixel(col, row, x, y, 1.0);
+	}
 }
 
 //
@@ -385,10 +583,23 @@ void Traverser::processMultiLineString(OGRMultiLineString* coll) {
 
 //
 // processValidPolygon(Polygon* geos_poly): Process a valid polygon.
-// Direct call to processValidPolygon_QT(geos_poly).
+// Calls processValidPolygon_SL(geos_poly) if the scanline rasterizer
+// was requested, or by default when a pixel proportion is given (the
+// coverage grid is then used for the threshold) or an observer needs the
+// coverage of the pixels; processValidPolygon_QT(geos_poly) otherwise.
+// The quadtree does GEOS overlays, so it holds the GEOS lock; the
+// scanline rasterizer only reads the coordinates of geos_poly.
 //
 void Traverser::processValidPolygon(Polygon* geos_poly) {
-	processValidPolygon_QT(geos_poly);
+	const string& rasterizer = globalOptions.rasterizer;
+	if ( rasterizer == "scanline"
+	|| ( rasterizer != "qt" && (globalOptions.pix_prop > 0.0 || coverageObserver) ) ) {
+		processValidPolygon_SL(geos_poly);
+	}
+	else {
+		GeosLock lock;
+		processValidPolygon_QT(geos_poly);
+	}
 }
 
 
@@ -401,15 +612,20 @@ const CoordinateSequenceFactory* global_cs_factory = global_factory->getCoordina
 // process a polygon intersection.
 // The area of intersections are used to determine if a pixel is to be
 // included.  
+// GEOS calls are done under the GEOS lock, except the rasterization of
+// a valid polygon (see processValidPolygon).
 //
 void Traverser::processPolygon(OGRPolygon* poly) {
+	GeosLock lock;
 	Polygon* geos_poly = (Polygon*) poly->exportToGEOS();
 	if ( geos_poly->isValid() ) {
         // 2008-04-18
         if ( geos_poly->getNumInteriorRing() > 0 ) {
             cerr<< "--Valid polygon WITH interior rings: " <<geos_poly->getNumInteriorRing()<< endl;
         } 
+		lock.unlock();
 		processValidPolygon(geos_poly);
+		lock.lock();
 	}
 	else {
 		summary.num_invalid_polys++;
@@ -568,9 +784,220 @@ void Traverser::processGeometry(OGRGeometry* intersection_geometry, bool count)
 
 
 //
-// processes a given feature
+// processes a given feature, using the footprint cache if set
 //
 void Traverser::process_feature(OGRFeature* feature) {
+	if ( footprintCache && cacheableFeature(feature) ) {
+		process_feature_cached(feature);
+	}
+	else {
+		process_feature_uncached(feature);
+	}
+}
+
+
+//
+// Tells if the footprint of a feature can be cached and looked up by its
+// FID: the FID must be given and unique (see FootprintCache::useFID).
+// To be called once per feature in each traversal.
+//
+bool Traverser::cacheableFeature(OGRFeature* feature) {
+	long FID = feature->GetFID();
+	return FID != OGRNullFID && footprintCache->useFID(FID);
+}
+
+
+//
+// processes a given feature, replaying its footprint from the cache, or
+// adding it to the cache
+//
+void Traverser::process_feature_cached(OGRFeature* feature) {
+	long FID = feature->GetFID();
+	Footprint fp;
+	if ( footprintCache->get(footprintGrid, FID, fp) ) {
+		summary.num_footprint_hits++;
+		replayFootprint(feature, fp);
+		return;
+	}
+	summary.num_footprint_misses++;
+	
+	// record the footprint along with the summary counts for this feature:
+	Summary prevSummary = summary;
+	memset(&summary, 0, sizeof(summary));
+	fp.clear();
+	footprint = &fp;
+	footprintComplete = false;
+	
+	process_feature_uncached(feature);
+	
+	footprint = 0;
+	fp.summary = summary;
+	summary = prevSummary;
+	summary.add(fp.summary);
+	
+	if ( footprintComplete ) {
+		// extent checks and overlay are not repeated when replayed:
+		fp.summary.num_contained_features = 0;
+		fp.summary.num_disjoint_features = 0;
+		fp.summary.num_overlay_features = 0;
+		footprintCache->put(footprintGrid, FID, fp);
+	}
+}
+
+
+//
+// aux routines for the geometries in footprints
+//
+static void geometryToWkb(OGRGeometry* geometry, vector<unsigned char>& wkb) {
+	wkb.resize(geometry->WkbSize());
+	geometry->exportToWkb(wkbNDR, &wkb[0]);
+}
+
+static OGRGeometry* geometryFromWkb(vector<unsigned char>& wkb) {
+	OGRGeometry* geometry = 0;
+	if ( OGRGeometryFactory::createFromWkb(&wkb[0], NULL, &geometry, wkb.size()) != OGRERR_NONE ) {
+		return 0;
+	}
+	return geometry;
+}
+
+
+//
+// adds a visited pixel to the footprint being recorded
+//
+void Traverser::addFootprintPixel(int col, int row, double x, double y, double coverage) {
+	double gx, gy;
+	toGridXY(col, row, &gx, &gy);
+	footprint->addPixel(col, row, x, y, coverage, gx, gy);
+}
+
+
+//
+// Notifies the observers about a feature according to its footprint,
+// as process_feature would do, but only reading the band values.
+//
+void Traverser::replayFootprint(OGRFeature* feature, Footprint& fp) {
+	if ( fp.found ) {
+		OGRGeometry* feature_geometry = feature->GetGeometryRef();
+		OGRGeometry* geometryToIntersect = feature_geometry;
+		if ( fp.geometryToIntersect.size() > 0 ) {
+			geometryToIntersect = geometryFromWkb(fp.geometryToIntersect);
+		}
+		OGRGeometry* intersection_geometry = geometryToIntersect;
+		if ( geometryToIntersect && fp.intersection_geometry.size() > 0 ) {
+			intersection_geometry = geometryFromWkb(fp.intersection_geometry);
+		}
+		if ( !geometryToIntersect || !intersection_geometry ) {
+			cerr<< ">>>>> FID: " << feature->GetFID()
+			    << "  could not restore geometries from footprint" << endl;
+		}
+		else {
+			IntersectionInfo intersInfo;
+			intersInfo.trv = this;
+			intersInfo.feature = feature;
+			intersInfo.geometryToIntersect = geometryToIntersect;
+			intersInfo.intersection_geometry = intersection_geometry;
+			
+			for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ ) {
+				(*obs)->intersectionFound(intersInfo);
+			}
+			
+			pixset.clear();
+			if ( fp.hasEnvelope ) {
+				pixset.setEnvelope(fp.col0, fp.row0, fp.col1 - fp.col0 + 1, fp.row1 - fp.row0 + 1);
+				if ( notSimpleObserver ) {
+					loadBandWindow(fp.col0, fp.row0, fp.col1, fp.row1);
+				}
+			}
+			
+			for ( unsigned i = 0; i < fp.runs.size(); i++ ) {
+				const PixelRun& run = fp.runs[i];
+				for ( int k = 0; k < run.len; k++ ) {
+					int col = run.col + k;
+					double x = run.x, y = run.y;
+					if ( k > 0 ) {
+						toGridXY(col, run.row, &x, &y);
+					}
+					TraversalEvent event(col, run.row, x, y, run.coverage);
+					if ( notSimpleObserver ) {
+						getBandValuesForPixel(col, run.row);
+						event.bandValues = bandValues_buffer;
+					}
+					for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ )
+						(*obs)->addPixel(event);
+					pixset.insert(col, run.row);
+				}
+			}
+			
+			for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ ) {
+				(*obs)->intersectionEnd(intersInfo);
+			}
+			window.loaded = false;
+		}
+		
+		if ( intersection_geometry != geometryToIntersect ) {
+			delete intersection_geometry;
+		}
+		if ( geometryToIntersect != feature_geometry ) {
+			delete geometryToIntersect;
+		}
+	}
+	
+	summary.add(fp.summary);
+}
+
+
+//
+// Adds the footprint of a feature processed by a worker (see threads.cc)
+// to the footprint cache, as process_feature would do for a miss.
+// The record has the summary counts of the feature, which are added by
+// replayFeature.
+//
+void Traverser::cacheFeatureRecord(FeatureRecord* rec) {
+	summary.num_footprint_misses++;
+	if ( !rec->complete ) {
+		return;
+	}
+	
+	Footprint fp;
+	fp.clear();
+	if ( rec->found ) {
+		fp.found = true;
+		if ( rec->geometryToIntersect ) {
+			geometryToWkb(rec->geometryToIntersect, fp.geometryToIntersect);
+		}
+		// record has a copy of the intersection even if it was geometryToIntersect:
+		if ( rec->summary.num_contained_features == 0 ) {
+			geometryToWkb(rec->intersection_geometry, fp.intersection_geometry);
+		}
+		int col0, row0, col1, row1;
+		if ( getPixelEnvelope(rec->intersection_geometry, &col0, &row0, &col1, &row1) ) {
+			fp.hasEnvelope = true;
+			fp.col0 = col0;
+			fp.row0 = row0;
+			fp.col1 = col1;
+			fp.row1 = row1;
+		}
+		for ( unsigned i = 0; i < rec->pixels.size(); i++ ) {
+			const PixelRecord& p = rec->pixels[i];
+			double gx, gy;
+			toGridXY(p.col, p.row, &gx, &gy);
+			fp.addPixel(p.col, p.row, p.x, p.y, p.coverage, gx, gy);
+		}
+	}
+	
+	fp.summary = rec->summary;
+	fp.summary.num_contained_features = 0;
+	fp.summary.num_disjoint_features = 0;
+	fp.summary.num_overlay_features = 0;
+	footprintCache->put(footprintGrid, rec->feature->GetFID(), fp);
+}
+
+
+//
+// processes a given feature
+//
+void Traverser::process_feature_uncached(OGRFeature* feature) {
 	if ( globalOptions.verbose ) {
 		fprintf(stdout, "\n\nFID: %ld", feature->GetFID());
 	}
@@ -670,6 +1097,7 @@ void Traverser::process_feature(OGRFeature* feature) {
 		
 		
 		try {
+			GeosLock lock;
 			buffered_geometry = feature_geometry->Buffer(distance, quadrantSegments);
 		}
 		catch(GEOSException* ex) {
@@ -693,19 +1121,48 @@ void Traverser::process_feature(OGRFeature* feature) {
 	//
 	OGRGeometry* intersection_geometry = 0;
 	
-	try {
-		intersection_geometry = globalInfo.rasterPoly.Intersection(geometryToIntersect);
+	//
+	// The raster ring is a rectangle, so the envelope of the geometry tells
+	// the common cases without a GEOS overlay: geometry fully inside the
+	// raster (the intersection is the geometry itself), or no intersection.
+	//
+	if ( geometryToIntersect ) {
+		OGREnvelope env;
+		geometryToIntersect->getEnvelope(&env);
+		if ( env.MaxX < raster_env.MinX || env.MinX > raster_env.MaxX
+		||   env.MaxY < raster_env.MinY || env.MinY > raster_env.MaxY ) {
+			summary.num_disjoint_features++;
+			if ( globalOptions.verbose ) {
+				cout<< " NO INTERSECTION (extent):\n";
+			}
+			footprintComplete = true;
+			goto done;
+		}
+		if ( env.MinX >= raster_env.MinX && env.MaxX <= raster_env.MaxX
+		&&   env.MinY >= raster_env.MinY && env.MaxY <= raster_env.MaxY ) {
+			summary.num_contained_features++;
+			intersection_geometry = geometryToIntersect;
+		}
 	}
-	catch(GEOSException* ex) {
-		cerr<< ">>>>> FID: " << feature->GetFID()
-		    << "  GEOSException: " << EXC_STRING(ex) << endl;
-		goto done;
+	
+	if ( !intersection_geometry ) {
+		summary.num_overlay_features++;
+		try {
+			GeosLock lock;
+			intersection_geometry = globalInfo.rasterPoly.Intersection(geometryToIntersect);
+		}
+		catch(GEOSException* ex) {
+			cerr<< ">>>>> FID: " << feature->GetFID()
+			    << "  GEOSException: " << EXC_STRING(ex) << endl;
+			goto done;
+		}
 	}
 
 	if ( !intersection_geometry ) {
 		if ( globalOptions.verbose ) {
 			cout<< " NO INTERSECTION:\n";
 		}
+		footprintComplete = true;
 		goto done;
 	}
 
@@ -724,6 +1181,16 @@ void Traverser::process_feature(OGRFeature* feature) {
     intersInfo.geometryToIntersect = geometryToIntersect;
     intersInfo.intersection_geometry = intersection_geometry;
     
+	if ( footprint ) {
+		footprint->found = true;
+		if ( geometryToIntersect != feature_geometry ) {
+			geometryToWkb(geometryToIntersect, footprint->geometryToIntersect);
+		}
+		if ( intersection_geometry != geometryToIntersect ) {
+			geometryToWkb(intersection_geometry, footprint->intersection_geometry);
+		}
+	}
+    
 	//
 	// Notify observers about this feature:
 	// NOTE: Particularly in the case of a GeometryCollection, it might be the
@@ -737,8 +1204,31 @@ void Traverser::process_feature(OGRFeature* feature) {
 	}
 	
 	pixset.clear();
+	
+	{
+		int col0, row0, col1, row1;
+		if ( getPixelEnvelope(intersection_geometry, &col0, &row0, &col1, &row1) ) {
+			// dense visited-pixel region:
+			pixset.setEnvelope(col0, row0, col1 - col0 + 1, row1 - row0 + 1);
+			
+			if ( footprint ) {
+				footprint->hasEnvelope = true;
+				footprint->col0 = col0;
+				footprint->row0 = row0;
+				footprint->col1 = col1;
+				footprint->row1 = row1;
+			}
+			
+			// if at least one observer is not simple, preload band values:
+			if ( notSimpleObserver ) {
+				loadBandWindow(col0, row0, col1, row1);
+			}
+		}
+	}
+	
 	try {
 		processGeometry(intersection_geometry, true);
+		footprintComplete = true;
 	}
 	catch(string err) {
 		cerr<< "starspan: FID=" <<feature->GetFID()
@@ -752,15 +1242,68 @@ void Traverser::process_feature(OGRFeature* feature) {
 	for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ ) {
 		(*obs)->intersectionEnd(intersInfo);
 	}
+	window.loaded = false;
 
 done:
-	delete intersection_geometry;
+	if ( intersection_geometry != geometryToIntersect ) {
+		delete intersection_geometry;
+	}
 	if ( geometryToIntersect != feature_geometry ) {
 		delete geometryToIntersect;
 	}
 }
 
 
+//
+// Notifies the observers of this traverser about a recorded feature,
+// updating the set of visited pixels as process_feature would do.
+// Only the leading minimumBandBufferSize bytes of the recorded band values
+// of each pixel are passed, so the record may have been obtained with
+// additional rasters after the ones in this traverser.
+//
+void Traverser::replayFeature(FeatureRecord* rec) {
+	if ( rec->found ) {
+		OGRFeature* feature = rec->feature;
+
+		IntersectionInfo intersInfo;
+		intersInfo.trv = this;
+		intersInfo.feature = feature;
+		intersInfo.geometryToIntersect = rec->geometryToIntersect ?
+			rec->geometryToIntersect : feature->GetGeometryRef();
+		intersInfo.intersection_geometry = rec->intersection_geometry;
+
+		for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ ) {
+			(*obs)->intersectionFound(intersInfo);
+		}
+
+		pixset.clear();
+		int col0, row0, col1, row1;
+		if ( getPixelEnvelope(rec->intersection_geometry, &col0, &row0, &col1, &row1) ) {
+			pixset.setEnvelope(col0, row0, col1 - col0 + 1, row1 - row0 + 1);
+		}
+
+		for ( unsigned i = 0; i < rec->pixels.size(); i++ ) {
+			const PixelRecord& p = rec->pixels[i];
+			TraversalEvent event(p.col, p.row, p.x, p.y, p.coverage);
+			if ( notSimpleObserver ) {
+				assert( rec->bandValuesSize >= minimumBandBufferSize );
+				memcpy(bandValues_buffer, rec->getBandValues(i), minimumBandBufferSize);
+				event.bandValues = bandValues_buffer;
+			}
+			for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ )
+				(*obs)->addPixel(event);
+			pixset.insert(p.col, p.row);
+		}
+
+		for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ ) {
+			(*obs)->intersectionEnd(intersInfo);
+		}
+	}
+
+	summary.add(rec->summary);
+}
+
+
 //
 // main method for traversal
 //
@@ -846,16 +1389,28 @@ void Traverser::traverse() {
     }    
 
 
-	lineRasterizer = new LineRasterizer(x0, y0, pix_x_size, pix_y_size);
-	lineRasterizer->setObserver(this);
+	beginTraversal();
 	
-	memset(&summary, 0, sizeof(summary));
-	
-	// assuming biggest data type we assign enough memory:
-	bandValues_buffer = new double[globalInfo.bands.size()];
-
-	// for polygon rasterization:
-	pixelProportion_times_pix_abs_area = globalOptions.pix_prop * pix_abs_area;
+	if ( footprintCache ) {
+		// grid and parameters determining the visited pixels:
+		ostringstream signature;
+		signature<< setprecision(17)
+		    << width << " " << height << " " << x0 << " " << y0 << " " 
+		    << pix_x_size << " " << pix_y_size
+		    << " pix_prop=" << globalOptions.pix_prop
+		    << " rasterizer=" << globalOptions.rasterizer
+		    << " skip_invalid_polys=" << globalOptions.skip_invalid_polys;
+		if ( globalOptions.bufferParams.given ) {
+			signature<< " buffer=" << globalOptions.bufferParams.distance
+			    << "," << globalOptions.bufferParams.quadrantSegments;
+		}
+		if ( globalOptions.boxParams.given ) {
+			signature<< " box=" << globalOptions.boxParams.width
+			    << "," << globalOptions.boxParams.height;
+		}
+		footprintGrid = footprintCache->getGridId(signature.str());
+		footprintCache->beginTraversal();
+	}
 
     globalInfo.layer = layer;
     
@@ -872,13 +1427,18 @@ void Traverser::traverse() {
 	// Was a specific FID given?
 	//
 	if ( desired_FID >= 0 ) {
-		feature = layer->GetFeature(desired_FID);
-		if ( !feature ) {
-			cerr<< "FID " <<desired_FID<< " not found in " <<vect->getName()<< endl;
-			exit(1);
+		if ( featureRecord ) {
+			replayFeature(featureRecord);
+		}
+		else {
+			feature = layer->GetFeature(desired_FID);
+			if ( !feature ) {
+				cerr<< "FID " <<desired_FID<< " not found in " <<vect->getName()<< endl;
+				exit(1);
+			}
+			process_feature(feature);
+			delete feature;
 		}
-		process_feature(feature);
-		delete feature;
 	}
 	//
 	// Was a specific field name/value given?
@@ -915,6 +1475,18 @@ void Traverser::traverse() {
 		if ( debug_no_spatial_filter ) {
 			cout<< "*** Spatial filtering disabled ***" <<endl;
 		}
+		else if ( useFeatureIndex && !releaseLayer 
+		&&   !globalOptions.bufferParams.given && !globalOptions.boxParams.given
+		&&   (featureIndex || buildFeatureIndex(layer)) ) {
+			// only the candidate features will be fetched:
+			featureCandidates.clear();
+			featureIndex->query(raster_env.MinX, raster_env.MinY, 
+				raster_env.MaxX, raster_env.MaxY, featureCandidates
+			);
+			nextCandidate = 0;
+			summary.num_fetched_features = featureCandidates.size();
+			summary.num_skipped_features = featureIndex->size() - featureCandidates.size();
+		}
 		else {
 			double minX = raster_env.MinX;
 			double minY = raster_env.MinY; 
@@ -925,7 +1497,7 @@ void Traverser::traverse() {
 		
 		Progress* progress = 0;
 		if ( progress_out ) {
-			long psize = layer->GetFeatureCount();
+			long psize = featureIndex ? (long) featureCandidates.size() : layer->GetFeatureCount();
 			if ( psize >= 0 ) {
 				progress = new Progress(psize, progress_perc, *progress_out);
 			}
@@ -935,11 +1507,16 @@ void Traverser::traverse() {
 			*progress_out << "\t";
 			progress->start();
 		}
-		while( (feature = layer->GetNextFeature()) != NULL ) {
-			process_feature(feature);
-			delete feature;
-			if ( progress )
-				progress->update();
+		if ( numThreads > 1 ) {
+			traverseParallel(layer, progress);
+		}
+		else {
+			while( (feature = nextFeature(layer)) != NULL ) {
+				process_feature(feature);
+				delete feature;
+				if ( progress )
+					progress->update();
+			}
 		}
 		if ( progress ) {
 			progress->complete();
@@ -961,10 +1538,122 @@ void Traverser::traverse() {
         poDS->ReleaseResultSet(layer);
     }
 
+	endTraversal();
+}
+
+
+//
+// builds the feature index with one pass over the layer
+//
+bool Traverser::buildFeatureIndex(OGRLayer* layer) {
+	if ( globalOptions.verbose ) {
+		cout<< "traverser: building feature index...\n";
+	}
+	featureIndex = new EnvelopeIndex();
+	featureIndexFIDs.clear();
+	
+	layer->SetSpatialFilter(NULL);
+	layer->ResetReading();
+	OGRFeature* feature;
+	while( (feature = layer->GetNextFeature()) != NULL ) {
+		OGRGeometry* geometry = feature->GetGeometryRef();
+		if ( geometry ) {
+			OGREnvelope env;
+			geometry->getEnvelope(&env);
+			featureIndex->insert(env.MinX, env.MinY, env.MaxX, env.MaxY, featureIndexFIDs.size());
+			featureIndexFIDs.push_back(feature->GetFID());
+		}
+		delete feature;
+	}
+	featureIndex->build();
+	
+	if ( globalOptions.verbose ) {
+		cout<< "traverser: " <<featureIndex->size()<< " features indexed\n";
+	}
+	return true;
+}
+
+//
+// gets the next feature to be processed: from the candidates if the
+// feature index is in use, otherwise from the layer.
+//
+OGRFeature* Traverser::nextFeature(OGRLayer* layer) {
+	if ( !featureIndex ) {
+		return layer->GetNextFeature();
+	}
+	while ( nextCandidate < featureCandidates.size() ) {
+		long FID = featureIndexFIDs[featureCandidates[nextCandidate++]];
+		OGRFeature* feature = layer->GetFeature(FID);
+		if ( feature ) {
+			return feature;
+		}
+		cerr<< "traverser: FID " <<FID<< " not found\n";
+	}
+	return NULL;
+}
+
+
+//
+// allocates the resources for the processing of features
+//
+void Traverser::beginTraversal() {
+	lineRasterizer = new LineRasterizer(x0, y0, pix_x_size, pix_y_size);
+	lineRasterizer->setObserver(this);
+	
+	memset(&summary, 0, sizeof(summary));
+	
+	// assuming biggest data type we assign enough memory:
+	bandValues_buffer = new double[globalInfo.bands.size()];
+	
+	// bands whose values are used by some observer:
+	bandsUsed.assign(globalInfo.bands.size(), false);
+	for ( unsigned i = 0; i < globalInfo.bands.size(); i++ ) {
+		for ( vector<Observer*>::const_iterator obs = observers.begin(); obs != observers.end(); obs++ ) {
+			if ( !(*obs)->isSimple() && (*obs)->usesBand(i + 1) ) {
+				bandsUsed[i] = true;
+				break;
+			}
+		}
+	}
+
+	// for polygon rasterization:
+	pixelProportion_times_pix_abs_area = globalOptions.pix_prop * pix_abs_area;
+}
+
+
+//
+// releases the resources allocated by beginTraversal
+//
+void Traverser::endTraversal() {
 	delete[] bandValues_buffer;
 	bandValues_buffer = 0;
 	delete lineRasterizer;
 	lineRasterizer = 0;
+	releaseBandWindow();
+}
+
+
+void Traverser::Summary::add(const Summary& s) {
+	num_intersecting_features += s.num_intersecting_features;
+	num_point_features += s.num_point_features;
+	num_multipoint_features += s.num_multipoint_features;
+	num_linestring_features += s.num_linestring_features;
+	num_multilinestring_features += s.num_multilinestring_features;
+	num_polygon_features += s.num_polygon_features;
+	num_multipolygon_features += s.num_multipolygon_features;
+	num_geometrycollection_features += s.num_geometrycollection_features;
+	num_invalid_polys += s.num_invalid_polys;
+	num_polys_with_internal_ring += s.num_polys_with_internal_ring;
+	num_polys_exploded += s.num_polys_exploded;
+	num_sub_polys += s.num_sub_polys;
+	num_processed_pixels += s.num_processed_pixels;
+	num_contained_features += s.num_contained_features;
+	num_disjoint_features += s.num_disjoint_features;
+	num_overlay_features += s.num_overlay_features;
+	num_fetched_features += s.num_fetched_features;
+	num_skipped_features += s.num_skipped_features;
+	num_footprint_hits += s.num_footprint_hits;
+	num_footprint_misses += s.num_footprint_misses;
 }
 
 
@@ -995,4 +1684,19 @@ void Traverser::reportSummary() {
 		cout<< "      GeometryCollections: " <<summary.num_geometrycollection_features<< endl;
 	cout<< endl;
 	cout<< "  Processed pixels: " <<summary.num_processed_pixels<< endl;
+	cout<< endl;
+	cout<< "  Features by extent:" << endl;
+	cout<< "      inside raster (no overlay): " <<summary.num_contained_features<< endl;
+	cout<< "      outside raster (rejected): " <<summary.num_disjoint_features<< endl;
+	cout<< "      overlay computed: " <<summary.num_overlay_features<< endl;
+	if ( summary.num_fetched_features || summary.num_skipped_features ) {
+		cout<< "  Features by index:" << endl;
+		cout<< "      fetched: " <<summary.num_fetched_features<< endl;
+		cout<< "      skipped: " <<summary.num_skipped_features<< endl;
+	}
+	if ( summary.num_footprint_hits || summary.num_footprint_misses ) {
+		cout<< "  Footprint cache:" << endl;
+		cout<< "      hits: " <<summary.num_footprint_hits<< endl;
+		cout<< "      misses: " <<summary.num_footprint_misses<< endl;
+	}
 }
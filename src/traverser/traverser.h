@@ -12,6 +12,9 @@
 #include "Vector.h"
 #include "rasterizers.h"
 #include "Progress.h"
+#include "EnvelopeIndex.h"
+#include "pixset.h"
+#include "coverage.h"
 
 #include <geos/version.h>
 #if GEOS_VERSION_MAJOR < 3
@@ -66,57 +69,6 @@ using namespace std;
 #endif
 
 
-/**
-  * Pixel location.
-  * Used as element for set of visited pixels
-  */
-class EPixel {
-	public:
-	int col, row;
-	EPixel(int col, int row) : col(col), row(row) {}
-	EPixel(const EPixel& p) : col(p.col), row(p.row) {}
-	bool operator<(EPixel const &right) const {
-		if ( col < right.col )
-			return true;
-		else if ( col == right.col )
-			return row < right.row;
-		else
-			return false;
-	}
-};
-
-
-/**
-  * Set of visited pixels in feature currently being processed
-  */
-class PixSet {
-	set<EPixel> _set;
-
-public:
-	class Iterator {
-		friend class PixSet;
-		
-		PixSet* ps;
-		set<EPixel>::iterator colrow;
-		
-		Iterator(PixSet* ps);
-	public:
-		~Iterator();
-		bool hasNext();
-		void next(int *col, int *row);
-	};
-
-	PixSet();
-	~PixSet();
-	
-	void insert(int col, int row);
-	int size();
-	bool contains(int col, int row);
-	void clear();
-	Iterator* iterator();
-};
-
-
 /**
   * Info passed in observer#init(info)
   */
@@ -136,8 +88,11 @@ struct GlobalInfo {
 };
 
 
-// forward declaration
+// forward declarations
 class Traverser;
+class FootprintCache;
+struct Footprint;
+struct FeatureRecord;
 
 
 /**
@@ -189,11 +144,20 @@ struct TraversalEvent {
 	  */
 	void* bandValues;
 	
-	TraversalEvent(int col, int row, double x, double y) {
+	/**
+	  * Proportion of the pixel covered by the feature, in [0,1].
+	  * Only computed when polygons are rasterized with the coverage grid
+	  * (see GlobalOptions::rasterizer); 1.0 otherwise, in particular
+	  * for points and lines.
+	  */
+	double coverage;
+	
+	TraversalEvent(int col, int row, double x, double y, double coverage = 1.0) {
 		pixel.col = col;
 		pixel.row = row;
 		pixel.x = x;
 		pixel.y = y;
+		this->coverage = coverage;
 	}
 };
 
@@ -214,6 +178,24 @@ public:
 	  */
 	virtual bool isSimple(void) { return false; }
 	
+	/**
+	  * Returns true if this observer uses the coverage of the pixels
+	  * (TraversalEvent::coverage), in which case polygons are processed
+	  * with the coverage grid unless the quadtree is explicitly requested.
+	  * This base class returns false.
+	  */
+	virtual bool needsCoverage(void) { return false; }
+
+	/**
+	  * Returns true if this observer uses the values of the given band
+	  * (1-based index in GlobalInfo::bands). Only called for observers
+	  * that are not simple, when the traversal begins. Bands not used by
+	  * any observer are not read by the traverser; their values in the
+	  * traversal events are undefined.
+	  * This base class returns true.
+	  */
+	virtual bool usesBand(int band_index) { return true; }
+	
 	/**
 	  * Called only once at the beginning of a traversal processing.
 	  */
@@ -264,6 +246,30 @@ inline Polygon* create_pix_poly(double x0, double y0, double x1, double y1) {
 }
 
 
+/**
+  * Serializes GEOS operations while worker threads are running (see
+  * threads.cc): the GEOS geometries created by the traversers share
+  * global_factory, and the overlay operations are not thread-safe.
+  * Locks on construction and unlocks on destruction; does nothing when
+  * not enabled. The lock is recursive.
+  */
+class GeosLock {
+public:
+	GeosLock() : locked(false) { lock(); }
+	~GeosLock() { unlock(); }
+
+	void lock(void);
+	void unlock(void);
+
+	/** enables/disables the lock; only to be called with no workers running */
+	static void setEnabled(bool enabled);
+
+private:
+	bool locked;
+	static bool enabled;
+};
+
+
 	
 
 
@@ -356,6 +362,16 @@ public:
 	  */
 	void setDesiredFID(long FID);
 
+	/**
+	  * Sets the recorded notifications (see recorder.h) for the feature
+	  * given by setDesiredFID. If not null, traverse() replays the record
+	  * to the observers instead of reading and processing the feature, so
+	  * no geometry operations or raster reads are done.
+	  * The record must have been obtained with the same rasters (possibly
+	  * followed by others) and options as this traverser.
+	  */
+	void setFeatureRecord(FeatureRecord* rec) { featureRecord = rec; }
+
 	/**
 	  * Only the feature whose given field is equal to the given value
 	  * FID will be processed.
@@ -467,8 +483,41 @@ public:
 		return pixset.contains(col, row);
 	}
 	
+	/**
+	  * Sets the number of threads to process features.
+	  * With n > 1, features are processed concurrently by n worker
+	  * traversers, each with its own raster datasets. Observers are still
+	  * notified from the calling thread and in the same order as with a
+	  * single thread. Only applies when all features are traversed (ie.,
+	  * not with setDesiredFID or setDesiredFeatureByField).
+	  * Initial value taken from globalOptions.num_threads.
+	  */
+	void setNumThreads(int n) { numThreads = n; }
+	
+	/**
+	  * Sets whether an index of feature envelopes should be used to get
+	  * the features intersecting the raster extent. The index is built
+	  * by the first traversal of all features (one pass over the layer)
+	  * and reused by subsequent traversals, eg., with other rasters; each
+	  * of them then only fetches the candidate features by FID instead of
+	  * reading the layer with a spatial filter.
+	  * Not used with --sql, --buffer or --box. False by default.
+	  */
+	void setFeatureIndex(bool b);
+	
+	/**
+	  * Sets a cache of feature footprints. With a cache, the visited pixels
+	  * of a feature are obtained from it if the feature was already
+	  * traversed on a raster with the same grid (size and geotransform) 
+	  * and parameters (pixel proportion, rasterizer, buffer, box), so only
+	  * the band values are read; otherwise, the footprint is added to the
+	  * cache. Only used in single-threaded traversals of all features.
+	  * The cache is not owned by this traverser. Null by default.
+	  */
+	void setFootprintCache(FootprintCache* cache) { footprintCache = cache; }
+	
 	/** summary results for each traversal */
-	struct {
+	struct Summary {
 		int num_intersecting_features;
 		int num_point_features;
 		int num_multipoint_features;
@@ -483,6 +532,22 @@ public:
 		int num_sub_polys;
 		long num_processed_pixels;
 		
+		// extent pruning before the raster-feature intersection:
+		int num_contained_features;   // inside raster extent: no overlay
+		int num_disjoint_features;    // outside raster extent: rejected
+		int num_overlay_features;     // overlay computed
+		
+		// feature index (see setFeatureIndex):
+		int num_fetched_features;     // candidates fetched by FID
+		int num_skipped_features;     // not fetched
+		
+		// footprint cache (see setFootprintCache):
+		int num_footprint_hits;
+		int num_footprint_misses;
+		
+		/** adds the counts in s to this summary */
+		void add(const Summary& s);
+		
 	} summary;
 	
 	/** reports a summary of intersection to std output. */
@@ -596,8 +661,10 @@ private:
 	vector<Raster*> rasts;
 	vector<Observer*> observers;
 	bool notSimpleObserver;
+	bool coverageObserver;
 
 	long desired_FID;
+	FeatureRecord* featureRecord;
 	string desired_fieldName;
 	string desired_fieldValue;
 	
@@ -613,6 +680,44 @@ private:
 	LineRasterizer* lineRasterizer;
 	void notifyObservers(void);
 	void getBandValuesForPixel(int col, int row);
+	size_t readBandValue(unsigned i, int col, int row, char* ptr);
+	
+	// per band in globalInfo.bands: is it used by some observer?
+	// (see Observer::usesBand; set by beginTraversal)
+	vector<bool> bandsUsed;
+	
+	/**
+	  * Window of band values covering the envelope of the current feature
+	  * intersection. All bands are read with one RasterIO call each, so
+	  * band values for dispatched pixels are served from memory instead
+	  * of issuing a 1x1 read per pixel per band.
+	  * Stored band-sequential; each band in its native data type.
+	  */
+	struct {
+		char* buffer;
+		size_t bufferSize;
+		bool loaded;
+		int col0, row0;
+		int cols, rows;
+		vector<size_t> bandOffsets;
+		vector<int> bandTypeSizes;
+	} window;
+	
+	/** max number of bytes for the window buffer; see loadBandWindow */
+	static const size_t MAX_WINDOW_BYTES = 64 * 1024 * 1024;
+	
+	/**
+	  * For each band in globalInfo.bands, the memory mapped image of its
+	  * raster (NULL if read through GDAL) and its index in that image.
+	  * Values of these bands are copied directly from the mapped pages,
+	  * so they are not loaded in the window.
+	  */
+	vector<RawImage*> bandRawImages;
+	vector<int> bandRawIndices;
+	
+	bool getPixelEnvelope(OGRGeometry* geometry, int *col0, int *row0, int *col1, int *row1);
+	void loadBandWindow(int col0, int row0, int col1, int row1);
+	void releaseBandWindow(void);
 	
 	/** (x,y) to (col,row) conversion */
 	inline void toColRow(double x, double y, int *col, int *row) {
@@ -638,12 +743,12 @@ private:
 	// Return:
 	//   -1: [col,row] out of raster extension
 	//   0:  [col,row] dispached and added to pixset
-	inline int dispatchPixel(int col, int row, double x, double y) {
+	inline int dispatchPixel(int col, int row, double x, double y, double coverage = 1.0) {
 		if ( col < 0 || col >= width  ||  row < 0 || row >= height ) {
 			return -1;
 		}
 		
-		TraversalEvent event(col, row, x, y);
+		TraversalEvent event(col, row, x, y, coverage);
 		summary.num_processed_pixels++;
 		
 		// if at least one observer is not simple...
@@ -659,6 +764,10 @@ private:
 		
 		// keep track of processed pixels
 		pixset.insert(col, row);
+		
+		if ( footprint ) {
+			addFootprintPixel(col, row, x, y, coverage);
+		}
 		return 0;
 	}
 	
@@ -671,12 +780,52 @@ private:
 	void rasterize_poly_QT(_Rect& env, Polygon* poly);
 	void rasterize_geometry_QT(_Rect& env, Geometry* geom);
 	void dispatchRect_QT(_Rect& r);
+	void processValidPolygon_SL(Polygon* geos_poly);
+	void addRingToCoverage(const LineString* ring, bool hole, double x, double y);
+	void rasterize_poly_SL(_Rect& env, int col, int row);
+	void dispatchRect_SL(_Rect& r, int ecol, int erow);
+	
+	// coverage of polygon being processed by processValidPolygon_SL
+	CoverageGrid coverageGrid;
 	void processPolygon(OGRPolygon* poly);
 	void processMultiPolygon(OGRMultiPolygon* mpoly);
 	void processGeometryCollection(OGRGeometryCollection* coll);
 	void processGeometry(OGRGeometry* intersection_geometry, bool count);
 
 	void process_feature(OGRFeature* feature);
+	void process_feature_cached(OGRFeature* feature);
+	void process_feature_uncached(OGRFeature* feature);
+	
+	// setup and cleanup of resources for the processing of features:
+	void beginTraversal(void);
+	void endTraversal(void);
+	
+	// notifies observers about a recorded feature:
+	void replayFeature(FeatureRecord* rec);
+
+	// footprint cache:
+	FootprintCache* footprintCache;
+	int footprintGrid;          // grid id of current traversal
+	Footprint* footprint;       // footprint being recorded, if any
+	bool footprintComplete;     // was the feature completely processed?
+	void addFootprintPixel(int col, int row, double x, double y, double coverage);
+	void replayFootprint(OGRFeature* feature, Footprint& fp);
+	void cacheFeatureRecord(FeatureRecord* rec);
+	bool cacheableFeature(OGRFeature* feature);
+	
+	// feature index:
+	bool useFeatureIndex;
+	EnvelopeIndex* featureIndex;
+	vector<long> featureIndexFIDs;    // FID of each item in featureIndex
+	vector<int> featureCandidates;    // items for current traversal
+	unsigned nextCandidate;
+	bool buildFeatureIndex(OGRLayer* layer);
+	OGRFeature* nextFeature(OGRLayer* layer);
+	
+	// multi-threaded processing (see threads.cc):
+	int numThreads;
+	void traverseParallel(OGRLayer* layer, Progress* progress);
+	static void* workerMain(void* arg);
 	
 	// LineRasterizerObserver	
 	void pixelFound(double x, double y);
@@ -0,0 +1,129 @@
+//
+// EnvelopeIndex - Static spatial index of rectangles
+// Carlos A. Rueda
+// $Id$
+// See EnvelopeIndex.h for public doc.
+//
+
+#include "EnvelopeIndex.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+
+// to sort nodes by center x:
+bool EnvelopeIndex::byX(const Node& a, const Node& b) {
+	return a.minX + a.maxX < b.minX + b.maxX;
+}
+
+// to sort nodes by center y:
+bool EnvelopeIndex::byY(const Node& a, const Node& b) {
+	return a.minY + a.maxY < b.minY + b.maxY;
+}
+
+
+EnvelopeIndex::EnvelopeIndex(int nodeCapacity)
+: nodeCapacity(nodeCapacity), numLeaves(0), built(false) {
+	assert( nodeCapacity >= 2 );
+}
+
+
+void EnvelopeIndex::insert(double minX, double minY, double maxX, double maxY, int item) {
+	assert( !built );
+	Node node;
+	node.minX = minX;
+	node.minY = minY;
+	node.maxX = maxX;
+	node.maxY = maxY;
+	node.item = item;
+	node.numChildren = 0;
+	nodes.push_back(node);
+	numLeaves++;
+}
+
+
+void EnvelopeIndex::build(void) {
+	if ( built )
+		return;
+	built = true;
+
+	int first = 0;
+	int count = numLeaves;
+	while ( count > 1 ) {
+		sortTiles(first, count);
+		buildLevel(first, count);
+		first += count;
+		count = nodes.size() - first;
+	}
+}
+
+
+//
+// STR ordering of the nodes in [first, first+count): vertical slices by
+// center x, each slice sorted by center y.
+//
+void EnvelopeIndex::sortTiles(int first, int count) {
+	const int numParents = (count + nodeCapacity - 1) / nodeCapacity;
+	const int numSlices = (int) ceil(sqrt((double) numParents));
+	const int sliceSize = numSlices * nodeCapacity;
+
+	vector<Node>::iterator begin = nodes.begin() + first;
+	vector<Node>::iterator end = begin + count;
+	sort(begin, end, byX);
+	for ( vector<Node>::iterator slice = begin; slice < end; slice += sliceSize ) {
+		vector<Node>::iterator sliceEnd = end - slice > sliceSize ? slice + sliceSize : end;
+		sort(slice, sliceEnd, byY);
+	}
+}
+
+
+//
+// Appends the parents of the nodes in [first, first+count), taking
+// consecutive groups of nodeCapacity nodes.
+//
+void EnvelopeIndex::buildLevel(int first, int count) {
+	for ( int i = 0; i < count; i += nodeCapacity ) {
+		Node parent = nodes[first + i];
+		parent.item = first + i;
+		parent.numChildren = min(nodeCapacity, count - i);
+		for ( int k = 1; k < parent.numChildren; k++ ) {
+			const Node& child = nodes[first + i + k];
+			parent.minX = min(parent.minX, child.minX);
+			parent.minY = min(parent.minY, child.minY);
+			parent.maxX = max(parent.maxX, child.maxX);
+			parent.maxY = max(parent.maxY, child.maxY);
+		}
+		nodes.push_back(parent);
+	}
+}
+
+
+void EnvelopeIndex::query(double minX, double minY, double maxX, double maxY, vector<int>& items) {
+	build();
+	if ( nodes.size() == 0 )
+		return;
+
+	const unsigned prevSize = items.size();
+
+	vector<int> stack;
+	stack.push_back(nodes.size() - 1);
+	while ( stack.size() > 0 ) {
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if ( node.maxX < minX || node.minX > maxX || node.maxY < minY || node.minY > maxY )
+			continue;
+
+		if ( node.numChildren == 0 ) {
+			items.push_back(node.item);
+		}
+		else {
+			for ( int k = 0; k < node.numChildren; k++ ) {
+				stack.push_back(node.item + k);
+			}
+		}
+	}
+
+	sort(items.begin() + prevSize, items.end());
+}
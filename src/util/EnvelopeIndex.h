@@ -0,0 +1,86 @@
+//
+// EnvelopeIndex - Static spatial index of rectangles
+// Carlos A. Rueda
+// $Id$
+//
+
+#ifndef EnvelopeIndex_h
+#define EnvelopeIndex_h
+
+#include <vector>
+
+using namespace std;
+
+
+/**
+  * A static R-tree of axis-aligned rectangles packed with the
+  * Sort-Tile-Recursive (STR) algorithm.
+  *
+  * Rectangles are added with insert() and the tree is built by the first
+  * query (or explicitly with build()); no more rectangles can be inserted
+  * after that.
+  *
+  * Usage:
+  * <pre>
+  *    EnvelopeIndex index;
+  *    for ( ... )
+  *        index.insert(minX, minY, maxX, maxY, item);
+  *    vector<int> items;
+  *    index.query(minX, minY, maxX, maxY, items);
+  * </pre>
+  */
+class EnvelopeIndex {
+public:
+	/**
+	  * Creates an empty index.
+	  * @param nodeCapacity max number of children per node.
+	  */
+	EnvelopeIndex(int nodeCapacity = 10);
+
+	/**
+	  * Adds a rectangle with an associated item.
+	  */
+	void insert(double minX, double minY, double maxX, double maxY, int item);
+
+	/**
+	  * Builds the tree. Called by query() if not done yet.
+	  */
+	void build(void);
+
+	/**
+	  * Gets the items whose rectangles intersect the given one.
+	  * Items are appended to the given vector in increasing order.
+	  */
+	void query(double minX, double minY, double maxX, double maxY, vector<int>& items);
+
+	/**
+	  * Number of rectangles in this index.
+	  */
+	int size(void) { return numLeaves; }
+
+private:
+	struct Node {
+		double minX, minY, maxX, maxY;
+
+		// for a leaf, the item; otherwise, the index of first child in nodes
+		int item;
+
+		// number of children, 0 for a leaf
+		int numChildren;
+	};
+
+	int nodeCapacity;
+	int numLeaves;
+	bool built;
+
+	/** leaves first, then each upper level; the root is the last node */
+	vector<Node> nodes;
+
+	void buildLevel(int first, int count);
+	void sortTiles(int first, int count);
+
+	static bool byX(const Node& a, const Node& b);
+	static bool byY(const Node& a, const Node& b);
+};
+
+#endif
@@ -0,0 +1,336 @@
+//
+//  Benchmark: writing extracted pixels as a CSV table vs. columnar (.npy).
+//  $Id$
+//
+//    g++ -O2 -Wall columnar_bench.cc -o columnar_bench
+//    zcat ../expected/csv/myoutput.csv.gz > /tmp/table.csv
+//    ./columnar_bench /tmp/table.csv            # default: rows repeated 20 times
+//    ./columnar_bench /tmp/table.csv 50 /tmp    # repetitions, output directory
+//
+//  The rows of a table generated by starspan (FID, 4 attribute fields, RID,
+//  col, row, x, y, and the Int16 bands of the test rasters) are read into
+//  memory and written out again, repeated the given number of times, as
+//  done by the output side of the observers (replicas of the code in
+//  starspan_csv.cc and starspan_columnar.cc):
+//    - table: FID, attributes and RID serialized once per feature, col/row
+//      and band values with starspan_format_long, x/y with "%.3f", records
+//      accumulated in a 1MB buffer;
+//    - table without attributes (as with --fields none);
+//    - columnar: one .npy file per column (FID int64, RID fixed-width
+//      string, col/row int32, x/y float64, bands int16), written in groups
+//      of 64K rows.
+//  Output sizes and write throughput are reported. Raster reading and
+//  rasterization (the same for both outputs) are not included.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+using namespace std;
+
+#define CSV_BUFFER_SIZE     (1024 * 1024)
+#define COLUMNAR_ROW_GROUP  (64 * 1024)
+#define NPY_HEADER_SIZE     128
+
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// as in starspan.h:
+static inline int format_ulong(unsigned long v, char* value) {
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = (char) ('0' + v % 10);
+		v /= 10;
+	} while ( v > 0 );
+	for ( int i = 0; i < n; i++ ) {
+		value[i] = digits[n - 1 - i];
+	}
+	return n;
+}
+
+static inline int format_long(long v, char* value) {
+	if ( v < 0 ) {
+		value[0] = '-';
+		return 1 + format_ulong(0UL - (unsigned long) v, value + 1);
+	}
+	return format_ulong((unsigned long) v, value);
+}
+
+
+struct Row {
+	long fid;
+	vector<string> fields;   // attributes
+	string rid;
+	int col, row;
+	double x, y;
+	short bands[4];
+};
+
+static vector<string> split(const string& line) {
+	vector<string> fields;
+	size_t start = 0;
+	for (;;) {
+		size_t comma = line.find(',', start);
+		fields.push_back(line.substr(start, comma == string::npos ? string::npos : comma - start));
+		if ( comma == string::npos )
+			break;
+		start = comma + 1;
+	}
+	return fields;
+}
+
+static bool read_table(const char* filename, vector<Row>& rows) {
+	FILE* file = fopen(filename, "r");
+	if ( !file )
+		return false;
+	char line[4096];
+	bool header = true;
+	while ( fgets(line, sizeof(line), file) ) {
+		string s(line);
+		if ( s.size() > 0 && s[s.size() - 1] == '\n' )
+			s.erase(s.size() - 1);
+		if ( header ) {
+			header = false;
+			continue;
+		}
+		vector<string> f = split(s);
+		if ( f.size() != 14 ) {
+			fprintf(stderr, "unexpected number of fields: %u\n", (unsigned) f.size());
+			fclose(file);
+			return false;
+		}
+		Row r;
+		r.fid = atol(f[0].c_str());
+		r.fields.assign(f.begin() + 1, f.begin() + 5);
+		r.rid = f[5];
+		r.col = atoi(f[6].c_str());
+		r.row = atoi(f[7].c_str());
+		r.x = atof(f[8].c_str());
+		r.y = atof(f[9].c_str());
+		for ( int b = 0; b < 4; b++ )
+			r.bands[b] = (short) atoi(f[10 + b].c_str());
+		rows.push_back(r);
+	}
+	fclose(file);
+	return true;
+}
+
+
+//
+// table output (CSVObserver::addPixel)
+//
+static long write_table(const vector<Row>& rows, int reps, bool attributes, const char* filename) {
+	FILE* file = fopen(filename, "w");
+	string buffer, prefix;
+	char value[1024];
+	long prefixFid = -1;
+	for ( int k = 0; k < reps; k++ ) {
+		for ( unsigned i = 0; i < rows.size(); i++ ) {
+			const Row& r = rows[i];
+			if ( r.fid != prefixFid ) {
+				prefix.clear();
+				int len = format_long(r.fid, value);
+				prefix.append(value, len);
+				if ( attributes ) {
+					for ( unsigned j = 0; j < r.fields.size(); j++ ) {
+						prefix += ',';
+						prefix += r.fields[j];
+					}
+				}
+				prefix += ',';
+				prefix += r.rid;
+				prefixFid = r.fid;
+			}
+			buffer += prefix;
+			int len = format_long(r.col, value);
+			buffer += ',';
+			buffer.append(value, len);
+			len = format_long(r.row, value);
+			buffer += ',';
+			buffer.append(value, len);
+			len = sprintf(value, "%.3f", r.x);
+			buffer += ',';
+			buffer.append(value, len);
+			len = sprintf(value, "%.3f", r.y);
+			buffer += ',';
+			buffer.append(value, len);
+			for ( int b = 0; b < 4; b++ ) {
+				len = format_long(r.bands[b], value);
+				buffer += ',';
+				buffer.append(value, len);
+			}
+			buffer += '\n';
+			if ( buffer.length() >= CSV_BUFFER_SIZE ) {
+				fwrite(buffer.data(), 1, buffer.length(), file);
+				buffer.clear();
+			}
+		}
+	}
+	fwrite(buffer.data(), 1, buffer.length(), file);
+	long size = ftell(file);
+	fclose(file);
+	return size;
+}
+
+
+//
+// columnar output (NpyColumn)
+//
+struct Column {
+	FILE* file;
+	string descr;
+	int itemSize;
+	long rows;
+	vector<char> buffer;
+
+	void writeHeader(void) {
+		char dict[NPY_HEADER_SIZE];
+		int len = sprintf(dict, "{'descr': '%s', 'fortran_order': False, 'shape': (%ld,), }",
+			descr.c_str(), rows
+		);
+		const int dictSize = NPY_HEADER_SIZE - 10;
+		memset(dict + len, ' ', dictSize - len);
+		dict[dictSize - 1] = '\n';
+		unsigned char preamble[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+			(unsigned char) (dictSize & 0xff), (unsigned char) (dictSize >> 8)
+		};
+		fseek(file, 0, SEEK_SET);
+		fwrite(preamble, 1, sizeof(preamble), file);
+		fwrite(dict, 1, dictSize, file);
+	}
+
+	void open(const string& filename, const string& d, int size) {
+		file = fopen(filename.c_str(), "wb");
+		descr = d;
+		itemSize = size;
+		rows = 0;
+		buffer.reserve((size_t) COLUMNAR_ROW_GROUP * itemSize);
+		writeHeader();
+	}
+
+	inline void add(const void* value) {
+		const char* p = (const char*) value;
+		buffer.insert(buffer.end(), p, p + itemSize);
+	}
+
+	void flush(void) {
+		if ( buffer.size() > 0 ) {
+			fwrite(&buffer[0], 1, buffer.size(), file);
+			rows += buffer.size() / itemSize;
+			buffer.clear();
+		}
+	}
+
+	long close(void) {
+		flush();
+		writeHeader();
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fclose(file);
+		return size;
+	}
+};
+
+static long write_columnar(const vector<Row>& rows, int reps, const string& prefix) {
+	unsigned ridSize = 1;
+	for ( unsigned i = 0; i < rows.size(); i++ ) {
+		if ( ridSize < rows[i].rid.length() )
+			ridSize = rows[i].rid.length();
+	}
+	char ridDescr[32];
+	sprintf(ridDescr, "|S%u", ridSize);
+
+	Column fid, rid, col, row, x, y, bands[4];
+	fid.open(prefix + "FID.npy", "<i8", 8);
+	rid.open(prefix + "RID.npy", ridDescr, ridSize);
+	col.open(prefix + "col.npy", "<i4", 4);
+	row.open(prefix + "row.npy", "<i4", 4);
+	x.open(prefix + "x.npy", "<f8", 8);
+	y.open(prefix + "y.npy", "<f8", 8);
+	for ( int b = 0; b < 4; b++ ) {
+		char name[32];
+		sprintf(name, "Band%d.npy", b + 1);
+		bands[b].open(prefix + name, "<i2", 2);
+	}
+
+	string ridValue;
+	long rowsInGroup = 0;
+	for ( int k = 0; k < reps; k++ ) {
+		for ( unsigned i = 0; i < rows.size(); i++ ) {
+			const Row& r = rows[i];
+			long long f = r.fid;
+			fid.add(&f);
+			ridValue = r.rid;
+			ridValue.resize(ridSize, '\0');
+			rid.add(ridValue.data());
+			int c = r.col, w = r.row;
+			col.add(&c);
+			row.add(&w);
+			x.add(&r.x);
+			y.add(&r.y);
+			for ( int b = 0; b < 4; b++ )
+				bands[b].add(&r.bands[b]);
+			if ( ++rowsInGroup >= COLUMNAR_ROW_GROUP ) {
+				fid.flush(); rid.flush(); col.flush(); row.flush(); x.flush(); y.flush();
+				for ( int b = 0; b < 4; b++ )
+					bands[b].flush();
+				rowsInGroup = 0;
+			}
+		}
+	}
+
+	long size = fid.close() + rid.close() + col.close() + row.close() + x.close() + y.close();
+	for ( int b = 0; b < 4; b++ )
+		size += bands[b].close();
+	return size;
+}
+
+
+static void report(const char* name, long rows, long size, double secs) {
+	printf("%-26s %12ld bytes (%6.1f bytes/row)  %.3fs  %6.2f Mrows/s  %7.1f MB/s\n",
+		name, size, (double) size / rows, secs, rows / secs / 1e6, size / secs / 1e6
+	);
+}
+
+int main(int argc, char** argv) {
+	if ( argc < 2 ) {
+		fprintf(stderr, "usage: columnar_bench table.csv [repetitions [outdir]]\n");
+		return 1;
+	}
+	const int reps = argc > 2 ? atoi(argv[2]) : 20;
+	const string outdir = argc > 3 ? argv[3] : "/tmp";
+
+	vector<Row> rows;
+	if ( !read_table(argv[1], rows) || rows.size() == 0 ) {
+		fprintf(stderr, "%s: cannot read table\n", argv[1]);
+		return 1;
+	}
+	const long total = (long) rows.size() * reps;
+	printf("%u rows x %d = %ld rows\n", (unsigned) rows.size(), reps, total);
+
+	double t0 = now();
+	long size = write_table(rows, reps, true, (outdir + "/bench_table.csv").c_str());
+	double t1 = now();
+	report("table", total, size, t1 - t0);
+
+	t0 = now();
+	size = write_table(rows, reps, false, (outdir + "/bench_table_nofields.csv").c_str());
+	t1 = now();
+	report("table (--fields none)", total, size, t1 - t0);
+
+	t0 = now();
+	size = write_columnar(rows, reps, outdir + "/bench_columnar_");
+	t1 = now();
+	report("columnar", total, size, t1 - t0);
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+//
+//  Benchmark: PixSet (bitmap + sparse fallback) vs. plain std::set<EPixel>.
+//  $Id$
+//
+//    g++ -O2 -Wall -I../../src/traverser pixset_bench.cc ../../src/traverser/pixset.cc -o pixset_bench
+//    ./pixset_bench            # default: 1000 x 1000 envelope
+//    ./pixset_bench 3000 2000
+//
+//  Each case runs in a forked child so the reported peak RSS (ru_maxrss of
+//  the child) only reflects that case.
+//  Cases:
+//    area: a disk filling the envelope (typical polygon feature)
+//    thin: a diagonal line over the envelope; with an envelope bigger than
+//          PixSet::MAX_BITMAP_BITS (eg., 20000 x 20000) PixSet uses its
+//          sparse fallback.
+//
+
+#include "pixset.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+// the previous PixSet implementation
+class SetPixSet {
+	set<EPixel> _set;
+public:
+	void setEnvelope(int, int, int, int) { _set.clear(); }
+	void insert(int col, int row) { _set.insert(EPixel(col, row)); }
+	bool contains(int col, int row) { return _set.find(EPixel(col, row)) != _set.end(); }
+	int size() { return _set.size(); }
+};
+
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+// visits pixels as the traverser does: contains, then insert.
+template <class PS>
+static void run(const char* name, const char* shape, int cols, int rows) {
+	PS ps;
+	double t0 = now();
+	ps.setEnvelope(0, 0, cols, rows);
+	long ops = 0;
+	if ( shape[0] == 'a' ) {
+		double cx = cols / 2.0, cy = rows / 2.0;
+		double r2 = (cx < cy ? cx : cy) * (cx < cy ? cx : cy);
+		for ( int col = 0; col < cols; col++ ) {
+			for ( int row = 0; row < rows; row++ ) {
+				double dx = col - cx, dy = row - cy;
+				if ( dx*dx + dy*dy <= r2 && !ps.contains(col, row) ) {
+					ps.insert(col, row);
+				}
+				ops++;
+			}
+		}
+	}
+	else {
+		for ( int col = 0; col < cols; col++ ) {
+			int row = (int) ((double) col * rows / cols);
+			if ( !ps.contains(col, row) ) {
+				ps.insert(col, row);
+			}
+			ops++;
+		}
+	}
+	// second pass: lookups only
+	long hits = 0;
+	for ( int col = 0; col < cols; col += 7 ) {
+		for ( int row = 0; row < rows; row += 7 ) {
+			if ( ps.contains(col, row) )
+				hits++;
+			ops++;
+		}
+	}
+	double secs = now() - t0;
+	printf("%-8s %-5s size=%-9d ops=%-9ld time=%8.3fs  %8.2f Mops/s  (hits=%ld)\n",
+		name, shape, ps.size(), ops, secs, ops / secs / 1e6, hits
+	);
+	fflush(stdout);
+}
+
+
+template <class PS>
+static void runChild(const char* name, const char* shape, int cols, int rows) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if ( pid == 0 ) {
+		run<PS>(name, shape, cols, rows);
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		printf("%-8s %-5s peak RSS: %ld KB\n", name, shape, usage.ru_maxrss);
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+}
+
+
+int main(int argc, char** argv) {
+	int cols = argc > 1 ? atoi(argv[1]) : 1000;
+	int rows = argc > 2 ? atoi(argv[2]) : 1000;
+	cout<< "envelope: " <<cols<< " x " <<rows<< endl;
+
+	runChild<PixSet>("PixSet", "area", cols, rows);
+	runChild<SetPixSet>("std::set", "area", cols, rows);
+	runChild<PixSet>("PixSet", "thin", cols, rows);
+	runChild<SetPixSet>("std::set", "thin", cols, rows);
+	return 0;
+}
@@ -0,0 +1,506 @@
+//
+//  Check/benchmark: scanline (coverage grid) vs. quadtree rasterization.
+//  $Id$
+//
+//    g++ -O2 -Wall -I../../src/traverser rasterizer_bench.cc ../../src/traverser/coverage.cc -o rasterizer_bench
+//    ./rasterizer_bench ../data/vector/ply/ply.shp
+//
+//  Both algorithms are reproduced here in pixel coordinates, with no GEOS:
+//    qt:       the recursive decomposition of polyqt.cc; the polygon is
+//              clipped (Sutherland-Hodgman) against each quadrant to get
+//              the area of intersection, where polyqt.cc does a GEOS
+//              intersection with a pixel polygon (_Rect::intersect).
+//    scanline: the same decomposition with areas from the coverage grid,
+//              as in polysl.cc, with the grid limited to SL_MAX_PIXELS
+//              and to a few rows (ie., in groups of rows).
+//  The selected pixels must be the same in all cases, and in the same
+//  order for qt and scanline with no groups of rows, except for pixels
+//  whose covered area is within 1e-6 of the threshold (--pixprop, or 0),
+//  which are reported as ties (rounding differences). A rectangle clip is
+//  much cheaper than a GEOS overlay, so the qt times here are a lower bound
+//  of those of the actual quadtree.
+//
+//  Inputs, with --pixprop 0 and 0.5:
+//    - the polygons in the given shapefile (in the grid of the test rasters),
+//      each densified to about 2000 vertices as with --buffer 3 500;
+//    - 200 detailed polygons (noisy disks of 2000 vertices, radius 20-120);
+//    - a large polygon of 200000 vertices and radius 1500 (envelope over
+//      SL_MAX_PIXELS, so the scanline rasterizer processes it in groups).
+//
+
+#include "coverage.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <sys/time.h>
+
+using namespace std;
+
+
+// as in polysl.cc
+#define SL_MAX_PIXELS  (4 * 1024 * 1024)
+#define SL_EPSILON  1e-9
+
+// origin of the test rasters (tests/data/raster/*.hdr), 1m pixels
+#define GRID_X0  742809.826
+#define GRID_Y0  4335565.540
+
+
+struct Ring {
+	vector<double> us, vs;   // pixel coordinates, closed
+	bool hole;
+};
+
+typedef vector<Ring> Polygon;
+
+struct Pixel {
+	int col, row;
+	bool operator==(const Pixel& p) const { return col == p.col && row == p.row; }
+	bool operator<(const Pixel& p) const { return row < p.row || (row == p.row && col < p.col); }
+};
+
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double ring_area(const vector<double>& us, const vector<double>& vs) {
+	double a = 0;
+	for ( unsigned i = 1; i < us.size(); i++ ) {
+		a += (us[i-1] * vs[i] - us[i] * vs[i-1]);
+	}
+	return fabs(a) / 2;
+}
+
+static double poly_area(const Polygon& poly) {
+	double a = 0;
+	for ( unsigned k = 0; k < poly.size(); k++ ) {
+		double ra = ring_area(poly[k].us, poly[k].vs);
+		a += poly[k].hole ? -ra : ra;
+	}
+	return a;
+}
+
+
+//
+// Sutherland-Hodgman clipping of a ring against one side of a rectangle.
+// side: 0: u >= lim, 1: u <= lim, 2: v >= lim, 3: v <= lim
+//
+static void clip_side(const vector<double>& us, const vector<double>& vs,
+	vector<double>& ous, vector<double>& ovs, int side, double lim)
+{
+	ous.clear();
+	ovs.clear();
+	const unsigned n = us.size();
+	if ( n < 2 )
+		return;
+	for ( unsigned i = 0; i + 1 < n; i++ ) {
+		double ua = us[i], va = vs[i], ub = us[i+1], vb = vs[i+1];
+		double ca = side < 2 ? ua : va, cb = side < 2 ? ub : vb;
+		bool ina = (side & 1) ? ca <= lim : ca >= lim;
+		bool inb = (side & 1) ? cb <= lim : cb >= lim;
+		if ( ina ) {
+			ous.push_back(ua);
+			ovs.push_back(va);
+		}
+		if ( ina != inb ) {
+			double t = (lim - ca) / (cb - ca);
+			ous.push_back(ua + t * (ub - ua));
+			ovs.push_back(va + t * (vb - va));
+		}
+	}
+	if ( ous.size() > 0 ) {
+		ous.push_back(ous[0]);
+		ovs.push_back(ovs[0]);
+	}
+}
+
+static void clip(const Polygon& poly, double u0, double v0, double u1, double v1, Polygon& res) {
+	res.clear();
+	vector<double> aus, avs, bus, bvs;
+	for ( unsigned k = 0; k < poly.size(); k++ ) {
+		clip_side(poly[k].us, poly[k].vs, aus, avs, 0, u0);
+		clip_side(aus, avs, bus, bvs, 1, u1);
+		clip_side(bus, bvs, aus, avs, 2, v0);
+		clip_side(aus, avs, bus, bvs, 3, v1);
+		if ( bus.size() > 3 ) {
+			Ring ring;
+			ring.us = bus;
+			ring.vs = bvs;
+			ring.hole = poly[k].hole;
+			res.push_back(ring);
+		}
+	}
+}
+
+
+//
+// quadtree with clipping (polyqt.cc)
+//
+struct QT {
+	double pix_prop;
+	vector<Pixel> pixels;
+
+	void dispatch(int col, int row, int cols, int rows) {
+		for ( int i = 0; i < rows; i++ ) {
+			for ( int j = 0; j < cols; j++ ) {
+				Pixel p = { col + j, row + i };
+				pixels.push_back(p);
+			}
+		}
+	}
+
+	void rasterize(int col, int row, int cols, int rows, const Polygon& poly) {
+		if ( cols <= 0 || rows <= 0 )
+			return;
+		double area_e = (double) cols * rows;
+		double area_i = poly_area(poly);
+		if ( area_i < SL_EPSILON )
+			return;
+		if ( area_i >= area_e - (1.0 - pix_prop) - SL_EPSILON ) {
+			dispatch(col, row, cols, rows);
+			return;
+		}
+		if ( pix_prop > 0.0 ) {
+			if ( area_i < pix_prop - SL_EPSILON )
+				return;
+		}
+		else if ( cols == 1 && rows == 1 ) {
+			dispatch(col, row, cols, rows);
+			return;
+		}
+		const int cols2 = cols >> 1;
+		const int rows2 = rows >> 1;
+		child(col, row, cols2, rows2, poly);
+		child(col + cols2, row, cols - cols2, rows2, poly);
+		child(col, row + rows2, cols2, rows - rows2, poly);
+		if ( cols > 1 || rows > 1 )
+			child(col + cols2, row + rows2, cols - cols2, rows - rows2, poly);
+	}
+
+	void child(int col, int row, int cols, int rows, const Polygon& poly) {
+		if ( cols <= 0 || rows <= 0 )
+			return;
+		Polygon inters;
+		clip(poly, col, row, col + cols, row + rows, inters);
+		if ( inters.size() > 0 )
+			rasterize(col, row, cols, rows, inters);
+	}
+
+	void run(const Polygon& poly, int col0, int row0, int cols, int rows) {
+		rasterize(col0, row0, cols, rows, poly);
+	}
+};
+
+
+//
+// quadtree with areas from the coverage grid (polysl.cc)
+//
+struct SL {
+	double pix_prop;
+	int maxPixels;
+	CoverageGrid grid;
+	vector<Pixel> pixels;
+
+	void dispatch(int col0, int row0, int col, int row, int cols, int rows) {
+		for ( int i = 0; i < rows; i++ ) {
+			for ( int j = 0; j < cols; j++ ) {
+				Pixel p = { col0 + col + j, row0 + row + i };
+				pixels.push_back(p);
+			}
+		}
+	}
+
+	void rasterize(int col0, int row0, int col, int row, int cols, int rows) {
+		if ( cols <= 0 || rows <= 0 )
+			return;
+		double area_i = grid.area(col, row, cols, rows);
+		if ( area_i < SL_EPSILON )
+			return;
+		double area_e = (double) cols * rows;
+		if ( area_i >= area_e - (1.0 - pix_prop) - SL_EPSILON ) {
+			dispatch(col0, row0, col, row, cols, rows);
+			return;
+		}
+		if ( pix_prop > 0.0 ) {
+			if ( area_i < pix_prop - SL_EPSILON )
+				return;
+		}
+		else if ( cols == 1 && rows == 1 ) {
+			dispatch(col0, row0, col, row, cols, rows);
+			return;
+		}
+		const int cols2 = cols >> 1;
+		const int rows2 = rows >> 1;
+		rasterize(col0, row0, col, row, cols2, rows2);
+		rasterize(col0, row0, col + cols2, row, cols - cols2, rows2);
+		rasterize(col0, row0, col, row + rows2, cols2, rows - rows2);
+		if ( cols > 1 || rows > 1 )
+			rasterize(col0, row0, col + cols2, row + rows2, cols - cols2, rows - rows2);
+	}
+
+	void run(const Polygon& poly, int col0, int row0, int cols, int rows) {
+		int group_rows = rows;
+		if ( (double) cols * rows > maxPixels ) {
+			group_rows = maxPixels / cols;
+			if ( group_rows < 1 )
+				group_rows = 1;
+		}
+		for ( int r0 = 0; r0 < rows; r0 += group_rows ) {
+			const int nrows = rows - r0 < group_rows ? rows - r0 : group_rows;
+			grid.reset(cols, nrows);
+			for ( unsigned k = 0; k < poly.size(); k++ ) {
+				const Ring& ring = poly[k];
+				vector<double> us(ring.us.size()), vs(ring.vs.size());
+				for ( unsigned i = 0; i < us.size(); i++ ) {
+					us[i] = ring.us[i] - col0;
+					vs[i] = ring.vs[i] - (row0 + r0);
+				}
+				grid.addRing(&us[0], &vs[0], us.size(), ring.hole);
+			}
+			grid.compute();
+			rasterize(col0, row0 + r0, 0, 0, cols, nrows);
+		}
+	}
+};
+
+
+static void envelope(const Polygon& poly, int* col0, int* row0, int* cols, int* rows) {
+	double u0 = 1e300, v0 = 1e300, u1 = -1e300, v1 = -1e300;
+	for ( unsigned k = 0; k < poly.size(); k++ ) {
+		for ( unsigned i = 0; i < poly[k].us.size(); i++ ) {
+			u0 = min(u0, poly[k].us[i]);
+			u1 = max(u1, poly[k].us[i]);
+			v0 = min(v0, poly[k].vs[i]);
+			v1 = max(v1, poly[k].vs[i]);
+		}
+	}
+	*col0 = (int) floor(u0);
+	*row0 = (int) floor(v0);
+	*cols = (int) floor(u1) - *col0 + 1;
+	*rows = (int) floor(v1) - *row0 + 1;
+}
+
+// splits each edge so the ring gets about n vertices
+static void densify(Ring& ring, int n) {
+	double length = 0;
+	for ( unsigned i = 1; i < ring.us.size(); i++ )
+		length += hypot(ring.us[i] - ring.us[i-1], ring.vs[i] - ring.vs[i-1]);
+	const double step = length / n;
+	vector<double> us, vs;
+	for ( unsigned i = 1; i < ring.us.size(); i++ ) {
+		double d = hypot(ring.us[i] - ring.us[i-1], ring.vs[i] - ring.vs[i-1]);
+		int k = (int) ceil(d / step);
+		for ( int j = 0; j < k; j++ ) {
+			us.push_back(ring.us[i-1] + (ring.us[i] - ring.us[i-1]) * j / k);
+			vs.push_back(ring.vs[i-1] + (ring.vs[i] - ring.vs[i-1]) * j / k);
+		}
+	}
+	us.push_back(us[0]);
+	vs.push_back(vs[0]);
+	ring.us.swap(us);
+	ring.vs.swap(vs);
+}
+
+// a disk with noisy radius (star-shaped, so simple)
+static Polygon noisy_disk(double cu, double cv, double radius, int n) {
+	Ring ring;
+	ring.hole = false;
+	double phase1 = rand() % 100, phase2 = rand() % 100;
+	for ( int i = 0; i < n; i++ ) {
+		double a = 2 * M_PI * i / n;
+		double r = radius * (1 + 0.15 * sin(7 * a + phase1) + 0.05 * sin(61 * a + phase2)
+		                       + 0.01 * (rand() / (double) RAND_MAX));
+		ring.us.push_back(cu + r * cos(a));
+		ring.vs.push_back(cv + r * sin(a));
+	}
+	ring.us.push_back(ring.us[0]);
+	ring.vs.push_back(ring.vs[0]);
+	return Polygon(1, ring);
+}
+
+static int read_le_int(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+static int read_be_int(const unsigned char* p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static double read_le_double(const unsigned char* p) {
+	double d;
+	memcpy(&d, p, 8);   // (little endian host assumed)
+	return d;
+}
+
+//
+// Polygons (shape type 5) in a shapefile, in pixel coordinates.
+// The ring orientation gives exterior rings and holes.
+//
+static bool read_shapefile(const char* filename, vector<Polygon>& polys) {
+	FILE* file = fopen(filename, "rb");
+	if ( !file )
+		return false;
+	vector<unsigned char> data;
+	unsigned char buf[4096];
+	size_t n;
+	while ( (n = fread(buf, 1, sizeof(buf), file)) > 0 )
+		data.insert(data.end(), buf, buf + n);
+	fclose(file);
+
+	size_t pos = 100;
+	while ( pos + 12 <= data.size() ) {
+		const int contentLength = 2 * read_be_int(&data[pos + 4]);
+		const unsigned char* rec = &data[pos + 8];
+		pos += 8 + contentLength;
+		if ( read_le_int(rec) != 5 )
+			continue;
+		const int numParts = read_le_int(rec + 36);
+		const int numPoints = read_le_int(rec + 40);
+		const unsigned char* parts = rec + 44;
+		const unsigned char* points = parts + 4 * numParts;
+		Polygon poly;
+		for ( int k = 0; k < numParts; k++ ) {
+			const int start = read_le_int(parts + 4 * k);
+			const int end = k + 1 < numParts ? read_le_int(parts + 4 * (k + 1)) : numPoints;
+			Ring ring;
+			double signedArea = 0;
+			for ( int i = start; i < end; i++ ) {
+				ring.us.push_back(read_le_double(points + 16 * i) - GRID_X0);
+				ring.vs.push_back(GRID_Y0 - read_le_double(points + 16 * i + 8));
+				if ( i > start ) {
+					const int j = ring.us.size() - 1;
+					signedArea += ring.us[j-1] * ring.vs[j] - ring.us[j] * ring.vs[j-1];
+				}
+			}
+			// clockwise in map coordinates (exterior) is counterclockwise here:
+			ring.hole = signedArea < 0;
+			poly.push_back(ring);
+		}
+		polys.push_back(poly);
+	}
+	return true;
+}
+
+
+//
+// Number of pixels selected by only one of a and b (both sorted) and not
+// ties, ie., with an area not within 1e-6 of the threshold.
+//
+static int mismatches(const vector<Pixel>& a, const vector<Pixel>& b, const Polygon& poly,
+	double pix_prop, long* ties)
+{
+	vector<Pixel> diff;
+	set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), back_inserter(diff));
+	int errors = 0;
+	for ( unsigned i = 0; i < diff.size(); i++ ) {
+		Polygon inters;
+		clip(poly, diff[i].col, diff[i].row, diff[i].col + 1, diff[i].row + 1, inters);
+		if ( fabs(poly_area(inters) - pix_prop) < 1e-6 )
+			(*ties)++;
+		else
+			errors++;
+	}
+	return errors;
+}
+
+//
+// runs both algorithms on the polygons; returns the number of mismatches
+//
+static int run(const char* name, vector<Polygon>& polys, double pix_prop) {
+	QT qt;
+	qt.pix_prop = pix_prop;
+	SL sl;
+	sl.pix_prop = pix_prop;
+	sl.maxPixels = SL_MAX_PIXELS;
+	SL slGroups;
+	slGroups.pix_prop = pix_prop;
+
+	double tqt = 0, tsl = 0, tgroups = 0;
+	long pixels = 0, ties = 0;
+	int errors = 0;
+	for ( unsigned p = 0; p < polys.size(); p++ ) {
+		int col0, row0, cols, rows;
+		envelope(polys[p], &col0, &row0, &cols, &rows);
+		slGroups.maxPixels = cols * 7;   // groups of 7 rows
+
+		qt.pixels.clear();
+		sl.pixels.clear();
+		slGroups.pixels.clear();
+
+		double t0 = now();
+		qt.run(polys[p], col0, row0, cols, rows);
+		double t1 = now();
+		sl.run(polys[p], col0, row0, cols, rows);
+		double t2 = now();
+		slGroups.run(polys[p], col0, row0, cols, rows);
+		double t3 = now();
+		tqt += t1 - t0;
+		tsl += t2 - t1;
+		tgroups += t3 - t2;
+		pixels += qt.pixels.size();
+
+		// same order if no groups were needed:
+		const bool sameOrder = (double) cols * rows > SL_MAX_PIXELS || qt.pixels == sl.pixels;
+		sort(qt.pixels.begin(), qt.pixels.end());
+		sort(sl.pixels.begin(), sl.pixels.end());
+		sort(slGroups.pixels.begin(), slGroups.pixels.end());
+		long polyTies = 0;
+		const bool same = mismatches(qt.pixels, sl.pixels, polys[p], pix_prop, &polyTies) == 0
+		               && mismatches(qt.pixels, slGroups.pixels, polys[p], pix_prop, &polyTies) == 0
+		               && (sameOrder || polyTies > 0);
+		ties += polyTies;
+		if ( !same ) {
+			if ( errors++ < 5 )
+				fprintf(stderr, "%s, polygon %u: qt %u pixels, scanline %u, groups %u\n",
+					name, p, (unsigned) qt.pixels.size(),
+					(unsigned) sl.pixels.size(), (unsigned) slGroups.pixels.size());
+		}
+	}
+	printf("%-24s pixprop %.1f: %8ld pixels; qt %6.3fs, scanline %6.3fs (%4.1fx), groups of 7 rows %6.3fs; %s (%ld ties)\n",
+		name, pix_prop, pixels, tqt, tsl, tqt / tsl, tgroups,
+		errors ? "DIFFERENT PIXELS" : "same pixels", ties);
+	return errors;
+}
+
+
+int main(int argc, char** argv) {
+	if ( argc < 2 ) {
+		fprintf(stderr, "rasterizer_bench <polygon-shapefile>\n");
+		return 1;
+	}
+	vector<Polygon> shapes;
+	if ( !read_shapefile(argv[1], shapes) || shapes.size() == 0 ) {
+		fprintf(stderr, "%s: cannot read polygons\n", argv[1]);
+		return 1;
+	}
+	for ( unsigned p = 0; p < shapes.size(); p++ ) {
+		for ( unsigned k = 0; k < shapes[p].size(); k++ )
+			densify(shapes[p][k], 2000);
+	}
+
+	srand(1);
+	vector<Polygon> detailed;
+	for ( int i = 0; i < 200; i++ ) {
+		detailed.push_back(noisy_disk(500 + (rand() % 10000) / 100.0, 500 + (rand() % 10000) / 100.0,
+			20 + rand() % 100, 2000));
+	}
+	vector<Polygon> large;
+	large.push_back(noisy_disk(2000.3, 2000.7, 1500, 200000));
+
+	int errors = 0;
+	const double pix_props[] = { 0.0, 0.5 };
+	for ( int i = 0; i < 2; i++ ) {
+		errors += run("shapefile (densified)", shapes, pix_props[i]);
+		errors += run("200 detailed polygons", detailed, pix_props[i]);
+		errors += run("large polygon", large, pix_props[i]);
+	}
+	return errors ? 1 : 0;
+}
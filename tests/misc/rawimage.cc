@@ -0,0 +1,80 @@
+//
+//  Check/benchmark: RawImage (memory mapped ENVI image) vs. GDAL RasterIO.
+//  $Id$
+//
+//    g++ -O2 -Wall -I../../src -I../../src/raster `gdal-config --cflags` rawimage.cc ../../src/raster/RawImage.cc `gdal-config --libs` -o rawimage
+//    ./rawimage ../data/raster/starspan1raster.img
+//
+//  All band values of the image are obtained both ways, pixel by pixel,
+//  and compared; the times of both are reported.
+//
+
+#include "RawImage.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/time.h>
+
+using namespace std;
+
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char** argv) {
+	if ( argc < 2 ) {
+		fprintf(stderr, "rawimage <envi-image>\n");
+		return 1;
+	}
+	GDALAllRegister();
+	GDALDataset* dataset = (GDALDataset*) GDALOpen(argv[1], GA_ReadOnly);
+	if ( !dataset ) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	RawImage* raw = RawImage::open(argv[1], dataset);
+	if ( !raw ) {
+		fprintf(stderr, "%s: not a raw ENVI image handled by RawImage\n", argv[1]);
+		return 1;
+	}
+	const int width = dataset->GetRasterXSize();
+	const int height = dataset->GetRasterYSize();
+	const int bands = dataset->GetRasterCount();
+	const int size = raw->getValueSize();
+	printf("%s: %dx%dx%d, interleave %s\n", argv[1], width, height, bands, raw->getInterleave());
+
+	vector<char> gdalValues((size_t) width * height * bands * size);
+	vector<char> rawValues(gdalValues.size());
+
+	double t0 = now();
+	char* ptr = &gdalValues[0];
+	for ( int row = 0; row < height; row++ ) {
+		for ( int col = 0; col < width; col++ ) {
+			for ( int b = 0; b < bands; b++ ) {
+				GDALRasterBand* band = dataset->GetRasterBand(b+1);
+				band->RasterIO(GF_Read, col, row, 1, 1, ptr, 1, 1, band->GetRasterDataType(), 0, 0);
+				ptr += size;
+			}
+		}
+	}
+	double t1 = now();
+	ptr = &rawValues[0];
+	for ( int row = 0; row < height; row++ ) {
+		for ( int col = 0; col < width; col++ ) {
+			raw->getBandValues(col, row, ptr);
+			ptr += bands * size;
+		}
+	}
+	double t2 = now();
+
+	bool same = gdalValues == rawValues;
+	printf("%s; GDAL %.3fs, RawImage %.3fs\n", same ? "same values" : "DIFFERENT VALUES", t1 - t0, t2 - t1);
+
+	delete raw;
+	GDALClose(dataset);
+	return same ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+//
+//  Check/benchmark: StatsKernels reductions, scalar vs. SSE2 vs. AVX2.
+//  $Id$
+//
+//    g++ -O2 -Wall -I../../src/stats stats_kernels_bench.cc ../../src/stats/StatsKernels.cc -o stats_kernels_bench
+//    ./stats_kernels_bench            # default: 10000000 values
+//    ./stats_kernels_bench 1000000
+//
+//  For each type (Byte, UInt16, Int16, Float32), results with each
+//  instruction set supported by the CPU are first compared with the scalar
+//  ones over arrays of random lengths (exactly, except float sums, which
+//  are accumulated in a different order), then the reduction of an array
+//  of the given number of values is timed.
+//
+
+#include "StatsKernels.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <sys/time.h>
+
+using namespace std;
+
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+template <typename T> static T random_value(void);
+template <> unsigned char  random_value(void) { return rand() % 256; }
+template <> unsigned short random_value(void) { return rand() % 65536; }
+template <> short          random_value(void) { return rand() % 65536 - 32768; }
+template <> float          random_value(void) { return (rand() % 2000000) / 7.0f - 100000.0f; }
+
+// dispatches to the reduce variant for T
+static void reduce(const unsigned char* v, unsigned n, bool hasNodata, unsigned char nd, Reduction<double>& r) {
+	Reduction<long long> ri;
+	StatsKernels::reduce(v, n, hasNodata, nd, ri);
+	r.count = ri.count; r.nulls = ri.nulls; r.sum = ri.sum; r.sumsq = ri.sumsq; r.min = ri.min; r.max = ri.max;
+}
+static void reduce(const unsigned short* v, unsigned n, bool hasNodata, unsigned short nd, Reduction<double>& r) {
+	Reduction<long long> ri;
+	StatsKernels::reduce(v, n, hasNodata, nd, ri);
+	r.count = ri.count; r.nulls = ri.nulls; r.sum = ri.sum; r.sumsq = ri.sumsq; r.min = ri.min; r.max = ri.max;
+}
+static void reduce(const short* v, unsigned n, bool hasNodata, short nd, Reduction<double>& r) {
+	Reduction<long long> ri;
+	StatsKernels::reduce(v, n, hasNodata, nd, ri);
+	r.count = ri.count; r.nulls = ri.nulls; r.sum = ri.sum; r.sumsq = ri.sumsq; r.min = ri.min; r.max = ri.max;
+}
+static void reduce(const float* v, unsigned n, bool hasNodata, float nd, Reduction<double>& r) {
+	StatsKernels::reduce(v, n, hasNodata, nd, 0.0, r);
+}
+
+static bool same(const Reduction<double>& a, const Reduction<double>& b, bool exact) {
+	if ( a.count != b.count || a.nulls != b.nulls )
+		return false;
+	if ( a.count == 0 )
+		return true;
+	if ( a.min != b.min || a.max != b.max )
+		return false;
+	if ( exact )
+		return a.sum == b.sum && a.sumsq == b.sumsq;
+	return fabs(a.sum - b.sum) <= 1e-9 * (fabs(a.sum) + 1)
+	    && fabs(a.sumsq - b.sumsq) <= 1e-9 * (fabs(a.sumsq) + 1);
+}
+
+template <typename T>
+static int run(const char* name, unsigned n, bool exact) {
+	const StatsKernels::Isa best = StatsKernels::getBestIsa();
+	int errors = 0;
+
+	// check:
+	srand(1);
+	for ( int t = 0; t < 2000; t++ ) {
+		vector<T> values(rand() % 300 + 1);
+		for ( unsigned i = 0; i < values.size(); i++ )
+			values[i] = random_value<T>();
+		// nodata: some value in the array, or none
+		const bool hasNodata = t % 4 != 0;
+		const T nodata = values[rand() % values.size()];
+		if ( hasNodata ) {
+			for ( unsigned i = 0; i < values.size(); i += 1 + rand() % 5 )
+				values[i] = nodata;
+		}
+
+		StatsKernels::setIsa(StatsKernels::SCALAR);
+		Reduction<double> expected;
+		reduce(&values[0], values.size(), hasNodata, nodata, expected);
+		for ( int isa = StatsKernels::SSE2; isa <= best; isa++ ) {
+			StatsKernels::setIsa((StatsKernels::Isa) isa);
+			Reduction<double> r;
+			reduce(&values[0], values.size(), hasNodata, nodata, r);
+			if ( !same(expected, r, exact) ) {
+				if ( errors++ < 5 ) {
+					fprintf(stderr, "%s %s: %u values: count %lu/%lu nulls %lu/%lu sum %g/%g sumsq %g/%g min %g/%g max %g/%g\n",
+						name, StatsKernels::getIsaName((StatsKernels::Isa) isa), (unsigned) values.size(),
+						expected.count, r.count, expected.nulls, r.nulls, expected.sum, r.sum,
+						expected.sumsq, r.sumsq, expected.min, r.min, expected.max, r.max
+					);
+				}
+			}
+		}
+	}
+
+	// timing:
+	vector<T> values(n);
+	for ( unsigned i = 0; i < n; i++ )
+		values[i] = random_value<T>();
+	printf("%-8s %s", name, errors ? "DIFFERENT RESULTS" : "same results");
+	for ( int isa = StatsKernels::SCALAR; isa <= best; isa++ ) {
+		StatsKernels::setIsa((StatsKernels::Isa) isa);
+		Reduction<double> r;
+		double t0 = now();
+		for ( int k = 0; k < 10; k++ )
+			reduce(&values[0], n, true, values[0], r);
+		double t = (now() - t0) / 10;
+		printf("  %s %7.2f Mvalues/s", StatsKernels::getIsaName((StatsKernels::Isa) isa), n / t / 1e6);
+	}
+	printf("\n");
+	return errors;
+}
+
+int main(int argc, char** argv) {
+	const unsigned n = argc > 1 ? atoi(argv[1]) : 10000000;
+	printf("best instruction set: %s\n", StatsKernels::getIsaName(StatsKernels::getBestIsa()));
+	int errors = 0;
+	errors += run<unsigned char>("Byte", n, true);
+	errors += run<unsigned short>("UInt16", n, true);
+	errors += run<short>("Int16", n, true);
+	errors += run<float>("Float32", n, false);
+	return errors ? 1 : 0;
+}
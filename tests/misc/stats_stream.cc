@@ -0,0 +1,235 @@
+//
+//  Check/benchmark: Stats streaming interface (begin/add/end) vs. compute.
+//  $Id$
+//
+//    g++ -O2 -Wall -I../../src/stats stats_stream.cc ../../src/stats/Stats.cc ../../src/stats/TDigest.cc ../../src/stats/StatsKernels.cc -o stats_stream
+//    ./stats_stream            # default: 1000000 values per feature
+//    ./stats_stream 5000000
+//
+//  For integer values, results (as reported by starspan, "%f") must be the
+//  same with both interfaces; this is checked for many small random
+//  "features" with Byte and Int16 ranges and a wide range (sparse histogram),
+//  adding the values one at a time and as arrays. Some percentiles are
+//  also requested, with p50 checked against the median.
+//  For Float32 and Float64 values, adding them as arrays must give the same
+//  results as adding them one at a time, and the sum must be the same as
+//  with compute (ie., sequential).
+//  For real values, the relative error of the t-digest median is reported,
+//  and the MODE of mostly distinct values (beyond STATS_MAX_MODE_VALUES)
+//  with a value repeated in 1% of them must be as with compute.
+//
+
+#include "Stats.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <sys/time.h>
+
+using namespace std;
+
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void format(Stats& stats, char* str) {
+	str[0] = 0;
+	for ( int i = 0; i < TOT_RESULTS; i++ ) {
+		if ( i != VAR )   // not reported
+			sprintf(str + strlen(str), "%f,", stats.result[i]);
+	}
+	for ( unsigned k = 0; k < stats.percentileResult.size(); k++ ) {
+		sprintf(str + strlen(str), "p%g=%f,", stats.percentiles[k], stats.percentileResult[k]);
+	}
+}
+
+static int random_value(int kind) {
+	switch ( kind ) {
+		case 0:  return rand() % 256;
+		case 1:  return rand() % 65536 - 32768;
+		default: return (rand() % 7) * 1000000 - 3000000;
+	}
+}
+
+int main(int argc, char** argv) {
+	const int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	Stats computed, streamed, blocks;
+	char str1[2048], str2[2048], str3[2048];
+	int errors = 0;
+
+	const char* names[] = { "avg", "mode", "stdev", "min", "max", "sum", "median", "nulls", "p5", "p50", "p97.5", 0 };
+	for ( int i = 0; names[i]; i++ ) {
+		if ( computed.select(names[i]) < 0 || streamed.select(names[i]) < 0 || blocks.select(names[i]) < 0 ) {
+			fprintf(stderr, "%s: not recognized\n", names[i]);
+			errors++;
+		}
+	}
+	if ( computed.select("p101") >= 0 || computed.select("p") >= 0 || computed.select("avgs") >= 0 ) {
+		fprintf(stderr, "invalid names recognized\n");
+		errors++;
+	}
+
+	srand(1);
+	for ( int t = 0; t < 3000; t++ ) {
+		const int kind = t % 3;
+		const int size = rand() % 500;
+		vector<int> values;
+		for ( int i = 0; i < size; i++ ) {
+			values.push_back(random_value(kind));
+		}
+		if ( kind == 0 )
+			streamed.begin(0, 0, 255);
+		else if ( kind == 1 )
+			streamed.begin(0, -32768, 32767);
+		else
+			streamed.begin(0);
+		for ( int i = 0; i < size; i++ ) {
+			streamed.add(values[i]);
+		}
+		streamed.end();
+
+		// same values as arrays:
+		if ( kind == 0 ) {
+			vector<unsigned char> bytes(values.begin(), values.end());
+			blocks.begin(0, 0, 255);
+			for ( int i = 0; i < size; i += 100 )
+				blocks.add(&bytes[i], min(100, size - i));
+		}
+		else if ( kind == 1 ) {
+			vector<short> shorts(values.begin(), values.end());
+			blocks.begin(0, -32768, 32767);
+			for ( int i = 0; i < size; i += 100 )
+				blocks.add(&shorts[i], min(100, size - i));
+		}
+		else {
+			blocks.begin(0);
+			for ( int i = 0; i < size; i += 100 )
+				blocks.add(&values[i], min(100, size - i));
+		}
+		blocks.end();
+
+		computed.compute(values, 0);
+
+		format(computed, str1);
+		format(streamed, str2);
+		format(blocks, str3);
+		if ( strcmp(str1, str2) || strcmp(str1, str3)
+		||   streamed.percentileResult[1] != streamed.result[MEDIAN] ) {
+			if ( errors++ < 5 )
+				fprintf(stderr, "kind %d, %d values:\n  compute: %s\n  stream:  %s\n  arrays:  %s\n", kind, size, str1, str2, str3);
+		}
+	}
+	printf("integer values: %s\n", errors ? "DIFFERENT RESULTS" : "same results");
+
+	// Float32 and Float64 values:
+	int realErrors = 0;
+	for ( int t = 0; t < 1000; t++ ) {
+		const int size = rand() % 10000;
+		vector<float> floats;
+		for ( int i = 0; i < size; i++ ) {
+			floats.push_back(rand() % 5 == 0 ? 0.0f : (rand() % 2000000) / 7.0f - 100000.0f);
+		}
+		vector<double> doubles(floats.begin(), floats.end());
+		for ( int i = 0; i < size; i++ ) {
+			doubles[i] *= 1.0 + 1e-9 * i;
+		}
+		for ( int d = 0; d < 2; d++ ) {
+			streamed.begin(0.0);
+			for ( int i = 0; i < size; i++ ) {
+				streamed.add(d ? doubles[i] : (double) floats[i]);
+			}
+			streamed.end();
+
+			blocks.begin(0.0);
+			for ( int i = 0; i < size; i += 4096 ) {
+				if ( d )
+					blocks.add(&doubles[i], min(4096, size - i));
+				else
+					blocks.add(&floats[i], min(4096, size - i));
+			}
+			blocks.end();
+
+			vector<double> copy;
+			for ( int i = 0; i < size; i++ ) {
+				copy.push_back(d ? doubles[i] : (double) floats[i]);
+			}
+			computed.compute(copy, 0.0);
+
+			format(streamed, str2);
+			format(blocks, str3);
+			if ( strcmp(str2, str3) || computed.result[SUM] != blocks.result[SUM] ) {
+				if ( realErrors++ < 5 )
+					fprintf(stderr, "%s, %d values:\n  stream:  %s\n  arrays:  %s\n  compute sum: %f\n",
+						d ? "Float64" : "Float32", size, str2, str3, computed.result[SUM]);
+			}
+		}
+	}
+	printf("Float32/Float64 values: %s\n", realErrors ? "DIFFERENT RESULTS" : "same results");
+	errors += realErrors;
+
+	// timing, Int16 values:
+	vector<int> values;
+	for ( int i = 0; i < n; i++ ) {
+		values.push_back(random_value(1));
+	}
+	double t0 = now();
+	vector<int> copy = values;
+	computed.compute(copy, 0);
+	double t1 = now();
+	streamed.begin(0, -32768, 32767);
+	for ( int i = 0; i < n; i++ ) {
+		streamed.add(values[i]);
+	}
+	streamed.end();
+	double t2 = now();
+	vector<short> shorts(values.begin(), values.end());
+	streamed.begin(0, -32768, 32767);
+	streamed.add(&shorts[0], n);
+	streamed.end();
+	double t3 = now();
+	printf("%d Int16 values: compute %.3fs, stream %.3fs, array %.3fs\n", n, t1 - t0, t2 - t1, t3 - t2);
+
+	// real values: median estimate
+	vector<double> reals;
+	for ( int i = 0; i < n; i++ ) {
+		double x = rand() / (double) RAND_MAX;
+		reals.push_back(1 + 1000 * x * x);
+	}
+	t0 = now();
+	vector<double> rcopy = reals;
+	computed.compute(rcopy, 0.0);
+	t1 = now();
+	streamed.begin(0.0);
+	for ( int i = 0; i < n; i++ ) {
+		streamed.add(reals[i]);
+	}
+	streamed.end();
+	t2 = now();
+	printf("%d real values: compute %.3fs, stream %.3fs; median %f vs. %f (rel. error %.2e)\n",
+		n, t1 - t0, t2 - t1, computed.result[MEDIAN], streamed.result[MEDIAN],
+		fabs(streamed.result[MEDIAN] - computed.result[MEDIAN]) / computed.result[MEDIAN]
+	);
+
+	// real values: mode with bounded counters
+	for ( int i = 0; i < n; i += 100 ) {
+		reals[i] = 123.456;
+	}
+	rcopy = reals;
+	computed.compute(rcopy, 0.0);
+	streamed.begin(0.0);
+	for ( int i = 0; i < n; i++ ) {
+		streamed.add(reals[i]);
+	}
+	streamed.end();
+	printf("%d real values: mode %f vs. %f\n", n, computed.result[MODE], streamed.result[MODE]);
+	if ( computed.result[MODE] != streamed.result[MODE] ) {
+		fprintf(stderr, "DIFFERENT MODE\n");
+		errors++;
+	}
+
+	return errors ? 1 : 0;
+}